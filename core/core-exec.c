@@ -27,6 +27,9 @@
  *      - RDMA handler: TCP, RoCE, InfiniBand, etc.
  */
 
+/* The mmgr_complete latency is only computed while the probe is traced */
+#define OX_TRACE_SEMAPHORES
+
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
@@ -42,8 +45,26 @@
 #include <libox.h>
 #include <ox-mq.h>
 
+OX_PROBE_SEMAPHORE (ftl_dequeue);
+OX_PROBE_SEMAPHORE (ftl_enqueue);
+OX_PROBE_SEMAPHORE (mmgr_submit);
+OX_PROBE_SEMAPHORE (mmgr_complete);
+
 extern struct core_struct core;
 
+/* I/O class of the synchronous I/Os submitted by the calling thread */
+static __thread uint8_t core_io_class = OX_IO_CLASS_USER;
+
+void ox_set_io_class (uint8_t io_class)
+{
+    core_io_class = io_class;
+}
+
+uint8_t ox_get_io_class (void)
+{
+    return core_io_class;
+}
+
 int ox_contains_ppa (struct nvm_ppa_addr *list, uint32_t list_sz,
                                                         struct nvm_ppa_addr ppa)
 {
@@ -59,8 +80,71 @@ int ox_contains_ppa (struct nvm_ppa_addr *list, uint32_t list_sz,
     return 0;
 }
 
+/* Sets a bit per reserved (lun, blk) of the channel from the MMGR and FTL
+ * reserved lists. Called again if the lists change. */
+int ox_ch_rsv_map_build (struct nvm_channel *ch)
+{
+    struct nvm_mmgr_geometry *g = ch->geometry;
+    struct nvm_ppa_addr *ppa;
+    uint32_t i, bit, n_pl = g->n_of_planes;
+    uint8_t *map;
+
+    map = ox_calloc ((g->lun_per_ch * g->blk_per_lun + 7) / 8, 1,
+                                                            OX_MEM_CORE_EXEC);
+    if (!map)
+        return -1;
+
+    for (i = 0; ch->mmgr_rsv_list && i < ch->mmgr_rsv * n_pl; i++) {
+        ppa = &ch->mmgr_rsv_list[i];
+        bit = ppa->g.lun * g->blk_per_lun + ppa->g.blk;
+        map[bit / 8] |= 1 << (bit % 8);
+    }
+
+    for (i = 0; ch->ftl_rsv_list && i < ch->ftl_rsv * n_pl; i++) {
+        ppa = &ch->ftl_rsv_list[i];
+        bit = ppa->g.lun * g->blk_per_lun + ppa->g.blk;
+        map[bit / 8] |= 1 << (bit % 8);
+    }
+
+    ox_ch_rsv_map_free (ch);
+    ch->rsv_map = map;
+
+    return 0;
+}
+
+void ox_ch_rsv_map_free (struct nvm_channel *ch)
+{
+    if (ch->rsv_map)
+        ox_free (ch->rsv_map, OX_MEM_CORE_EXEC);
+    ch->rsv_map = NULL;
+}
+
+int ox_ch_is_rsv (struct nvm_channel *ch, uint16_t lun, uint16_t blk)
+{
+    struct nvm_ppa_addr ppa;
+    uint32_t bit;
+
+    if (ch->rsv_map) {
+        bit = lun * ch->geometry->blk_per_lun + blk;
+        return (ch->rsv_map[bit / 8] >> (bit % 8)) & 1;
+    }
+
+    /* Map not built yet */
+    ppa.ppa = 0;
+    ppa.g.ch = ch->ch_mmgr_id;
+    ppa.g.lun = lun;
+    ppa.g.blk = blk;
+
+    return ox_contains_ppa (ch->mmgr_rsv_list, ch->mmgr_rsv *
+                                        ch->geometry->n_of_planes, ppa) ||
+           ox_contains_ppa (ch->ftl_rsv_list, ch->ftl_rsv *
+                                        ch->geometry->n_of_planes, ppa);
+}
+
 inline static void ox_complete_request (NvmeRequest *req)
 {
+    ox_io_vec_put (&req->nvm_io);
+
     if (core.std_transport == NVM_TRANSP_FABRICS)
         nvmef_complete_request (req);
     else
@@ -74,6 +158,8 @@ void ox_ftl_process_sq (struct ox_mq_entry *req)
     int ret, retry;
 
     cmd->mq_req = (void *) req;
+    ox_lat_mark (cmd, OX_LAT_T_FTL);
+    OX_PROBE2 (ftl_dequeue, cmd->cid, cmd->cmdtype);
 
     retry = 1;//NVM_QUEUE_RETRY;
     do {
@@ -96,10 +182,45 @@ void ox_ftl_process_sq (struct ox_mq_entry *req)
     }
 }
 
+/* Returns the host command if 'sub' is the last sub-command of a split I/O */
+static struct nvm_io_cmd *ox_ftl_complete_sub (struct nvm_io_cmd *sub)
+{
+    struct nvm_io_cmd *cmd = sub->parent;
+
+    ox_io_vec_put (sub);
+
+    /* The first failed sub-command sets the status */
+    if (sub->status.status != NVM_IO_SUCCESS) {
+        pthread_mutex_lock (&cmd->mutex);
+        if (cmd->status.status == NVM_IO_SUCCESS) {
+            cmd->status.status = sub->status.status;
+            cmd->status.nvme_status = sub->status.nvme_status;
+        }
+        pthread_mutex_unlock (&cmd->mutex);
+    }
+
+    if (__sync_sub_and_fetch (&cmd->pending, 1))
+        return NULL;
+
+    memcpy (&cmd->lat_ts[OX_LAT_T_SUBMIT], &sub->lat_ts[OX_LAT_T_SUBMIT],
+                        sizeof (uint64_t) * (OX_LAT_T_DONE - OX_LAT_T_SUBMIT));
+    cmd->callback.cb_fn (cmd->callback.opaque);
+
+    return cmd;
+}
+
 void ox_ftl_process_cq (void *opaque)
 {
     struct nvm_io_cmd *cmd = (struct nvm_io_cmd *) opaque;
-    NvmeRequest *req = (NvmeRequest *) cmd->req;
+    NvmeRequest *req;
+
+    if (cmd->parent) {
+        cmd = ox_ftl_complete_sub (cmd);
+        if (!cmd)
+            return;
+    }
+
+    req = (NvmeRequest *) cmd->req;
 
     req->status = (cmd->status.status == NVM_IO_SUCCESS) ?
                 NVME_SUCCESS : (cmd->status.nvme_status) ?
@@ -109,6 +230,7 @@ void ox_ftl_process_cq (void *opaque)
         printf(" [NVMe cmd 0x%x. cid: %d completed. Status: %x]\n",
                                    req->cmd.opcode, req->cmd.cid, req->status);
 
+    ox_lat_complete (cmd);
     ox_complete_request (req);
 }
 
@@ -154,6 +276,12 @@ static void nvm_debug_print_mmgr_io (struct nvm_mmgr_io_cmd *cmd)
 void ox_mmgr_callback (struct nvm_mmgr_io_cmd *cmd)
 {
     gettimeofday(&cmd->tend,NULL);
+    ox_lat_add_mmgr (cmd);
+    ox_chstat_complete (cmd);
+    if (OX_PROBE_ENABLED (mmgr_complete))
+        OX_PROBE4 (mmgr_complete, cmd, cmd->cmdtype, cmd->status,
+                    (cmd->tend.tv_sec - cmd->tstart.tv_sec) * 1000000 +
+                    (cmd->tend.tv_usec - cmd->tstart.tv_usec));
 
     if (core.debug)
         nvm_debug_print_mmgr_io (cmd);
@@ -297,6 +425,7 @@ int ox_submit_sync_io (struct nvm_channel *ch, struct nvm_mmgr_io_cmd *cmd,
     }
 
     cmd->cmdtype = cmdtype;
+    cmd->io_class = core_io_class;
     if (nvm_sync_io_prepare (ch, cmd, buf, &flags))
         goto ERR;
 
@@ -312,6 +441,7 @@ int ox_submit_sync_io (struct nvm_channel *ch, struct nvm_mmgr_io_cmd *cmd,
     cmd->status = NVM_IO_PROCESS;
 
     gettimeofday(&cmd->tstart,NULL);
+    ox_chstat_submit (cmd);
     switch (cmd->cmdtype) {
         case MMGR_READ_PG:
             ret = mmgr->ops->read_pg(cmd);
@@ -334,6 +464,7 @@ int ox_submit_sync_io (struct nvm_channel *ch, struct nvm_mmgr_io_cmd *cmd,
                 cmd->ppa.g.pl, cmd->ppa.g.pg);
 
     if (ret) {
+        ox_chstat_cancel (cmd);
         nvm_sync_io_free (flags, buf, cmd);
         goto ERR;
     }
@@ -377,22 +508,34 @@ int ox_submit_mmgr (struct nvm_mmgr_io_cmd *cmd)
 {
     gettimeofday(&cmd->tstart,NULL);
     cmd->cmdtype = cmd->nvm_io->cmdtype;
+    cmd->io_class = cmd->nvm_io->io_class;
     int ret;
 
+    OX_PROBE4 (mmgr_submit, cmd, cmd->cmdtype, cmd->ppa.g.ch, cmd->n_sectors);
+    ox_chstat_submit (cmd);
+
     switch (cmd->nvm_io->cmdtype) {
         case MMGR_WRITE_PG:
             ox_stats_add_io (cmd, 0, 0);
-            return cmd->ch->mmgr->ops->write_pg(cmd);
+            ret = cmd->ch->mmgr->ops->write_pg(cmd);
+            break;
         case MMGR_READ_PG:
             ret = cmd->ch->mmgr->ops->read_pg(cmd);
-            return ret;
+            break;
         case MMGR_ERASE_BLK:
             ox_stats_add_io (cmd, 0, 0);
-            return cmd->ch->mmgr->ops->erase_blk(cmd);
+            ret = cmd->ch->mmgr->ops->erase_blk(cmd);
+            break;
         default:
             cmd->status = NVM_IO_FAIL;
-            return -1;
+            ret = -1;
     }
+
+    /* Not accepted by the media manager, the caller may resubmit */
+    if (ret)
+        ox_chstat_cancel (cmd);
+
+    return ret;
 }
 
 int ox_dma (void *ptr, uint64_t prp, ssize_t size, uint8_t direction)
@@ -461,7 +604,10 @@ int ox_submit_ftl (struct nvm_io_cmd *cmd)
     uint8_t multi_ch = 0;
     NvmeRequest *req = (NvmeRequest *) cmd->req;
 
+    ox_lat_mark (cmd, OX_LAT_T_SUBMIT);
     cmd->status.nvme_status = NVME_SUCCESS;
+    cmd->io_class = (cmd->cmdtype == MMGR_WRITE_PG) ?
+                                        OX_IO_CLASS_WRITE : OX_IO_CLASS_USER;
 
     switch (cmd->status.status) {
         case NVM_IO_NEW:
@@ -541,7 +687,7 @@ int ox_submit_ftl (struct nvm_io_cmd *cmd)
 
     qid = ox_ftl_q_schedule (ftl, cmd, multi_ch);
     do {
-        ret = ox_mq_submit_req(ftl->mq, qid, cmd);
+        ret = ox_mq_submit_class(ftl->mq, qid, cmd, cmd->io_class);
 
         if (ret) {
             retry--;
@@ -558,24 +704,30 @@ int ox_submit_ftl (struct nvm_io_cmd *cmd)
         }
     } while (ret && retry);
 
+    if (!ret)
+        OX_PROBE3 (ftl_enqueue, cmd->cid, qid, cmd->n_sec);
+
     return (retry) ? NVME_NO_COMPLETE : NVME_CMD_ABORT_REQ;
 
 RANGE_ERR:
     syslog(LOG_INFO,"[ox ERROR: IO out of bounds.]\n");
     req->status = NVME_LBA_RANGE;
-    ox_complete_request (req);
+    if (!cmd->parent)
+        ox_complete_request (req);
     return NVME_LBA_RANGE;
 
 CH_ERR:
     syslog(LOG_INFO,"[ox ERROR: IO failed, channel not found.]\n");
     req->status = NVME_INVALID_FIELD;
-    ox_complete_request (req);
+    if (!cmd->parent)
+        ox_complete_request (req);
     return NVME_INVALID_FIELD;
 
 FTL_ERR:
     syslog(LOG_INFO,"[ox ERROR: IO failed, channels do not match FTL.]\n");
     req->status = NVME_INVALID_FIELD;
-    ox_complete_request (req);
+    if (!cmd->parent)
+        ox_complete_request (req);
     return NVME_INVALID_FIELD;
 }
 
@@ -743,14 +895,6 @@ void ox_execute_opcode (uint16_t qid, NvmeRequest *req)
         if (core.debug) printf("%s\n",err);
     }
 
-    /* Enqueue completion for flush command and flush everything to NVM */
-    if (qid && cmd->opcode == NVME_CMD_FLUSH) {
-        req->status = status;
-        ox_complete_request (req);
-        //nvm_restart();
-        return;
-    }
-
     /* Enqueue completion in case of admin command */
     if (!qid && status != NVME_NO_COMPLETE) {
         req->status = status;
@@ -27,6 +27,10 @@
  *      - RDMA handler: TCP, RoCE, InfiniBand, etc.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
@@ -375,7 +379,11 @@ static void ox_ftl_stats_fill_row (struct oxmq_output_row *row, void *opaque)
 int ox_register_ftl (struct nvm_ftl *ftl)
 {
     struct ox_mq_config mq_config;
+    uint16_t weights[OX_MQ_CLASSES] = OX_IO_CLASS_WEIGHTS;
+#if OX_TH_AFFINITY
+    cpu_set_t sq_cpus[ftl->nq], cq_cpus[ftl->nq];
     uint16_t qid;
+#endif
 
     if (strlen(ftl->name) > MAX_NAME_SIZE)
         return EMAX_NAME_SIZE;
@@ -389,27 +397,36 @@ int ox_register_ftl (struct nvm_ftl *ftl)
     mq_config.to_fn = ox_ftl_process_to;
     mq_config.output_fn = ox_ftl_stats_fill_row;
     mq_config.to_usec = NVM_FTL_QUEUE_TO;
-    mq_config.flags = (OX_MQ_TO_COMPLETE | OX_MQ_CPU_AFFINITY);
-
-    /* Set thread affinity, if enabled */
+    mq_config.flags = (OX_MQ_TO_COMPLETE | OX_MQ_CPU_AFFINITY | OX_MQ_RING |
+                                                                    OX_MQ_QOS);
+    mq_config.sq_affinity = NULL;
+    mq_config.cq_affinity = NULL;
+    memcpy (mq_config.class_weight, weights, sizeof (weights));
+
+    /* Set thread affinity, if enabled. Otherwise, spread the FTL queues over
+     * the host topology */
+#if OX_TH_AFFINITY
     for (qid = 0; qid < mq_config.n_queues; qid++) {
-        mq_config.sq_affinity[qid] = 0;
-        mq_config.cq_affinity[qid] = 0;
+        CPU_ZERO(&sq_cpus[qid]);
+        CPU_ZERO(&cq_cpus[qid]);
 
-#if OX_TH_AFFINITY
         if (qid < mq_config.n_queues / 2) {
-            mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 0);
-	    mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 4);
-            mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 5);
-	    mq_config.cq_affinity[qid] |= ((uint64_t) 1 << 0);
-            mq_config.cq_affinity[qid] |= ((uint64_t) 1 << 4);
-	    mq_config.cq_affinity[qid] |= ((uint64_t) 1 << 5);
+            CPU_SET(0, &sq_cpus[qid]);
+            CPU_SET(4, &sq_cpus[qid]);
+            CPU_SET(5, &sq_cpus[qid]);
+            CPU_SET(0, &cq_cpus[qid]);
+            CPU_SET(4, &cq_cpus[qid]);
+            CPU_SET(5, &cq_cpus[qid]);
         } else {
-            mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 0);
-            mq_config.cq_affinity[qid] |= ((uint64_t) 1 << 0);
+            CPU_SET(0, &sq_cpus[qid]);
+            CPU_SET(0, &cq_cpus[qid]);
         }
-#endif /* OX_TH_AFFINITY */
     }
+    mq_config.sq_affinity = sq_cpus;
+    mq_config.cq_affinity = cq_cpus;
+#else
+    mq_config.flags |= OX_MQ_CPU_AUTO;
+#endif /* OX_TH_AFFINITY */
 
     ftl->mq = ox_mq_init(&mq_config);
     if (!ftl->mq)
@@ -468,9 +485,14 @@ static void ox_remove_parser (struct nvm_parser_cmd *cmd)
 
 static void nvm_unregister_mmgr (struct nvm_mmgr *mmgr)
 {
+    int i;
+
     if (LIST_EMPTY(&mmgr_head))
         return;
 
+    for (i = 0; i < mmgr->geometry->n_of_ch; i++)
+        ox_ch_rsv_map_free (&mmgr->ch_info[i]);
+
     mmgr->ops->exit(mmgr);
     ox_free(mmgr->ch_info, OX_MEM_CORE_INIT);
     LIST_REMOVE(mmgr, entry);
@@ -489,6 +511,7 @@ static void ox_unregister_ftl (struct nvm_ftl *ftl)
     ox_mq_destroy(ftl->mq);
     core.ftl_q_count -= ftl->nq;
     ftl->ops->exit();
+    ftl_pg_io_drain ();
     LIST_REMOVE(ftl, entry);
     core.ftl_count--;
     log_info(" [nvm: FTL (%s)(%d) unregistered.]\n", ftl->name, ftl->ftl_id);
@@ -552,6 +575,10 @@ static int nvm_ch_config (void)
             ret = ch->ftl->ops->init_ch(ch);
                 if (ret) return ret;
 
+            /* Reserved lists are final once the FTL took its blocks */
+            if (ox_ch_rsv_map_build (ch))
+                return EMEM;
+
             ch->tot_bytes = ch->ns_pgs *
                                   (ch->geometry->pg_size & 0xffffffffffffffff);
             ch->slba = core.nvm_ns_size;
@@ -970,8 +997,15 @@ int  ox_ctrl_start (int argc, char **argv)
         return -1;
     }
 
+    if (ox_io_vec_init ()) {
+        ox_stats_exit ();
+        ox_mem_exit ();
+        return -1;
+    }
+
     exec = ox_cmdarg_init (argc, argv);
     if (exec < 0) {
+        ox_io_vec_exit ();
         ox_stats_exit ();
         ox_mem_exit ();
         return -1;
@@ -1000,6 +1034,9 @@ int  ox_ctrl_start (int argc, char **argv)
             ret = ox_admin_init (core.args_global);
             break;
         case OX_RUN_MODE:
+            ox_chstat_init ();
+            if (ox_metrics_init ())
+                printf (" [ox: Metrics exporter disabled, see the log]\n");
             ox_cmdline_init ();
             goto OUT;
         default:
@@ -1010,13 +1047,17 @@ int  ox_ctrl_start (int argc, char **argv)
 CLEAN:
     nvm_printerror(ret);
     nvm_clear_all(NVM_FULL_UPDOWN);
+    ox_io_vec_exit ();
     ox_cmdarg_exit();
     ox_stats_exit ();
     ox_mem_exit ();
     return -1;
 OUT:
+    ox_metrics_exit ();
     ox_mq_output_stop ();
     nvm_clear_all(NVM_FULL_UPDOWN);
+    ox_chstat_exit ();
+    ox_io_vec_exit ();
     ox_cmdarg_exit();
     ox_stats_exit ();
     ox_mem_exit ();
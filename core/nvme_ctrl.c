@@ -129,7 +129,7 @@ static int nvme_init_ctrl (NvmeCtrl *n)
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
     id->cmic = 0;
-    id->mdts = 8; /* 4k * (1 << 8) = 1 MB max transfer per NVMe I/O */
+    id->mdts = NVME_MDTS;
     id->oacs = htole16(NVME_OACS_FORMAT);
     id->acl = 3;
     id->aerl = 3;
@@ -140,10 +140,10 @@ static int nvme_init_ctrl (NvmeCtrl *n)
     id->sqes = (n->max_sqes << 4) | 0x6;
     id->cqes = (n->max_cqes << 4) | 0x4;
     id->nn = htole32(n->num_namespaces);
-    id->oncs = htole16(NVME_ONCS_FEATURES);
+    id->oncs = htole16(NVME_ONCS_FEATURES | NVME_ONCS_DSM);
     id->fuses = htole16(0);
     id->fna = 0;
-    id->vwc = 0;
+    id->vwc = 1;
     id->awun = htole16(0);
     id->awupf = htole16(0);
     id->psd[0].mp = htole16(0x9c4);
@@ -323,7 +323,7 @@ static int nvme_check_constraints (NvmeCtrl *n)
 				     (1 << ((n->dps & DPS_TYPE_MASK) - 1)))) ||
 	(n->mpsmax > 0xf || n->mpsmax < n->mpsmin) ||
 	(n->id_ctrl.oacs & ~(NVME_OACS_FORMAT)) ||
-	(n->id_ctrl.oncs & ~(NVME_ONCS_FEATURES))) {
+	(n->id_ctrl.oncs & ~(NVME_ONCS_FEATURES | NVME_ONCS_DSM))) {
         return -1;
     }
     return 0;
@@ -390,7 +390,7 @@ uint16_t nvme_init_sq (NvmeSQ *sq, NvmeCtrl *n, uint64_t dma_addr,
         }
     }
 
-    sq->io_req = malloc(sq->size * sizeof(*sq->io_req));
+    sq->io_req = calloc(sq->size, sizeof(*sq->io_req));
     TAILQ_INIT(&sq->req_list);
     TAILQ_INIT(&sq->out_req_list);
     for (i = 0; i < sq->size; i++) {
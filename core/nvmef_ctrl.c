@@ -19,6 +19,10 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
@@ -110,7 +114,7 @@ int nvmef_sgl_to_prp (uint32_t nlb, NvmeSGLDesc *desc, uint64_t *prp_buf,
                 return -1;
         }
 
-        while ( offset < desc_sz ) {
+        while ( offset < desc_sz && nlb_count < nlb ) {
             prp_buf[nlb_count] = desc_addr + offset;
             offset += NVME_KERNEL_PG_SIZE;
             nlb_count++;
@@ -251,7 +255,7 @@ static int nvmef_init_ctrl (NvmeCtrl *n)
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
     id->cmic = 0;
-    id->mdts = 8; /* 4k * (1 << 8) = 1 MB max transfer per NVMe I/O */
+    id->mdts = NVME_MDTS;
     id->oacs = htole16(NVME_OACS_FORMAT);
     id->acl = 3;
     id->aerl = 3;
@@ -262,10 +266,10 @@ static int nvmef_init_ctrl (NvmeCtrl *n)
     id->sqes = (n->max_sqes << 4) | 0x6;
     id->cqes = (n->max_cqes << 4) | 0x4;
     id->nn = htole32(n->num_namespaces);
-    id->oncs = htole16(NVME_ONCS_FEATURES);
+    id->oncs = htole16(NVME_ONCS_FEATURES | NVME_ONCS_DSM);
     id->fuses = htole16(0);
     id->fna = 0;
-    id->vwc = 0;
+    id->vwc = 1;
     id->awun = htole16(0);
     id->awupf = htole16(0);
     id->psd[0].mp = htole16(0x9c4);
@@ -376,7 +380,7 @@ static int nvmef_check_constraints (NvmeCtrl *n)
 				     (1 << ((n->dps & DPS_TYPE_MASK) - 1)))) ||
 	(n->mpsmax > 0xf || n->mpsmax < n->mpsmin) ||
 	(n->id_ctrl.oacs & ~(NVME_OACS_FORMAT)) ||
-	(n->id_ctrl.oncs & ~(NVME_ONCS_FEATURES))) {
+	(n->id_ctrl.oncs & ~(NVME_ONCS_FEATURES | NVME_ONCS_DSM))) {
         return -1;
     }
     return 0;
@@ -503,6 +507,9 @@ int nvmef_create_queue (uint16_t qid)
 {
     uint32_t ent_i;
     struct ox_mq_config mq_config;
+#if OX_TH_AFFINITY
+    cpu_set_t sq_cpus, cq_cpus;
+#endif
 
     if (qid >= NVME_NUM_QUEUES)
         return -1;
@@ -525,19 +532,29 @@ int nvmef_create_queue (uint16_t qid)
     mq_config.to_fn = nvmef_process_to;
     mq_config.output_fn = NULL;
     mq_config.to_usec = 0;
-    mq_config.flags = OX_MQ_CPU_AFFINITY;
+    mq_config.flags = (OX_MQ_CPU_AFFINITY | OX_MQ_RING | OX_MQ_POLL |
+                                                            OX_MQ_CQ_INLINE);
+    mq_config.poll_usec = NVMEF_QUEUE_POLL;
 
-    /* Set thread affinity, if enabled */
-    mq_config.sq_affinity[0] = 0;
-    mq_config.cq_affinity[0] = 0;
+    /* Set thread affinity, if enabled. Otherwise, each transport queue gets
+     * its own core from the host topology */
+    mq_config.sq_affinity = NULL;
+    mq_config.cq_affinity = NULL;
 
 #if OX_TH_AFFINITY
-    mq_config.sq_affinity[0] |= ((uint64_t) 1 << 0);
-    mq_config.sq_affinity[0] |= ((uint64_t) 1 << 2);
-    mq_config.sq_affinity[0] |= ((uint64_t) 1 << 5);
-
-    mq_config.cq_affinity[0] |= ((uint64_t) 1 << 0);
-    mq_config.cq_affinity[0] |= ((uint64_t) 1 << 1);
+    CPU_ZERO(&sq_cpus);
+    CPU_SET(0, &sq_cpus);
+    CPU_SET(2, &sq_cpus);
+    CPU_SET(5, &sq_cpus);
+
+    CPU_ZERO(&cq_cpus);
+    CPU_SET(0, &cq_cpus);
+    CPU_SET(1, &cq_cpus);
+
+    mq_config.sq_affinity = &sq_cpus;
+    mq_config.cq_affinity = &cq_cpus;
+#else
+    mq_config.flags |= OX_MQ_CPU_AUTO;
 #endif /* OX_TH_AFFINITY */
 
     nvmef_queues[qid]->mq = ox_mq_init(&mq_config);
@@ -0,0 +1,491 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Channel and LUN utilization sampler
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Media manager commands are counted per (channel, LUN) at submission and
+ * completion. A LUN is busy while it has commands outstanding; the busy time
+ * is closed when the last command completes, so the I/O path only reads the
+ * clock on idle-to-busy and busy-to-idle transitions.
+ *
+ * The metrics sampler thread calls ox_chstat_sample every second, each sample
+ * keeps depth, utilization, IOPS and bandwidth of all LUNs in a fixed ring of
+ * OX_CHSTAT_SAMPLES entries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <libox.h>
+
+extern struct core_struct core;
+
+#define OX_CHSTAT_SAMPLES   300 /* 5 minutes at one sample per second */
+#define OX_CHSTAT_WINDOW    60  /* samples averaged by 'show channels' */
+#define OX_CHSTAT_SERIES    30  /* samples printed per channel */
+#define OX_CHSTAT_UTIL_MAX  10000
+
+enum ox_chstat_ops {
+    OX_CHSTAT_READ = 0,
+    OX_CHSTAT_WRITE,
+    OX_CHSTAT_ERASE,
+    OX_CHSTAT_OPS
+};
+
+struct ox_chstat_lun {
+    uint64_t    inflight;
+    uint64_t    busy_since;     /* ns, start of the current busy period */
+    uint64_t    busy_ns;        /* closed busy periods */
+    uint64_t    io[OX_CHSTAT_OPS];
+    uint64_t    bytes;
+} __attribute__((aligned(64)));
+
+struct ox_chstat_sample {
+    uint16_t    depth;
+    uint16_t    util;           /* 1/100 of percent */
+    uint32_t    iops;
+    uint64_t    bps;
+};
+
+/* Totals at the last sample */
+struct ox_chstat_prev {
+    uint64_t    busy_ns;
+    uint64_t    io;
+    uint64_t    bytes;
+};
+
+struct ox_chstat_avg {
+    double      depth;
+    double      util;           /* 0 to 1 */
+    double      iops;
+    double      bps;
+};
+
+static struct ox_chstat {
+    struct ox_chstat_lun    *lun;   /* [nch * nlun] */
+    struct ox_chstat_prev   *prev;
+    struct ox_chstat_sample *ring;  /* [OX_CHSTAT_SAMPLES][nch * nlun] */
+    uint32_t                 ring_i;
+    uint32_t                 ring_n;
+    uint64_t                 prev_ns;
+    uint16_t                 nch;
+    uint16_t                 nlun;
+    pthread_mutex_t          mutex; /* ring, sampler against readers */
+} ox_chstat;
+
+static inline uint64_t ox_chstat_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline struct ox_chstat_lun *ox_chstat_get (
+                                                struct nvm_mmgr_io_cmd *cmd)
+{
+    if (!ox_chstat.lun || !cmd->ch || cmd->ch->ch_id >= ox_chstat.nch ||
+                                            cmd->ppa.g.lun >= ox_chstat.nlun)
+        return NULL;
+
+    return &ox_chstat.lun[cmd->ch->ch_id * ox_chstat.nlun + cmd->ppa.g.lun];
+}
+
+static void ox_chstat_release (struct ox_chstat_lun *lun)
+{
+    uint64_t since;
+
+    /* Our command is outstanding, the busy period cannot restart meanwhile */
+    since = __atomic_load_n (&lun->busy_since, __ATOMIC_ACQUIRE);
+    if (__atomic_fetch_sub (&lun->inflight, 1, __ATOMIC_ACQ_REL) == 1)
+        __atomic_fetch_add (&lun->busy_ns, ox_chstat_now () - since,
+                                                            __ATOMIC_RELAXED);
+}
+
+void ox_chstat_submit (struct nvm_mmgr_io_cmd *cmd)
+{
+    struct ox_chstat_lun *lun = ox_chstat_get (cmd);
+
+    cmd->sampled = (lun != NULL);
+    if (!lun)
+        return;
+
+    if (!__atomic_fetch_add (&lun->inflight, 1, __ATOMIC_ACQ_REL))
+        __atomic_store_n (&lun->busy_since, ox_chstat_now (), __ATOMIC_RELEASE);
+}
+
+void ox_chstat_complete (struct nvm_mmgr_io_cmd *cmd)
+{
+    struct ox_chstat_lun *lun;
+    uint8_t op;
+
+    /* Commands submitted before the sampler started are not counted */
+    if (!cmd->sampled)
+        return;
+    cmd->sampled = 0;
+
+    lun = ox_chstat_get (cmd);
+    if (!lun)
+        return;
+
+    switch (cmd->cmdtype) {
+        case MMGR_READ_PG:
+            op = OX_CHSTAT_READ;
+            break;
+        case MMGR_WRITE_PG:
+            op = OX_CHSTAT_WRITE;
+            break;
+        default:
+            op = OX_CHSTAT_ERASE;
+    }
+
+    __atomic_fetch_add (&lun->io[op], 1, __ATOMIC_RELAXED);
+    if (op != OX_CHSTAT_ERASE)
+        __atomic_fetch_add (&lun->bytes, (uint64_t) cmd->n_sectors *
+                                            cmd->sec_sz, __ATOMIC_RELAXED);
+
+    ox_chstat_release (lun);
+}
+
+/* The media manager refused the command, it will never complete */
+void ox_chstat_cancel (struct nvm_mmgr_io_cmd *cmd)
+{
+    struct ox_chstat_lun *lun;
+
+    if (!cmd->sampled)
+        return;
+    cmd->sampled = 0;
+
+    lun = ox_chstat_get (cmd);
+    if (lun)
+        ox_chstat_release (lun);
+}
+
+void ox_chstat_sample (void)
+{
+    struct ox_chstat_lun *lun;
+    struct ox_chstat_prev *prev;
+    struct ox_chstat_sample *s;
+    uint64_t now, dt, busy, io, bytes, inflight, util;
+    uint32_t lun_i, nluns;
+
+    if (!ox_chstat.lun)
+        return;
+
+    nluns = ox_chstat.nch * ox_chstat.nlun;
+    now = ox_chstat_now ();
+    dt = now - ox_chstat.prev_ns;
+
+    pthread_mutex_lock (&ox_chstat.mutex);
+    s = &ox_chstat.ring[ox_chstat.ring_i * nluns];
+
+    for (lun_i = 0; lun_i < nluns; lun_i++) {
+        lun = &ox_chstat.lun[lun_i];
+        prev = &ox_chstat.prev[lun_i];
+
+        inflight = __atomic_load_n (&lun->inflight, __ATOMIC_ACQUIRE);
+        busy = __atomic_load_n (&lun->busy_ns, __ATOMIC_RELAXED);
+        if (inflight)
+            busy += now - __atomic_load_n (&lun->busy_since, __ATOMIC_ACQUIRE);
+
+        io = __atomic_load_n (&lun->io[OX_CHSTAT_READ], __ATOMIC_RELAXED) +
+             __atomic_load_n (&lun->io[OX_CHSTAT_WRITE], __ATOMIC_RELAXED) +
+             __atomic_load_n (&lun->io[OX_CHSTAT_ERASE], __ATOMIC_RELAXED);
+        bytes = __atomic_load_n (&lun->bytes, __ATOMIC_RELAXED);
+
+        if (ox_chstat.prev_ns && dt) {
+            util = (busy > prev->busy_ns) ?
+                (busy - prev->busy_ns) * OX_CHSTAT_UTIL_MAX / dt : 0;
+
+            s[lun_i].depth = MIN (inflight, UINT16_MAX);
+            s[lun_i].util  = MIN (util, OX_CHSTAT_UTIL_MAX);
+            s[lun_i].iops  = (io - prev->io) * 1000000000 / dt;
+            s[lun_i].bps   = (bytes - prev->bytes) * 1000000000 / dt;
+        }
+
+        /* A busy period that closes later may end before 'now' */
+        prev->busy_ns = MAX (busy, prev->busy_ns);
+        prev->io = io;
+        prev->bytes = bytes;
+    }
+
+    if (ox_chstat.prev_ns) {
+        ox_chstat.ring_i = (ox_chstat.ring_i + 1) % OX_CHSTAT_SAMPLES;
+        if (ox_chstat.ring_n < OX_CHSTAT_SAMPLES)
+            ox_chstat.ring_n++;
+    }
+    pthread_mutex_unlock (&ox_chstat.mutex);
+
+    ox_chstat.prev_ns = now;
+}
+
+/* Sample 'age' (0 is the latest) of LUN index 'lun_i', under the mutex */
+static struct ox_chstat_sample *ox_chstat_at (uint32_t age, uint32_t lun_i)
+{
+    uint32_t slot;
+
+    slot = (ox_chstat.ring_i + OX_CHSTAT_SAMPLES - 1 - age) % OX_CHSTAT_SAMPLES;
+
+    return &ox_chstat.ring[slot * ox_chstat.nch * ox_chstat.nlun + lun_i];
+}
+
+/*
+ * Averages the last 'n' samples of a channel, or of a single LUN if 'lun' is
+ * not negative. Channel IOPS and bandwidth are the sum of the LUNs, depth and
+ * utilization are the mean. Called under the mutex.
+ */
+static void ox_chstat_avg (uint16_t ch, int lun, uint32_t n,
+                                                    struct ox_chstat_avg *avg)
+{
+    struct ox_chstat_sample *s;
+    uint32_t age, lun_i, first, last;
+
+    memset (avg, 0x0, sizeof (struct ox_chstat_avg));
+
+    n = MIN (n, ox_chstat.ring_n);
+    if (!n)
+        return;
+
+    first = ch * ox_chstat.nlun + ((lun < 0) ? 0 : lun);
+    last = (lun < 0) ? first + ox_chstat.nlun : first + 1;
+
+    for (age = 0; age < n; age++) {
+        for (lun_i = first; lun_i < last; lun_i++) {
+            s = ox_chstat_at (age, lun_i);
+            avg->depth += s->depth;
+            avg->util  += s->util;
+            avg->iops  += s->iops;
+            avg->bps   += s->bps;
+        }
+    }
+
+    avg->depth /= (double) n * (last - first);
+    avg->util  /= (double) n * (last - first) * OX_CHSTAT_UTIL_MAX;
+    avg->iops  /= (double) n;
+    avg->bps   /= (double) n;
+}
+
+static void ox_chstat_print_row (uint16_t ch, int lun)
+{
+    struct ox_chstat_avg cur, win;
+
+    ox_chstat_avg (ch, lun, 1, &cur);
+    ox_chstat_avg (ch, lun, OX_CHSTAT_WINDOW, &win);
+
+    if (lun < 0)
+        printf ("   %3d    - ", ch);
+    else
+        printf ("   %3s %4d ", "", lun);
+
+    printf (" %6.1lf %7.1lf %9.0lf %8.2lf %9.1lf %9.0lf %8.2lf\n",
+            cur.depth, cur.util * 100, cur.iops, cur.bps / 1048576,
+            win.util * 100, win.iops, win.bps / 1048576);
+}
+
+void ox_chstat_print (void)
+{
+    struct ox_chstat_avg avg;
+    uint32_t ch_i, lun_i, age, n;
+    double util, sum = 0, max = 0;
+    uint16_t busiest = 0, idlest = 0;
+    double min = 2;
+
+    if (!ox_chstat.lun) {
+        printf ("\n Channel sampler is not running\n\n");
+        return;
+    }
+
+    pthread_mutex_lock (&ox_chstat.mutex);
+
+    printf ("\n Channel utilization (%d samples, one per second)\n",
+                                                            ox_chstat.ring_n);
+    printf ("   %3s %4s  %6s %7s %9s %8s %9s %9s %8s\n", "Ch", "LUN",
+            "Depth", "Util%", "IOPS", "MB/s", "Util% 60s", "IOPS 60s",
+            "MB/s 60s");
+
+    for (ch_i = 0; ch_i < ox_chstat.nch; ch_i++) {
+        ox_chstat_print_row (ch_i, -1);
+        for (lun_i = 0; lun_i < ox_chstat.nlun; lun_i++)
+            ox_chstat_print_row (ch_i, lun_i);
+
+        ox_chstat_avg (ch_i, -1, OX_CHSTAT_WINDOW, &avg);
+        sum += avg.util;
+        if (avg.util > max) {
+            max = avg.util;
+            busiest = ch_i;
+        }
+        if (avg.util < min) {
+            min = avg.util;
+            idlest = ch_i;
+        }
+    }
+
+    if (ox_chstat.ring_n && sum > 0)
+        printf ("\n Busiest channel: %d (%.1lf%%), idlest: %d (%.1lf%%), "
+                "max/mean: %.2lf\n", busiest, max * 100, idlest, min * 100,
+                max / (sum / ox_chstat.nch));
+
+    n = MIN (OX_CHSTAT_SERIES, ox_chstat.ring_n);
+    printf ("\n Channel utilization %%, last %d samples (oldest first)\n", n);
+    for (ch_i = 0; ch_i < ox_chstat.nch; ch_i++) {
+        printf ("   %3d ", ch_i);
+        for (age = n; age > 0; age--) {
+            util = 0;
+            for (lun_i = 0; lun_i < ox_chstat.nlun; lun_i++)
+                util += ox_chstat_at (age - 1, ch_i * ox_chstat.nlun +
+                                                            lun_i)->util;
+            printf (" %3.0lf", util * 100 /
+                            ((double) ox_chstat.nlun * OX_CHSTAT_UTIL_MAX));
+        }
+        printf ("\n");
+    }
+    printf ("\n");
+
+    pthread_mutex_unlock (&ox_chstat.mutex);
+}
+
+void ox_chstat_metrics (struct ox_metrics *m)
+{
+    struct ox_chstat_lun *lun;
+    struct ox_chstat_avg cur, win;
+    uint32_t ch_i, lun_i, first = 1;
+
+    if (!ox_chstat.lun)
+        return;
+
+    pthread_mutex_lock (&ox_chstat.mutex);
+
+    for (ch_i = 0; ch_i < ox_chstat.nch; ch_i++) {
+        for (lun_i = 0; lun_i < ox_chstat.nlun; lun_i++) {
+            ox_chstat_avg (ch_i, lun_i, 1, &cur);
+            ox_metrics_add (m, "ox_lun_queue_depth", OX_METRIC_GAUGE,
+                (first) ? "Media commands outstanding per LUN" : NULL,
+                cur.depth, "ch=\"%d\",lun=\"%d\"", ch_i, lun_i);
+            first = 0;
+        }
+    }
+
+    first = 1;
+    for (ch_i = 0; ch_i < ox_chstat.nch; ch_i++) {
+        for (lun_i = 0; lun_i < ox_chstat.nlun; lun_i++) {
+            ox_chstat_avg (ch_i, lun_i, 1, &cur);
+            ox_metrics_add (m, "ox_lun_utilization", OX_METRIC_GAUGE,
+                (first) ? "Fraction of the last second a LUN was busy" : NULL,
+                cur.util, "ch=\"%d\",lun=\"%d\"", ch_i, lun_i);
+            first = 0;
+        }
+    }
+
+    first = 1;
+    for (ch_i = 0; ch_i < ox_chstat.nch; ch_i++) {
+        for (lun_i = 0; lun_i < ox_chstat.nlun; lun_i++) {
+            lun = &ox_chstat.lun[ch_i * ox_chstat.nlun + lun_i];
+            ox_metrics_add (m, "ox_lun_busy_seconds_total", OX_METRIC_COUNTER,
+                (first) ? "Time with media commands outstanding" : NULL,
+                (double) __atomic_load_n (&lun->busy_ns, __ATOMIC_RELAXED) /
+                1000000000.0, "ch=\"%d\",lun=\"%d\"", ch_i, lun_i);
+            first = 0;
+        }
+    }
+
+    /* Channels, aggregated over their LUNs */
+    for (ch_i = 0; ch_i < ox_chstat.nch; ch_i++) {
+        ox_chstat_avg (ch_i, -1, 1, &cur);
+        ox_metrics_add (m, "ox_channel_iops", OX_METRIC_GAUGE,
+                (!ch_i) ? "Media commands per second per channel" : NULL,
+                cur.iops, "ch=\"%d\"", ch_i);
+    }
+    for (ch_i = 0; ch_i < ox_chstat.nch; ch_i++) {
+        ox_chstat_avg (ch_i, -1, 1, &cur);
+        ox_metrics_add (m, "ox_channel_bandwidth_bytes", OX_METRIC_GAUGE,
+                (!ch_i) ? "Media bytes per second per channel" : NULL,
+                cur.bps, "ch=\"%d\"", ch_i);
+    }
+    for (ch_i = 0; ch_i < ox_chstat.nch; ch_i++) {
+        ox_chstat_avg (ch_i, -1, 1, &cur);
+        ox_chstat_avg (ch_i, -1, OX_CHSTAT_WINDOW, &win);
+        ox_metrics_add (m, "ox_channel_utilization", OX_METRIC_GAUGE,
+                (!ch_i) ? "Mean LUN utilization per channel" : NULL,
+                cur.util, "ch=\"%d\",window=\"1s\"", ch_i);
+        ox_metrics_add (m, "ox_channel_utilization", OX_METRIC_GAUGE, NULL,
+                win.util, "ch=\"%d\",window=\"60s\"", ch_i);
+    }
+
+    pthread_mutex_unlock (&ox_chstat.mutex);
+}
+
+void ox_chstat_exit (void)
+{
+    struct ox_chstat_lun *lun = ox_chstat.lun;
+
+    if (!lun)
+        return;
+
+    ox_chstat.lun = NULL;
+    pthread_mutex_destroy (&ox_chstat.mutex);
+    ox_free (ox_chstat.ring, OX_MEM_CORE_INIT);
+    ox_free (ox_chstat.prev, OX_MEM_CORE_INIT);
+    ox_free (lun, OX_MEM_CORE_INIT);
+}
+
+int ox_chstat_init (void)
+{
+    uint32_t ch_i, nluns;
+    struct ox_chstat_lun *lun;
+
+    if (ox_chstat.lun || !core.nvm_ch_count)
+        return 0;
+
+    memset (&ox_chstat, 0x0, sizeof (ox_chstat));
+
+    ox_chstat.nch = core.nvm_ch_count;
+    for (ch_i = 0; ch_i < core.nvm_ch_count; ch_i++)
+        ox_chstat.nlun = MAX (ox_chstat.nlun,
+                                    core.nvm_ch[ch_i]->geometry->lun_per_ch);
+    nluns = ox_chstat.nch * ox_chstat.nlun;
+
+    if (pthread_mutex_init (&ox_chstat.mutex, NULL))
+        return -1;
+
+    lun = ox_calloc (nluns, sizeof (struct ox_chstat_lun), OX_MEM_CORE_INIT);
+    if (!lun)
+        goto MUTEX;
+
+    ox_chstat.prev = ox_calloc (nluns, sizeof (struct ox_chstat_prev),
+                                                            OX_MEM_CORE_INIT);
+    if (!ox_chstat.prev)
+        goto FREE_LUN;
+
+    ox_chstat.ring = ox_calloc ((size_t) nluns * OX_CHSTAT_SAMPLES,
+                        sizeof (struct ox_chstat_sample), OX_MEM_CORE_INIT);
+    if (!ox_chstat.ring)
+        goto FREE_PREV;
+
+    /* Publish last, the I/O path checks it */
+    __atomic_store_n (&ox_chstat.lun, lun, __ATOMIC_RELEASE);
+
+    return 0;
+
+FREE_PREV:
+    ox_free (ox_chstat.prev, OX_MEM_CORE_INIT);
+FREE_LUN:
+    ox_free (lun, OX_MEM_CORE_INIT);
+MUTEX:
+    pthread_mutex_destroy (&ox_chstat.mutex);
+    log_err (" [ox-chstat: Channel sampler not started.]\n");
+    return -1;
+}
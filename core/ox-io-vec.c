@@ -0,0 +1,239 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Pools of I/O command vectors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * The per-sector (channel, ppalist, prp, md_prp) and per-page (mmgr_io)
+ * arrays of 'nvm_io_cmd' live in a vector taken from one of a few size
+ * classes. A 4 KB read carries 8-sector arrays instead of 256. Pools grow on
+ * demand and vectors are only released to the allocator at exit, so a late
+ * completion after a timeout never touches freed memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <libox.h>
+
+#define OX_IO_VEC_CLASSES   3
+
+static const uint32_t ox_io_vec_sec[OX_IO_VEC_CLASSES] = {
+    8, 64, NVM_IO_MAX_SEC
+};
+
+struct nvm_io_vec {
+    uint8_t                     class;
+    uint32_t                    n_sec;
+    uint32_t                    n_pgs;
+    struct nvm_mmgr_io_cmd      *mmgr_io;
+    struct nvm_channel          **channel;
+    struct nvm_ppa_addr         *ppalist;
+    uint64_t                    *prp;
+    uint64_t                    *md_prp;
+    STAILQ_ENTRY(nvm_io_vec)    fentry;
+    LIST_ENTRY(nvm_io_vec)      aentry;
+};
+
+struct ox_io_vec_pool {
+    STAILQ_HEAD(vec_free, nvm_io_vec)   free_head;
+    LIST_HEAD(vec_all, nvm_io_vec)      all_head;
+    pthread_spinlock_t                  spin;
+    uint32_t                            allocd;
+    u_atomic_t                          in_use;
+};
+
+static struct ox_io_vec_pool vec_pool[OX_IO_VEC_CLASSES];
+static uint8_t               vec_started;
+
+static size_t ox_io_vec_size (uint8_t class)
+{
+    uint32_t n_sec = ox_io_vec_sec[class];
+
+    return sizeof (struct nvm_io_vec) +
+           sizeof (struct nvm_mmgr_io_cmd) * MIN (n_sec, NVM_IO_MAX_PGS) +
+           (sizeof (struct nvm_channel *) + sizeof (struct nvm_ppa_addr) +
+                                            sizeof (uint64_t) * 2) * n_sec;
+}
+
+static struct nvm_io_vec *ox_io_vec_new (uint8_t class)
+{
+    struct nvm_io_vec *vec;
+    uint32_t n_sec, n_pgs;
+    uint8_t *ptr;
+
+    n_sec = ox_io_vec_sec[class];
+    n_pgs = MIN (n_sec, NVM_IO_MAX_PGS);
+
+    ptr = ox_calloc (1, ox_io_vec_size (class), OX_MEM_CORE_EXEC);
+    if (!ptr)
+        return NULL;
+
+    vec = (struct nvm_io_vec *) ptr;
+    vec->class = class;
+    vec->n_sec = n_sec;
+    vec->n_pgs = n_pgs;
+
+    ptr += sizeof (struct nvm_io_vec);
+    vec->mmgr_io = (struct nvm_mmgr_io_cmd *) ptr;
+    ptr += sizeof (struct nvm_mmgr_io_cmd) * n_pgs;
+    vec->channel = (struct nvm_channel **) ptr;
+    ptr += sizeof (struct nvm_channel *) * n_sec;
+    vec->ppalist = (struct nvm_ppa_addr *) ptr;
+    ptr += sizeof (struct nvm_ppa_addr) * n_sec;
+    vec->prp = (uint64_t *) ptr;
+    ptr += sizeof (uint64_t) * n_sec;
+    vec->md_prp = (uint64_t *) ptr;
+
+    return vec;
+}
+
+/* Points 'cmd' to the arrays of 'vec', clearing the first 'n_sec' sectors */
+void ox_io_vec_attach (struct nvm_io_cmd *cmd, struct nvm_io_vec *vec,
+                                                                uint32_t n_sec)
+{
+    uint32_t n_pgs = MIN (n_sec, vec->n_pgs);
+
+    memset (vec->mmgr_io, 0x0, sizeof (struct nvm_mmgr_io_cmd) * n_pgs);
+    memset (vec->channel, 0x0, sizeof (struct nvm_channel *) * n_sec);
+    memset (vec->ppalist, 0x0, sizeof (struct nvm_ppa_addr) * n_sec);
+    memset (vec->prp, 0x0, sizeof (uint64_t) * n_sec);
+    memset (vec->md_prp, 0x0, sizeof (uint64_t) * n_sec);
+
+    cmd->vec = vec;
+    cmd->mmgr_io = vec->mmgr_io;
+    cmd->channel = vec->channel;
+    cmd->ppalist = vec->ppalist;
+    cmd->prp = vec->prp;
+    cmd->md_prp = vec->md_prp;
+}
+
+/* Attaches a vector of at least 'n_sec' sectors to 'cmd' */
+int ox_io_vec_get (struct nvm_io_cmd *cmd, uint32_t n_sec)
+{
+    struct ox_io_vec_pool *pool;
+    struct nvm_io_vec *vec;
+    uint8_t class;
+
+    if (!vec_started || !n_sec || n_sec > NVM_IO_MAX_SEC)
+        return -1;
+
+    for (class = 0; ox_io_vec_sec[class] < n_sec; class++);
+    pool = &vec_pool[class];
+
+    pthread_spin_lock (&pool->spin);
+    vec = STAILQ_FIRST (&pool->free_head);
+    if (vec)
+        STAILQ_REMOVE_HEAD (&pool->free_head, fentry);
+    pthread_spin_unlock (&pool->spin);
+
+    if (!vec) {
+        vec = ox_io_vec_new (class);
+        if (!vec) {
+            log_err ("[io-vec: Vector of %d sectors not allocated.]", n_sec);
+            return -1;
+        }
+
+        pthread_spin_lock (&pool->spin);
+        LIST_INSERT_HEAD (&pool->all_head, vec, aentry);
+        pool->allocd++;
+        pthread_spin_unlock (&pool->spin);
+    }
+
+    u_atomic_inc (&pool->in_use);
+    ox_io_vec_attach (cmd, vec, n_sec);
+
+    return 0;
+}
+
+/* Returns the vector of 'cmd' to its pool, the array pointers are kept */
+void ox_io_vec_put (struct nvm_io_cmd *cmd)
+{
+    struct nvm_io_vec *vec = cmd->vec;
+    struct ox_io_vec_pool *pool;
+
+    if (!vec)
+        return;
+
+    cmd->vec = NULL;
+    pool = &vec_pool[vec->class];
+
+    pthread_spin_lock (&pool->spin);
+    STAILQ_INSERT_HEAD (&pool->free_head, vec, fentry);
+    pthread_spin_unlock (&pool->spin);
+
+    u_atomic_dec (&pool->in_use);
+}
+
+void ox_io_vec_print (void)
+{
+    uint8_t class;
+
+    printf ("\n I/O command vectors (nvm_io_cmd: %lu bytes)\n",
+                                                sizeof (struct nvm_io_cmd));
+    printf ("  Sectors   Pages   Size (KB)   Allocated   In use\n");
+    for (class = 0; class < OX_IO_VEC_CLASSES; class++)
+        printf ("  %7d   %5d   %9.1lf   %9d   %6d\n", ox_io_vec_sec[class],
+                MIN (ox_io_vec_sec[class], NVM_IO_MAX_PGS),
+                (double) ox_io_vec_size (class) / 1024,
+                vec_pool[class].allocd,
+                u_atomic_read (&vec_pool[class].in_use));
+}
+
+void ox_io_vec_exit (void)
+{
+    struct nvm_io_vec *vec;
+    uint8_t class;
+
+    if (!vec_started)
+        return;
+
+    vec_started = 0;
+    for (class = 0; class < OX_IO_VEC_CLASSES; class++) {
+        while (!LIST_EMPTY (&vec_pool[class].all_head)) {
+            vec = LIST_FIRST (&vec_pool[class].all_head);
+            LIST_REMOVE (vec, aentry);
+            ox_free (vec, OX_MEM_CORE_EXEC);
+        }
+        pthread_spin_destroy (&vec_pool[class].spin);
+    }
+}
+
+int ox_io_vec_init (void)
+{
+    uint8_t class;
+
+    for (class = 0; class < OX_IO_VEC_CLASSES; class++) {
+        if (pthread_spin_init (&vec_pool[class].spin, 0))
+            goto SPIN;
+
+        STAILQ_INIT (&vec_pool[class].free_head);
+        LIST_INIT (&vec_pool[class].all_head);
+        vec_pool[class].allocd = 0;
+        u_atomic_set (&vec_pool[class].in_use, 0);
+    }
+
+    vec_started = 1;
+
+    return 0;
+
+SPIN:
+    while (class) {
+        class--;
+        pthread_spin_destroy (&vec_pool[class].spin);
+    }
+    return -1;
+}
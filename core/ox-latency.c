@@ -0,0 +1,314 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Per-stage latency histograms
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * User commands are timestamped at each stage boundary (see 'ox_lat_marks'),
+ * the time between two marks goes to the histogram of that stage when the
+ * command completes. Media commands are recorded apart, from submission to
+ * the media manager callback.
+ *
+ * Histograms are log-bucketed: each power of two is split in 16 linear
+ * sub-buckets, so any value is kept with at most 1/16 (6.25%) error. Buckets
+ * are updated with relaxed atomics and never locked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <libox.h>
+
+#define OX_LAT_SUB_BITS     4
+#define OX_LAT_SUB          (1 << OX_LAT_SUB_BITS)
+#define OX_LAT_MAX_EXP      40  /* Values are clamped to 2^40 ns (~18 min) */
+#define OX_LAT_BUCKETS      ((OX_LAT_MAX_EXP - OX_LAT_SUB_BITS + 1) * OX_LAT_SUB)
+
+struct ox_lat_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[OX_LAT_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct ox_lat_hist ox_lat[OX_LAT_DIRS][OX_LAT_STAGES];
+
+static const char *ox_lat_names[OX_LAT_DIRS][OX_LAT_STAGES] = {
+    { "parse", "map", "media", NULL, "total" },
+    { "parse", "ftl-queue", "ftl", "commit", "total" },
+    { "read", "write", "erase", NULL, NULL }
+};
+
+static const char *ox_lat_dir_names[OX_LAT_DIRS] = {
+    "Read", "Write", "Media (MMGR)"
+};
+
+static inline uint64_t ox_lat_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint32_t ox_lat_index (uint64_t ns)
+{
+    uint32_t exp;
+
+    if (ns < OX_LAT_SUB)
+        return ns;
+
+    if (ns >> OX_LAT_MAX_EXP)
+        ns = (1UL << OX_LAT_MAX_EXP) - 1;
+
+    exp = 63 - __builtin_clzl (ns);
+
+    return ((exp - OX_LAT_SUB_BITS + 1) << OX_LAT_SUB_BITS) +
+                    ((ns >> (exp - OX_LAT_SUB_BITS)) & (OX_LAT_SUB - 1));
+}
+
+/* Highest value that falls in bucket 'index' */
+static uint64_t ox_lat_bucket_value (uint32_t index)
+{
+    uint32_t exp;
+
+    if (index < OX_LAT_SUB)
+        return index;
+
+    exp = (index >> OX_LAT_SUB_BITS) + OX_LAT_SUB_BITS - 1;
+
+    return ((uint64_t) (OX_LAT_SUB + (index & (OX_LAT_SUB - 1)) + 1) <<
+                                            (exp - OX_LAT_SUB_BITS)) - 1;
+}
+
+static void ox_lat_record (uint8_t dir, uint8_t stage, uint64_t ns)
+{
+    struct ox_lat_hist *hist = &ox_lat[dir][stage];
+    uint64_t max;
+
+    __atomic_fetch_add (&hist->bucket[ox_lat_index (ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&hist->sum, ns, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n (&hist->max, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n (&hist->max, &max, ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void ox_lat_mark (struct nvm_io_cmd *cmd, uint8_t mark)
+{
+    cmd->lat_ts[mark] = ox_lat_now ();
+}
+
+/*
+ * Called once per user command at completion. A stage ends at the next mark
+ * that was set, so paths that skip a boundary (e.g. reads have no commit) are
+ * accounted to the stage before it.
+ */
+void ox_lat_complete (struct nvm_io_cmd *cmd)
+{
+    uint64_t *ts = cmd->lat_ts;
+    uint8_t dir, mark, next;
+
+    if (!ts[OX_LAT_T_PARSE])
+        return;
+
+    switch (cmd->cmdtype) {
+        case MMGR_READ_PG:
+            dir = OX_LAT_READ;
+            break;
+        case MMGR_WRITE_PG:
+        case MMGR_WRITE_DELTA:
+            dir = OX_LAT_WRITE;
+            break;
+        default:
+            return;
+    }
+
+    ts[OX_LAT_T_DONE] = ox_lat_now ();
+
+    for (mark = OX_LAT_T_PARSE; mark < OX_LAT_T_DONE; mark = next) {
+        for (next = mark + 1; next < OX_LAT_T_DONE && !ts[next]; next++);
+
+        if (ts[mark] && ts[next] >= ts[mark])
+            ox_lat_record (dir, mark, ts[next] - ts[mark]);
+    }
+
+    if (ts[OX_LAT_T_DONE] >= ts[OX_LAT_T_PARSE])
+        ox_lat_record (dir, OX_LAT_TOTAL,
+                                    ts[OX_LAT_T_DONE] - ts[OX_LAT_T_PARSE]);
+}
+
+void ox_lat_add_mmgr (struct nvm_mmgr_io_cmd *cmd)
+{
+    uint64_t us;
+    uint8_t type;
+
+    if (!cmd->tstart.tv_sec)
+        return;
+
+    switch (cmd->cmdtype) {
+        case MMGR_READ_PG:
+            type = OX_LAT_MMGR_READ;
+            break;
+        case MMGR_WRITE_PG:
+            type = OX_LAT_MMGR_WRITE;
+            break;
+        case MMGR_ERASE_BLK:
+            type = OX_LAT_MMGR_ERASE;
+            break;
+        default:
+            return;
+    }
+
+    us = (cmd->tend.tv_sec - cmd->tstart.tv_sec) * 1000000 +
+                                    (cmd->tend.tv_usec - cmd->tstart.tv_usec);
+    if ((int64_t) us < 0)
+        return;
+
+    ox_lat_record (OX_LAT_MMGR, type, us * 1000);
+}
+
+uint64_t ox_lat_count (uint8_t dir, uint8_t stage)
+{
+    if (dir >= OX_LAT_DIRS || stage >= OX_LAT_STAGES)
+        return 0;
+
+    return __atomic_load_n (&ox_lat[dir][stage].count, __ATOMIC_RELAXED);
+}
+
+/* Returns the latency in ns under which 'pct' percent of the samples are */
+uint64_t ox_lat_percentile (uint8_t dir, uint8_t stage, double pct)
+{
+    struct ox_lat_hist *hist;
+    uint64_t total = 0, target, acc = 0, max;
+    uint32_t i;
+
+    if (dir >= OX_LAT_DIRS || stage >= OX_LAT_STAGES)
+        return 0;
+
+    hist = &ox_lat[dir][stage];
+
+    for (i = 0; i < OX_LAT_BUCKETS; i++)
+        total += __atomic_load_n (&hist->bucket[i], __ATOMIC_RELAXED);
+    if (!total)
+        return 0;
+
+    target = (uint64_t) ((pct / 100.0) * (double) total + 0.5);
+    if (target < 1)
+        target = 1;
+    if (target > total)
+        target = total;
+
+    max = __atomic_load_n (&hist->max, __ATOMIC_RELAXED);
+    for (i = 0; i < OX_LAT_BUCKETS; i++) {
+        acc += __atomic_load_n (&hist->bucket[i], __ATOMIC_RELAXED);
+        if (acc >= target)
+            return MIN (ox_lat_bucket_value (i), max);
+    }
+
+    return max;
+}
+
+void ox_lat_reset (void)
+{
+    uint32_t dir, stage, i;
+    struct ox_lat_hist *hist;
+
+    for (dir = 0; dir < OX_LAT_DIRS; dir++) {
+        for (stage = 0; stage < OX_LAT_STAGES; stage++) {
+            hist = &ox_lat[dir][stage];
+            __atomic_store_n (&hist->count, 0, __ATOMIC_RELAXED);
+            __atomic_store_n (&hist->sum, 0, __ATOMIC_RELAXED);
+            __atomic_store_n (&hist->max, 0, __ATOMIC_RELAXED);
+            for (i = 0; i < OX_LAT_BUCKETS; i++)
+                __atomic_store_n (&hist->bucket[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void ox_lat_metrics (struct ox_metrics *m)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    const char *help = "Per-stage latency quantiles";
+    uint32_t dir, stage, q;
+    const char *dname;
+
+    for (dir = 0; dir < OX_LAT_DIRS; dir++) {
+        dname = (dir == OX_LAT_READ) ? "read" :
+                                    (dir == OX_LAT_WRITE) ? "write" : "mmgr";
+
+        for (stage = 0; stage < OX_LAT_STAGES; stage++) {
+            if (!ox_lat_names[dir][stage])
+                continue;
+
+            for (q = 0; q < sizeof (quantiles) / sizeof (double); q++) {
+                ox_metrics_add (m, "ox_latency_seconds", OX_METRIC_GAUGE, help,
+                    (double) ox_lat_percentile (dir, stage, quantiles[q] * 100)
+                    / 1000000000.0, "dir=\"%s\",stage=\"%s\",quantile=\"%g\"",
+                    dname, ox_lat_names[dir][stage], quantiles[q]);
+                help = NULL;
+            }
+        }
+    }
+
+    for (dir = OX_LAT_READ; dir <= OX_LAT_WRITE; dir++)
+        ox_metrics_add (m, "ox_user_io_total", OX_METRIC_COUNTER,
+                (dir == OX_LAT_READ) ? "Completed NVMe reads and writes" : NULL,
+                ox_lat_count (dir, OX_LAT_TOTAL), "dir=\"%s\"",
+                (dir == OX_LAT_READ) ? "read" : "write");
+}
+
+void ox_lat_print (void)
+{
+    uint32_t dir, stage;
+    uint64_t count, sum;
+
+    printf ("\n Latency in microseconds\n");
+
+    for (dir = 0; dir < OX_LAT_DIRS; dir++) {
+        printf ("\n %s\n", ox_lat_dir_names[dir]);
+        printf ("   %-10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "Stage",
+                    "Count", "Mean", "p50", "p90", "p99", "p99.9", "p99.99",
+                    "Max");
+
+        for (stage = 0; stage < OX_LAT_STAGES; stage++) {
+            if (!ox_lat_names[dir][stage])
+                continue;
+
+            count = ox_lat_count (dir, stage);
+            sum = __atomic_load_n (&ox_lat[dir][stage].sum, __ATOMIC_RELAXED);
+
+            printf ("   %-10s %10lu", ox_lat_names[dir][stage], count);
+            if (!count) {
+                printf (" %10s %10s %10s %10s %10s %10s %10s\n",
+                                        "-", "-", "-", "-", "-", "-", "-");
+                continue;
+            }
+
+            printf (" %10.1lf %10.1lf %10.1lf %10.1lf %10.1lf %10.1lf "
+                "%10.1lf\n", (double) sum / count / 1000,
+                (double) ox_lat_percentile (dir, stage, 50.0) / 1000,
+                (double) ox_lat_percentile (dir, stage, 90.0) / 1000,
+                (double) ox_lat_percentile (dir, stage, 99.0) / 1000,
+                (double) ox_lat_percentile (dir, stage, 99.9) / 1000,
+                (double) ox_lat_percentile (dir, stage, 99.99) / 1000,
+                (double) __atomic_load_n (&ox_lat[dir][stage].max,
+                                                    __ATOMIC_RELAXED) / 1000);
+        }
+    }
+
+    printf ("\n Percentiles are bucket upper bounds (max. error 6.25%%)\n");
+}
@@ -33,7 +33,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <search.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <libox.h>
 
 #define OX_MEM_MAX_TYPES    64
@@ -41,79 +44,610 @@
 #define OX_MEM_MALLOC   0
 #define OX_MEM_CALLOC   1
 
-struct ox_mem_node {
-    void        *ptr;
-    uint64_t     size;
+/*
+ * Allocations up to OX_MEM_CLASS_MAX bytes (header included) are served from
+ * per-type slab pools with power-of-two block sizes. Slabs are kept until the
+ * type is destroyed, freed blocks go back to the pool of their class. Larger
+ * allocations go to malloc. Every block starts with a header holding the size
+ * and type, so accounting is a counter update and no lookup is needed.
+ */
+#define OX_MEM_CLASSES      8
+#define OX_MEM_CLASS_MIN    64
+#define OX_MEM_CLASS_MAX    (OX_MEM_CLASS_MIN << (OX_MEM_CLASSES - 1))
+#define OX_MEM_CLASS_LARGE  0xff
+#define OX_MEM_SLAB_SZ      (128 * 1024)
+
+/*
+ * Each thread keeps a magazine of free blocks per type and class in front of
+ * the pools, of at most OX_MEM_MAG_BYTES (and OX_MEM_MAG_MAX blocks). Empty
+ * magazines are refilled and full ones drained by half, under a single pool
+ * lock. Magazines left untouched for OX_MEM_MAG_TICK operations of the thread
+ * are returned to the pools, and the thread's cache is drained at exit.
+ */
+#define OX_MEM_MAG_MAX      32
+#define OX_MEM_MAG_BYTES    (16 * 1024)
+#define OX_MEM_MAG_TICK     (1 << 14)
+
+/*
+ * Arenas back large regions that live as long as their owner (media of the
+ * volatile mmgr, mapping cache). The region is mapped once with hugepages,
+ * falling back to transparent hugepages when none are reserved, and carved
+ * by a bump pointer. Blocks are not freed one by one, the arena goes at once.
+ */
+#define OX_MEM_HUGEPAGE_SZ  (2 * 1024 * 1024)
+#define OX_MEM_ARENA_ALIGN  64
+
+/*
+ * A type may have a budget in bytes. Allocations that would exceed it either
+ * fail at once (OX_MEM_BUDGET_FAIL) or wait up to OX_MEM_BUDGET_WAIT_MS for
+ * frees of the same type (OX_MEM_BUDGET_BLOCK) before failing.
+ */
+#define OX_MEM_BUDGET_WAIT_MS   100
+
+#define OX_MEM_MAGIC        0x0c0ffee0
+#define OX_MEM_MAGIC_FREE   0xdeadbeef
+
+struct ox_mem_hdr {
+#if OX_MEM_LEAK_DEBUG
+    LIST_ENTRY(ox_mem_hdr)  entry;
+#endif
+    uint64_t                size;   /* requested size */
+    uint16_t                type;
+    uint8_t                 class;
+    uint8_t                 rsvd;
+    uint32_t                magic;
+} __attribute__((aligned(16)));
+
+#define OX_MEM_HDR_SZ       sizeof (struct ox_mem_hdr)
+
+/* Free blocks are linked through their payload */
+struct ox_mem_free_blk {
+    struct ox_mem_hdr       hdr;
+    struct ox_mem_free_blk *next;
+};
+
+/* Slabs are linked through their first 16 bytes */
+struct ox_mem_slab {
+    struct ox_mem_slab     *next;
+    uint64_t                rsvd;
+};
+
+struct ox_mem_class {
+    pthread_spinlock_t      spin;
+    struct ox_mem_free_blk *free;
+    struct ox_mem_slab     *slabs;
+    uint32_t                blk_sz;
+    uint16_t                mag_sz;
+};
+
+struct ox_mem_mag {
+    struct ox_mem_free_blk *head;
+    uint16_t                count;
+    uint8_t                 used;   /* touched since the last tick */
+    uint32_t                gen;    /* type generation of the blocks */
+};
+
+struct ox_mem_cache {
+    struct ox_mem_mag       mags[OX_MEM_MAX_TYPES][OX_MEM_CLASSES];
+    uint32_t                ops;
 };
 
 struct ox_mem_type {
     char                name[32];
     uint16_t            id;
     volatile uint64_t   allocd;
+    volatile uint64_t   peak;       /* high-water mark of allocd */
     pthread_spinlock_t  alloc_spin;
+
+    uint64_t            budget;     /* 0 for no budget */
+    uint8_t             policy;
+    uint8_t             over;       /* budget reached, reported once */
+    volatile uint32_t   waiters;
+    volatile uint64_t   throttled;  /* allocations that waited */
+    volatile uint64_t   denied;     /* allocations failed by the budget */
+    pthread_mutex_t     budget_mutex;
+    pthread_cond_t      budget_cond;
     TAILQ_ENTRY(ox_mem_type)  entry;
 
-    /* RB tree */
-    void *root;
+    struct ox_mem_class classes[OX_MEM_CLASSES];
+
+#if OX_MEM_LEAK_DEBUG
+    LIST_HEAD(mem_live, ox_mem_hdr) live;
+#endif
+};
+
+struct ox_mem_arena {
+    uint8_t            *base;
+    size_t              size;
+    size_t              used;
+    uint16_t            type;
+    uint8_t             huge;   /* MAP_HUGETLB, otherwise THP advised */
+    pthread_spinlock_t  spin;
 };
 
 struct ox_memory {
     struct ox_mem_type  *types[OX_MEM_MAX_TYPES];
     TAILQ_HEAD(types_list, ox_mem_type) types_head;
+
+    /* Bumped when a type ID is created, stale magazines are dropped */
+    uint32_t             gens[OX_MEM_MAX_TYPES];
 };
 
 static struct ox_memory ox_mem;
 
-static void ox_mem_btree_free_act (void *nodep)
+/* Budget headrooms set by name before the types exist, see ox_mem_conf_budget */
+#define OX_MEM_MAX_CONF     16
+
+static struct ox_mem_conf {
+    char                name[32];
+    uint64_t            headroom;
+} ox_mem_conf[OX_MEM_MAX_CONF];
+static uint16_t         ox_mem_conf_count;
+
+static __thread struct ox_mem_cache *mem_cache = NULL;
+static pthread_key_t                 mem_cache_key;
+static pthread_once_t                mem_cache_once = PTHREAD_ONCE_INIT;
+
+static inline void ox_mem_charge (struct ox_mem_type *memtype, int64_t size)
 {
-    struct ox_mem_node *datap = (struct ox_mem_node *) nodep;
+    uint64_t cur;
 
-    log_info ("[mem: Leak detected. ptr: %p, size %lu bytes]",
-                                                       datap->ptr, datap->size);
-    free (datap->ptr);
-    free (datap);
+    cur = __sync_add_and_fetch (&memtype->allocd, size);
+    if (cur > memtype->peak)
+        memtype->peak = cur;
 }
 
-#if OX_MEM_MANAGER
-static int ox_mem_btree_compare(const void *new_ptr, const void *tree_ptr)
+static inline void ox_mem_uncharge (struct ox_mem_type *memtype, uint64_t size)
+{
+    __sync_fetch_and_sub (&memtype->allocd, size);
+
+    if (memtype->waiters) {
+        pthread_mutex_lock (&memtype->budget_mutex);
+        pthread_cond_broadcast (&memtype->budget_cond);
+        pthread_mutex_unlock (&memtype->budget_mutex);
+    }
+}
+
+/* Charges 'size' bytes if they fit in the budget of the type. Check and
+ * charge are a single CAS, concurrent allocations cannot overshoot */
+static inline int ox_mem_budget_try (struct ox_mem_type *memtype, size_t size)
 {
-    struct ox_mem_node *tree_node = (struct ox_mem_node *) tree_ptr;
-    struct ox_mem_node *new_node = (struct ox_mem_node *) new_ptr;
+    uint64_t cur;
 
-    if ( new_node->ptr < tree_node->ptr )
+    do {
+        cur = memtype->allocd;
+        if (cur + size > memtype->budget)
+            return -1;
+    } while (!__sync_bool_compare_and_swap (&memtype->allocd, cur, cur + size));
+
+    if (cur + size > memtype->peak)
+        memtype->peak = cur + size;
+
+    return 0;
+}
+
+/* Returns 0 if 'size' more bytes fit in the budget of the type, the bytes
+ * are then charged to the type */
+static int ox_mem_budget_charge (struct ox_mem_type *memtype, size_t size)
+{
+    struct timespec ts;
+    int ret = 0;
+
+    if (!memtype->budget) {
+        ox_mem_charge (memtype, size);
+        return 0;
+    }
+
+    if (!ox_mem_budget_try (memtype, size))
+        return 0;
+
+    if (!memtype->over) {
+        memtype->over = 1;
+        log_info ("[mem: %s reached its budget of %lu bytes]", memtype->name,
+                                                            memtype->budget);
+    }
+
+    if (memtype->policy != OX_MEM_BUDGET_BLOCK || size > memtype->budget) {
+        __sync_fetch_and_add (&memtype->denied, 1);
+        return -1;
+    }
+
+    __sync_fetch_and_add (&memtype->throttled, 1);
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (OX_MEM_BUDGET_WAIT_MS % 1000) * 1000000;
+    ts.tv_sec += OX_MEM_BUDGET_WAIT_MS / 1000 + ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock (&memtype->budget_mutex);
+    __sync_fetch_and_add (&memtype->waiters, 1);
+    while (ox_mem_budget_try (memtype, size)) {
+        if (pthread_cond_timedwait (&memtype->budget_cond,
+                            &memtype->budget_mutex, &ts) == ETIMEDOUT) {
+            ret = ox_mem_budget_try (memtype, size);
+            break;
+        }
+    }
+    __sync_fetch_and_sub (&memtype->waiters, 1);
+    pthread_mutex_unlock (&memtype->budget_mutex);
+
+    if (ret)
+        __sync_fetch_and_add (&memtype->denied, 1);
+
+    return ret;
+}
+
+int ox_mem_set_budget (uint16_t type, uint64_t bytes, uint8_t policy)
+{
+    struct ox_mem_type *memtype;
+
+    if (type >= OX_MEM_MAX_TYPES || !ox_mem.types[type])
         return -1;
-    if ( new_node->ptr > tree_node->ptr )
-        return 1;
+
+    memtype = ox_mem.types[type];
+    memtype->policy = policy;
+    memtype->over = 0;
+    memtype->budget = bytes;
+
+    /* Wake up waiters if the budget was raised */
+    pthread_mutex_lock (&memtype->budget_mutex);
+    pthread_cond_broadcast (&memtype->budget_cond);
+    pthread_mutex_unlock (&memtype->budget_mutex);
+
     return 0;
 }
 
-static void *ox_alloc (size_t size, uint16_t type, uint8_t fn)
+/*
+ * Sets the budget headroom of a type by name. It may be called before the
+ * type exists, usually by the target before ox_ctrl_start. The module that
+ * owns the type applies it with ox_mem_apply_budget once its pools are
+ * allocated, the budget is then the size at that point plus the headroom.
+ */
+int ox_mem_conf_budget (const char *name, uint64_t headroom)
 {
-    void *ptr;
-    struct ox_mem_node *node;
+    uint16_t i;
 
+    if (strlen (name) >= sizeof (ox_mem_conf[0].name))
+        return -1;
+
+    for (i = 0; i < ox_mem_conf_count; i++)
+        if (!strcmp (ox_mem_conf[i].name, name))
+            break;
+
+    if (i == OX_MEM_MAX_CONF)
+        return -1;
+
+    strcpy (ox_mem_conf[i].name, name);
+    ox_mem_conf[i].headroom = headroom;
+    if (i == ox_mem_conf_count)
+        ox_mem_conf_count++;
+
+    return 0;
+}
+
+/* Types without a configured headroom are left without a budget */
+int ox_mem_apply_budget (uint16_t type, uint8_t policy)
+{
+    struct ox_mem_type *memtype;
+    uint16_t i;
+
+    if (type >= OX_MEM_MAX_TYPES || !ox_mem.types[type])
+        return -1;
+
+    memtype = ox_mem.types[type];
+    for (i = 0; i < ox_mem_conf_count; i++) {
+        if (strcmp (ox_mem_conf[i].name, memtype->name))
+            continue;
+
+        if (!ox_mem_conf[i].headroom)
+            return 0;
+
+        return ox_mem_set_budget (type, memtype->allocd +
+                                        ox_mem_conf[i].headroom, policy);
+    }
+
+    return 0;
+}
+
+/* Returns the type ID with 'name', or -1 */
+int ox_mem_find_type (const char *name)
+{
+    struct ox_mem_type *memtype;
+
+    TAILQ_FOREACH (memtype, &ox_mem.types_head, entry) {
+        if (!strcmp (memtype->name, name))
+            return memtype->id;
+    }
+
+    return -1;
+}
+
+uint64_t ox_mem_peak (uint16_t type)
+{
     if (type >= OX_MEM_MAX_TYPES || !ox_mem.types[type])
+        return 0;
+
+    return ox_mem.types[type]->peak;
+}
+
+#if OX_MEM_MANAGER
+static inline uint8_t ox_mem_class (size_t size)
+{
+    size_t blk = size + OX_MEM_HDR_SZ;
+
+    if (blk > OX_MEM_CLASS_MAX)
+        return OX_MEM_CLASS_LARGE;
+    if (blk <= OX_MEM_CLASS_MIN)
+        return 0;
+
+    return (64 - __builtin_clzll (blk - 1)) - __builtin_ctz (OX_MEM_CLASS_MIN);
+}
+
+/* Carve a new slab in blocks, called with the class lock held */
+static int ox_mem_class_grow (struct ox_mem_class *cl)
+{
+    struct ox_mem_slab *slab;
+    struct ox_mem_free_blk *blk;
+    uint8_t *off, *end;
+
+    slab = malloc (OX_MEM_SLAB_SZ);
+    if (!slab)
+        return -1;
+
+    slab->next = cl->slabs;
+    cl->slabs = slab;
+
+    off = (uint8_t *) slab + sizeof (struct ox_mem_slab);
+    end = (uint8_t *) slab + OX_MEM_SLAB_SZ;
+    while (off + cl->blk_sz <= end) {
+        blk = (struct ox_mem_free_blk *) off;
+        blk->hdr.magic = OX_MEM_MAGIC_FREE;
+        blk->next = cl->free;
+        cl->free = blk;
+        off += cl->blk_sz;
+    }
+
+    return 0;
+}
+
+/* Move up to 'n' pool blocks to 'mag', returns the count */
+static int ox_mem_class_get (struct ox_mem_class *cl, struct ox_mem_mag *mag,
+                                                                        int n)
+{
+    struct ox_mem_free_blk *blk;
+    int got = 0;
+
+    pthread_spin_lock (&cl->spin);
+    while (got < n) {
+        if (!cl->free && ox_mem_class_grow (cl))
+            break;
+        blk = cl->free;
+        cl->free = blk->next;
+        blk->next = mag->head;
+        mag->head = blk;
+        got++;
+    }
+    pthread_spin_unlock (&cl->spin);
+
+    mag->count += got;
+    return got;
+}
+
+/* Give all but 'keep' blocks of 'mag' back to the pool */
+static void ox_mem_class_put (struct ox_mem_class *cl, struct ox_mem_mag *mag,
+                                                                    int keep)
+{
+    struct ox_mem_free_blk *first, *last;
+    int i, n = mag->count - keep;
+
+    if (n <= 0)
+        return;
+
+    first = last = mag->head;
+    for (i = 1; i < n; i++)
+        last = last->next;
+    mag->head = last->next;
+    mag->count = keep;
+
+    pthread_spin_lock (&cl->spin);
+    last->next = cl->free;
+    cl->free = first;
+    pthread_spin_unlock (&cl->spin);
+}
+
+/* Blocks cached from a destroyed type went away with its slabs, forget them */
+static struct ox_mem_mag *ox_mem_cache_mag (struct ox_mem_cache *cache,
+                                                uint16_t type, uint8_t class)
+{
+    struct ox_mem_mag *mag = &cache->mags[type][class];
+
+    if (mag->gen != ox_mem.gens[type]) {
+        mag->head = NULL;
+        mag->count = 0;
+        mag->gen = ox_mem.gens[type];
+    }
+    mag->used = 1;
+
+    return mag;
+}
+
+static void ox_mem_cache_drain (struct ox_mem_cache *cache, uint8_t idle)
+{
+    struct ox_mem_mag *mag;
+    int t, c;
+
+    for (t = 0; t < OX_MEM_MAX_TYPES; t++) {
+        for (c = 0; c < OX_MEM_CLASSES; c++) {
+            mag = &cache->mags[t][c];
+            if (mag->count && (!idle || !mag->used) && ox_mem.types[t] &&
+                                                mag->gen == ox_mem.gens[t])
+                ox_mem_class_put (&ox_mem.types[t]->classes[c], mag, 0);
+            mag->used = 0;
+        }
+    }
+}
+
+static void ox_mem_cache_exit (void *arg)
+{
+    struct ox_mem_cache *cache = (struct ox_mem_cache *) arg;
+
+    ox_mem_cache_drain (cache, 0);
+    free (cache);
+    mem_cache = NULL;
+}
+
+static void ox_mem_cache_key (void)
+{
+    pthread_key_create (&mem_cache_key, ox_mem_cache_exit);
+}
+
+static struct ox_mem_cache *ox_mem_cache_get (void)
+{
+    if (mem_cache)
+        return mem_cache;
+
+    pthread_once (&mem_cache_once, ox_mem_cache_key);
+
+    mem_cache = calloc (1, sizeof (struct ox_mem_cache));
+    if (mem_cache)
+        pthread_setspecific (mem_cache_key, mem_cache);
+
+    return mem_cache;
+}
+
+/* Take a block from the thread's magazine, refilled from the pool */
+static struct ox_mem_hdr *ox_mem_cache_alloc (struct ox_mem_type *memtype,
+                                                                uint8_t class)
+{
+    struct ox_mem_class *cl = &memtype->classes[class];
+    struct ox_mem_cache *cache;
+    struct ox_mem_mag *mag, tmp = { NULL, 0, 0, 0 };
+    struct ox_mem_free_blk *blk;
+
+    cache = ox_mem_cache_get ();
+    mag = (cache) ? ox_mem_cache_mag (cache, memtype->id, class) : NULL;
+
+    /* No cache for this thread, take a single block */
+    if (!mag) {
+        if (!ox_mem_class_get (cl, &tmp, 1))
+            return NULL;
+        return &tmp.head->hdr;
+    }
+
+    if (++cache->ops % OX_MEM_MAG_TICK == 0)
+        ox_mem_cache_drain (cache, 1);
+
+    if (!mag->count && !ox_mem_class_get (cl, mag, cl->mag_sz / 2))
         return NULL;
 
-    ptr = (fn == OX_MEM_CALLOC) ? calloc (1, size) : malloc (size);
+    blk = mag->head;
+    mag->head = blk->next;
+    mag->count--;
+
+    return &blk->hdr;
+}
+
+/* Return a block to the thread's magazine, drained by half when full */
+static void ox_mem_cache_free (struct ox_mem_type *memtype,
+                                                        struct ox_mem_hdr *hdr)
+{
+    struct ox_mem_class *cl = &memtype->classes[hdr->class];
+    struct ox_mem_free_blk *blk = (struct ox_mem_free_blk *) hdr;
+    struct ox_mem_cache *cache;
+    struct ox_mem_mag *mag, tmp = { NULL, 0, 0, 0 };
+
+    cache = ox_mem_cache_get ();
+    mag = (cache) ? ox_mem_cache_mag (cache, memtype->id, hdr->class) : NULL;
+    if (!mag)
+        mag = &tmp;
+
+    blk->next = mag->head;
+    mag->head = blk;
+    mag->count++;
+
+    if (mag == &tmp)
+        ox_mem_class_put (cl, mag, 0);
+    else if (mag->count >= cl->mag_sz)
+        ox_mem_class_put (cl, mag, cl->mag_sz / 2);
+}
+
+static inline void ox_mem_track (struct ox_mem_type *memtype,
+                                                        struct ox_mem_hdr *hdr)
+{
+#if OX_MEM_LEAK_DEBUG
+    pthread_spin_lock (&memtype->alloc_spin);
+    LIST_INSERT_HEAD (&memtype->live, hdr, entry);
+    pthread_spin_unlock (&memtype->alloc_spin);
+#endif
+}
+
+static inline void ox_mem_untrack (struct ox_mem_type *memtype,
+                                                        struct ox_mem_hdr *hdr)
+{
+#if OX_MEM_LEAK_DEBUG
+    pthread_spin_lock (&memtype->alloc_spin);
+    LIST_REMOVE (hdr, entry);
+    pthread_spin_unlock (&memtype->alloc_spin);
+#endif
+}
+
+/* Returns the header of a live block, or NULL if 'ptr' was not allocated by
+ * ox_malloc or is already free */
+static struct ox_mem_hdr *ox_mem_hdr_get (void *ptr)
+{
+    struct ox_mem_hdr *hdr;
+
     if (!ptr)
         return NULL;
 
-    node = malloc (sizeof (struct ox_mem_node));
-    if (!node) {
-        free (ptr);
+    hdr = (struct ox_mem_hdr *) ((uint8_t *) ptr - OX_MEM_HDR_SZ);
+    if (hdr->magic != OX_MEM_MAGIC || hdr->type >= OX_MEM_MAX_TYPES ||
+                                                    !ox_mem.types[hdr->type])
         return NULL;
+
+    return hdr;
+}
+
+static void *ox_alloc (size_t size, uint16_t type, uint8_t fn)
+{
+    struct ox_mem_type *memtype;
+    struct ox_mem_hdr *hdr;
+    uint8_t class;
+
+    if (type >= OX_MEM_MAX_TYPES || !ox_mem.types[type])
+        return NULL;
+
+    memtype = ox_mem.types[type];
+    if (ox_mem_budget_charge (memtype, size))
+        return NULL;
+
+    class = ox_mem_class (size);
+
+    if (class == OX_MEM_CLASS_LARGE) {
+        hdr = (fn == OX_MEM_CALLOC) ? calloc (1, OX_MEM_HDR_SZ + size) :
+                                                malloc (OX_MEM_HDR_SZ + size);
+        if (!hdr)
+            goto UNCHARGE;
+    } else {
+        hdr = ox_mem_cache_alloc (memtype, class);
+        if (!hdr)
+            goto UNCHARGE;
+        if (fn == OX_MEM_CALLOC)
+            memset (hdr + 1, 0x0, size);
     }
 
-    node->ptr = ptr;
-    node->size = size;
+    hdr->size = size;
+    hdr->type = type;
+    hdr->class = class;
+    hdr->magic = OX_MEM_MAGIC;
 
-    pthread_spin_lock (&ox_mem.types[type]->alloc_spin);
-    ox_mem.types[type]->allocd += size;
-    tsearch((void *) node, &ox_mem.types[type]->root, ox_mem_btree_compare);
-    pthread_spin_unlock (&ox_mem.types[type]->alloc_spin);
+    ox_mem_track (memtype, hdr);
 
-    return ptr;
+    return hdr + 1;
+
+UNCHARGE:
+    ox_mem_uncharge (memtype, size);
+    return NULL;
 }
 
 void *ox_calloc (size_t members, size_t size, uint16_t type)
@@ -128,9 +662,10 @@ void *ox_malloc (size_t size, uint16_t type)
 
 void *ox_realloc (void *ptr, size_t size, uint16_t type)
 {
-    struct ox_mem_node **ret;
-    struct ox_mem_node *node;
-    void *new;
+    struct ox_mem_type *memtype;
+    struct ox_mem_hdr *hdr, *new;
+    void *new_ptr;
+    size_t grow;
 
     if (type >= OX_MEM_MAX_TYPES || !ox_mem.types[type])
         return NULL;
@@ -138,61 +673,82 @@ void *ox_realloc (void *ptr, size_t size, uint16_t type)
     if (!ptr)
         return ox_alloc (size, type, OX_MEM_MALLOC);
 
-    pthread_spin_lock (&ox_mem.types[type]->alloc_spin);
-
-    ret = (struct ox_mem_node **) tfind(&ptr, &ox_mem.types[type]->root,
-                                                        ox_mem_btree_compare);
-    if (!ret) {
+    hdr = ox_mem_hdr_get (ptr);
+    if (!hdr) {
         log_err ("[mem: Realloc pointer not found. ptr: %p, type %d]", ptr, type);
-        pthread_spin_unlock (&ox_mem.types[type]->alloc_spin);
         return NULL;
     }
+    memtype = ox_mem.types[hdr->type];
+
+    grow = (size > hdr->size) ? size - hdr->size : 0;
+
+    /* Still fits in the same block */
+    if (hdr->class != OX_MEM_CLASS_LARGE &&
+            size + OX_MEM_HDR_SZ <= memtype->classes[hdr->class].blk_sz) {
+        if (grow && ox_mem_budget_charge (memtype, grow))
+            return NULL;
+        if (!grow)
+            ox_mem_uncharge (memtype, hdr->size - size);
+        hdr->size = size;
+        return ptr;
+    }
 
-    new = realloc (ptr, size);
-    if (!new)
-        return NULL;
-
-    node = *ret;
-    tdelete(node, &ox_mem.types[type]->root, ox_mem_btree_compare);
-    node->ptr = new;
-    tsearch((void *) node, &ox_mem.types[type]->root, ox_mem_btree_compare);
+    if (hdr->class == OX_MEM_CLASS_LARGE &&
+                                ox_mem_class (size) == OX_MEM_CLASS_LARGE) {
+        if (grow && ox_mem_budget_charge (memtype, grow))
+            return NULL;
+        ox_mem_untrack (memtype, hdr);
+        new = realloc (hdr, OX_MEM_HDR_SZ + size);
+        if (!new) {
+            ox_mem_track (memtype, hdr);
+            if (grow)
+                ox_mem_uncharge (memtype, grow);
+            return NULL;
+        }
+        if (!grow)
+            ox_mem_uncharge (memtype, new->size - size);
+        new->size = size;
+        ox_mem_track (memtype, new);
+        return new + 1;
+    }
 
-    ox_mem.types[type]->allocd += size - node->size;
-    node->size = size;
+    new_ptr = ox_alloc (size, hdr->type, OX_MEM_MALLOC);
+    if (!new_ptr)
+        return NULL;
 
-    pthread_spin_unlock (&ox_mem.types[type]->alloc_spin);
+    memcpy (new_ptr, ptr, MIN (size, hdr->size));
+    ox_free (ptr, hdr->type);
 
-    return new;
+    return new_ptr;
 }
 
 void *ox_free (void *ptr, uint16_t type)
 {
-    struct ox_mem_node **ret;
-    struct ox_mem_node *node;
+    struct ox_mem_type *memtype;
+    struct ox_mem_hdr *hdr;
 
     if (type >= OX_MEM_MAX_TYPES || !ox_mem.types[type])
         return ptr;
 
-    pthread_spin_lock (&ox_mem.types[type]->alloc_spin);
-
-    ret = (struct ox_mem_node **) tfind(&ptr, &ox_mem.types[type]->root,
-                                                        ox_mem_btree_compare);
-    if (!ret) {
+    hdr = ox_mem_hdr_get (ptr);
+    if (!hdr) {
         log_err ("[mem: Double free detected. ptr: %p, type %d]", ptr, type);
-        pthread_spin_unlock (&ox_mem.types[type]->alloc_spin);
         return ptr;
     }
 
-    node = *ret;
-    ox_mem.types[type]->allocd -= node->size;
+    if (hdr->type != type)
+        log_err ("[mem: Type mismatch in free. ptr: %p, type %d, allocated "
+                                            "as %d]", ptr, type, hdr->type);
 
-    free (node->ptr);    
+    memtype = ox_mem.types[hdr->type];
+    ox_mem_untrack (memtype, hdr);
+    hdr->magic = OX_MEM_MAGIC_FREE;
+    ox_mem_uncharge (memtype, hdr->size);
 
-    tdelete(node, &ox_mem.types[type]->root, ox_mem_btree_compare);
-
-    free (node);
-
-    pthread_spin_unlock (&ox_mem.types[type]->alloc_spin);
+    if (hdr->class == OX_MEM_CLASS_LARGE)
+        free (hdr);
+    else
+        ox_mem_cache_free (memtype, hdr);
 
     return NULL;
 }
@@ -201,6 +757,7 @@ void *ox_free (void *ptr, uint16_t type)
 struct ox_mem_type *ox_mem_create_type (const char *name, uint16_t type)
 {
     struct ox_mem_type *memtype;
+    int i;
 
     if (strlen(name) > 32) {
         log_err ("[mem: Type name is too big. max of 32 bytes]");
@@ -225,33 +782,91 @@ struct ox_mem_type *ox_mem_create_type (const char *name, uint16_t type)
     memcpy (memtype->name, name, strlen(name) + 1);
 
     memtype->allocd = 0;
-    memtype->root = NULL;
+    memtype->peak = 0;
+    memtype->budget = 0;
+    memtype->policy = OX_MEM_BUDGET_FAIL;
+    memtype->over = 0;
+    memtype->waiters = 0;
+    memtype->throttled = 0;
+    memtype->denied = 0;
+#if OX_MEM_LEAK_DEBUG
+    LIST_INIT (&memtype->live);
+#endif
 
-    if (pthread_spin_init (&memtype->alloc_spin, 0)) {
-        free (memtype);
-        return NULL;
+    if (pthread_spin_init (&memtype->alloc_spin, 0))
+        goto FREE;
+    if (pthread_mutex_init (&memtype->budget_mutex, NULL))
+        goto SPIN;
+    if (pthread_cond_init (&memtype->budget_cond, NULL))
+        goto MUTEX;
+
+    for (i = 0; i < OX_MEM_CLASSES; i++) {
+        memtype->classes[i].free = NULL;
+        memtype->classes[i].slabs = NULL;
+        memtype->classes[i].blk_sz = OX_MEM_CLASS_MIN << i;
+        memtype->classes[i].mag_sz = MAX (2, MIN (OX_MEM_MAG_MAX,
+                                    OX_MEM_MAG_BYTES / (OX_MEM_CLASS_MIN << i)));
+        pthread_spin_init (&memtype->classes[i].spin, 0);
     }
 
+    ox_mem.gens[type]++;
+
     TAILQ_INSERT_TAIL (&ox_mem.types_head, memtype, entry);
     ox_mem.types[type] = memtype;
 
     return memtype;
+
+MUTEX:
+    pthread_mutex_destroy (&memtype->budget_mutex);
+SPIN:
+    pthread_spin_destroy (&memtype->alloc_spin);
+FREE:
+    free (memtype);
+    return NULL;
 }
 
 static void ox_mem_destroy_type (struct ox_mem_type *type)
 {
+    struct ox_mem_slab *slab;
+#if OX_MEM_LEAK_DEBUG
+    struct ox_mem_hdr *hdr;
+#endif
+    int i;
+
     if (!type || !ox_mem.types[type->id])
         return;
 
     if (type->allocd) {
-        log_info ("[mem: Leak was found in %s]", type->name);
+        log_info ("[mem: Leak was found in %s: %lu bytes]", type->name,
+                                                                type->allocd);
         //printf ("\n[mem: Leak was found in %s. Check the log.]\n", type->name);
-        tdestroy (ox_mem.types[type->id]->root,ox_mem_btree_free_act);
+#if OX_MEM_LEAK_DEBUG
+        while (!LIST_EMPTY (&type->live)) {
+            hdr = LIST_FIRST (&type->live);
+            LIST_REMOVE (hdr, entry);
+            log_info ("[mem: Leak detected. ptr: %p, size %lu bytes]",
+                                                        hdr + 1, hdr->size);
+            if (hdr->class == OX_MEM_CLASS_LARGE)
+                free (hdr);
+        }
+#endif
         type->allocd = 0;
     }
 
+    /* Leaked slab blocks go with their slabs */
+    for (i = 0; i < OX_MEM_CLASSES; i++) {
+        while (type->classes[i].slabs) {
+            slab = type->classes[i].slabs;
+            type->classes[i].slabs = slab->next;
+            free (slab);
+        }
+        pthread_spin_destroy (&type->classes[i].spin);
+    }
+
     TAILQ_REMOVE (&ox_mem.types_head, type, entry);
     ox_mem.types[type->id] = NULL;
+    pthread_cond_destroy (&type->budget_cond);
+    pthread_mutex_destroy (&type->budget_mutex);
     pthread_spin_destroy (&type->alloc_spin);
     free (type);
 }
@@ -279,16 +894,148 @@ uint64_t ox_mem_total (void)
 void ox_mem_print_memory (void)
 {
     struct ox_mem_type *memtype;
-    uint64_t total = 0;
 
+    uint64_t total = 0, peak = 0;
+
+    printf ("                          %14s %14s %14s %9s %7s\n", "Current MB",
+                            "Peak MB", "Budget MB", "Throttled", "Denied");
     TAILQ_FOREACH (memtype, &ox_mem.types_head, entry) {
-        printf (" %2d - %-18s: %10.5lf MB (%lu bytes)\n", memtype->id, memtype->name,
+        printf (" %2d - %-18s: %14.5lf %14.5lf ", memtype->id, memtype->name,
                 (double) memtype->allocd / (double) 1024 / (double) 1024,
-                memtype->allocd);
+                (double) memtype->peak / (double) 1024 / (double) 1024);
+        if (memtype->budget)
+            printf ("%10.2lf %s %9lu %7lu\n",
+                (double) memtype->budget / (double) 1024 / (double) 1024,
+                (memtype->policy == OX_MEM_BUDGET_BLOCK) ? "(b)" : "(f)",
+                memtype->throttled, memtype->denied);
+        else
+            printf ("%14s %9s %7s\n", "-", "-", "-");
         total += ox_mem_size (memtype->id);
+        peak += memtype->peak;
+    }
+    printf ("\n Total: %.5lf MB (%lu bytes), sum of peaks %.5lf MB\n",
+                        (double) total / (double) 1024 / (double) 1024, total,
+                        (double) peak / (double) 1024 / (double) 1024);
+    printf (" Budget policy: (b) blocks up to %d ms, (f) fails at once\n",
+                                                        OX_MEM_BUDGET_WAIT_MS);
+}
+
+void ox_mem_metrics (struct ox_metrics *m)
+{
+    struct ox_mem_type *memtype;
+    const char *help[4] = { "Bytes allocated per memory type",
+                            "High-water mark of allocated bytes",
+                            "Memory budget in bytes, 0 for none",
+                            "Allocations throttled or denied by the budget" };
+
+    TAILQ_FOREACH (memtype, &ox_mem.types_head, entry) {
+        ox_metrics_add (m, "ox_memory_bytes", OX_METRIC_GAUGE, help[0],
+                            memtype->allocd, "type=\"%s\"", memtype->name);
+        help[0] = NULL;
+    }
+    TAILQ_FOREACH (memtype, &ox_mem.types_head, entry) {
+        ox_metrics_add (m, "ox_memory_peak_bytes", OX_METRIC_GAUGE, help[1],
+                            memtype->peak, "type=\"%s\"", memtype->name);
+        help[1] = NULL;
+    }
+    TAILQ_FOREACH (memtype, &ox_mem.types_head, entry) {
+        ox_metrics_add (m, "ox_memory_budget_bytes", OX_METRIC_GAUGE, help[2],
+                            memtype->budget, "type=\"%s\"", memtype->name);
+        help[2] = NULL;
+    }
+    TAILQ_FOREACH (memtype, &ox_mem.types_head, entry) {
+        if (!memtype->budget)
+            continue;
+        ox_metrics_add (m, "ox_memory_budget_events_total", OX_METRIC_COUNTER,
+                help[3], memtype->throttled, "type=\"%s\",event=\"throttled\"",
+                memtype->name);
+        help[3] = NULL;
+        ox_metrics_add (m, "ox_memory_budget_events_total", OX_METRIC_COUNTER,
+                NULL, memtype->denied, "type=\"%s\",event=\"denied\"",
+                memtype->name);
     }
-    printf ("\n Total: %.5lf MB (%lu bytes)\n",
-                        (double) total / (double) 1024 / (double) 1024, total);
+}
+
+struct ox_mem_arena *ox_mem_arena_create (size_t size, uint16_t type)
+{
+    struct ox_mem_arena *arena;
+    struct ox_mem_type *memtype;
+
+    if (!size || type >= OX_MEM_MAX_TYPES)
+        return NULL;
+
+    arena = malloc (sizeof (struct ox_mem_arena));
+    if (!arena)
+        return NULL;
+
+    arena->size = (size + OX_MEM_HUGEPAGE_SZ - 1) &
+                                        ~((size_t) OX_MEM_HUGEPAGE_SZ - 1);
+    arena->used = 0;
+    arena->type = type;
+    arena->huge = 1;
+
+    arena->base = mmap (NULL, arena->size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena->base == MAP_FAILED) {
+        arena->huge = 0;
+        arena->base = mmap (NULL, arena->size, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena->base == MAP_FAILED)
+            goto FREE;
+        madvise (arena->base, arena->size, MADV_HUGEPAGE);
+    }
+
+    if (pthread_spin_init (&arena->spin, 0))
+        goto UNMAP;
+
+    memtype = ox_mem.types[type];
+    if (memtype)
+        ox_mem_charge (memtype, arena->size);
+
+    log_info ("[mem: Arena of %lu MB created for type %d (%s).]",
+                        arena->size / 1024 / 1024, type,
+                        (arena->huge) ? "hugetlb" : "transparent hugepages");
+
+    return arena;
+
+UNMAP:
+    munmap (arena->base, arena->size);
+FREE:
+    free (arena);
+    return NULL;
+}
+
+/* Bump allocation, blocks are cache-line aligned and zeroed */
+void *ox_mem_arena_alloc (struct ox_mem_arena *arena, size_t size)
+{
+    void *ptr = NULL;
+
+    size = (size + OX_MEM_ARENA_ALIGN - 1) & ~((size_t) OX_MEM_ARENA_ALIGN - 1);
+
+    pthread_spin_lock (&arena->spin);
+    if (arena->used + size <= arena->size) {
+        ptr = arena->base + arena->used;
+        arena->used += size;
+    }
+    pthread_spin_unlock (&arena->spin);
+
+    return ptr;
+}
+
+void ox_mem_arena_destroy (struct ox_mem_arena *arena)
+{
+    struct ox_mem_type *memtype;
+
+    if (!arena)
+        return;
+
+    memtype = ox_mem.types[arena->type];
+    if (memtype)
+        ox_mem_uncharge (memtype, arena->size);
+
+    munmap (arena->base, arena->size);
+    pthread_spin_destroy (&arena->spin);
+    free (arena);
 }
 
 void ox_mem_exit (void)
@@ -0,0 +1,331 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Metrics exporter over a Unix domain socket
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * A thread listens on OX_METRICS_SOCK. Each connection gets one snapshot and
+ * is closed; a client that stops reading is dropped after
+ * OX_METRICS_SEND_TO_MS. Per-second sampling runs in its own thread, so
+ * clients never delay it, and keeps running if the socket cannot be set up.
+ * The first line sent by the client selects the format: anything
+ * containing "json" gets JSON, otherwise Prometheus text. Requests starting
+ * with "GET " are answered with an HTTP header, so the socket can be scraped
+ * with e.g. 'curl --unix-socket /tmp/ox-metrics.sock http://ox/metrics'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <libox.h>
+#include <ox-mq.h>
+
+#define OX_METRICS_SAMPLE_MS    1000
+#define OX_METRICS_REQ_SZ       256
+#define OX_METRICS_REQ_TO_MS    200
+#define OX_METRICS_SEND_TO_MS   1000
+
+static struct ox_metrics_server {
+    int             fd;
+    pthread_t       tid;
+    pthread_t       sample_tid;
+    volatile uint8_t stop;
+    uint8_t         running;  /* socket thread */
+    uint8_t         sampling; /* sample thread */
+    uint8_t         ready;    /* 'sample_mutex' is initialized */
+
+    /* Held while sampling and while collecting a snapshot */
+    pthread_mutex_t sample_mutex;
+
+    /* User IOPS of the last sample, from the latency histogram counts */
+    uint64_t        user_prev[2];
+    uint64_t        sample_ns;
+    double          user_iops[2];
+} ox_metrics_srv;
+
+static void ox_metrics_user_io (struct ox_metrics *m)
+{
+    ox_metrics_add (m, "ox_user_iops", OX_METRIC_GAUGE,
+                "Completed NVMe reads and writes per second",
+                ox_metrics_srv.user_iops[OX_LAT_READ], "dir=\"read\"");
+    ox_metrics_add (m, "ox_user_iops", OX_METRIC_GAUGE, NULL,
+                ox_metrics_srv.user_iops[OX_LAT_WRITE], "dir=\"write\"");
+}
+
+static void ox_metrics_collect (struct ox_metrics *m)
+{
+    ox_metrics_user_io (m);
+    ox_stats_metrics (m);
+    ox_lat_metrics (m);
+    ox_mq_metrics (m);
+    ox_mem_metrics (m);
+    ox_chstat_metrics (m);
+}
+
+/* Refresh the per-second rates */
+static void ox_metrics_sample (void)
+{
+    struct timespec ts;
+    uint64_t ns, count;
+    double sec;
+    uint8_t dir;
+
+    GET_NANOSECONDS (ns, ts);
+
+    if (ox_metrics_srv.sample_ns) {
+        sec = (double) (ns - ox_metrics_srv.sample_ns) / 1000000000.0;
+        for (dir = OX_LAT_READ; dir <= OX_LAT_WRITE; dir++) {
+            count = ox_lat_count (dir, OX_LAT_TOTAL);
+
+            /* A reset of the histograms restarts the counts */
+            ox_metrics_srv.user_iops[dir] =
+                (count < ox_metrics_srv.user_prev[dir] || sec <= 0) ? 0 :
+                (double) (count - ox_metrics_srv.user_prev[dir]) / sec;
+            ox_metrics_srv.user_prev[dir] = count;
+        }
+    } else {
+        for (dir = OX_LAT_READ; dir <= OX_LAT_WRITE; dir++)
+            ox_metrics_srv.user_prev[dir] = ox_lat_count (dir, OX_LAT_TOTAL);
+    }
+
+    ox_metrics_srv.sample_ns = ns;
+    ox_stats_sample ();
+    ox_chstat_sample ();
+}
+
+static void *ox_metrics_sample_thread (void *arg)
+{
+    struct timespec ts;
+    uint64_t now, next = 0;
+
+    while (!ox_metrics_srv.stop) {
+        GET_NANOSECONDS (now, ts);
+        if (now >= next) {
+            pthread_mutex_lock (&ox_metrics_srv.sample_mutex);
+            ox_metrics_sample ();
+            pthread_mutex_unlock (&ox_metrics_srv.sample_mutex);
+            next = now + (uint64_t) OX_METRICS_SAMPLE_MS * 1000000;
+        }
+        usleep (100000);
+    }
+
+    return NULL;
+}
+
+static void ox_metrics_serve (int fd)
+{
+    struct ox_metrics *m;
+    char req[OX_METRICS_REQ_SZ];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct timeval to = { OX_METRICS_SEND_TO_MS / 1000,
+                                        (OX_METRICS_SEND_TO_MS % 1000) * 1000 };
+    char *buf;
+    ssize_t ret;
+    size_t off, len;
+    int json, http;
+
+    req[0] = '\0';
+    if (poll (&pfd, 1, OX_METRICS_REQ_TO_MS) > 0) {
+        ret = read (fd, req, OX_METRICS_REQ_SZ - 1);
+        req[(ret > 0) ? ret : 0] = '\0';
+    }
+
+    if (setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &to, sizeof (to)))
+        return;
+
+    json = (strstr (req, "json") != NULL);
+    http = !strncmp (req, "GET ", 4);
+
+    m = ox_metrics_new ();
+    if (!m)
+        return;
+
+    pthread_mutex_lock (&ox_metrics_srv.sample_mutex);
+    ox_metrics_collect (m);
+    pthread_mutex_unlock (&ox_metrics_srv.sample_mutex);
+    buf = ox_metrics_format (m, json, &len);
+    ox_metrics_free (m);
+    if (!buf)
+        return;
+
+    if (http)
+        dprintf (fd, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+                    "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+                    (json) ? "application/json" :
+                                        "text/plain; version=0.0.4", len);
+
+    off = 0;
+    while (off < len) {
+        ret = write (fd, buf + off, len - off);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        off += ret;
+    }
+
+    ox_free (buf, OX_MEM_CORE_EXEC);
+}
+
+static void *ox_metrics_thread (void *arg)
+{
+    struct pollfd pfd = { ox_metrics_srv.fd, POLLIN, 0 };
+    int fd;
+
+    while (!ox_metrics_srv.stop) {
+        if (poll (&pfd, 1, OX_METRICS_SAMPLE_MS) <= 0)
+            continue;
+
+        fd = accept (ox_metrics_srv.fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        ox_metrics_serve (fd);
+        close (fd);
+    }
+
+    return NULL;
+}
+
+/* Removes a socket file left by a previous run. Fails if the path is not a
+ * socket or if another exporter is still listening on it. */
+static int ox_metrics_sock_clear (struct sockaddr_un *addr)
+{
+    struct stat st;
+    int fd, ret;
+
+    if (lstat (OX_METRICS_SOCK, &st))
+        return (errno == ENOENT) ? 0 : -1;
+
+    if (!S_ISSOCK (st.st_mode)) {
+        log_err (" [ox-metrics: %s exists and is not a socket]\n",
+                                                            OX_METRICS_SOCK);
+        return -1;
+    }
+
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    ret = connect (fd, (struct sockaddr *) addr, sizeof (struct sockaddr_un));
+    close (fd);
+    if (!ret) {
+        log_err (" [ox-metrics: Another exporter is listening on %s]\n",
+                                                            OX_METRICS_SOCK);
+        return -1;
+    }
+
+    return unlink (OX_METRICS_SOCK);
+}
+
+/* Sampling does not depend on the socket, it also feeds ox_stats and
+ * ox_chstat rates */
+static int ox_metrics_sample_start (void)
+{
+    if (pthread_create (&ox_metrics_srv.sample_tid, NULL,
+                                            ox_metrics_sample_thread, NULL))
+        return -1;
+
+    ox_metrics_srv.sampling = 1;
+    return 0;
+}
+
+int ox_metrics_init (void)
+{
+    struct sockaddr_un addr;
+
+    if (ox_metrics_srv.ready)
+        return (ox_metrics_srv.running) ? 0 : -1;
+
+    memset (&ox_metrics_srv, 0x0, sizeof (ox_metrics_srv));
+
+    if (pthread_mutex_init (&ox_metrics_srv.sample_mutex, NULL)) {
+        log_err (" [ox-metrics: Exporter not started on %s]\n",
+                                                            OX_METRICS_SOCK);
+        return -1;
+    }
+    ox_metrics_srv.ready = 1;
+
+    if (ox_metrics_sample_start ())
+        log_err (" [ox-metrics: Sampling thread not started]\n");
+
+    ox_metrics_srv.fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (ox_metrics_srv.fd < 0)
+        goto ERR;
+
+    memset (&addr, 0x0, sizeof (struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, OX_METRICS_SOCK, sizeof (addr.sun_path) - 1);
+
+    if (ox_metrics_sock_clear (&addr))
+        goto CLOSE;
+
+    if (bind (ox_metrics_srv.fd, (struct sockaddr *) &addr,
+                                                sizeof (struct sockaddr_un)))
+        goto CLOSE;
+
+    /* No client can connect before listen, the mode is set in time */
+    if (chmod (OX_METRICS_SOCK, OX_METRICS_SOCK_MODE))
+        goto UNLINK;
+
+    if (listen (ox_metrics_srv.fd, 8))
+        goto UNLINK;
+
+    if (pthread_create (&ox_metrics_srv.tid, NULL, ox_metrics_thread, NULL))
+        goto UNLINK;
+
+    ox_metrics_srv.running = 1;
+    log_info (" [ox-metrics: Exporter listening on %s]\n", OX_METRICS_SOCK);
+
+    return 0;
+
+UNLINK:
+    unlink (OX_METRICS_SOCK);
+CLOSE:
+    close (ox_metrics_srv.fd);
+ERR:
+    log_err (" [ox-metrics: Exporter not started on %s]\n", OX_METRICS_SOCK);
+    return -1;
+}
+
+void ox_metrics_exit (void)
+{
+    if (!ox_metrics_srv.ready)
+        return;
+
+    ox_metrics_srv.stop = 1;
+
+    if (ox_metrics_srv.running) {
+        pthread_join (ox_metrics_srv.tid, NULL);
+        close (ox_metrics_srv.fd);
+        unlink (OX_METRICS_SOCK);
+        ox_metrics_srv.running = 0;
+    }
+
+    if (ox_metrics_srv.sampling) {
+        pthread_join (ox_metrics_srv.sample_tid, NULL);
+        ox_metrics_srv.sampling = 0;
+    }
+
+    pthread_mutex_destroy (&ox_metrics_srv.sample_mutex);
+    ox_metrics_srv.ready = 0;
+}
@@ -0,0 +1,244 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Metrics snapshots and export formats
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Metric snapshots and their Prometheus text and JSON formats. Modules fill a
+ * snapshot with ox_metrics_add, reading only counters that I/O threads update
+ * with atomics, so no lock taken by the I/O path is held. The socket server
+ * is in ox-metrics-server.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libox.h>
+
+#define OX_METRICS_BUF_SZ   (64 * 1024)
+
+struct ox_metric {
+    char        name[64];
+    char        labels[128];
+    const char  *help;
+    uint8_t     type;
+    double      value;
+};
+
+struct ox_metrics {
+    struct ox_metric *list;
+    uint32_t          count;
+    uint32_t          size;
+};
+
+struct ox_metrics_buf {
+    char     *data;
+    size_t    len;
+    size_t    size;
+};
+
+void ox_metrics_add (struct ox_metrics *m, const char *name, uint8_t type,
+                const char *help, double value, const char *labels, ...)
+{
+    struct ox_metric *metric, *list;
+    va_list ap;
+
+    if (m->count == m->size) {
+        list = ox_realloc (m->list, sizeof (struct ox_metric) *
+                                    (m->size ? m->size * 2 : 128),
+                                    OX_MEM_CORE_EXEC);
+        if (!list)
+            return;
+        m->list = list;
+        m->size = m->size ? m->size * 2 : 128;
+    }
+
+    metric = &m->list[m->count];
+    snprintf (metric->name, sizeof (metric->name), "%s", name);
+    metric->labels[0] = '\0';
+    if (labels) {
+        va_start (ap, labels);
+        vsnprintf (metric->labels, sizeof (metric->labels), labels, ap);
+        va_end (ap);
+    }
+    metric->help = help;
+    metric->type = type;
+    metric->value = value;
+
+    m->count++;
+}
+
+static void ox_metrics_printf (struct ox_metrics_buf *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+    char *data;
+
+    if (!buf->data)
+        return;
+
+    while (1) {
+        va_start (ap, fmt);
+        len = vsnprintf (buf->data + buf->len, buf->size - buf->len, fmt, ap);
+        va_end (ap);
+
+        if (len < 0)
+            return;
+
+        if (buf->len + len < buf->size) {
+            buf->len += len;
+            return;
+        }
+
+        data = ox_realloc (buf->data, buf->size * 2, OX_MEM_CORE_EXEC);
+        if (!data) {
+            buf->data[buf->len] = '\0';
+            return;
+        }
+        buf->data = data;
+        buf->size *= 2;
+    }
+}
+
+static void ox_metrics_value (struct ox_metrics_buf *buf, double value)
+{
+    if (value >= 0 && value < 1e18 && value == (double) (uint64_t) value)
+        ox_metrics_printf (buf, "%lu", (uint64_t) value);
+    else
+        ox_metrics_printf (buf, "%.9g", value);
+}
+
+static void ox_metrics_prometheus (struct ox_metrics *m,
+                                                    struct ox_metrics_buf *buf)
+{
+    struct ox_metric *metric;
+    const char *last = "";
+    uint32_t i;
+
+    for (i = 0; i < m->count; i++) {
+        metric = &m->list[i];
+
+        if (strcmp (last, metric->name)) {
+            if (metric->help)
+                ox_metrics_printf (buf, "# HELP %s %s\n", metric->name,
+                                                                metric->help);
+            ox_metrics_printf (buf, "# TYPE %s %s\n", metric->name,
+                    (metric->type == OX_METRIC_COUNTER) ? "counter" : "gauge");
+            last = metric->name;
+        }
+
+        if (metric->labels[0])
+            ox_metrics_printf (buf, "%s{%s} ", metric->name, metric->labels);
+        else
+            ox_metrics_printf (buf, "%s ", metric->name);
+
+        ox_metrics_value (buf, metric->value);
+        ox_metrics_printf (buf, "\n");
+    }
+}
+
+/* Labels are kept in Prometheus form (a="x",b="y"), quote the keys for JSON */
+static void ox_metrics_json_labels (struct ox_metrics_buf *buf,
+                                                            const char *labels)
+{
+    const char *p = labels, *eq;
+    int first = 1;
+
+    ox_metrics_printf (buf, "{");
+    while (*p) {
+        eq = strchr (p, '=');
+        if (!eq)
+            break;
+
+        ox_metrics_printf (buf, "%s\"%.*s\":", first ? "" : ",",
+                                                        (int) (eq - p), p);
+        first = 0;
+
+        p = eq + 1;
+        if (*p != '"')
+            break;
+
+        eq = strchr (p + 1, '"');
+        if (!eq)
+            break;
+
+        ox_metrics_printf (buf, "%.*s", (int) (eq - p + 1), p);
+
+        p = eq + 1;
+        if (*p == ',')
+            p++;
+    }
+    ox_metrics_printf (buf, "}");
+}
+
+static void ox_metrics_json (struct ox_metrics *m, struct ox_metrics_buf *buf)
+{
+    struct ox_metric *metric;
+    struct timeval tv;
+    uint32_t i;
+
+    gettimeofday (&tv, NULL);
+
+    ox_metrics_printf (buf, "{\"timestamp\":%lu.%06lu,\"metrics\":[",
+                                                        tv.tv_sec, tv.tv_usec);
+
+    for (i = 0; i < m->count; i++) {
+        metric = &m->list[i];
+
+        ox_metrics_printf (buf, "%s\n{\"name\":\"%s\",\"type\":\"%s\","
+                "\"labels\":", (i) ? "," : "", metric->name,
+                (metric->type == OX_METRIC_COUNTER) ? "counter" : "gauge");
+        ox_metrics_json_labels (buf, metric->labels);
+        ox_metrics_printf (buf, ",\"value\":");
+        ox_metrics_value (buf, metric->value);
+        ox_metrics_printf (buf, "}");
+    }
+
+    ox_metrics_printf (buf, "\n]}\n");
+}
+
+struct ox_metrics *ox_metrics_new (void)
+{
+    return ox_calloc (1, sizeof (struct ox_metrics), OX_MEM_CORE_EXEC);
+}
+
+void ox_metrics_free (struct ox_metrics *m)
+{
+    if (m->list)
+        ox_free (m->list, OX_MEM_CORE_EXEC);
+    ox_free (m, OX_MEM_CORE_EXEC);
+}
+
+/* Returns a null-terminated buffer to be freed with ox_free (CORE_EXEC) */
+char *ox_metrics_format (struct ox_metrics *m, uint8_t json, size_t *len)
+{
+    struct ox_metrics_buf buf;
+
+    buf.size = OX_METRICS_BUF_SZ;
+    buf.len = 0;
+    buf.data = ox_malloc (buf.size, OX_MEM_CORE_EXEC);
+    if (!buf.data)
+        return NULL;
+    buf.data[0] = '\0';
+
+    if (json)
+        ox_metrics_json (m, &buf);
+    else
+        ox_metrics_prometheus (m, &buf);
+
+    *len = buf.len;
+    return buf.data;
+}
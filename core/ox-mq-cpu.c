@@ -0,0 +1,289 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Multi-Queue Support for Parallel I/O - CPU placement
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Automatic placement for OX_MQ_CPU_AUTO queues. The CPUs allowed to the
+ * process are grouped in physical cores and NUMA nodes from sysfs. Each queue
+ * gets a core of its own, nodes are taken in turn, and the SQ/CQ threads of a
+ * queue run on SMT siblings (or on two cores of the same node) to share the
+ * cache. Queues that do not find a free core are left unpinned.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ox-mq.h>
+#include <libox.h>
+
+#define OX_MQ_CPU_SYSFS "/sys/devices/system/cpu"
+
+struct ox_mq_cpu_core {
+    int         node;
+    int         n_cpu;
+    int         cpu[2];     /* first two SMT siblings */
+    uint8_t     used;
+};
+
+struct ox_mq_cpu_node {
+    int         id;
+    int         n_cores;
+    int         n_used;
+    int         *cores;
+};
+
+static struct ox_mq_cpu_core *cpu_cores;
+static struct ox_mq_cpu_node *cpu_nodes;
+static int                    cpu_n_cores;
+static int                    cpu_n_nodes;
+static int                    cpu_node_rr;
+static uint8_t                cpu_init = 0;
+static pthread_mutex_t        cpu_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads the first CPU of a sysfs cpu list (e.g. "4-5" or "4,68") */
+static int ox_mq_cpu_first_sibling (int cpu)
+{
+    char path[128];
+    FILE *fp;
+    int first;
+
+    sprintf (path, OX_MQ_CPU_SYSFS "/cpu%d/topology/thread_siblings_list",
+                                                                        cpu);
+    fp = fopen (path, "r");
+    if (!fp)
+        return cpu;
+
+    if (fscanf (fp, "%d", &first) != 1)
+        first = cpu;
+
+    fclose (fp);
+    return first;
+}
+
+/* Each CPU directory has a 'nodeX' link on NUMA kernels */
+static int ox_mq_cpu_node (int cpu)
+{
+    char path[128];
+    struct dirent *ent;
+    DIR *dir;
+    int node = 0;
+
+    sprintf (path, OX_MQ_CPU_SYSFS "/cpu%d", cpu);
+    dir = opendir (path);
+    if (!dir)
+        return 0;
+
+    while ((ent = readdir (dir)) != NULL) {
+        if (!strncmp (ent->d_name, "node", 4) &&
+                                    sscanf (ent->d_name + 4, "%d", &node) == 1)
+            break;
+    }
+
+    closedir (dir);
+    return node;
+}
+
+static void ox_mq_cpu_exit (void)
+{
+    int i;
+
+    for (i = 0; i < cpu_n_nodes; i++)
+        free (cpu_nodes[i].cores);
+    free (cpu_nodes);
+    free (cpu_cores);
+    cpu_nodes = NULL;
+    cpu_cores = NULL;
+    cpu_n_nodes = 0;
+    cpu_n_cores = 0;
+}
+
+static int ox_mq_cpu_topology (void)
+{
+    cpu_set_t allowed;
+    int cpu, leader, node, i, c, n, zero_core = -1;
+    int *leaders;
+
+    if (sched_getaffinity (0, sizeof (cpu_set_t), &allowed))
+        return -1;
+
+    cpu_cores = calloc (CPU_SETSIZE, sizeof (struct ox_mq_cpu_core));
+    cpu_nodes = calloc (CPU_SETSIZE, sizeof (struct ox_mq_cpu_node));
+    leaders = calloc (CPU_SETSIZE, sizeof (int));
+    if (!cpu_cores || !cpu_nodes || !leaders)
+        goto FREE;
+
+    /* Group CPUs by physical core */
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET (cpu, &allowed))
+            continue;
+
+        leader = ox_mq_cpu_first_sibling (cpu);
+        for (c = 0; c < cpu_n_cores; c++)
+            if (leaders[c] == leader)
+                break;
+
+        if (c == cpu_n_cores) {
+            leaders[c] = leader;
+            cpu_cores[c].node = ox_mq_cpu_node (cpu);
+            cpu_n_cores++;
+        }
+
+        if (cpu_cores[c].n_cpu < 2)
+            cpu_cores[c].cpu[cpu_cores[c].n_cpu++] = cpu;
+
+        if (!cpu)
+            zero_core = c;
+    }
+
+    /* Group cores by NUMA node */
+    for (c = 0; c < cpu_n_cores; c++) {
+        node = cpu_cores[c].node;
+        for (n = 0; n < cpu_n_nodes; n++)
+            if (cpu_nodes[n].id == node)
+                break;
+
+        if (n == cpu_n_nodes) {
+            cpu_nodes[n].id = node;
+            cpu_nodes[n].cores = calloc (cpu_n_cores, sizeof (int));
+            if (!cpu_nodes[n].cores)
+                goto FREE;
+            cpu_n_nodes++;
+        }
+        cpu_nodes[n].cores[cpu_nodes[n].n_cores++] = c;
+    }
+
+    /* Keep the core of CPU 0 for the main and interrupt threads, hand it out
+     * last */
+    for (n = 0; zero_core >= 0 && n < cpu_n_nodes; n++) {
+        for (i = 0; i < cpu_nodes[n].n_cores - 1; i++) {
+            if (cpu_nodes[n].cores[i] == zero_core) {
+                memmove (&cpu_nodes[n].cores[i], &cpu_nodes[n].cores[i + 1],
+                            sizeof (int) * (cpu_nodes[n].n_cores - i - 1));
+                cpu_nodes[n].cores[cpu_nodes[n].n_cores - 1] = zero_core;
+                break;
+            }
+        }
+    }
+
+    free (leaders);
+
+    log_info (" [ox-mq: CPU topology: %d CPUs, %d cores, %d NUMA nodes.]\n",
+                            CPU_COUNT (&allowed), cpu_n_cores, cpu_n_nodes);
+    return 0;
+
+FREE:
+    free (leaders);
+    ox_mq_cpu_exit ();
+    return -1;
+}
+
+/* Returns the first free core in 'node', or -1 */
+static int ox_mq_cpu_take (struct ox_mq_cpu_node *node)
+{
+    int i, core;
+
+    for (i = 0; i < node->n_cores; i++) {
+        core = node->cores[i];
+        if (!cpu_cores[core].used) {
+            cpu_cores[core].used = 1;
+            node->n_used++;
+            return core;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Pick the CPUs of the SQ and CQ threads of a new queue. Returns -1 if the
+ * topology is unknown or all cores are taken; the sets are left empty.
+ */
+int ox_mq_cpu_auto (cpu_set_t *sq, cpu_set_t *cq)
+{
+    struct ox_mq_cpu_node *node = NULL;
+    int n, sq_core, cq_core, cq_cpu;
+
+    CPU_ZERO (sq);
+    CPU_ZERO (cq);
+
+    pthread_mutex_lock (&cpu_mutex);
+
+    if (!cpu_init) {
+        cpu_init = 1;
+        if (ox_mq_cpu_topology ())
+            log_err (" [ox-mq: CPU topology not available, automatic "
+                                                    "placement disabled.]\n");
+    }
+
+    /* Spread queues across nodes */
+    for (n = 0; n < cpu_n_nodes; n++) {
+        node = &cpu_nodes[(cpu_node_rr + n) % cpu_n_nodes];
+        if (node->n_used < node->n_cores)
+            break;
+        node = NULL;
+    }
+
+    if (!node) {
+        pthread_mutex_unlock (&cpu_mutex);
+        return -1;
+    }
+    cpu_node_rr = (cpu_node_rr + n + 1) % cpu_n_nodes;
+
+    sq_core = ox_mq_cpu_take (node);
+
+    /* CQ on the SMT sibling, or on a second core of the same node */
+    if (cpu_cores[sq_core].n_cpu > 1) {
+        cq_cpu = cpu_cores[sq_core].cpu[1];
+    } else {
+        cq_core = ox_mq_cpu_take (node);
+        cq_cpu = (cq_core < 0) ? cpu_cores[sq_core].cpu[0] :
+                                                    cpu_cores[cq_core].cpu[0];
+    }
+
+    CPU_SET (cpu_cores[sq_core].cpu[0], sq);
+    CPU_SET (cq_cpu, cq);
+
+    pthread_mutex_unlock (&cpu_mutex);
+
+    return 0;
+}
+
+/* Give back the cores of a queue placed by ox_mq_cpu_auto */
+void ox_mq_cpu_release (cpu_set_t *sq, cpu_set_t *cq)
+{
+    int c, n;
+
+    pthread_mutex_lock (&cpu_mutex);
+
+    for (c = 0; c < cpu_n_cores; c++) {
+        if (!cpu_cores[c].used)
+            continue;
+        if (!CPU_ISSET (cpu_cores[c].cpu[0], sq) &&
+                                        !CPU_ISSET (cpu_cores[c].cpu[0], cq))
+            continue;
+
+        cpu_cores[c].used = 0;
+        for (n = 0; n < cpu_n_nodes; n++)
+            if (cpu_nodes[n].id == cpu_cores[c].node)
+                cpu_nodes[n].n_used--;
+    }
+
+    pthread_mutex_unlock (&cpu_mutex);
+}
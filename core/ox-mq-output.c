@@ -32,21 +32,40 @@
 #include <ox-mq.h>
 #include <libox.h>
 
-#define OXMQ_OUTPUT_BUF_SZ  8192 
+/*
+ * Rows are kept in a ring per queue. The SQ thread of the queue is the only
+ * producer, a writer thread per output drains completed rows to a binary file
+ * every OXMQ_OUTPUT_FLUSH_US. The I/O path never formats nor writes the file:
+ * if the writer falls behind, new rows are dropped and counted.
+ *
+ * Rows not completed after OXMQ_OUTPUT_STALE_NS (e.g. timed out requests) are
+ * written with 'tend' = 0 to unblock the ring. Each open row has an owner tag
+ * (node_seq + 1); the completer and the writer race to clear it, and only the
+ * winner touches the row. A late completion of a row already written as
+ * stale finds a different tag and leaves the reused slot alone. Use
+ * 'ox-mq-trace' to convert the file to CSV.
+ */
+
+#define OXMQ_OUTPUT_BUF_SZ      16384   /* Rows per queue, power of two */
+#define OXMQ_OUTPUT_FLUSH_US    10000
+#define OXMQ_OUTPUT_STALE_NS    1000000000UL
+#define OXMQ_OUTPUT_FILE_BUF    (1024 * 1024)
+
+static void *ox_mq_output_writer (void *arg);
 
 struct oxmq_output *ox_mq_output_init (uint64_t id, const char *name,
                                                                 uint32_t nodes)
 {
-    FILE *fp;
     char filename[80];
     struct stat st = {0};
     struct oxmq_output *output;
+    struct oxmq_output_hdr hdr;
     uint32_t node_i;
 
     if (strlen(name) > 40)
         return NULL;
 
-    output = ox_malloc (sizeof (struct oxmq_output), OX_MEM_OX_MQ);
+    output = ox_calloc (1, sizeof (struct oxmq_output), OX_MEM_OX_MQ);
     if (!output)
         return NULL;
 
@@ -57,21 +76,29 @@ struct oxmq_output *ox_mq_output_init (uint64_t id, const char *name,
     if (stat("output", &st) == -1)
         mkdir("output", S_IRWXO);
 
-    sprintf (filename, "output/%lu_%s.csv", id, name);
-    fp = fopen(filename, "a");
-    if (!fp)
+    sprintf (filename, "output/%lu_%s.trc", id, name);
+    output->fp = fopen(filename, "w");
+    if (!output->fp)
         goto FREE_OUT;
 
-    fprintf (fp, "node_sequence;node_id;lba;channel;lun;block;page;"
-        "plane;sector;start;end;latency;type;is_failed;read_memcmp;bytes\n");
+    setvbuf (output->fp, NULL, _IOFBF, OXMQ_OUTPUT_FILE_BUF);
 
-    fclose(fp);
+    memset (&hdr, 0x0, sizeof (struct oxmq_output_hdr));
+    memcpy (hdr.magic, OXMQ_OUTPUT_MAGIC, sizeof (hdr.magic));
+    hdr.version = OXMQ_OUTPUT_VERSION;
+    hdr.row_sz = sizeof (struct oxmq_output_row);
+    hdr.id = id;
+    hdr.nodes = nodes;
+    strcpy (hdr.name, name);
+
+    if (fwrite (&hdr, sizeof (struct oxmq_output_hdr), 1, output->fp) != 1)
+        goto CLOSE;
 
     output->node_seq = ox_calloc (sizeof(uint64_t), nodes, OX_MEM_OX_MQ);
     if (!output->node_seq)
-        goto FREE_OUT;
+        goto CLOSE;
 
-    output->queues = ox_malloc (sizeof (struct oxmq_output_tq) * nodes,
+    output->queues = ox_calloc (nodes, sizeof (struct oxmq_output_tq),
                                                                 OX_MEM_OX_MQ);
     if (!output->queues)
         goto FREE_NODE;
@@ -81,155 +108,180 @@ struct oxmq_output *ox_mq_output_init (uint64_t id, const char *name,
                                             OXMQ_OUTPUT_BUF_SZ, OX_MEM_OX_MQ);
         if (!output->queues[node_i].rows)
             goto FREE_QUEUE;
-        output->queues[node_i].row_off = 0;
-        TAILQ_INIT (&output->queues[node_i].out_head);
+        output->queues[node_i].tags = ox_calloc (OXMQ_OUTPUT_BUF_SZ,
+                                            sizeof (uint64_t), OX_MEM_OX_MQ);
+        if (!output->queues[node_i].tags) {
+            ox_free (output->queues[node_i].rows, OX_MEM_OX_MQ);
+            goto FREE_QUEUE;
+        }
     }
 
     if (pthread_mutex_init (&output->file_mutex, 0))
         goto FREE_QUEUE;
 
-    output->sequence = 0;
+    if (pthread_create (&output->writer, NULL, ox_mq_output_writer, output))
+        goto MUTEX;
 
     return output;
 
+MUTEX:
+    pthread_mutex_destroy (&output->file_mutex);
 FREE_QUEUE:
     while (node_i) {
         node_i--;
+        ox_free (output->queues[node_i].tags, OX_MEM_OX_MQ);
         ox_free (output->queues[node_i].rows, OX_MEM_OX_MQ);
     }
     ox_free (output->queues, OX_MEM_OX_MQ);
 FREE_NODE:
     ox_free (output->node_seq, OX_MEM_OX_MQ);
+CLOSE:
+    fclose (output->fp);
+    unlink (filename);
 FREE_OUT:
     ox_free (output, OX_MEM_OX_MQ);
     return NULL;
 }
 
-void ox_mq_output_exit (struct oxmq_output *output)
+/* Writes the ready rows of a queue. If 'all' is set, rows still in flight
+ * are written as they are. */
+static void ox_mq_output_drain (struct oxmq_output *output,
+                                                    uint32_t node_i, int all)
+{
+    struct oxmq_output_tq *q = &output->queues[node_i];
+    struct oxmq_output_row *row;
+    uint64_t head, tail, tstart, slot;
+    struct timespec ts;
+    uint64_t now;
+
+    GET_NANOSECONDS (now, ts);
+
+    tail = q->tail;
+    head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        slot = tail & (OXMQ_OUTPUT_BUF_SZ - 1);
+        row = &q->rows[slot];
+
+        if (!all && !__atomic_load_n (&row->tend, __ATOMIC_ACQUIRE)) {
+            tstart = __atomic_load_n (&row->tstart, __ATOMIC_RELAXED);
+            if (!tstart || now < tstart + OXMQ_OUTPUT_STALE_NS)
+                break;
+
+            /* Stale: take the row from its request. If the completer got it
+             * first, 'tend' is about to be set, retry on the next flush. */
+            tstart = row->node_seq + 1;
+            if (!__atomic_compare_exchange_n (&q->tags[slot], &tstart, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                break;
+        }
+
+        if (fwrite (row, sizeof (struct oxmq_output_row), 1, output->fp) != 1)
+        {
+            printf (" [ox-mq: ERROR. Not possible flushing results.]\n");
+            break;
+        }
+        output->written++;
+        tail++;
+    }
+
+    __atomic_store_n (&q->tail, tail, __ATOMIC_RELEASE);
+}
+
+void ox_mq_output_flush (struct oxmq_output *output)
 {
     uint32_t node_i;
 
-    pthread_mutex_destroy (&output->file_mutex);
+    pthread_mutex_lock (&output->file_mutex);
 
     for (node_i = 0; node_i < output->nodes; node_i++)
-        ox_free (output->queues[node_i].rows, OX_MEM_OX_MQ);
+        ox_mq_output_drain (output, node_i, 0);
+    fflush (output->fp);
 
-    ox_free (output->queues, OX_MEM_OX_MQ);
-    ox_free (output->node_seq, OX_MEM_OX_MQ);
-    ox_free (output, OX_MEM_OX_MQ);
+    pthread_mutex_unlock (&output->file_mutex);
 }
 
-static int ox_mq_output_flush_node (struct oxmq_output *output, int node_i)
+static void *ox_mq_output_writer (void *arg)
 {
-    struct oxmq_output_row *row;
-    char tstart[21], tend[21];
-    uint32_t row_i;
-    FILE *fp;
-    char filename[80];
+    struct oxmq_output *output = (struct oxmq_output *) arg;
 
-    sprintf (filename, "output/%lu_%s.csv", output->id, output->name);
-    fp = fopen(filename, "a");
-    if (!fp) {
-        printf (" [ox-mq: ERROR. File not opened.]\n");
-        return -1;
+    while (!output->stop) {
+        usleep (OXMQ_OUTPUT_FLUSH_US);
+        ox_mq_output_flush (output);
     }
 
-    for (row_i = 0; row_i < output->queues[node_i].row_off; row_i++) {
-
-        row = &output->queues[node_i].rows[row_i];
-        if (!row) {
-            fclose(fp);
-            return -1;
-        }
-
-        row->ulat = (row->tend - row->tstart) / 1000;
-        sprintf (tstart, "%lu", row->tstart);
-        sprintf (tend, "%lu", row->tend);
-        memmove (tstart, tstart+4, 17);
-        memmove (tend, tend+4, 17);
-
-        if(fprintf (fp,
-                "%lu;"
-                "%d;"
-                "%lu;"
-                "%d;"
-                "%d;"
-                "%d;"
-                "%d;"
-                "%d;"
-                "%d;"
-                "%s;"
-                "%s;"
-                "%lu;"
-                "%c;"
-                "%d;"
-                "%d;"
-                "%d\n",
-                row->node_seq,
-                row->node_id,
-                row->lba,
-                row->ch,
-                row->lun,
-                row->blk,
-                row->pg,
-                row->pl,
-                row->sec,
-                tstart,
-                tend,
-                row->ulat,
-                row->type,
-                row->failed,
-                row->datacmp,
-                row->size) < 0) {
-            printf (" [ox-mq: ERROR. Not possible flushing results.]\n");
-            fclose(fp);
-            return -1;
-        }
-    }
-    
-    fclose(fp);
-    return 0;
+    return NULL;
 }
 
-void ox_mq_output_flush (struct oxmq_output *output)
+void ox_mq_output_exit (struct oxmq_output *output)
 {
     uint32_t node_i;
+    uint64_t dropped = 0;
+
+    output->stop = 1;
+    pthread_join (output->writer, NULL);
 
     pthread_mutex_lock (&output->file_mutex);
+    for (node_i = 0; node_i < output->nodes; node_i++) {
+        ox_mq_output_drain (output, node_i, 1);
+        dropped += output->queues[node_i].dropped;
+    }
+    fclose (output->fp);
+    pthread_mutex_unlock (&output->file_mutex);
 
-    for (node_i = 0; node_i < output->nodes; node_i++)
-        ox_mq_output_flush_node (output, node_i);
+    log_info (" [ox-mq: Output %lu_%s: %lu rows written, %lu dropped.]\n",
+                        output->id, output->name, output->written, dropped);
 
-    pthread_mutex_unlock (&output->file_mutex);
+    pthread_mutex_destroy (&output->file_mutex);
+
+    for (node_i = 0; node_i < output->nodes; node_i++) {
+        ox_free (output->queues[node_i].tags, OX_MEM_OX_MQ);
+        ox_free (output->queues[node_i].rows, OX_MEM_OX_MQ);
+    }
+
+    ox_free (output->queues, OX_MEM_OX_MQ);
+    ox_free (output->node_seq, OX_MEM_OX_MQ);
+    ox_free (output, OX_MEM_OX_MQ);
+}
+
+/* Sets the completion time of 'row' if it still belongs to the request that
+ * got it from ox_mq_output_new with owner tag 'tag' (node_seq + 1). */
+void ox_mq_output_end (struct oxmq_output *output, uint32_t node_id,
+                    struct oxmq_output_row *row, uint64_t tag, uint64_t tend)
+{
+    struct oxmq_output_tq *q = &output->queues[node_id];
+
+    if (__atomic_compare_exchange_n (&q->tags[row - q->rows], &tag, 0, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        __atomic_store_n (&row->tend, tend, __ATOMIC_RELEASE);
 }
 
+/* Called only by the SQ thread of queue 'node_id'. Returns NULL if the ring
+ * is full. */
 struct oxmq_output_row *ox_mq_output_new (struct oxmq_output *output,
                                                                     int node_id)
 {
+    struct oxmq_output_tq *q = &output->queues[node_id];
     struct oxmq_output_row *row;
+    uint64_t head = q->head;
 
-    if (output->queues[node_id].row_off >= OXMQ_OUTPUT_BUF_SZ) {
-        pthread_mutex_lock (&output->file_mutex);
-        if (!output->queues[node_id].row_off) {
-            pthread_mutex_unlock (&output->file_mutex);
-            goto GET;
-        }
-
-        ox_mq_output_flush_node (output, node_id);
-        memset (output->queues[node_id].rows, 0x0,
-                        sizeof (struct oxmq_output_row) * OXMQ_OUTPUT_BUF_SZ);
-        output->queues[node_id].row_off = 0;
-
-        pthread_mutex_unlock (&output->file_mutex);
+    if (head - __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE) >=
+                                                        OXMQ_OUTPUT_BUF_SZ) {
+        q->dropped++;
+        return NULL;
     }
 
-GET:
-    row = &output->queues[node_id].rows[output->queues[node_id].row_off];
-    output->queues[node_id].row_off++;
+    row = &q->rows[head & (OXMQ_OUTPUT_BUF_SZ - 1)];
+    memset (row, 0x0, sizeof (struct oxmq_output_row));
 
     row->node_id = node_id;
     row->node_seq = output->node_seq[node_id];
     output->node_seq[node_id]++;
 
+    __atomic_store_n (&q->tags[head & (OXMQ_OUTPUT_BUF_SZ - 1)],
+                                        row->node_seq + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n (&q->head, head + 1, __ATOMIC_RELEASE);
+
     return row;
-}
\ No newline at end of file
+}
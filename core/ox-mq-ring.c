@@ -0,0 +1,216 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Multi-Queue Support for Parallel I/O - Lock-free ring buffers
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Bounded multi-producer/multi-consumer ring of ox_mq entries. Each slot
+ * carries a sequence number that tells producers and consumers whether the
+ * slot is ready for them, so head and tail are only moved by a CAS and no
+ * lock is taken. The ring never holds more than its capacity because all
+ * entries come from a fixed pool of 'q_size' entries per queue.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ox-mq.h>
+#include <libox.h>
+
+int ox_mq_ring_init (struct ox_mq_ring *ring, uint32_t size)
+{
+    uint64_t cap = 1, i;
+
+    while (cap < size)
+        cap <<= 1;
+
+    ring->slots = ox_malloc (sizeof (struct ox_mq_ring_slot) * cap,
+                                                                OX_MEM_OX_MQ);
+    if (!ring->slots)
+        return -1;
+
+    for (i = 0; i < cap; i++) {
+        ring->slots[i].seq = i;
+        ring->slots[i].entry = NULL;
+    }
+
+    ring->mask = cap - 1;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return 0;
+}
+
+void ox_mq_ring_free (struct ox_mq_ring *ring)
+{
+    if (ring->slots)
+        ox_free (ring->slots, OX_MEM_OX_MQ);
+    ring->slots = NULL;
+}
+
+/* Returns -1 if the ring is full */
+int ox_mq_ring_push (struct ox_mq_ring *ring, struct ox_mq_entry *entry)
+{
+    struct ox_mq_ring_slot *slot;
+    uint64_t pos, head, seq;
+    int64_t dif;
+
+    pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (int64_t) seq - (int64_t) pos;
+
+        if (!dif) {
+            if (__atomic_compare_exchange_n (&ring->tail, &pos, pos + 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            /* A consumer may still be releasing the slot */
+            head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+            pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+            if (pos - head > ring->mask)
+                return -1;
+        } else {
+            pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->entry = entry;
+    __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Returns NULL if the ring is empty */
+struct ox_mq_entry *ox_mq_ring_pop (struct ox_mq_ring *ring)
+{
+    struct ox_mq_ring_slot *slot;
+    struct ox_mq_entry *entry;
+    uint64_t pos, seq;
+    int64_t dif;
+
+    pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (int64_t) seq - (int64_t) (pos + 1);
+
+        if (!dif) {
+            if (__atomic_compare_exchange_n (&ring->head, &pos, pos + 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            /* Empty, unless a producer is still publishing the slot */
+            if (__atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) == pos)
+                return NULL;
+            pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    entry = slot->entry;
+    __atomic_store_n (&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+    return entry;
+}
+
+/*
+ * Claims 'count' consecutive slots with a single tail update. All entries are
+ * pushed or none is. Returns -1 if the ring has no room for 'count' entries.
+ */
+int ox_mq_ring_push_bulk (struct ox_mq_ring *ring, struct ox_mq_entry **entry,
+                                                                    int count)
+{
+    struct ox_mq_ring_slot *slot;
+    uint64_t pos, head, seq;
+    int i;
+
+    if (count <= 0)
+        return 0;
+
+    pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        for (i = 0; i < count; i++) {
+            slot = &ring->slots[(pos + i) & ring->mask];
+            seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq != pos + i)
+                break;
+        }
+
+        if (i == count) {
+            if (__atomic_compare_exchange_n (&ring->tail, &pos, pos + count,
+                                    1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                break;
+            continue;
+        }
+
+        /* A consumer may still be releasing a slot, only fail if truly full */
+        head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+        pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+        if (pos - head + count > ring->mask + 1)
+            return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        slot = &ring->slots[(pos + i) & ring->mask];
+        slot->entry = entry[i];
+        __atomic_store_n (&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/* Pops up to 'max' entries with a single head update, returns the count */
+int ox_mq_ring_pop_bulk (struct ox_mq_ring *ring, struct ox_mq_entry **entry,
+                                                                        int max)
+{
+    struct ox_mq_ring_slot *slot;
+    uint64_t pos, seq;
+    int i, n;
+
+    if (max <= 0)
+        return 0;
+
+    pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        for (n = 0; n < max; n++) {
+            slot = &ring->slots[(pos + n) & ring->mask];
+            seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq != pos + n + 1)
+                break;
+        }
+
+        if (!n) {
+            /* Empty, unless a producer is still publishing the slot */
+            if (__atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) == pos)
+                return 0;
+            pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n (&ring->head, &pos, pos + n, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+    }
+
+    for (i = 0; i < n; i++) {
+        slot = &ring->slots[(pos + i) & ring->mask];
+        entry[i] = slot->entry;
+        __atomic_store_n (&slot->seq, pos + i + ring->mask + 1,
+                                                            __ATOMIC_RELEASE);
+    }
+
+    return n;
+}
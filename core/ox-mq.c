@@ -35,6 +35,7 @@
 #include <libox.h>
 
 static volatile uint8_t mq_output = 0;
+static __thread uint8_t mq_inline_depth = 0; /* nested inline completions */
 static int mq_count = 0;
 LIST_HEAD(mq_list, ox_mq) mq_head = LIST_HEAD_INITIALIZER(mq_head);
 
@@ -48,6 +49,53 @@ int ox_mq_get_status (struct ox_mq *mq, struct ox_mq_stats *st, uint16_t qid)
     return 0;
 }
 
+/* Queue depths summed over the queues of each instance, and timeout counters */
+void ox_mq_metrics (struct ox_metrics *m)
+{
+    struct ox_mq *mq;
+    struct ox_mq_queue *q;
+    uint64_t used, wait, cq;
+    int i, first = 1;
+
+    LIST_FOREACH(mq, &mq_head, entry){
+        used = wait = cq = 0;
+        for (i = 0; i < mq->config->n_queues; i++) {
+            q = &mq->queues[i];
+            used += u_atomic_read(&q->stats.sq_used);
+            wait += u_atomic_read(&q->stats.sq_wait);
+            cq   += u_atomic_read(&q->stats.cq_used);
+        }
+
+        ox_metrics_add (m, "ox_mq_depth", OX_METRIC_GAUGE, (first) ?
+                "Entries per ox-mq state: queued (SU), in process (SW), "
+                "waiting completion (CU)" : NULL, used,
+                "mq=\"%s\",state=\"queued\"", mq->config->name);
+        ox_metrics_add (m, "ox_mq_depth", OX_METRIC_GAUGE, NULL, wait,
+                "mq=\"%s\",state=\"process\"", mq->config->name);
+        ox_metrics_add (m, "ox_mq_depth", OX_METRIC_GAUGE, NULL, cq,
+                "mq=\"%s\",state=\"completion\"", mq->config->name);
+        first = 0;
+    }
+
+    first = 1;
+    LIST_FOREACH(mq, &mq_head, entry){
+        ox_metrics_add (m, "ox_mq_timeouts_total", OX_METRIC_COUNTER, (first) ?
+                "Entries timed out since the queue was created" : NULL,
+                u_atomic_read(&mq->stats.timeout),
+                "mq=\"%s\"", mq->config->name);
+        first = 0;
+    }
+
+    first = 1;
+    LIST_FOREACH(mq, &mq_head, entry){
+        ox_metrics_add (m, "ox_mq_late_completions_total", OX_METRIC_COUNTER,
+                (first) ? "Timed out entries completed afterwards" : NULL,
+                u_atomic_read(&mq->stats.to_back),
+                "mq=\"%s\"", mq->config->name);
+        first = 0;
+    }
+}
+
 int ox_mq_used_count (struct ox_mq *mq, uint16_t qid)
 {
     if (!mq || !mq->config) {
@@ -171,9 +219,14 @@ static void ox_mq_destroy_cq (struct ox_mq_queue *q)
 
 static int ox_mq_init_sq (struct ox_mq_queue *q, uint32_t size)
 {
+    int c;
+
     TAILQ_INIT (&q->sq_free);
     TAILQ_INIT (&q->sq_used);
     TAILQ_INIT (&q->sq_wait);
+    TAILQ_INIT (&q->to_pending);
+    for (c = 0; c < OX_MQ_CLASSES; c++)
+        TAILQ_INIT (&q->sq_class[c]);
     pthread_mutex_init (&q->sq_free_mutex, NULL);
     pthread_mutex_init (&q->sq_used_mutex, NULL);
     pthread_mutex_init (&q->sq_wait_mutex, NULL);
@@ -215,10 +268,48 @@ CLEAN:
     return -1;
 }
 
+static void ox_mq_free_rings (struct ox_mq_queue *q)
+{
+    int c;
+
+    ox_mq_ring_free (&q->sq_free_r);
+    ox_mq_ring_free (&q->sq_used_r);
+    ox_mq_ring_free (&q->cq_free_r);
+    ox_mq_ring_free (&q->cq_used_r);
+    for (c = 0; c < OX_MQ_CLASSES; c++)
+        ox_mq_ring_free (&q->sq_class_r[c]);
+}
+
+static int ox_mq_init_rings (struct ox_mq_queue *q, uint32_t size)
+{
+    int c;
+
+    if (ox_mq_ring_init (&q->sq_free_r, size))
+        return -1;
+    if (ox_mq_ring_init (&q->sq_used_r, size))
+        goto FREE;
+    if (ox_mq_ring_init (&q->cq_free_r, size))
+        goto FREE;
+    if (ox_mq_ring_init (&q->cq_used_r, size))
+        goto FREE;
+
+    /* Any class may hold the whole queue */
+    for (c = 0; c < OX_MQ_CLASSES && (q->mq->config->flags & OX_MQ_QOS); c++)
+        if (ox_mq_ring_init (&q->sq_class_r[c], size))
+            goto FREE;
+
+    return 0;
+
+FREE:
+    ox_mq_free_rings (q);
+    return -1;
+}
+
 static int ox_mq_init_queue (struct ox_mq_queue *q, uint32_t size,
                                         ox_mq_sq_fn *sq_fn, ox_mq_cq_fn *cq_fn)
 {
-    int i;
+    int i, c;
+    uint8_t ring = q->mq->config->flags & OX_MQ_RING;
 
     if (!sq_fn || !cq_fn)
         return -1;
@@ -232,21 +323,42 @@ static int ox_mq_init_queue (struct ox_mq_queue *q, uint32_t size,
     if (ox_mq_init_cq (q, size))
         goto CLEAN_SQ;
 
+    if (ring && ox_mq_init_rings (q, size))
+        goto CLEAN_CQ;
+
     ox_mq_init_stats(&q->stats);
 
     for (i = 0; i < size; i++) {
-        TAILQ_INSERT_TAIL (&q->sq_free, &q->sq_entries[i], entry);
+        if (ring) {
+            ox_mq_ring_push (&q->sq_free_r, &q->sq_entries[i]);
+            ox_mq_ring_push (&q->cq_free_r, &q->cq_entries[i]);
+        } else {
+            TAILQ_INSERT_TAIL (&q->sq_free, &q->sq_entries[i], entry);
+            TAILQ_INSERT_TAIL (&q->cq_free, &q->cq_entries[i], entry);
+        }
         u_atomic_inc(&q->stats.sq_free);
-        TAILQ_INSERT_TAIL (&q->cq_free, &q->cq_entries[i], entry);
         u_atomic_inc(&q->stats.cq_free);
         pthread_mutex_init (&q->sq_entries[i].entry_mutex, NULL);
         pthread_mutex_init (&q->cq_entries[i].entry_mutex, NULL);
     }
 
+    q->sq_poll_usec = OX_MQ_POLL_MIN_USEC;
+    q->cq_poll_usec = OX_MQ_POLL_MIN_USEC;
+
+    for (c = 0; c < OX_MQ_CLASSES; c++) {
+        q->class_used[c].counter = U_ATOMIC_INIT_RUNTIME(0);
+        if (q->mq->config->flags & OX_MQ_QOS)
+            q->class_credit[c] = q->mq->config->class_weight[c];
+    }
+    q->class_cur = 0;
+
     q->running = 1; /* ready */
 
     return 0;
 
+CLEAN_CQ:
+    ox_mq_destroy_cq (q);
+    ox_free (q->cq_entries, OX_MEM_OX_MQ);
 CLEAN_SQ:
     ox_mq_destroy_sq (q);
     ox_free (q->sq_entries, OX_MEM_OX_MQ);
@@ -300,6 +412,16 @@ static void ox_mq_free_queues (struct ox_mq *mq, uint32_t n_queues)
 
         /* Wake threads if queue was empty and stop it */
         q->running = 0;
+        if (mq->config->flags & OX_MQ_RING) {
+            pthread_mutex_lock (&q->sq_cond_m);
+            pthread_cond_signal(&q->sq_cond);
+            pthread_mutex_unlock (&q->sq_cond_m);
+            pthread_mutex_lock (&q->cq_cond_m);
+            pthread_cond_signal(&q->cq_cond);
+            pthread_mutex_unlock (&q->cq_cond_m);
+            goto JOIN;
+        }
+
         pthread_mutex_lock (&q->sq_used_mutex);
         if (TAILQ_EMPTY (&q->sq_used)) {
             pthread_mutex_lock (&q->sq_cond_m);
@@ -316,9 +438,16 @@ static void ox_mq_free_queues (struct ox_mq *mq, uint32_t n_queues)
         }
         pthread_mutex_unlock (&q->cq_used_mutex);
 
+JOIN:
         pthread_join(q->sq_tid, NULL);
         pthread_join(q->cq_tid, NULL);
 
+        if (q->cpu_auto)
+            ox_mq_cpu_release (&q->sq_cpus, &q->cq_cpus);
+
+        if (mq->config->flags & OX_MQ_RING)
+            ox_mq_free_rings (q);
+
         for (j = 0; j < mq->config->q_size; j++) {
             pthread_mutex_destroy (&q->sq_entries[j].entry_mutex);
             pthread_mutex_destroy (&q->cq_entries[j].entry_mutex);
@@ -352,138 +481,394 @@ static void ox_mq_free_queues (struct ox_mq *mq, uint32_t n_queues)
         pthread_mutex_unlock ((mutex));                             \
 } while (/*CONSTCOND*/0)
 
-static void *ox_mq_sq_thread (void *arg)
+/* Callbacks that complete new requests fall back to the CQ thread once
+ * OX_MQ_INLINE_DEPTH nested levels are reached */
+#define OX_MQ_CAN_INLINE(mq) (((mq)->config->flags & OX_MQ_CQ_INLINE) &&   \
+                                        mq_inline_depth < OX_MQ_INLINE_DEPTH)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OX_MQ_CPU_RELAX()   __asm__ __volatile__ ("pause" ::: "memory")
+#else
+#define OX_MQ_CPU_RELAX()   __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+/*
+ * Busy-poll 'count' for up to the current poll window before the consumer
+ * parks. The window adapts between OX_MQ_POLL_MIN_USEC and the configured
+ * 'poll_usec': it doubles when work shows up while spinning and is halved
+ * when the spin expires empty. Returns 1 if new work is available.
+ */
+static int ox_mq_poll (struct ox_mq_queue *q, u_atomic_t *count,
+                                                            uint32_t *window)
+{
+    struct timespec ts;
+    uint64_t start, now;
+    uint32_t spin = 0;
+
+    if (!(q->mq->config->flags & OX_MQ_POLL))
+        return 0;
+
+    GET_NANOSECONDS (start, ts);
+    now = start;
+
+    while (now - start < (uint64_t) *window * 1000 && q->running) {
+        if (u_atomic_read (count) > 0) {
+            *window = MIN (*window << 1, q->mq->config->poll_usec);
+            return 1;
+        }
+        OX_MQ_CPU_RELAX ();
+        if (!(++spin & 0x3f))
+            GET_NANOSECONDS (now, ts);
+    }
+
+    *window = MAX (*window >> 1, OX_MQ_POLL_MIN_USEC);
+
+    return 0;
+}
+
+/* Park a ring consumer until a producer wakes it up, or for 1 second. The
+ * counter is raised before the push, so it covers every ring of the queue */
+static void ox_mq_ring_park (struct ox_mq_queue *q, u_atomic_t *count,
+        volatile uint8_t *sleep, pthread_mutex_t *cond_m, pthread_cond_t *cond)
 {
-    struct ox_mq_queue *q = (struct ox_mq_queue *) arg;
-    struct ox_mq_entry *req;
     struct timespec ts;
     struct timeval tv;
-    uint64_t ns;
-    pthread_t current_thread;
-    cpu_set_t cpuset;
-    uint16_t cpu_i;
 
-    if (q->mq->config->flags & OX_MQ_CPU_AFFINITY) {
-        if (!q->mq->config->sq_affinity[q->qid])
-            goto NO_AFFINITY;
+    pthread_mutex_lock (cond_m);
+    *sleep = 1;
+    __sync_synchronize ();
 
-        CPU_ZERO(&cpuset);
+    if (!u_atomic_read (count) && q->running) {
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + 1; /* 1 second timeout */
+        ts.tv_nsec = tv.tv_usec * 1000;
+        pthread_cond_timedwait(cond, cond_m, &ts);
+    }
 
-        for (cpu_i = 0; cpu_i < 64; cpu_i++) {
-            if (q->mq->config->sq_affinity[q->qid] & ((uint64_t) 1 << cpu_i)) {
-                CPU_SET(cpu_i, &cpuset);
+    *sleep = 0;
+    pthread_mutex_unlock (cond_m);
+}
 
-                log_info (" [ox-mq (%s): SQ %d affinity to CPU %d.\n",
-                                            q->mq->config->name, q->qid, cpu_i);
-            }
-        }
+/* Only pays the wakeup if the consumer is parked (or about to park) */
+static inline void ox_mq_ring_wake (volatile uint8_t *sleep,
+                                  pthread_mutex_t *cond_m, pthread_cond_t *cond)
+{
+    __sync_synchronize ();
 
-        current_thread = pthread_self();
-        pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset);
+    if (*sleep) {
+        pthread_mutex_lock (cond_m);
+        pthread_cond_signal (cond);
+        pthread_mutex_unlock (cond_m);
     }
+}
 
-NO_AFFINITY:
-    while (q->running) {
-        pthread_mutex_lock(&q->sq_cond_m);
+/* Next class with pending entries and credit, -1 if all classes are empty.
+ * Credits are refilled from the weights once the backlogged classes run out */
+static int ox_mq_class_next (struct ox_mq_queue *q)
+{
+    int c, i, pending = 0;
 
-        if (TAILQ_EMPTY (&q->sq_used)) {
-            gettimeofday(&tv, NULL);
-            ts.tv_sec = tv.tv_sec + 1; /* 1 second timeout */
-            ts.tv_nsec = tv.tv_usec * 1000;
-            pthread_cond_timedwait(&q->sq_cond, &q->sq_cond_m, &ts);
+    for (i = 0; i < OX_MQ_CLASSES; i++) {
+        c = (q->class_cur + i) % OX_MQ_CLASSES;
+        if (!u_atomic_read (&q->class_used[c]))
+            continue;
+        pending++;
+        if (q->class_credit[c] > 0) {
+            q->class_cur = c;
+            return c;
         }
+    }
 
-        pthread_mutex_unlock(&q->sq_cond_m);
+    if (!pending)
+        return -1;
 
-        if (!q->running)
-            pthread_exit(NULL);
+    for (c = 0; c < OX_MQ_CLASSES; c++)
+        q->class_credit[c] = q->mq->config->class_weight[c];
 
-        if (TAILQ_EMPTY (&q->sq_used))
-            continue;
+    return ox_mq_class_next (q);
+}
 
-        OX_MQ_DEQUEUE_H(&q->sq_used, req, &q->sq_used_mutex, &q->stats.sq_used);
+/*
+ * Deficit round robin over the SQ classes, one credit per entry. Only the SQ
+ * thread touches the credits; list queues hold 'sq_used_mutex' for the whole
+ * pass. Returns the count.
+ */
+static int ox_mq_sq_fetch_qos (struct ox_mq_queue *q, struct ox_mq_entry **req,
+                                                                        int max)
+{
+    uint8_t ring = q->mq->config->flags & OX_MQ_RING;
+    int n = 0, got, c, want;
 
-        gettimeofday(&req->wtime, NULL);
+    if (!u_atomic_read (&q->stats.sq_used))
+        return 0;
 
-        req->status = OX_MQ_WAITING;
-        OX_MQ_ENQUEUE (&q->sq_wait, req, &q->sq_wait_mutex, &q->stats.sq_wait);
+    if (!ring)
+        pthread_mutex_lock (&q->sq_used_mutex);
 
-        /* Output statistics */
-        if (mq_output && q->mq->output) {
-            req->out_row = ox_mq_output_new (q->mq->output, req->qid);
-            if (!req->out_row)
-                goto FN;
-            if (q->mq->config->output_fn)
-                q->mq->config->output_fn (req->out_row, req->opaque);
-            GET_NANOSECONDS (ns, ts);
-            req->out_row->tstart = ns;
+    while (n < max && (c = ox_mq_class_next (q)) >= 0) {
+        want = MIN (q->class_credit[c], max - n);
+
+        if (ring) {
+            got = ox_mq_ring_pop_bulk (&q->sq_class_r[c], &req[n], want);
+        } else {
+            got = 0;
+            while (got < want && !TAILQ_EMPTY (&q->sq_class[c])) {
+                req[n + got] = TAILQ_FIRST (&q->sq_class[c]);
+                TAILQ_REMOVE (&q->sq_class[c], req[n + got], entry);
+                got++;
+            }
         }
 
-FN:
-        q->sq_fn (req);
+        /* A producer is still publishing, take it in the next call */
+        if (!got)
+            break;
+
+        u_atomic_sub(got, &q->class_used[c]);
+        q->class_credit[c] -= got;
+        if (q->class_credit[c] <= 0 || !u_atomic_read (&q->class_used[c]))
+            q->class_cur = (c + 1) % OX_MQ_CLASSES;
+        n += got;
     }
 
-    return NULL;
+    if (n)
+        u_atomic_sub(n, &q->stats.sq_used);
+
+    if (!ring)
+        pthread_mutex_unlock (&q->sq_used_mutex);
+
+    return n;
 }
 
-static void *ox_mq_cq_thread (void *arg)
+/* Dequeue up to 'max' ready entries from the SQ, returns the count */
+static int ox_mq_sq_fetch (struct ox_mq_queue *q, struct ox_mq_entry **req,
+                                                                        int max)
+{
+    int n = 0;
+
+    if (q->mq->config->flags & OX_MQ_QOS)
+        return ox_mq_sq_fetch_qos (q, req, max);
+
+    if (q->mq->config->flags & OX_MQ_RING) {
+        n = ox_mq_ring_pop_bulk (&q->sq_used_r, req, max);
+        if (n)
+            u_atomic_sub(n, &q->stats.sq_used);
+        return n;
+    }
+
+    if (TAILQ_EMPTY (&q->sq_used))
+        return 0;
+
+    pthread_mutex_lock (&q->sq_used_mutex);
+    while (n < max && !TAILQ_EMPTY (&q->sq_used)) {
+        req[n] = TAILQ_FIRST (&q->sq_used);
+        TAILQ_REMOVE (&q->sq_used, req[n], entry);
+        n++;
+    }
+    u_atomic_sub(n, &q->stats.sq_used);
+    pthread_mutex_unlock (&q->sq_used_mutex);
+
+    return n;
+}
+
+/* Same as ox_mq_sq_fetch, for the CQ */
+static int ox_mq_cq_fetch (struct ox_mq_queue *q, struct ox_mq_entry **req,
+                                                                        int max)
+{
+    int n = 0;
+
+    if (q->mq->config->flags & OX_MQ_RING) {
+        n = ox_mq_ring_pop_bulk (&q->cq_used_r, req, max);
+        if (n)
+            u_atomic_sub(n, &q->stats.cq_used);
+        return n;
+    }
+
+    if (TAILQ_EMPTY (&q->cq_used))
+        return 0;
+
+    pthread_mutex_lock (&q->cq_used_mutex);
+    while (n < max && !TAILQ_EMPTY (&q->cq_used)) {
+        req[n] = TAILQ_FIRST (&q->cq_used);
+        TAILQ_REMOVE (&q->cq_used, req[n], entry);
+        n++;
+    }
+    u_atomic_sub(n, &q->stats.cq_used);
+    pthread_mutex_unlock (&q->cq_used_mutex);
+
+    return n;
+}
+
+/* Block the consumer while 'count' is empty (1 second at most) */
+static void ox_mq_wait (struct ox_mq_queue *q, u_atomic_t *count,
+                            uint32_t *window, volatile uint8_t *sleep,
+                                pthread_mutex_t *cond_m, pthread_cond_t *cond)
 {
-    struct ox_mq_queue *q = (struct ox_mq_queue *) arg;
-    struct ox_mq_entry *req;
-    void *opaque;
     struct timespec ts;
     struct timeval tv;
-    pthread_t current_thread;
-    cpu_set_t cpuset;
-    uint16_t cpu_i;
 
-    if (q->mq->config->flags & OX_MQ_CPU_AFFINITY) {
-        if (!q->mq->config->cq_affinity[q->qid])
-            goto NO_AFFINITY;
+    if (ox_mq_poll (q, count, window))
+        return;
 
-        CPU_ZERO(&cpuset);
+    if (q->mq->config->flags & OX_MQ_RING) {
+        ox_mq_ring_park (q, count, sleep, cond_m, cond);
+        return;
+    }
 
-        for (cpu_i = 0; cpu_i < 64; cpu_i++) {
-            if (q->mq->config->cq_affinity[q->qid] & ((uint64_t) 1 << cpu_i)) {
-                CPU_SET(cpu_i, &cpuset);
+    pthread_mutex_lock(cond_m);
 
-                log_info (" [ox-mq (%s): CQ %d affinity to CPU %d.\n",
-                                            q->mq->config->name, q->qid, cpu_i);
-            }
-        }
+    if (!u_atomic_read (count) && q->running) {
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + 1; /* 1 second timeout */
+        ts.tv_nsec = tv.tv_usec * 1000;
+        pthread_cond_timedwait(cond, cond_m, &ts);
+    }
+
+    pthread_mutex_unlock(cond_m);
+}
+
+/* Pin the calling thread, an empty set leaves it unpinned */
+static void ox_mq_set_affinity (struct ox_mq_queue *q, cpu_set_t *set,
+                                                            const char *type)
+{
+    int cpu_i;
+
+    if (!CPU_COUNT (set))
+        return;
+
+    for (cpu_i = 0; cpu_i < CPU_SETSIZE; cpu_i++) {
+        if (CPU_ISSET (cpu_i, set))
+            log_info (" [ox-mq (%s): %s %d affinity to CPU %d.\n",
+                                    q->mq->config->name, type, q->qid, cpu_i);
+    }
+
+    pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), set);
+}
+
+/* Explicit sets from the config come first, then automatic placement */
+static void ox_mq_place_queue (struct ox_mq_queue *q)
+{
+    struct ox_mq_config *config = q->mq->config;
+
+    CPU_ZERO (&q->sq_cpus);
+    CPU_ZERO (&q->cq_cpus);
 
-        current_thread = pthread_self();
-        pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset);
+    if (config->flags & OX_MQ_CPU_AFFINITY) {
+        if (config->sq_affinity)
+            q->sq_cpus = config->sq_affinity[q->qid];
+        if (config->cq_affinity)
+            q->cq_cpus = config->cq_affinity[q->qid];
     }
 
-NO_AFFINITY:
+    if ((config->flags & OX_MQ_CPU_AUTO) && !CPU_COUNT (&q->sq_cpus)
+                                                && !CPU_COUNT (&q->cq_cpus))
+        q->cpu_auto = !ox_mq_cpu_auto (&q->sq_cpus, &q->cq_cpus);
+}
+
+static void *ox_mq_sq_thread (void *arg)
+{
+    struct ox_mq_queue *q = (struct ox_mq_queue *) arg;
+    struct ox_mq_entry *req[OX_MQ_MAX_BATCH];
+    struct timespec ts;
+    uint64_t ns;
+    struct timeval tv;
+    int n, i, max, waitlist;
+
+    ox_mq_set_affinity (q, &q->sq_cpus, "SQ");
+
+    /* Single entry consumers may look at the queue depth, keep them at 1 */
+    max = (q->mq->config->flags & OX_MQ_SQ_BATCH) ? OX_MQ_MAX_BATCH : 1;
+
+    /* Ring queues only need the wait list for timeout detection */
+    waitlist = !(q->mq->config->flags & OX_MQ_RING) || q->mq->config->to_usec;
+
     while (q->running) {
-        pthread_mutex_lock(&q->cq_cond_m);
 
-        if (TAILQ_EMPTY (&q->cq_used)) {
+        n = ox_mq_sq_fetch (q, req, max);
+        if (!n) {
+            ox_mq_wait (q, &q->stats.sq_used, &q->sq_poll_usec,
+                                &q->sq_sleep, &q->sq_cond_m, &q->sq_cond);
+            continue;
+        }
+
+        /* The timestamp is taken under the lock, so sq_wait is kept in
+         * deadline order and the timeout thread only looks at its head */
+        if (waitlist) {
+            pthread_mutex_lock (&q->sq_wait_mutex);
             gettimeofday(&tv, NULL);
-            ts.tv_sec = tv.tv_sec + 1; /* 1 second timeout */
-            ts.tv_nsec = tv.tv_usec * 1000;
-            pthread_cond_timedwait(&q->cq_cond, &q->cq_cond_m, &ts);
+            for (i = 0; i < n; i++) {
+                req[i]->wtime = tv;
+                req[i]->status = OX_MQ_WAITING;
+                TAILQ_INSERT_TAIL (&q->sq_wait, req[i], entry);
+            }
+            u_atomic_add(n, &q->stats.sq_wait);
+            pthread_mutex_unlock (&q->sq_wait_mutex);
+        } else {
+            for (i = 0; i < n; i++)
+                req[i]->status = OX_MQ_WAITING;
+            u_atomic_add(n, &q->stats.sq_wait);
         }
 
-        pthread_mutex_unlock(&q->cq_cond_m);
+        /* Output statistics */
+        if (mq_output && q->mq->output) {
+            for (i = 0; i < n; i++) {
+                req[i]->out_row = ox_mq_output_new (q->mq->output, req[i]->qid);
+                if (!req[i]->out_row)
+                    continue;
+                req[i]->out_tag = req[i]->out_row->node_seq + 1;
+                if (q->mq->config->output_fn)
+                    q->mq->config->output_fn (req[i]->out_row, req[i]->opaque);
+                GET_NANOSECONDS (ns, ts);
+                req[i]->out_row->tstart = ns;
+            }
+        }
 
-        if (!q->running)
-            pthread_exit(NULL);
+        if (q->mq->config->flags & OX_MQ_SQ_BATCH)
+            q->mq->config->sq_batch_fn (req, n);
+        else
+            q->sq_fn (req[0]);
+    }
 
-        if (TAILQ_EMPTY (&q->cq_used))
-            continue;
+    return NULL;
+}
 
-        OX_MQ_DEQUEUE_H(&q->cq_used, req, &q->cq_used_mutex, &q->stats.cq_used);
-        opaque = req->opaque;
-        ox_mq_reset_entry (req);
-        OX_MQ_ENQUEUE (&q->cq_free, req, &q->cq_free_mutex, &q->stats.cq_free);
+static void *ox_mq_cq_thread (void *arg)
+{
+    struct ox_mq_queue *q = (struct ox_mq_queue *) arg;
+    struct ox_mq_entry *req[OX_MQ_MAX_BATCH];
+    void *opaque[OX_MQ_MAX_BATCH];
+    int n, i;
 
-        if (!opaque)
+    ox_mq_set_affinity (q, &q->cq_cpus, "CQ");
+
+    while (q->running) {
+
+        n = ox_mq_cq_fetch (q, req, OX_MQ_MAX_BATCH);
+        if (!n) {
+            ox_mq_wait (q, &q->stats.cq_used, &q->cq_poll_usec,
+                                &q->cq_sleep, &q->cq_cond_m, &q->cq_cond);
             continue;
+        }
+
+        /* Recycle the CQ entries before calling the user */
+        for (i = 0; i < n; i++) {
+            opaque[i] = req[i]->opaque;
+            ox_mq_reset_entry (req[i]);
+        }
+
+        if (q->mq->config->flags & OX_MQ_RING) {
+            u_atomic_add(n, &q->stats.cq_free);
+            ox_mq_ring_push_bulk (&q->cq_free_r, req, n);
+        } else {
+            pthread_mutex_lock (&q->cq_free_mutex);
+            for (i = 0; i < n; i++)
+                TAILQ_INSERT_TAIL (&q->cq_free, req[i], entry);
+            u_atomic_add(n, &q->stats.cq_free);
+            pthread_mutex_unlock (&q->cq_free_mutex);
+        }
 
-        q->cq_fn (opaque);
+        for (i = 0; i < n; i++)
+            if (opaque[i])
+                q->cq_fn (opaque[i]);
     }
 
     return NULL;
@@ -491,6 +876,8 @@ NO_AFFINITY:
 
 static int ox_mq_start_thread (struct ox_mq_queue *q)
 {
+    ox_mq_place_queue (q);
+
     if (pthread_create(&q->sq_tid, NULL, ox_mq_sq_thread, q))
         return -1;
 
@@ -500,52 +887,269 @@ static int ox_mq_start_thread (struct ox_mq_queue *q)
     return 0;
 }
 
-int ox_mq_submit_req (struct ox_mq *mq, uint32_t qid, void *opaque)
+/* Queue 'n' SQ entries of class 'cls' and wake the consumer if needed */
+static void ox_mq_sq_enqueue (struct ox_mq_queue *q, struct ox_mq_entry **req,
+                                                            int n, uint8_t cls)
+{
+    uint8_t qos = q->mq->config->flags & OX_MQ_QOS;
+    uint8_t wake;
+    int i;
+
+    for (i = 0; i < n; i++)
+        req[i]->status = OX_MQ_QUEUED;
+
+    if (q->mq->config->flags & OX_MQ_RING) {
+        if (qos)
+            u_atomic_add(n, &q->class_used[cls]);
+        u_atomic_add(n, &q->stats.sq_used);
+        ox_mq_ring_push_bulk ((qos) ? &q->sq_class_r[cls] : &q->sq_used_r,
+                                                                        req, n);
+        ox_mq_ring_wake (&q->sq_sleep, &q->sq_cond_m, &q->sq_cond);
+        return;
+    }
+
+    pthread_mutex_lock (&q->sq_used_mutex);
+    wake = !u_atomic_read (&q->stats.sq_used);
+
+    for (i = 0; i < n; i++) {
+        if (qos)
+            TAILQ_INSERT_TAIL (&q->sq_class[cls], req[i], entry);
+        else
+            TAILQ_INSERT_TAIL (&q->sq_used, req[i], entry);
+    }
+    if (qos)
+        u_atomic_add(n, &q->class_used[cls]);
+    u_atomic_add(n, &q->stats.sq_used);
+
+    /* Wake consumer thread if queue was empty */
+    if (wake) {
+        pthread_mutex_lock (&q->sq_cond_m);
+        pthread_cond_signal(&q->sq_cond);
+        pthread_mutex_unlock (&q->sq_cond_m);
+    }
+    pthread_mutex_unlock (&q->sq_used_mutex);
+}
+
+/*
+ * Submit to class 'cls' of an OX_MQ_QOS queue. Classes are served in weighted
+ * round robin, 'class_weight' entries per pass while they have pending
+ * entries. Without OX_MQ_QOS the class is ignored.
+ */
+int ox_mq_submit_class (struct ox_mq *mq, uint32_t qid, void *opaque,
+                                                                    uint8_t cls)
 {
     struct ox_mq_queue *q;
     struct ox_mq_entry *req;
-    uint8_t wake = 0;
 
     if (!mq || !mq->config) {
         log_err (" [ox-mq (submission): WARNING: Suspicious null pointer]");
         return -1;
     }
 
-    if (qid >= mq->config->n_queues)
+    if (qid >= mq->config->n_queues || cls >= OX_MQ_CLASSES)
         return -1;
 
     q = &mq->queues[qid];
 
-    /* If queue is full, the request is rejected */
-    pthread_mutex_lock (&q->sq_free_mutex);
-    if (TAILQ_EMPTY (&q->sq_free)) {
+    if (mq->config->flags & OX_MQ_RING) {
+        req = ox_mq_ring_pop (&q->sq_free_r);
+        if (!req)
+            return -1;
+        u_atomic_dec(&q->stats.sq_free);
+    } else {
+        /* If queue is full, the request is rejected */
+        pthread_mutex_lock (&q->sq_free_mutex);
+        if (TAILQ_EMPTY (&q->sq_free)) {
+            pthread_mutex_unlock (&q->sq_free_mutex);
+            return -1;
+        }
+
+        req = TAILQ_FIRST (&q->sq_free);
+        TAILQ_REMOVE (&q->sq_free, req, entry);
+        u_atomic_dec(&q->stats.sq_free);
         pthread_mutex_unlock (&q->sq_free_mutex);
-        return -1;
     }
 
-    req = TAILQ_FIRST (&q->sq_free);
-    TAILQ_REMOVE (&q->sq_free, req, entry);
-    u_atomic_dec(&q->stats.sq_free);
-    pthread_mutex_unlock (&q->sq_free_mutex);
-
     req->opaque = opaque;
     req->qid = qid;
 
-    pthread_mutex_lock (&q->sq_used_mutex);
-    if (TAILQ_EMPTY (&q->sq_used))
-        wake++;
+    ox_mq_sq_enqueue (q, &req, 1, cls);
+
+    return 0;
+}
+
+int ox_mq_submit_req (struct ox_mq *mq, uint32_t qid, void *opaque)
+{
+    return ox_mq_submit_class (mq, qid, opaque, 0);
+}
+
+/* Late completion of an entry taken by the timeout thread. The request was
+ * (or is about to be) completed through the timeout path; the entry is freed
+ * here or by the timeout thread, whichever comes last. */
+static void ox_mq_complete_late (struct ox_mq *mq, struct ox_mq_entry *req)
+{
+    uint8_t done;
+
+    pthread_mutex_lock (&req->entry_mutex);
+    if (req->status == OX_MQ_TIMEOUT_BACK) {
+        pthread_mutex_unlock (&req->entry_mutex);
+        return;
+    }
+
+    done = (req->status == OX_MQ_TIMEOUT_COMPLETED);
+    req->status = OX_MQ_TIMEOUT_BACK;
+    u_atomic_inc(&mq->stats.to_back);
+    pthread_mutex_unlock (&req->entry_mutex);
 
-    req->status = OX_MQ_QUEUED;
-    TAILQ_INSERT_TAIL (&q->sq_used, req, entry);
-    u_atomic_inc(&q->stats.sq_used);
+    if (done)
+        ox_mq_free_entry (mq, req);
+}
+
+/*
+ * Return waiting SQ entries to the free list. Taking an entry out of sq_wait
+ * is the claim: the timeout thread may have taken some of them, those are
+ * dropped from 'back' (and from 'opaque', if set) and completed as late. The
+ * order is kept. Returns the number of entries claimed, only those may be
+ * posted to cq_fn by the caller.
+ */
+static int ox_mq_release_sq_batch (struct ox_mq *mq, struct ox_mq_queue *q,
+                            struct ox_mq_entry **back, void **opaque, int nb)
+{
+    struct ox_mq_entry *late[OX_MQ_MAX_BATCH];
+    int i, kept = 0, n_late = 0;
+
+    if (!nb)
+        return 0;
+
+    if (!(mq->config->flags & OX_MQ_RING) || mq->config->to_usec) {
+        pthread_mutex_lock (&q->sq_wait_mutex);
+        for (i = 0; i < nb; i++) {
+            if (back[i]->status != OX_MQ_WAITING) {
+                late[n_late++] = back[i];
+                continue;
+            }
+            TAILQ_REMOVE (&q->sq_wait, back[i], entry);
+            if (opaque)
+                opaque[kept] = opaque[i];
+            back[kept++] = back[i];
+        }
+        nb = kept;
+        u_atomic_sub(nb, &q->stats.sq_wait);
+        pthread_mutex_unlock (&q->sq_wait_mutex);
+
+        for (i = 0; i < n_late; i++)
+            ox_mq_complete_late (mq, late[i]);
+    } else
+        u_atomic_sub(nb, &q->stats.sq_wait);
+
+    for (i = 0; i < nb; i++)
+        ox_mq_reset_entry (back[i]);
+
+    if (mq->config->flags & OX_MQ_RING) {
+        u_atomic_add(nb, &q->stats.sq_free);
+        ox_mq_ring_push_bulk (&q->sq_free_r, back, nb);
+    } else {
+        pthread_mutex_lock (&q->sq_free_mutex);
+        for (i = 0; i < nb; i++)
+            TAILQ_INSERT_TAIL (&q->sq_free, back[i], entry);
+        u_atomic_add(nb, &q->stats.sq_free);
+        pthread_mutex_unlock (&q->sq_free_mutex);
+    }
+
+    return nb;
+}
+
+/* Takes a free CQ entry, NULL if the CQ is full */
+static struct ox_mq_entry *ox_mq_cq_get (struct ox_mq_queue *q)
+{
+    struct ox_mq_entry *req_cq;
+
+    if (q->mq->config->flags & OX_MQ_RING) {
+        req_cq = ox_mq_ring_pop (&q->cq_free_r);
+        if (req_cq)
+            u_atomic_dec(&q->stats.cq_free);
+        return req_cq;
+    }
+
+    pthread_mutex_lock (&q->cq_free_mutex);
+    req_cq = TAILQ_FIRST (&q->cq_free);
+    if (req_cq) {
+        TAILQ_REMOVE (&q->cq_free, req_cq, entry);
+        u_atomic_dec(&q->stats.cq_free);
+    }
+    pthread_mutex_unlock (&q->cq_free_mutex);
+
+    return req_cq;
+}
+
+static void ox_mq_cq_unget (struct ox_mq_queue *q, struct ox_mq_entry *req_cq)
+{
+    if (q->mq->config->flags & OX_MQ_RING) {
+        u_atomic_inc(&q->stats.cq_free);
+        ox_mq_ring_push (&q->cq_free_r, req_cq);
+    } else
+        OX_MQ_ENQUEUE (&q->cq_free, req_cq, &q->cq_free_mutex,
+                                                            &q->stats.cq_free);
+}
+
+/* Queues a filled CQ entry to the CQ thread */
+static void ox_mq_cq_post (struct ox_mq_queue *q, struct ox_mq_entry *req_cq)
+{
+    uint8_t wake;
+
+    req_cq->status = OX_MQ_QUEUED;
+
+    if (q->mq->config->flags & OX_MQ_RING) {
+        u_atomic_inc(&q->stats.cq_used);
+        ox_mq_ring_push (&q->cq_used_r, req_cq);
+        ox_mq_ring_wake (&q->cq_sleep, &q->cq_cond_m, &q->cq_cond);
+        return;
+    }
+
+    pthread_mutex_lock (&q->cq_used_mutex);
+    wake = TAILQ_EMPTY (&q->cq_used);
+
+    TAILQ_INSERT_TAIL (&q->cq_used, req_cq, entry);
+    u_atomic_inc(&q->stats.cq_used);
 
     /* Wake consumer thread if queue was empty */
     if (wake) {
-        pthread_mutex_lock (&q->sq_cond_m);
-        pthread_cond_signal(&q->sq_cond);
-        pthread_mutex_unlock (&q->sq_cond_m);
+        pthread_mutex_lock (&q->cq_cond_m);
+        pthread_cond_signal(&q->cq_cond);
+        pthread_mutex_unlock (&q->cq_cond_m);
     }
-    pthread_mutex_unlock (&q->sq_used_mutex);
+    pthread_mutex_unlock (&q->cq_used_mutex);
+}
+
+/* Run cq_fn in the completer's thread, if the entry is still ours */
+static int ox_mq_complete_inline (struct ox_mq *mq, struct ox_mq_queue *q,
+                                    struct ox_mq_entry *req_sq, uint8_t locked)
+{
+    void *opaque;
+    struct timespec ts;
+    uint64_t ns;
+
+    if (locked)
+        pthread_mutex_lock (&req_sq->entry_mutex);
+
+    opaque = req_sq->opaque;
+
+    /* Output statistics */
+    if (mq_output && mq->output && req_sq->out_row) {
+        GET_NANOSECONDS (ns, ts);
+        ox_mq_output_end (mq->output, req_sq->qid, req_sq->out_row,
+                                                        req_sq->out_tag, ns);
+    }
+
+    if (locked)
+        pthread_mutex_unlock (&req_sq->entry_mutex);
+
+    if (!ox_mq_release_sq_batch (mq, q, &req_sq, NULL, 1))
+        return -1;
+
+    mq_inline_depth++;
+    q->cq_fn (opaque);
+    mq_inline_depth--;
 
     return 0;
 }
@@ -554,7 +1158,7 @@ int ox_mq_complete_req (struct ox_mq *mq, struct ox_mq_entry *req_sq)
 {
     struct ox_mq_queue *q;
     struct ox_mq_entry *req_cq;
-    uint8_t wake = 0;
+    uint8_t ring, locked;
     struct timespec ts;
     uint64_t ns;
 
@@ -563,93 +1167,371 @@ int ox_mq_complete_req (struct ox_mq *mq, struct ox_mq_entry *req_sq)
         return -1;
     }
 
-    pthread_mutex_lock (&req_sq->entry_mutex);
+    /* Without timeouts, ring entries never change status concurrently */
+    ring = mq->config->flags & OX_MQ_RING;
+    locked = !ring || mq->config->to_usec;
+
+    if (!req_sq)
+        return -1;
+
+    if (locked)
+        pthread_mutex_lock (&req_sq->entry_mutex);
     /* Timeout requests are OX_MQ_TIMEOUT_BACK after the first completion try */
-    if (!req_sq || !req_sq->opaque || req_sq->status == OX_MQ_TIMEOUT_BACK) {
-        pthread_mutex_unlock (&req_sq->entry_mutex);
+    if (!req_sq->opaque || req_sq->status == OX_MQ_TIMEOUT_BACK) {
+        if (locked)
+            pthread_mutex_unlock (&req_sq->entry_mutex);
         return -1;
     }
 
-    /* Check if request is a TIMEOUT_COMPLETED but not TIMEOUT_BACK */
-    if (req_sq->status == OX_MQ_TIMEOUT_COMPLETED) {
-        req_sq->status = OX_MQ_TIMEOUT_BACK;
-        ox_mq_free_entry(mq, req_sq);
-        u_atomic_inc(&mq->stats.to_back);
+    /* Taken by the timeout thread, completed through the timeout path */
+    if (req_sq->status == OX_MQ_TIMEOUT ||
+                                req_sq->status == OX_MQ_TIMEOUT_COMPLETED) {
         pthread_mutex_unlock (&req_sq->entry_mutex);
+        ox_mq_complete_late (mq, req_sq);
         return -1;
     }
 
     q = &mq->queues[req_sq->qid];
-    pthread_mutex_unlock (&req_sq->entry_mutex);
+    if (locked)
+        pthread_mutex_unlock (&req_sq->entry_mutex);
 
-    /* TODO: retry user defined times if queue is full */
-    pthread_mutex_lock (&q->cq_free_mutex);
-    if (TAILQ_EMPTY (&q->cq_free)) {
-        pthread_mutex_unlock (&q->cq_free_mutex);
-        log_info (" [ox-mq (%s): WARNING: CQ Full, request not completed.]\n",
-                                                              mq->config->name);
-        return -1;
-    }
+    if (OX_MQ_CAN_INLINE (mq))
+        return ox_mq_complete_inline (mq, q, req_sq, locked);
 
-    req_cq = TAILQ_FIRST (&q->cq_free);
-    TAILQ_REMOVE (&q->cq_free, req_cq, entry);
-    u_atomic_dec(&q->stats.cq_free);
-    pthread_mutex_unlock (&q->cq_free_mutex);
+    /* TODO: retry user defined times if queue is full */
+    req_cq = ox_mq_cq_get (q);
+    if (!req_cq)
+        goto CQ_FULL;
 
-    pthread_mutex_lock (&req_sq->entry_mutex);
+    if (locked)
+        pthread_mutex_lock (&req_sq->entry_mutex);
     req_cq->opaque = req_sq->opaque;
     req_cq->qid = req_sq->qid;
 
     /* Output statistics */
     if (mq_output && q->mq->output && req_sq->out_row) {
         GET_NANOSECONDS (ns, ts);
-        req_sq->out_row->tend = ns;
+        ox_mq_output_end (q->mq->output, req_sq->qid, req_sq->out_row,
+                                                        req_sq->out_tag, ns);
     }
+    if (locked)
+        pthread_mutex_unlock(&req_sq->entry_mutex);
 
-    if (req_sq->status == OX_MQ_WAITING) {
-        OX_MQ_DEQUEUE (&q->sq_wait,req_sq,&q->sq_wait_mutex,&q->stats.sq_wait);
+    if (!ox_mq_release_sq_batch (mq, q, &req_sq, NULL, 1)) {
+        ox_mq_cq_unget (q, req_cq);
+        return -1;
+    }
+
+    ox_mq_cq_post (q, req_cq);
+
+    return 0;
+
+CQ_FULL:
+    log_info (" [ox-mq (%s): WARNING: CQ Full, request not completed.]\n",
+                                                              mq->config->name);
+    return -1;
+}
+
+/*
+ * Submit 'count' opaque entries to queue 'qid', taking each list lock (or
+ * moving each ring index) once per OX_MQ_MAX_BATCH entries and waking the
+ * consumer once. Returns the number of submitted entries, which is smaller
+ * than 'count' if the queue becomes full, or -1 in case of error. OX_MQ_QOS
+ * queues take the entries in class 0.
+ */
+int ox_mq_submit_batch (struct ox_mq *mq, uint32_t qid, void **opaque,
+                                                                    int count)
+{
+    struct ox_mq_queue *q;
+    struct ox_mq_entry *req[OX_MQ_MAX_BATCH];
+    int submitted = 0, n, got, i;
 
-        ox_mq_reset_entry (req_sq);
-        OX_MQ_ENQUEUE (&q->sq_free,req_sq,&q->sq_free_mutex,&q->stats.sq_free);
+    if (!mq || !mq->config || !opaque) {
+        log_err (" [ox-mq (submission): WARNING: Suspicious null pointer]");
+        return -1;
     }
-    pthread_mutex_unlock(&req_sq->entry_mutex);
 
-    pthread_mutex_lock (&q->cq_used_mutex);
-    if (TAILQ_EMPTY (&q->cq_used))
-        wake++;
+    if (qid >= mq->config->n_queues || count < 0)
+        return -1;
 
-    req_cq->status = OX_MQ_QUEUED;
-    TAILQ_INSERT_TAIL (&q->cq_used, req_cq, entry);
-    u_atomic_inc(&q->stats.cq_used);
+    q = &mq->queues[qid];
 
-    /* Wake consumer thread if queue was empty */
-    if (wake) {
-        pthread_mutex_lock (&q->cq_cond_m);
-        pthread_cond_signal(&q->cq_cond);
-        pthread_mutex_unlock (&q->cq_cond_m);
+    while (submitted < count) {
+        n = MIN (count - submitted, OX_MQ_MAX_BATCH);
+
+        if (mq->config->flags & OX_MQ_RING) {
+            got = ox_mq_ring_pop_bulk (&q->sq_free_r, req, n);
+            u_atomic_sub(got, &q->stats.sq_free);
+        } else {
+            got = 0;
+            pthread_mutex_lock (&q->sq_free_mutex);
+            while (got < n && !TAILQ_EMPTY (&q->sq_free)) {
+                req[got] = TAILQ_FIRST (&q->sq_free);
+                TAILQ_REMOVE (&q->sq_free, req[got], entry);
+                got++;
+            }
+            u_atomic_sub(got, &q->stats.sq_free);
+            pthread_mutex_unlock (&q->sq_free_mutex);
+        }
+
+        if (!got)
+            break;
+
+        for (i = 0; i < got; i++) {
+            req[i]->opaque = opaque[submitted + i];
+            req[i]->qid = qid;
+        }
+
+        ox_mq_sq_enqueue (q, req, got, 0);
+
+        submitted += got;
+        if (got < n)
+            break;
     }
-    pthread_mutex_unlock (&q->cq_used_mutex);
 
-    return 0;
+    return submitted;
 }
 
-static int ox_mq_check_entry_to (struct ox_mq *mq, struct ox_mq_entry *entry)
+/* Completes up to OX_MQ_MAX_BATCH entries of the same queue */
+static int ox_mq_complete_run (struct ox_mq *mq, struct ox_mq_queue *q,
+                                        struct ox_mq_entry **reqs, int count)
 {
-    struct timeval cur;
-    uint64_t usec_e, usec_s, tot;
+    struct ox_mq_entry *valid[OX_MQ_MAX_BATCH], *req_cq[OX_MQ_MAX_BATCH];
+    struct ox_mq_entry *req;
+    int vidx[OX_MQ_MAX_BATCH];
+    void *opaque[OX_MQ_MAX_BATCH];
+    int v = 0, got = 0, kept, i;
+    uint8_t ring, locked, late, wake;
+    struct timespec ts;
+    uint64_t ns = 0;
 
-    gettimeofday(&cur, NULL);
+    ring = mq->config->flags & OX_MQ_RING;
+    locked = !ring || mq->config->to_usec;
+
+    /* Drop entries that were already taken by the timeout thread */
+    for (i = 0; i < count; i++) {
+        req = reqs[i];
+        if (!req)
+            continue;
+
+        if (locked)
+            pthread_mutex_lock (&req->entry_mutex);
+
+        if (!req->opaque || req->status == OX_MQ_TIMEOUT_BACK) {
+            if (locked)
+                pthread_mutex_unlock (&req->entry_mutex);
+            continue;
+        }
+
+        late = (req->status == OX_MQ_TIMEOUT ||
+                                    req->status == OX_MQ_TIMEOUT_COMPLETED);
+        if (locked)
+            pthread_mutex_unlock (&req->entry_mutex);
+
+        if (late) {
+            ox_mq_complete_late (mq, req);
+            continue;
+        }
+
+        valid[v] = req;
+        vidx[v] = i;
+        v++;
+    }
+
+    if (!v)
+        return count;
+
+    if (mq_output && q->mq->output)
+        GET_NANOSECONDS (ns, ts);
+
+    /* Run-to-completion: the claimed entries skip the CQ thread */
+    if (OX_MQ_CAN_INLINE (mq)) {
+        for (i = 0; i < v; i++) {
+            req = valid[i];
+            if (locked)
+                pthread_mutex_lock (&req->entry_mutex);
+
+            opaque[i] = req->opaque;
+            if (mq_output && q->mq->output && req->out_row)
+                ox_mq_output_end (q->mq->output, req->qid, req->out_row,
+                                                            req->out_tag, ns);
+            if (locked)
+                pthread_mutex_unlock (&req->entry_mutex);
+        }
+
+        kept = ox_mq_release_sq_batch (mq, q, valid, opaque, v);
+
+        mq_inline_depth++;
+        for (i = 0; i < kept; i++)
+            q->cq_fn (opaque[i]);
+        mq_inline_depth--;
+
+        return count;
+    }
+
+    if (ring) {
+        got = ox_mq_ring_pop_bulk (&q->cq_free_r, req_cq, v);
+        u_atomic_sub(got, &q->stats.cq_free);
+    } else {
+        pthread_mutex_lock (&q->cq_free_mutex);
+        while (got < v && !TAILQ_EMPTY (&q->cq_free)) {
+            req_cq[got] = TAILQ_FIRST (&q->cq_free);
+            TAILQ_REMOVE (&q->cq_free, req_cq[got], entry);
+            got++;
+        }
+        u_atomic_sub(got, &q->stats.cq_free);
+        pthread_mutex_unlock (&q->cq_free_mutex);
+    }
+
+    if (got < v)
+        log_info (" [ox-mq (%s): WARNING: CQ Full, %d requests not "
+                                "completed.]\n", mq->config->name, v - got);
+    if (!got)
+        return vidx[0];
+
+    for (i = 0; i < got; i++) {
+        req = valid[i];
+        if (locked)
+            pthread_mutex_lock (&req->entry_mutex);
+
+        opaque[i] = req->opaque;
+
+        /* Output statistics */
+        if (mq_output && q->mq->output && req->out_row)
+            ox_mq_output_end (q->mq->output, req->qid, req->out_row,
+                                                            req->out_tag, ns);
+        if (locked)
+            pthread_mutex_unlock (&req->entry_mutex);
+    }
+
+    /* Only the claimed entries are posted, the spare CQ entries go back */
+    kept = ox_mq_release_sq_batch (mq, q, valid, opaque, got);
+
+    for (i = 0; i < kept; i++) {
+        req_cq[i]->opaque = opaque[i];
+        req_cq[i]->qid = q->qid;
+        req_cq[i]->status = OX_MQ_QUEUED;
+    }
+    for (i = kept; i < got; i++)
+        ox_mq_cq_unget (q, req_cq[i]);
+
+    if (kept && ring) {
+        u_atomic_add(kept, &q->stats.cq_used);
+        ox_mq_ring_push_bulk (&q->cq_used_r, req_cq, kept);
+        ox_mq_ring_wake (&q->cq_sleep, &q->cq_cond_m, &q->cq_cond);
+    } else if (kept) {
+        pthread_mutex_lock (&q->cq_used_mutex);
+        wake = TAILQ_EMPTY (&q->cq_used);
+
+        for (i = 0; i < kept; i++)
+            TAILQ_INSERT_TAIL (&q->cq_used, req_cq[i], entry);
+        u_atomic_add(kept, &q->stats.cq_used);
+
+        /* Wake consumer thread if queue was empty */
+        if (wake) {
+            pthread_mutex_lock (&q->cq_cond_m);
+            pthread_cond_signal(&q->cq_cond);
+            pthread_mutex_unlock (&q->cq_cond_m);
+        }
+        pthread_mutex_unlock (&q->cq_used_mutex);
+    }
+
+    return (got < v) ? vidx[got] : count;
+}
+
+/*
+ * Complete 'count' entries received by the SQ consumer. Consecutive entries
+ * of the same queue are completed under a single synchronization step and a
+ * single wakeup. Entries already completed by the timeout thread are dropped,
+ * as in ox_mq_complete_req. Returns the number of leading entries handled, if
+ * smaller than 'count' the remaining ones were not completed (CQ full).
+ */
+int ox_mq_complete_batch (struct ox_mq *mq, struct ox_mq_entry **reqs,
+                                                                    int count)
+{
+    int off = 0, n, ret;
+    uint32_t qid;
+
+    if (!mq || !mq->config || !reqs) {
+        log_err (" [ox-mq (completion): WARNING: Suspicious null pointer]");
+        return -1;
+    }
+
+    while (off < count) {
+        if (!reqs[off]) {
+            off++;
+            continue;
+        }
+
+        qid = reqs[off]->qid;
+        if (qid >= mq->config->n_queues)
+            return -1;
+
+        n = 1;
+        while (off + n < count && n < OX_MQ_MAX_BATCH &&
+                                reqs[off + n] && reqs[off + n]->qid == qid)
+            n++;
+
+        ret = ox_mq_complete_run (mq, &mq->queues[qid], &reqs[off], n);
+        off += ret;
+        if (ret < n)
+            break;
+    }
+
+    return off;
+}
 
-    usec_e = cur.tv_sec * SEC64;
-    usec_e += cur.tv_usec;
+static int ox_mq_check_entry_to (struct ox_mq *mq, struct ox_mq_entry *entry,
+                                                        struct timeval *cur)
+{
+    uint64_t usec_e, usec_s, tot;
+
+    usec_e = cur->tv_sec * SEC64;
+    usec_e += cur->tv_usec;
     usec_s = entry->wtime.tv_sec * SEC64;
     usec_s += entry->wtime.tv_usec;
 
+    if (usec_s > usec_e)
+        return 0;
+
     tot = usec_e - usec_s;
 
     return (tot >= mq->config->to_usec);
 }
 
+/* Posts the completion of an entry taken by the timeout thread. Fails only if
+ * the CQ is full. */
+static int ox_mq_complete_to (struct ox_mq_queue *q, struct ox_mq_entry *req)
+{
+    struct ox_mq_entry *req_cq;
+
+    req_cq = ox_mq_cq_get (q);
+    if (!req_cq)
+        return -1;
+
+    req_cq->opaque = req->opaque;
+    req_cq->qid = req->qid;
+    ox_mq_cq_post (q, req_cq);
+
+    return 0;
+}
+
+/* The timeout path is done with 'req'. A late completion that came first
+ * left the entry to be freed here. */
+static void ox_mq_finish_to (struct ox_mq *mq, struct ox_mq_entry *req)
+{
+    uint8_t back;
+
+    pthread_mutex_lock (&req->entry_mutex);
+    back = (req->status == OX_MQ_TIMEOUT_BACK);
+    if (!back)
+        req->status = OX_MQ_TIMEOUT_COMPLETED;
+    pthread_mutex_unlock (&req->entry_mutex);
+
+    if (back)
+        ox_mq_free_entry (mq, req);
+}
+
 static int ox_mq_process_to_entry (struct ox_mq *mq, struct ox_mq_queue *q,
                                                       struct ox_mq_entry *req) {
     struct ox_mq_entry *new_req;
@@ -663,7 +1545,12 @@ static int ox_mq_process_to_entry (struct ox_mq *mq, struct ox_mq_queue *q,
     if (!new_req)
         goto ERR;
 
-    OX_MQ_ENQUEUE(&q->sq_free, new_req, &q->sq_free_mutex, &q->stats.sq_free);
+    if (mq->config->flags & OX_MQ_RING) {
+        u_atomic_inc(&q->stats.sq_free);
+        ox_mq_ring_push (&q->sq_free_r, new_req);
+    } else
+        OX_MQ_ENQUEUE(&q->sq_free, new_req, &q->sq_free_mutex,
+                                                            &q->stats.sq_free);
 
     return 0;
 
@@ -673,35 +1560,63 @@ ERR:
     return -1;
 }
 
+/* Post the timeout completions left behind by a full CQ, oldest first. The
+ * list is only touched by the timeout thread */
+static void ox_mq_post_pending_to (struct ox_mq *mq, struct ox_mq_queue *q)
+{
+    struct ox_mq_entry *req;
+
+    while ((req = TAILQ_FIRST (&q->to_pending)) != NULL) {
+        if (ox_mq_complete_to (q, req))
+            return;
+        TAILQ_REMOVE (&q->to_pending, req, entry);
+        ox_mq_finish_to (mq, req);
+    }
+}
+
 static void ox_mq_check_queue_to (struct ox_mq *mq, struct ox_mq_queue *q)
 {
     struct ox_mq_entry *req;
     struct ox_mq_entry **to_list;
+    struct timeval cur;
     void **to_opaque;
     int to_count, i;
 
+    if (!TAILQ_EMPTY (&q->to_pending))
+        ox_mq_post_pending_to (mq, q);
+
+    /* Idle queues are skipped without taking the lock */
+    if (!u_atomic_read (&q->stats.sq_wait))
+        return;
+
     to_count = 0;
     to_list = NULL;
     pthread_mutex_lock (&q->sq_wait_mutex);
+    gettimeofday(&cur, NULL);
 
-    /* Check and process the list of timeout requests */
+    /* sq_wait is in deadline order, stop at the first entry not expired */
     TAILQ_FOREACH (req, &q->sq_wait, entry) {
-        if (ox_mq_check_entry_to(mq, req)) {
-
-            ox_mq_process_to_entry (mq, q, req);
-            if (to_count)
-                to_list = ox_realloc (to_list, sizeof (void *) * to_count + 1,
-                                                                  OX_MEM_OX_MQ);
-            else
-                to_list = ox_malloc (sizeof (void *), OX_MEM_OX_MQ);
-
-            to_list[to_count] = req;
-            u_atomic_inc(&mq->stats.timeout);
-            to_count++;
+        if (!ox_mq_check_entry_to(mq, req, &cur))
+            break;
+        to_count++;
+    }
 
+    if (to_count) {
+        to_list = ox_malloc (sizeof (void *) * to_count, OX_MEM_OX_MQ);
+        if (!to_list) {
+            pthread_mutex_unlock (&q->sq_wait_mutex);
+            return;
         }
     }
 
+    /* Check and process the list of timeout requests */
+    for (i = 0; i < to_count; i++) {
+        req = TAILQ_FIRST (&q->sq_wait);
+        ox_mq_process_to_entry (mq, q, req);
+        to_list[i] = req;
+        u_atomic_inc(&mq->stats.timeout);
+    }
+
     pthread_mutex_unlock (&q->sq_wait_mutex);
 
     if (to_count)
@@ -714,15 +1629,17 @@ static void ox_mq_check_queue_to (struct ox_mq *mq, struct ox_mq_queue *q)
     if (to_count)
         mq->config->to_fn (to_opaque, to_count);
 
-    /* Complete the list of timeout requests, if flag enabled */
-    i = to_count;
-    while (i) {
-        i--;
-        if (mq->config->to_fn && (mq->config->flags & OX_MQ_TO_COMPLETE))
-            if (ox_mq_complete_req(mq, to_list[i]))
-                log_err (" [ox-mq (%s): WARNING: Not possible to post "
-                        "completion for a timeout request]", mq->config->name);
-        to_list[i]->status = OX_MQ_TIMEOUT_COMPLETED;
+    /* Complete the list of timeout requests, if flag enabled. If the CQ is
+     * full, the entry waits in to_pending and is posted on a later check */
+    for (i = 0; i < to_count; i++) {
+        if (mq->config->to_fn && (mq->config->flags & OX_MQ_TO_COMPLETE)) {
+            if (!TAILQ_EMPTY (&q->to_pending) ||
+                                        ox_mq_complete_to (q, to_list[i])) {
+                TAILQ_INSERT_TAIL (&q->to_pending, to_list[i], entry);
+                continue;
+            }
+        }
+        ox_mq_finish_to (mq, to_list[i]);
     }
 
     if (to_count) {
@@ -732,7 +1649,9 @@ static void ox_mq_check_queue_to (struct ox_mq *mq, struct ox_mq_queue *q)
 }
 
 /*
- * This thread checks all sq_wait queues for timeout requests.
+ * This thread checks all sq_wait queues for timeout requests. Entries are
+ * appended to sq_wait with increasing timestamps, so each check stops at the
+ * first entry not expired and only costs the number of timeout entries.
  *
  * If a timeout entry id found, the follow steps are performed:
  *  - Remove the entry from sq_wait;
@@ -755,7 +1674,11 @@ static void *ox_mq_to_thread (void *arg)
 {
     struct ox_mq *mq = (struct ox_mq *) arg;
     int exit, i;
-    uint64_t count, time = mq->config->to_usec / 200;
+    uint64_t count, time;
+
+    /* A tick only costs the expired entries, so check several times within
+     * 'to_usec' to detect timeouts closer to the deadline */
+    time = MAX (mq->config->to_usec / 200 / OX_MQ_TO_TICKS, 1);
 
     do {
         count = 0;
@@ -802,6 +1725,17 @@ struct ox_mq *ox_mq_init (struct ox_mq_config *config)
                 config->n_queues < 1 || config->n_queues > OX_MQ_MAX_QUEUES)
         return NULL;
 
+    if ((config->flags & OX_MQ_POLL) && (config->poll_usec < OX_MQ_POLL_MIN_USEC
+                                || config->poll_usec > OX_MQ_POLL_MAX_USEC))
+        return NULL;
+
+    if ((config->flags & OX_MQ_SQ_BATCH) && !config->sq_batch_fn)
+        return NULL;
+
+    for (i = 0; i < OX_MQ_CLASSES && (config->flags & OX_MQ_QOS); i++)
+        if (!config->class_weight[i])
+            return NULL;
+
     struct ox_mq *mq = ox_malloc (sizeof (struct ox_mq), OX_MEM_OX_MQ);
     if (!mq)
         return NULL;
@@ -838,6 +1772,10 @@ struct ox_mq *ox_mq_init (struct ox_mq_config *config)
         }
     }
 
+    /* The caller's CPU sets are only read at queue placement */
+    mq->config->sq_affinity = NULL;
+    mq->config->cq_affinity = NULL;
+
     if (mq->config->to_usec && ox_mq_start_to(mq))
         goto FREE_ALL;
 
@@ -27,11 +27,19 @@
 #include <libox.h>
 #include <ox-app.h>
 
-#define OX_STATS_IO_TYPES       45
+#define OX_STATS_IO_TYPES       50
 #define OX_STATS_REC_TYPES      15
-#define OX_STATS_LOG_TYPES      12  /* Follows 'enum app_log_type' in ox-app.h*/
+#define OX_STATS_LOG_TYPES      13  /* Follows 'enum app_log_type' in ox-app.h*/
 #define OX_STATS_CP_TYPES       10
-#define OX_STATS_IO_AREAD_TH    128
+#define OX_STATS_LINE_TYPES     4   /* Follows 'enum app_line_type' */
+
+/*
+ * I/O counters are kept in per-thread shards, each in its own cache lines.
+ * Threads take a shard on their first update, shards are shared with relaxed
+ * atomics if there are more threads than shards. Readers sum the shards and
+ * subtract the values saved by the last reset, so updates never take a lock.
+ */
+#define OX_STATS_SHARDS         64
 
 enum ox_stats_io_types {
     /* General media manager I/O */
@@ -88,25 +96,112 @@ enum ox_stats_io_types {
     OX_STATS_GC_SPACE_REC, /* 43 */
 
     /* Anomaly */
-    OX_STATS_SYNCH_USER_R
+    OX_STATS_SYNCH_USER_R, /* 44 */
+
+    /* Write amplification, media sectors per provisioning line */
+    OX_STATS_SEC_HOST_W,
+    OX_STATS_SEC_LINE_USER_W,
+    OX_STATS_SEC_LINE_COLD_W,
+    OX_STATS_SEC_LINE_META_W,
+    OX_STATS_SEC_LINE_DELTA_W /* 49 */
 };
 
-struct ox_stats_data {
+/* Seconds of per-second samples kept for the rolling WAF windows */
+#define OX_STATS_WINDOW         60
+#define OX_STATS_WAF_WINDOWS    3   /* since reset, 60 s, 10 s */
+
+enum ox_stats_waf_causes {
+    OX_STATS_WAF_USER = 0,
+    OX_STATS_WAF_GC,
+    OX_STATS_WAF_MAP,
+    OX_STATS_WAF_LOG,
+    OX_STATS_WAF_CP,
+    OX_STATS_WAF_PAD,
+    OX_STATS_WAF_OTHER,
+    OX_STATS_WAF_CAUSES
+};
+
+struct ox_stats_waf {
+    uint64_t    host;
+    uint64_t    media;
+    uint64_t    cause[OX_STATS_WAF_CAUSES];
+    uint64_t    line[OX_STATS_LINE_TYPES];
+    uint64_t    gc_moved;       /* sectors */
+    uint64_t    gc_reclaimed;   /* sectors */
+    uint64_t    gc_blks;
+};
+
+static const char *ox_stats_waf_names[OX_STATS_WAF_CAUSES] = {
+    "user", "gc", "map", "log", "checkpoint", "padding", "other"
+};
+
+static const char *ox_stats_line_names[OX_STATS_LINE_TYPES] = {
+    "user", "cold", "meta", "delta"
+};
+
+/* Window lengths in seconds, 0 is since the last reset */
+static const uint32_t ox_stats_waf_secs[OX_STATS_WAF_WINDOWS] = { 0, 60, 10 };
+
+struct ox_stats_shard {
     uint64_t            io     [OX_STATS_IO_TYPES];
-    pthread_spinlock_t  io_spin[OX_STATS_IO_TYPES];
+} __attribute__((aligned(64)));
 
-    uint64_t            io_asynch_read  [OX_STATS_IO_AREAD_TH];
-    uint64_t            io_asynch_bytes [OX_STATS_IO_AREAD_TH];
-    uint64_t            io_asynch_user_r[OX_STATS_IO_AREAD_TH];
+struct ox_stats_data {
+    struct ox_stats_shard shards[OX_STATS_SHARDS];
+    uint64_t            io_base[OX_STATS_IO_TYPES]; /* sums at the last reset */
+    pthread_mutex_t     reset_mutex;
+    uint32_t            next_shard;
 
     uint64_t            rec    [OX_STATS_REC_TYPES];
     uint64_t            log    [OX_STATS_LOG_TYPES];
     uint64_t            cp     [OX_STATS_CP_TYPES];
+
+    /* Per-second rates, refreshed by the metrics exporter thread */
+    uint64_t            rate_prev[OX_STATS_IO_TYPES];
+    uint64_t            rate_ns;
+    double              rate     [OX_STATS_IO_TYPES];
+
+    /* Raw sums of the last OX_STATS_WINDOW samples, under 'reset_mutex' */
+    uint64_t            window [OX_STATS_WINDOW][OX_STATS_IO_TYPES];
+    uint32_t            window_i;
+    uint32_t            window_n;
 };
 
 static struct ox_stats_data ox_stats;
 
-static uint8_t reset_read;
+static __thread struct ox_stats_shard *stats_shard = NULL;
+
+static inline void ox_stats_inc (uint16_t index, uint64_t value)
+{
+    if (!stats_shard)
+        stats_shard = &ox_stats.shards[__sync_fetch_and_add
+                                (&ox_stats.next_shard, 1) % OX_STATS_SHARDS];
+
+    __atomic_fetch_add (&stats_shard->io[index], value, __ATOMIC_RELAXED);
+}
+
+static void ox_stats_sum (uint64_t *io)
+{
+    uint32_t sh_i, type_i;
+
+    memset (io, 0x0, sizeof (uint64_t) * OX_STATS_IO_TYPES);
+    for (sh_i = 0; sh_i < OX_STATS_SHARDS; sh_i++)
+        for (type_i = 0; type_i < OX_STATS_IO_TYPES; type_i++)
+            io[type_i] += __atomic_load_n (&ox_stats.shards[sh_i].io[type_i],
+                                                            __ATOMIC_RELAXED);
+}
+
+/* Fills 'io' with the counters since the last reset */
+static void ox_stats_snapshot (uint64_t *io)
+{
+    uint32_t type_i;
+
+    pthread_mutex_lock (&ox_stats.reset_mutex);
+    ox_stats_sum (io);
+    for (type_i = 0; type_i < OX_STATS_IO_TYPES; type_i++)
+        io[type_i] -= ox_stats.io_base[type_i];
+    pthread_mutex_unlock (&ox_stats.reset_mutex);
+}
 
 void ox_stats_print_checkpoint (void)
 {
@@ -231,28 +326,29 @@ void ox_stats_print_recovery (void)
     printf ("       commit       : %lu\n", ox_stats.log[APP_LOG_COMMIT]);
     printf ("       abort write  : %lu\n", ox_stats.log[APP_LOG_ABORT_W]);
     printf ("       recycle blk  : %lu\n", ox_stats.log[APP_LOG_PUT_BLK]);
+    printf ("       trim         : %lu\n", ox_stats.log[APP_LOG_TRIM]);
     printf ("   transactions\n");
     printf ("     committed      : %lu\n", ox_stats.rec[OX_STATS_REC_TR_COMMIT]);
     printf ("     aborted        : %lu\n", ox_stats.rec[OX_STATS_REC_TR_ABORT]);
     printf ("\n");
 }
 
-static void ox_stats_print_gc_blks (void)
+static void ox_stats_print_gc_blks (uint64_t *io)
 {
     uint64_t tot_w, tot_r;
     uint64_t *val;
 
-    tot_w = ox_stats.io[OX_STATS_SEC_GC_USER_W] +
-            ox_stats.io[OX_STATS_SEC_GC_MAP_W] +
-            ox_stats.io[OX_STATS_SEC_GC_PAD_W];
+    tot_w = io[OX_STATS_SEC_GC_USER_W] +
+            io[OX_STATS_SEC_GC_MAP_W] +
+            io[OX_STATS_SEC_GC_PAD_W];
 
-    tot_r = ox_stats.io[OX_STATS_SEC_GC_USER_R] +
-            ox_stats.io[OX_STATS_SEC_GC_MAP_R] +
-            ox_stats.io[OX_STATS_SEC_GC_MAPMD_R] +
-            ox_stats.io[OX_STATS_SEC_GC_BLK_R] +
-            ox_stats.io[OX_STATS_SEC_GC_LOG_R] +
-            ox_stats.io[OX_STATS_SEC_GC_PAD_R] +
-            ox_stats.io[OX_STATS_SEC_GC_UNKOWN];
+    tot_r = io[OX_STATS_SEC_GC_USER_R] +
+            io[OX_STATS_SEC_GC_MAP_R] +
+            io[OX_STATS_SEC_GC_MAPMD_R] +
+            io[OX_STATS_SEC_GC_BLK_R] +
+            io[OX_STATS_SEC_GC_LOG_R] +
+            io[OX_STATS_SEC_GC_PAD_R] +
+            io[OX_STATS_SEC_GC_UNKOWN];
 
     printf ("\n Garbage Collection blocks (%d bytes each):\n",
                                                         NVME_KERNEL_PG_SIZE);
@@ -262,17 +358,17 @@ static void ox_stats_print_gc_blks (void)
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_USER_W];
+    val = &io[OX_STATS_SEC_GC_USER_W];
     printf ("      namespace   : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_MAP_W];
+    val = &io[OX_STATS_SEC_GC_MAP_W];
     printf ("      map (BIG)   : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_PAD_W];
+    val = &io[OX_STATS_SEC_GC_PAD_W];
     printf ("      padding     : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
@@ -281,37 +377,37 @@ static void ox_stats_print_gc_blks (void)
                 (double) (tot_r * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 tot_r * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_USER_R];
+    val = &io[OX_STATS_SEC_GC_USER_R];
     printf ("      namespace   : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_MAP_R];
+    val = &io[OX_STATS_SEC_GC_MAP_R];
     printf ("      map (BIG)   : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_MAPMD_R];
+    val = &io[OX_STATS_SEC_GC_MAPMD_R];
     printf ("      map (SMALL) : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_BLK_R];
+    val = &io[OX_STATS_SEC_GC_BLK_R];
     printf ("      blk (SMALL) : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_LOG_R];
+    val = &io[OX_STATS_SEC_GC_LOG_R];
     printf ("      log (WAL)   : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_PAD_R];
+    val = &io[OX_STATS_SEC_GC_PAD_R];
     printf ("      padding     : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
 
-    val = &ox_stats.io[OX_STATS_SEC_GC_UNKOWN];
+    val = &io[OX_STATS_SEC_GC_UNKOWN];
     printf ("      unknown     : %-7lu -> %10.2lf MB (%lu bytes)\n", *val,
                 (double) (*val * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 *val * NVME_KERNEL_PG_SIZE);
@@ -319,126 +415,103 @@ static void ox_stats_print_gc_blks (void)
 
 void ox_stats_print_gc (void)
 {
+    uint64_t io[OX_STATS_IO_TYPES];
+
+    ox_stats_snapshot (io);
+
     printf ("\n Garbage Collection events\n");
-    printf ("   recycled NVM blocks   : %lu\n", ox_stats.io[OX_STATS_GC_BLOCK_REC]);
+    printf ("   recycled NVM blocks   : %lu\n", io[OX_STATS_GC_BLOCK_REC]);
     printf ("   reclaimed space       : %.2lf MB (%lu bytes)\n",
-            (double) ox_stats.io[OX_STATS_GC_SPACE_REC] / (double) 1048576,
-            ox_stats.io[OX_STATS_GC_SPACE_REC]);
+            (double) io[OX_STATS_GC_SPACE_REC] / (double) 1048576,
+            io[OX_STATS_GC_SPACE_REC]);
     printf ("   race conditions\n");
-    printf ("      map update (BIG)   : %lu\n", ox_stats.io[OX_STATS_GC_RACE_BIG]);
-    printf ("      map update (SMALL) : %lu\n", ox_stats.io[OX_STATS_GC_RACE_SMALL]);
-    printf ("   write failures        : %lu\n", ox_stats.io[OX_STATS_SEC_GC_FAILED]);
+    printf ("      map update (BIG)   : %lu\n", io[OX_STATS_GC_RACE_BIG]);
+    printf ("      map update (SMALL) : %lu\n", io[OX_STATS_GC_RACE_SMALL]);
+    printf ("   write failures        : %lu\n", io[OX_STATS_SEC_GC_FAILED]);
 
-    ox_stats_print_gc_blks ();
+    ox_stats_print_gc_blks (io);
     printf ("\n");
 }
 
-static void ox_stats_reset_read (void)
-{
-    /* reset read values */
-    if (reset_read) {
-        pthread_spin_lock (&ox_stats.io_spin[OX_STATS_IO_ASYNC_R]);
-        if (!reset_read) {
-            pthread_spin_unlock (&ox_stats.io_spin[OX_STATS_IO_ASYNC_R]);
-            return;
-        }
-        memset (ox_stats.io_asynch_read, 0x0, sizeof(uint64_t) * OX_STATS_IO_AREAD_TH);
-        memset (ox_stats.io_asynch_bytes, 0x0, sizeof(uint64_t) * OX_STATS_IO_AREAD_TH);
-        memset (ox_stats.io_asynch_user_r, 0x0, sizeof(uint64_t) * OX_STATS_IO_AREAD_TH);
-        reset_read = 0;
-        pthread_spin_unlock (&ox_stats.io_spin[OX_STATS_IO_ASYNC_R]);
-    }
-}
-
 void ox_stats_print_io (void)
 {
     uint64_t tot_io, tot_io_w, tot_io_r, tot_md_w, tot_md_r;
     uint64_t user_w, map_w, pad_w,
              user_synch_r, map_r, mapmd_r, blk_r, log_r, pad_r, other_r;
     double tot_b, tot_b_w, tot_b_r;
-    uint32_t th_i;
-
-    ox_stats_reset_read  ();
-
-    /* Sum read threads */
-    ox_stats.io[OX_STATS_IO_ASYNC_R] = 0;
-    ox_stats.io[OX_STATS_SEC_USER_R] = 0;
-    ox_stats.io[OX_STATS_BYTES_ASYNC_R] = 0;
-    for (th_i = 0; th_i < OX_STATS_IO_AREAD_TH; th_i++) {
-        ox_stats.io[OX_STATS_IO_ASYNC_R] += ox_stats.io_asynch_read[th_i];
-        ox_stats.io[OX_STATS_SEC_USER_R] += ox_stats.io_asynch_user_r[th_i];
-        ox_stats.io[OX_STATS_BYTES_ASYNC_R] += ox_stats.io_asynch_bytes[th_i];
-    }
+    uint64_t io[OX_STATS_IO_TYPES];
+
+    ox_stats_snapshot (io);
 
-    tot_io_w = ox_stats.io[OX_STATS_IO_SYNC_W] +
-               ox_stats.io[OX_STATS_IO_ASYNC_W];
-    tot_io_r = ox_stats.io[OX_STATS_IO_SYNC_R] +
-               ox_stats.io[OX_STATS_IO_ASYNC_R];
+    tot_io_w = io[OX_STATS_IO_SYNC_W] +
+               io[OX_STATS_IO_ASYNC_W];
+    tot_io_r = io[OX_STATS_IO_SYNC_R] +
+               io[OX_STATS_IO_ASYNC_R];
     
     tot_io = tot_io_w + tot_io_r;
 
-    tot_b_w = ox_stats.io[OX_STATS_BYTES_SYNC_W] +
-               ox_stats.io[OX_STATS_BYTES_ASYNC_W];
-    tot_b_r = ox_stats.io[OX_STATS_BYTES_SYNC_R] +
-               ox_stats.io[OX_STATS_BYTES_ASYNC_R];
+    tot_b_w = io[OX_STATS_BYTES_SYNC_W] +
+               io[OX_STATS_BYTES_ASYNC_W];
+    tot_b_r = io[OX_STATS_BYTES_SYNC_R] +
+               io[OX_STATS_BYTES_ASYNC_R];
     
     tot_b = tot_b_w + tot_b_r;
 
     printf ("\n Physical I/O count: %lu\n", tot_io);
     printf ("   write : %-7lu -> user: %-7lu meta+gc: %lu\n", tot_io_w,
-            ox_stats.io[OX_STATS_IO_ASYNC_W], ox_stats.io[OX_STATS_IO_SYNC_W]);
+            io[OX_STATS_IO_ASYNC_W], io[OX_STATS_IO_SYNC_W]);
     printf ("   read  : %-7lu -> user: %-7lu meta+gc: %lu\n", tot_io_r,
-            ox_stats.io[OX_STATS_IO_ASYNC_R], ox_stats.io[OX_STATS_IO_SYNC_R]);
-    printf ("   erase : %lu\n", ox_stats.io[OX_STATS_IO_ERASE]);
+            io[OX_STATS_IO_ASYNC_R], io[OX_STATS_IO_SYNC_R]);
+    printf ("   erase : %lu\n", io[OX_STATS_IO_ERASE]);
 
     printf ("\n\n Data transferred (to/from NVM): %.2f MB (%lu bytes)\n",
                             tot_b / (double) 1048576, (uint64_t) tot_b);
     printf ("   data written     : %10.2lf MB (%lu bytes)\n",
                     (double) tot_b_w / (double) 1048576, (uint64_t) tot_b_w);
     printf ("      namespace+pad : %10.2lf MB (%lu bytes)\n",
-                (double) ox_stats.io[OX_STATS_BYTES_ASYNC_W] / (double) 1048576,
-                ox_stats.io[OX_STATS_BYTES_ASYNC_W]);
+                (double) io[OX_STATS_BYTES_ASYNC_W] / (double) 1048576,
+                io[OX_STATS_BYTES_ASYNC_W]);
     printf ("      meta+gc       : %10.2lf MB (%lu bytes)\n",
-                (double) ox_stats.io[OX_STATS_BYTES_SYNC_W] / (double) 1048576,
-                ox_stats.io[OX_STATS_BYTES_SYNC_W]);
+                (double) io[OX_STATS_BYTES_SYNC_W] / (double) 1048576,
+                io[OX_STATS_BYTES_SYNC_W]);
     printf ("   data read        : %10.2lf MB (%lu bytes)\n",
                 (double) tot_b_r / (double) 1048576, (uint64_t) tot_b_r);
     printf ("      namespace+pad : %10.2lf MB (%lu bytes)\n",
-                (double) ox_stats.io[OX_STATS_BYTES_ASYNC_R] / (double) 1048576,
-                ox_stats.io[OX_STATS_BYTES_ASYNC_R]);
+                (double) io[OX_STATS_BYTES_ASYNC_R] / (double) 1048576,
+                io[OX_STATS_BYTES_ASYNC_R]);
     printf ("      meta+gc       : %10.2lf MB (%lu bytes)\n",
-                (double) ox_stats.io[OX_STATS_BYTES_SYNC_R] / (double) 1048576,
-                ox_stats.io[OX_STATS_BYTES_SYNC_R]);
+                (double) io[OX_STATS_BYTES_SYNC_R] / (double) 1048576,
+                io[OX_STATS_BYTES_SYNC_R]);
 
     /* Fix numbers by subtracting the GC */
-    user_w = ox_stats.io[OX_STATS_SEC_USER_W] - ox_stats.io[OX_STATS_SEC_GC_USER_W];
-    map_w = ox_stats.io[OX_STATS_SEC_MAP_W] - ox_stats.io[OX_STATS_SEC_GC_MAP_W];
-    pad_w = ox_stats.io[OX_STATS_SEC_PAD_W] - ox_stats.io[OX_STATS_SEC_GC_PAD_W];
-
-    user_synch_r = ox_stats.io[OX_STATS_SYNCH_USER_R] - ox_stats.io[OX_STATS_SEC_GC_USER_R];
-    map_r = ox_stats.io[OX_STATS_SEC_MAP_R] - ox_stats.io[OX_STATS_SEC_GC_MAP_R];
-    mapmd_r = ox_stats.io[OX_STATS_SEC_CP_MAPMD_R] - ox_stats.io[OX_STATS_SEC_GC_MAPMD_R];
-    blk_r = ox_stats.io[OX_STATS_SEC_CP_BLK_R] - ox_stats.io[OX_STATS_SEC_GC_BLK_R];
-    log_r = ox_stats.io[OX_STATS_SEC_LOG_R] - ox_stats.io[OX_STATS_SEC_GC_LOG_R];
-    pad_r = ox_stats.io[OX_STATS_SEC_PAD_R] - ox_stats.io[OX_STATS_SEC_GC_PAD_R];
-    other_r = ox_stats.io[OX_STATS_SEC_OTHER_R] - ox_stats.io[OX_STATS_SEC_GC_UNKOWN];
+    user_w = io[OX_STATS_SEC_USER_W] - io[OX_STATS_SEC_GC_USER_W];
+    map_w = io[OX_STATS_SEC_MAP_W] - io[OX_STATS_SEC_GC_MAP_W];
+    pad_w = io[OX_STATS_SEC_PAD_W] - io[OX_STATS_SEC_GC_PAD_W];
+
+    user_synch_r = io[OX_STATS_SYNCH_USER_R] - io[OX_STATS_SEC_GC_USER_R];
+    map_r = io[OX_STATS_SEC_MAP_R] - io[OX_STATS_SEC_GC_MAP_R];
+    mapmd_r = io[OX_STATS_SEC_CP_MAPMD_R] - io[OX_STATS_SEC_GC_MAPMD_R];
+    blk_r = io[OX_STATS_SEC_CP_BLK_R] - io[OX_STATS_SEC_GC_BLK_R];
+    log_r = io[OX_STATS_SEC_LOG_R] - io[OX_STATS_SEC_GC_LOG_R];
+    pad_r = io[OX_STATS_SEC_PAD_R] - io[OX_STATS_SEC_GC_PAD_R];
+    other_r = io[OX_STATS_SEC_OTHER_R] - io[OX_STATS_SEC_GC_UNKOWN];
 
     tot_md_w = map_w +
-               ox_stats.io[OX_STATS_SEC_LOG_W] +
+               io[OX_STATS_SEC_LOG_W] +
                pad_w +
-               ox_stats.io[OX_STATS_SEC_CP_MAPMD_W] +
-               ox_stats.io[OX_STATS_SEC_CP_BLK_W] +
-               ox_stats.io[OX_STATS_SEC_RSV_W] +
-               ox_stats.io[OX_STATS_SEC_CP_W] +
-               ox_stats.io[OX_STATS_SEC_OTHER_W];
+               io[OX_STATS_SEC_CP_MAPMD_W] +
+               io[OX_STATS_SEC_CP_BLK_W] +
+               io[OX_STATS_SEC_RSV_W] +
+               io[OX_STATS_SEC_CP_W] +
+               io[OX_STATS_SEC_OTHER_W];
 
     tot_md_r = map_r +
                log_r +
                pad_r +
                mapmd_r +
                blk_r +
-               ox_stats.io[OX_STATS_SEC_RSV_R] +
-               ox_stats.io[OX_STATS_SEC_CP_R] +
+               io[OX_STATS_SEC_RSV_R] +
+               io[OX_STATS_SEC_CP_R] +
                other_r +
                user_synch_r;
 
@@ -450,10 +523,10 @@ void ox_stats_print_io (void)
                 user_w * NVME_KERNEL_PG_SIZE);
 
     printf ("   read           : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_USER_R],
-                (double) (ox_stats.io[OX_STATS_SEC_USER_R] *
+                io[OX_STATS_SEC_USER_R],
+                (double) (io[OX_STATS_SEC_USER_R] *
                 NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_USER_R] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_USER_R] * NVME_KERNEL_PG_SIZE);
 
     printf ("\n Metadata blocks (%d bytes each):\n", NVME_KERNEL_PG_SIZE);
 
@@ -468,22 +541,22 @@ void ox_stats_print_io (void)
                 map_w * NVME_KERNEL_PG_SIZE);
 
     printf ("      map (SMALL) : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_CP_MAPMD_W],
-                (double) (ox_stats.io[OX_STATS_SEC_CP_MAPMD_W] *
+                io[OX_STATS_SEC_CP_MAPMD_W],
+                (double) (io[OX_STATS_SEC_CP_MAPMD_W] *
                                     NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_CP_MAPMD_W] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_CP_MAPMD_W] * NVME_KERNEL_PG_SIZE);
 
     printf ("      blk (SMALL) : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_CP_BLK_W],
-                (double) (ox_stats.io[OX_STATS_SEC_CP_BLK_W] *
+                io[OX_STATS_SEC_CP_BLK_W],
+                (double) (io[OX_STATS_SEC_CP_BLK_W] *
                                     NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_CP_BLK_W] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_CP_BLK_W] * NVME_KERNEL_PG_SIZE);
 
     printf ("      log (WAL)   : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_LOG_W],
-                (double) (ox_stats.io[OX_STATS_SEC_LOG_W] *
+                io[OX_STATS_SEC_LOG_W],
+                (double) (io[OX_STATS_SEC_LOG_W] *
                                     NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_LOG_W] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_LOG_W] * NVME_KERNEL_PG_SIZE);
 
     printf ("      padding     : %-7lu -> %10.2lf MB (%lu bytes)\n",
                 pad_w,
@@ -491,22 +564,22 @@ void ox_stats_print_io (void)
                 pad_w * NVME_KERNEL_PG_SIZE);
 
     printf ("      checkpoint  : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_CP_W],
-                (double) (ox_stats.io[OX_STATS_SEC_CP_W] *
+                io[OX_STATS_SEC_CP_W],
+                (double) (io[OX_STATS_SEC_CP_W] *
                                     NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_CP_W] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_CP_W] * NVME_KERNEL_PG_SIZE);
 
     printf ("      reserved    : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_RSV_W],
-                (double) (ox_stats.io[OX_STATS_SEC_RSV_W] *
+                io[OX_STATS_SEC_RSV_W],
+                (double) (io[OX_STATS_SEC_RSV_W] *
                                     NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_RSV_W] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_RSV_W] * NVME_KERNEL_PG_SIZE);
 
     printf ("      other       : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_OTHER_W],
-                (double) (ox_stats.io[OX_STATS_SEC_OTHER_W] *
+                io[OX_STATS_SEC_OTHER_W],
+                (double) (io[OX_STATS_SEC_OTHER_W] *
                                     NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_OTHER_W] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_OTHER_W] * NVME_KERNEL_PG_SIZE);
 
     printf ("   read           : %-7lu -> %10.2lf MB (%lu bytes)\n",
                 tot_md_r, (double) (tot_md_r * NVME_KERNEL_PG_SIZE) /
@@ -539,16 +612,16 @@ void ox_stats_print_io (void)
                 pad_r * NVME_KERNEL_PG_SIZE);
 
     printf ("      checkpoint  : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_CP_R],
-                (double) (ox_stats.io[OX_STATS_SEC_CP_R] *
+                io[OX_STATS_SEC_CP_R],
+                (double) (io[OX_STATS_SEC_CP_R] *
                                     NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_CP_R] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_CP_R] * NVME_KERNEL_PG_SIZE);
 
     printf ("      reserved    : %-7lu -> %10.2lf MB (%lu bytes)\n",
-                ox_stats.io[OX_STATS_SEC_RSV_R],
-                (double) (ox_stats.io[OX_STATS_SEC_RSV_R] *
+                io[OX_STATS_SEC_RSV_R],
+                (double) (io[OX_STATS_SEC_RSV_R] *
                                     NVME_KERNEL_PG_SIZE) / (double) 1048576,
-                ox_stats.io[OX_STATS_SEC_RSV_R] * NVME_KERNEL_PG_SIZE);
+                io[OX_STATS_SEC_RSV_R] * NVME_KERNEL_PG_SIZE);
 
     printf ("      namespace * : %-7lu -> %10.2lf MB (%lu bytes)\n",
                 user_synch_r,
@@ -560,7 +633,7 @@ void ox_stats_print_io (void)
                 (double) (other_r * NVME_KERNEL_PG_SIZE) / (double) 1048576,
                 other_r * NVME_KERNEL_PG_SIZE);
 
-    ox_stats_print_gc_blks ();
+    ox_stats_print_gc_blks (io);
     printf ("\n");
 }
 
@@ -593,9 +666,7 @@ void ox_stats_add_gc (uint16_t type, uint8_t is_write, uint32_t count)
             break;
     }
 
-    pthread_spin_lock (&ox_stats.io_spin[index]);
-    ox_stats.io[index] += count;
-    pthread_spin_unlock (&ox_stats.io_spin[index]);
+    ox_stats_inc (index, count);
 }
 
 void ox_stats_add_event (uint16_t type, uint32_t count)
@@ -621,20 +692,26 @@ void ox_stats_add_event (uint16_t type, uint32_t count)
         case OX_CP_EVENT_FLUSH:
             index = OX_STATS_SEC_CP_TINY;
             break;
+        case OX_HOST_EVENT_WRITE:
+            index = OX_STATS_SEC_HOST_W;
+            break;
+        case OX_PROV_EVENT_LINE + APP_LINE_USER:
+        case OX_PROV_EVENT_LINE + APP_LINE_COLD:
+        case OX_PROV_EVENT_LINE + APP_LINE_META:
+        case OX_PROV_EVENT_LINE + APP_LINE_DELTA:
+            index = OX_STATS_SEC_LINE_USER_W + (type - OX_PROV_EVENT_LINE);
+            break;
         default:
             return;
     }
 
-    pthread_spin_lock (&ox_stats.io_spin[index]);
-    ox_stats.io[index] += count;
-    pthread_spin_unlock (&ox_stats.io_spin[index]);
+    ox_stats_inc (index, count);
 }
 
 void ox_stats_add_io (struct nvm_mmgr_io_cmd *cmd, uint8_t synch, uint16_t tid)
 {
     struct app_sec_oob *oob = (struct app_sec_oob *) cmd->md_prp;
-    struct nvm_ppa_addr ppa;
-    uint32_t sec_i;
+    uint32_t sec_i, user_r = 0;
     uint8_t is_write = 0;
     uint16_t index, index2;
 
@@ -656,63 +733,45 @@ void ox_stats_add_io (struct nvm_mmgr_io_cmd *cmd, uint8_t synch, uint16_t tid)
             break;
 
         case MMGR_ERASE_BLK:
-            pthread_spin_lock (&ox_stats.io_spin[OX_STATS_IO_ERASE]);
-            ox_stats.io[OX_STATS_IO_ERASE]++;
-            pthread_spin_unlock (&ox_stats.io_spin[OX_STATS_IO_ERASE]);
+            ox_stats_inc (OX_STATS_IO_ERASE, 1);
             return;
 
         default:
             return;
     }
 
-    ox_stats_reset_read  ();
-
+    /* user asynchronous reads have non-sequential sectors */
     if (!is_write && !synch) {
-        ox_stats.io_asynch_read[tid]++;
-    } else {
-        pthread_spin_lock (&ox_stats.io_spin[index]);
-        ox_stats.io[index]++;
-        ox_stats.io[index2] += cmd->n_sectors * cmd->sec_sz;
-        pthread_spin_unlock (&ox_stats.io_spin[index]);
+        for (sec_i = 0; sec_i < cmd->n_sectors; sec_i++)
+            if (cmd->prp[sec_i])
+                user_r++;
+
+        ox_stats_inc (OX_STATS_IO_ASYNC_R, 1);
+        ox_stats_inc (OX_STATS_SEC_USER_R, user_r);
+        ox_stats_inc (OX_STATS_BYTES_ASYNC_R, user_r * cmd->sec_sz);
+        return;
     }
 
-    for (sec_i = 0; sec_i < cmd->n_sectors; sec_i++) {
+    ox_stats_inc (index, 1);
+    ox_stats_inc (index2, cmd->n_sectors * cmd->sec_sz);
 
-        /* user asynchronous reads have non-sequential sectors */
-        if (!is_write && !synch) {
-            if (cmd->prp[sec_i]) {
-               ox_stats.io_asynch_user_r[tid]++;
-               ox_stats.io_asynch_bytes[tid] += cmd->sec_sz;
-            }
-            continue;
-        }
+    /* check if it is a checkpoint block */
+    /* TODO: Make it automatic, for now, checkpoint is fixed in a single blk */
+    if ( (cmd->ppa.g.lun == 0) &&
+         (cmd->ppa.g.blk == APP_RSV_CP_OFF + cmd->ch->mmgr_rsv)) {
+        index = (is_write) ? OX_STATS_SEC_CP_W : OX_STATS_SEC_CP_R;
+        ox_stats_inc (index, cmd->n_sectors);
+        return;
+    }
 
-        /* check if it is a checkpoint block */
-        /* TODO: Make it automatic, for now, checkpoint is fixed in a single blk */
-        if ( (cmd->ppa.g.lun == 0) &&
-             (cmd->ppa.g.blk == APP_RSV_CP_OFF + cmd->ch->mmgr_rsv)) {
-            index = (is_write) ? OX_STATS_SEC_CP_W : OX_STATS_SEC_CP_R;
-            pthread_spin_lock (&ox_stats.io_spin[index]);
-            ox_stats.io[index] += cmd->n_sectors;
-            pthread_spin_unlock (&ox_stats.io_spin[index]);
-            break;
-        }
+    /* check if it is a reserved block, all sectors are in the same block */
+    if (ox_ch_is_rsv (cmd->ch, cmd->ppa.g.lun, cmd->ppa.g.blk)) {
+        index = (is_write) ? OX_STATS_SEC_RSV_W : OX_STATS_SEC_RSV_R;
+        ox_stats_inc (index, cmd->n_sectors);
+        return;
+    }
 
-        /* check if it is a reserved block */
-        ppa.ppa = 0;
-        ppa.g.ch = cmd->ppa.g.ch;
-        ppa.g.lun = cmd->ppa.g.lun;
-        ppa.g.blk = cmd->ppa.g.blk;
-        if (ox_contains_ppa(cmd->ch->mmgr_rsv_list, cmd->ch->mmgr_rsv *
-                                cmd->ch->geometry->n_of_planes, ppa) ||
-            ox_contains_ppa(cmd->ch->ftl_rsv_list, cmd->ch->ftl_rsv *
-                                cmd->ch->geometry->n_of_planes, ppa)){
-            index = (is_write) ? OX_STATS_SEC_RSV_W : OX_STATS_SEC_RSV_R;
-            pthread_spin_lock (&ox_stats.io_spin[index]);
-            ox_stats.io[index] += cmd->n_sectors;
-            pthread_spin_unlock (&ox_stats.io_spin[index]);
-            break;
-        }
+    for (sec_i = 0; sec_i < cmd->n_sectors; sec_i++) {
 
         switch (oob[sec_i].pg_type) {
             
@@ -740,9 +799,7 @@ void ox_stats_add_io (struct nvm_mmgr_io_cmd *cmd, uint8_t synch, uint16_t tid)
                 index = (is_write) ? OX_STATS_SEC_OTHER_W : OX_STATS_SEC_OTHER_R;
         }
 
-        pthread_spin_lock (&ox_stats.io_spin[index]);
-        ox_stats.io[index]++;
-        pthread_spin_unlock (&ox_stats.io_spin[index]);
+        ox_stats_inc (index, 1);
     }
 }
 
@@ -766,74 +823,372 @@ void ox_stats_set_cp (uint16_t type, uint64_t value)
     ox_stats.cp[type] = value;
 }
 
-void ox_stats_reset_io (void)
+static const char *ox_stats_log_names[OX_STATS_LOG_TYPES] = {
+    "pad", "pointer", "write", "map", "gc_write", "gc_map", "amend",
+    "commit", "blk_md", "map_md", "abort_write", "put_blk", "trim"
+};
+
+/* Rates are computed from the raw sums, so 'show reset' does not affect them */
+void ox_stats_sample (void)
 {
+    uint64_t io[OX_STATS_IO_TYPES];
+    struct timespec ts;
     uint32_t type_i;
+    uint64_t ns;
+    double sec;
 
-    pthread_spin_lock (&ox_stats.io_spin[OX_STATS_IO_SYNC_R]);
-    ox_stats.io[OX_STATS_IO_SYNC_R] = 0;
-    ox_stats.io[OX_STATS_BYTES_SYNC_R] = 0;
-    pthread_spin_unlock (&ox_stats.io_spin[OX_STATS_IO_SYNC_R]);
+    ox_stats_sum (io);
+    GET_NANOSECONDS (ns, ts);
 
-    pthread_spin_lock (&ox_stats.io_spin[OX_STATS_IO_SYNC_W]);
-    ox_stats.io[OX_STATS_IO_SYNC_W] = 0;
-    ox_stats.io[OX_STATS_BYTES_SYNC_W] = 0;
-    pthread_spin_unlock (&ox_stats.io_spin[OX_STATS_IO_SYNC_W]);
-    
-    pthread_spin_lock (&ox_stats.io_spin[OX_STATS_IO_ASYNC_R]);
-    ox_stats.io[OX_STATS_IO_ASYNC_R] = 0;
-    ox_stats.io[OX_STATS_BYTES_ASYNC_R] = 0;
-    pthread_spin_unlock (&ox_stats.io_spin[OX_STATS_IO_ASYNC_R]);
-
-    pthread_spin_lock (&ox_stats.io_spin[OX_STATS_IO_ASYNC_W]);
-    ox_stats.io[OX_STATS_IO_ASYNC_W] = 0;
-    ox_stats.io[OX_STATS_BYTES_ASYNC_W] = 0;
-    pthread_spin_unlock (&ox_stats.io_spin[OX_STATS_IO_ASYNC_W]);
-
-    pthread_spin_lock (&ox_stats.io_spin[OX_STATS_IO_ERASE]);
-    ox_stats.io[OX_STATS_IO_ERASE] = 0;
-    pthread_spin_unlock (&ox_stats.io_spin[OX_STATS_IO_ERASE]);
-
-    for (type_i = 9; type_i < OX_STATS_IO_TYPES; type_i++) {
-        pthread_spin_lock (&ox_stats.io_spin[type_i]);
-        ox_stats.io[type_i] = 0;
-        pthread_spin_unlock (&ox_stats.io_spin[type_i]);
+    sec = (double) (ns - ox_stats.rate_ns) / 1000000000.0;
+    for (type_i = 0; type_i < OX_STATS_IO_TYPES; type_i++) {
+        ox_stats.rate[type_i] = (!ox_stats.rate_ns || sec <= 0) ? 0 :
+                    (double) (io[type_i] - ox_stats.rate_prev[type_i]) / sec;
+        ox_stats.rate_prev[type_i] = io[type_i];
     }
+    ox_stats.rate_ns = ns;
+
+    pthread_mutex_lock (&ox_stats.reset_mutex);
+    memcpy (ox_stats.window[ox_stats.window_i], io,
+                                        sizeof (uint64_t) * OX_STATS_IO_TYPES);
+    ox_stats.window_i = (ox_stats.window_i + 1) % OX_STATS_WINDOW;
+    if (ox_stats.window_n < OX_STATS_WINDOW)
+        ox_stats.window_n++;
+    pthread_mutex_unlock (&ox_stats.reset_mutex);
+}
 
-    reset_read = 1;
+static inline uint64_t ox_stats_sub (uint64_t a, uint64_t b)
+{
+    return (a > b) ? a - b : 0;
 }
 
-void ox_stats_exit (void)
+/*
+ * Media sectors written in the last 'secs' seconds (0 is since the last
+ * reset), split by cause. GC writes are also counted by their content type,
+ * so they are subtracted from the user, map and padding causes. Windows are
+ * built from the per-second samples, if fewer samples exist the oldest one
+ * is used. Returns the seconds covered, or -1 if there are no samples yet.
+ */
+static int ox_stats_waf_get (struct ox_stats_waf *waf, uint32_t secs)
 {
-    uint32_t type_i;
+    uint64_t io[OX_STATS_IO_TYPES];
+    uint64_t *base;
+    uint32_t type_i, n;
+    int ret = 0;
+
+    pthread_mutex_lock (&ox_stats.reset_mutex);
+    ox_stats_sum (io);
+
+    if (!secs) {
+        base = ox_stats.io_base;
+    } else {
+        if (!ox_stats.window_n) {
+            pthread_mutex_unlock (&ox_stats.reset_mutex);
+            return -1;
+        }
+        n = MIN (secs, ox_stats.window_n);
+        base = ox_stats.window[(ox_stats.window_i + OX_STATS_WINDOW - n) %
+                                                            OX_STATS_WINDOW];
+        ret = n;
+    }
 
     for (type_i = 0; type_i < OX_STATS_IO_TYPES; type_i++)
-        pthread_spin_destroy (&ox_stats.io_spin[type_i]);
+        io[type_i] = ox_stats_sub (io[type_i], base[type_i]);
+    pthread_mutex_unlock (&ox_stats.reset_mutex);
+
+    memset (waf, 0x0, sizeof (struct ox_stats_waf));
+
+    waf->cause[OX_STATS_WAF_USER] = ox_stats_sub (io[OX_STATS_SEC_USER_W],
+                                                io[OX_STATS_SEC_GC_USER_W]);
+    waf->cause[OX_STATS_WAF_GC] = io[OX_STATS_SEC_GC_USER_W] +
+                                  io[OX_STATS_SEC_GC_MAP_W] +
+                                  io[OX_STATS_SEC_GC_PAD_W];
+    waf->cause[OX_STATS_WAF_MAP] = ox_stats_sub (io[OX_STATS_SEC_MAP_W],
+                                                io[OX_STATS_SEC_GC_MAP_W]);
+    waf->cause[OX_STATS_WAF_LOG] = io[OX_STATS_SEC_LOG_W];
+    waf->cause[OX_STATS_WAF_CP] = io[OX_STATS_SEC_CP_W] +
+                                  io[OX_STATS_SEC_CP_MAPMD_W] +
+                                  io[OX_STATS_SEC_CP_BLK_W];
+    waf->cause[OX_STATS_WAF_PAD] = ox_stats_sub (io[OX_STATS_SEC_PAD_W],
+                                                io[OX_STATS_SEC_GC_PAD_W]);
+    waf->cause[OX_STATS_WAF_OTHER] = io[OX_STATS_SEC_OTHER_W] +
+                                     io[OX_STATS_SEC_RSV_W];
+
+    for (type_i = 0; type_i < OX_STATS_WAF_CAUSES; type_i++)
+        waf->media += waf->cause[type_i];
+
+    for (type_i = 0; type_i < OX_STATS_LINE_TYPES; type_i++)
+        waf->line[type_i] = io[OX_STATS_SEC_LINE_USER_W + type_i];
+
+    waf->host         = io[OX_STATS_SEC_HOST_W];
+    waf->gc_moved     = waf->cause[OX_STATS_WAF_GC];
+    waf->gc_reclaimed = io[OX_STATS_GC_SPACE_REC] / NVME_KERNEL_PG_SIZE;
+    waf->gc_blks      = io[OX_STATS_GC_BLOCK_REC];
+
+    return ret;
 }
 
-int ox_stats_init (void)
+static inline double ox_stats_waf_ratio (struct ox_stats_waf *waf)
 {
-    uint32_t type_i;
+    return (waf->host) ? (double) waf->media / (double) waf->host : 0;
+}
 
-    for (type_i = 0; type_i < OX_STATS_IO_TYPES; type_i++) {
-        if (pthread_spin_init (&ox_stats.io_spin[type_i], 0))
-            goto CLEAN_IO;
+/* Fraction of the recycled space that was invalid and did not need a move */
+static inline double ox_stats_gc_efficiency (struct ox_stats_waf *waf)
+{
+    if (!waf->gc_reclaimed)
+        return 0;
+
+    return 1.0 - (double) MIN (waf->gc_moved, waf->gc_reclaimed) /
+                                                (double) waf->gc_reclaimed;
+}
+
+void ox_stats_print_waf (void)
+{
+    struct ox_stats_waf waf[OX_STATS_WAF_WINDOWS];
+    int secs[OX_STATS_WAF_WINDOWS];
+    uint32_t win_i, type_i;
+
+    for (win_i = 0; win_i < OX_STATS_WAF_WINDOWS; win_i++)
+        secs[win_i] = ox_stats_waf_get (&waf[win_i], ox_stats_waf_secs[win_i]);
+
+    printf ("\n Write amplification (sectors of %d bytes)\n",
+                                                        NVME_KERNEL_PG_SIZE);
+    printf ("   %-14s %14s %14s %14s\n", "", "since reset", "last 60s",
+                                                                "last 10s");
+
+#define OX_STATS_WAF_ROW(label, expr, fmt)                                    \
+    do {                                                                      \
+        printf ("   %-14s", label);                                           \
+        for (win_i = 0; win_i < OX_STATS_WAF_WINDOWS; win_i++) {              \
+            if (secs[win_i] < 0)                                              \
+                printf (" %14s", "-");                                        \
+            else                                                              \
+                printf (" " fmt, expr);                                       \
+        }                                                                     \
+        printf ("\n");                                                        \
+    } while (0)
+
+    OX_STATS_WAF_ROW ("host writes", waf[win_i].host, "%14lu");
+    OX_STATS_WAF_ROW ("media writes", waf[win_i].media, "%14lu");
+    for (type_i = 0; type_i < OX_STATS_WAF_CAUSES; type_i++)
+        OX_STATS_WAF_ROW (ox_stats_waf_names[type_i],
+                                            waf[win_i].cause[type_i], "%14lu");
+    OX_STATS_WAF_ROW ("WAF", ox_stats_waf_ratio (&waf[win_i]), "%14.3lf");
+
+    printf ("\n Provisioned sectors per line\n");
+    for (type_i = 0; type_i < OX_STATS_LINE_TYPES; type_i++)
+        OX_STATS_WAF_ROW (ox_stats_line_names[type_i],
+                                            waf[win_i].line[type_i], "%14lu");
+
+    printf ("\n Garbage collection\n");
+    OX_STATS_WAF_ROW ("blocks", waf[win_i].gc_blks, "%14lu");
+    OX_STATS_WAF_ROW ("reclaimed", waf[win_i].gc_reclaimed, "%14lu");
+    OX_STATS_WAF_ROW ("moved", waf[win_i].gc_moved, "%14lu");
+    OX_STATS_WAF_ROW ("efficiency", ox_stats_gc_efficiency (&waf[win_i]),
+                                                                    "%14.3lf");
+#undef OX_STATS_WAF_ROW
+
+    if (secs[1] >= 0 && secs[1] < ox_stats_waf_secs[1])
+        printf ("\n Only %d seconds sampled, windows are shorter\n", secs[1]);
+    printf ("\n");
+}
+
+static void ox_stats_waf_metrics (struct ox_metrics *m)
+{
+    struct ox_stats_waf waf;
+    uint32_t win_i, type_i;
+    const char *help;
+
+    ox_stats_waf_get (&waf, 0);
+
+    ox_metrics_add (m, "ox_host_write_sectors_total", OX_METRIC_COUNTER,
+            "Sectors written by the host since the last reset", waf.host, NULL);
+    for (type_i = 0; type_i < OX_STATS_WAF_CAUSES; type_i++)
+        ox_metrics_add (m, "ox_media_write_sectors_total", OX_METRIC_COUNTER,
+                (!type_i) ? "Media sectors written by cause" : NULL,
+                waf.cause[type_i], "cause=\"%s\"", ox_stats_waf_names[type_i]);
+    for (type_i = 0; type_i < OX_STATS_LINE_TYPES; type_i++)
+        ox_metrics_add (m, "ox_line_write_sectors_total", OX_METRIC_COUNTER,
+                (!type_i) ? "Sectors provisioned per line type" : NULL,
+                waf.line[type_i], "line=\"%s\"", ox_stats_line_names[type_i]);
+
+    help = "Write amplification (media/host sectors)";
+    for (win_i = 0; win_i < OX_STATS_WAF_WINDOWS; win_i++) {
+        if (win_i && ox_stats_waf_get (&waf, ox_stats_waf_secs[win_i]) < 0)
+            break;
+        ox_metrics_add (m, "ox_waf", OX_METRIC_GAUGE, help,
+                ox_stats_waf_ratio (&waf), "window=\"%s\"",
+                (!win_i) ? "reset" : (win_i == 1) ? "60s" : "10s");
+        help = NULL;
     }
-    memset (ox_stats.io, 0x0, sizeof(uint64_t) * OX_STATS_IO_TYPES);
-    memset (ox_stats.io_asynch_read, 0x0, sizeof(uint64_t) * OX_STATS_IO_AREAD_TH);
-    memset (ox_stats.io_asynch_bytes, 0x0, sizeof(uint64_t) * OX_STATS_IO_AREAD_TH);
-    memset (ox_stats.io_asynch_user_r, 0x0, sizeof(uint64_t) * OX_STATS_IO_AREAD_TH);
+
+    help = "Recycled space not moved by GC";
+    for (win_i = 0; win_i < OX_STATS_WAF_WINDOWS; win_i++) {
+        if (ox_stats_waf_get (&waf, ox_stats_waf_secs[win_i]) < 0)
+            break;
+        ox_metrics_add (m, "ox_gc_efficiency", OX_METRIC_GAUGE, help,
+                ox_stats_gc_efficiency (&waf), "window=\"%s\"",
+                (!win_i) ? "reset" : (win_i == 1) ? "60s" : "10s");
+        help = NULL;
+    }
+}
+
+void ox_stats_metrics (struct ox_metrics *m)
+{
+    uint64_t io[OX_STATS_IO_TYPES];
+    uint32_t log_i;
+
+    ox_stats_snapshot (io);
+
+    /* Physical I/O, 'user' is asynchronous, 'meta' is synchronous (meta+gc) */
+    ox_metrics_add (m, "ox_media_io_total", OX_METRIC_COUNTER,
+            "Media commands since the last reset", io[OX_STATS_IO_ASYNC_R],
+            "dir=\"read\",path=\"user\"");
+    ox_metrics_add (m, "ox_media_io_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_IO_SYNC_R], "dir=\"read\",path=\"meta\"");
+    ox_metrics_add (m, "ox_media_io_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_IO_ASYNC_W], "dir=\"write\",path=\"user\"");
+    ox_metrics_add (m, "ox_media_io_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_IO_SYNC_W], "dir=\"write\",path=\"meta\"");
+    ox_metrics_add (m, "ox_media_io_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_IO_ERASE], "dir=\"erase\",path=\"meta\"");
+
+    ox_metrics_add (m, "ox_media_bytes_total", OX_METRIC_COUNTER,
+            "Bytes transferred to/from media since the last reset",
+            io[OX_STATS_BYTES_ASYNC_R], "dir=\"read\",path=\"user\"");
+    ox_metrics_add (m, "ox_media_bytes_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_BYTES_SYNC_R], "dir=\"read\",path=\"meta\"");
+    ox_metrics_add (m, "ox_media_bytes_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_BYTES_ASYNC_W], "dir=\"write\",path=\"user\"");
+    ox_metrics_add (m, "ox_media_bytes_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_BYTES_SYNC_W], "dir=\"write\",path=\"meta\"");
+
+    ox_metrics_add (m, "ox_media_iops", OX_METRIC_GAUGE,
+            "Media commands per second", ox_stats.rate[OX_STATS_IO_ASYNC_R] +
+            ox_stats.rate[OX_STATS_IO_SYNC_R], "dir=\"read\"");
+    ox_metrics_add (m, "ox_media_iops", OX_METRIC_GAUGE, NULL,
+            ox_stats.rate[OX_STATS_IO_ASYNC_W] +
+            ox_stats.rate[OX_STATS_IO_SYNC_W], "dir=\"write\"");
+    ox_metrics_add (m, "ox_media_iops", OX_METRIC_GAUGE, NULL,
+            ox_stats.rate[OX_STATS_IO_ERASE], "dir=\"erase\"");
+
+    ox_metrics_add (m, "ox_media_bandwidth_bytes", OX_METRIC_GAUGE,
+            "Media bytes per second", ox_stats.rate[OX_STATS_BYTES_ASYNC_R] +
+            ox_stats.rate[OX_STATS_BYTES_SYNC_R], "dir=\"read\"");
+    ox_metrics_add (m, "ox_media_bandwidth_bytes", OX_METRIC_GAUGE, NULL,
+            ox_stats.rate[OX_STATS_BYTES_ASYNC_W] +
+            ox_stats.rate[OX_STATS_BYTES_SYNC_W], "dir=\"write\"");
+
+    ox_metrics_add (m, "ox_user_bandwidth_bytes", OX_METRIC_GAUGE,
+            "Host data per second", ox_stats.rate[OX_STATS_SEC_USER_R] *
+            NVME_KERNEL_PG_SIZE, "dir=\"read\"");
+    ox_metrics_add (m, "ox_user_bandwidth_bytes", OX_METRIC_GAUGE, NULL,
+            ox_stats.rate[OX_STATS_SEC_USER_W] * NVME_KERNEL_PG_SIZE,
+            "dir=\"write\"");
+
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER,
+            "Media sectors by content since the last reset",
+            io[OX_STATS_SEC_USER_W], "dir=\"write\",kind=\"user\"");
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_USER_R], "dir=\"read\",kind=\"user\"");
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_MAP_W], "dir=\"write\",kind=\"map\"");
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_MAP_R], "dir=\"read\",kind=\"map\"");
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_LOG_W], "dir=\"write\",kind=\"log\"");
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_LOG_R], "dir=\"read\",kind=\"log\"");
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_PAD_W], "dir=\"write\",kind=\"pad\"");
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_CP_W], "dir=\"write\",kind=\"checkpoint\"");
+    ox_metrics_add (m, "ox_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_CP_R], "dir=\"read\",kind=\"checkpoint\"");
+
+    /* Garbage collection */
+    ox_metrics_add (m, "ox_gc_sectors_total", OX_METRIC_COUNTER,
+            "Sectors moved by GC since the last reset",
+            io[OX_STATS_SEC_GC_USER_W], "dir=\"write\",kind=\"user\"");
+    ox_metrics_add (m, "ox_gc_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_GC_USER_R], "dir=\"read\",kind=\"user\"");
+    ox_metrics_add (m, "ox_gc_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_GC_MAP_W], "dir=\"write\",kind=\"map\"");
+    ox_metrics_add (m, "ox_gc_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_GC_MAP_R], "dir=\"read\",kind=\"map\"");
+    ox_metrics_add (m, "ox_gc_sectors_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_SEC_GC_PAD_W], "dir=\"write\",kind=\"pad\"");
+    ox_metrics_add (m, "ox_gc_blocks_total", OX_METRIC_COUNTER,
+            "Blocks recycled by GC since the last reset",
+            io[OX_STATS_GC_BLOCK_REC], NULL);
+    ox_metrics_add (m, "ox_gc_failed_sectors_total", OX_METRIC_COUNTER,
+            "Sectors GC failed to move since the last reset",
+            io[OX_STATS_SEC_GC_FAILED], NULL);
+    ox_metrics_add (m, "ox_gc_races_total", OX_METRIC_COUNTER,
+            "Mapping races between GC and user writes",
+            io[OX_STATS_GC_RACE_BIG], "map=\"big\"");
+    ox_metrics_add (m, "ox_gc_races_total", OX_METRIC_COUNTER, NULL,
+            io[OX_STATS_GC_RACE_SMALL], "map=\"small\"");
+
+    /* Checkpoint */
+    ox_metrics_add (m, "ox_checkpoint_bytes", OX_METRIC_GAUGE,
+            "Size of the latest checkpoint", ox_stats.cp[OX_STATS_CP_SZ], NULL);
+    ox_metrics_add (m, "ox_checkpoint_evict_pages_total", OX_METRIC_COUNTER,
+            "Metadata pages persisted by checkpoints",
+            ox_stats.cp[OX_STATS_CP_MAP_EVICT], "table=\"map\"");
+    ox_metrics_add (m, "ox_checkpoint_evict_pages_total", OX_METRIC_COUNTER,
+            NULL, ox_stats.cp[OX_STATS_CP_MAPMD_EVICT], "table=\"map_md\"");
+    ox_metrics_add (m, "ox_checkpoint_evict_pages_total", OX_METRIC_COUNTER,
+            NULL, ox_stats.cp[OX_STATS_CP_BLK_EVICT], "table=\"blk_md\"");
+
+    /* Log and recovery */
+    for (log_i = 1; log_i < OX_STATS_LOG_TYPES; log_i++)
+        ox_metrics_add (m, "ox_log_replay_entries", OX_METRIC_GAUGE,
+                (log_i == 1) ? "Log entries replayed at startup" : NULL,
+                ox_stats.log[log_i], "type=\"%s\"", ox_stats_log_names[log_i]);
+
+    ox_metrics_add (m, "ox_log_replay_pages", OX_METRIC_GAUGE,
+            "Log chain pages read at startup",
+            ox_stats.rec[OX_STATS_REC_LOG_PGS], NULL);
+    ox_metrics_add (m, "ox_log_replay_dropped", OX_METRIC_GAUGE,
+            "Log entries dropped at startup",
+            ox_stats.rec[OX_STATS_REC_DROPPED_LOGS], NULL);
+    ox_metrics_add (m, "ox_log_replay_transactions", OX_METRIC_GAUGE,
+            "Transactions found at startup",
+            ox_stats.rec[OX_STATS_REC_TR_COMMIT], "state=\"committed\"");
+    ox_metrics_add (m, "ox_log_replay_transactions", OX_METRIC_GAUGE, NULL,
+            ox_stats.rec[OX_STATS_REC_TR_ABORT], "state=\"aborted\"");
+    ox_metrics_add (m, "ox_startup_seconds", OX_METRIC_GAUGE,
+            "Controller startup time",
+            (double) (ox_stats.rec[OX_STATS_REC_START2_US] -
+                    ox_stats.rec[OX_STATS_REC_START1_US]) / 1000000.0, NULL);
+
+    ox_stats_waf_metrics (m);
+}
+
+void ox_stats_reset_io (void)
+{
+    pthread_mutex_lock (&ox_stats.reset_mutex);
+    ox_stats_sum (ox_stats.io_base);
+    pthread_mutex_unlock (&ox_stats.reset_mutex);
+}
+
+void ox_stats_exit (void)
+{
+    pthread_mutex_destroy (&ox_stats.reset_mutex);
+}
+
+int ox_stats_init (void)
+{
+    if (pthread_mutex_init (&ox_stats.reset_mutex, NULL))
+        return -1;
+
+    memset (ox_stats.shards, 0x0, sizeof (ox_stats.shards));
+    memset (ox_stats.io_base, 0x0, sizeof(uint64_t) * OX_STATS_IO_TYPES);
     memset (ox_stats.rec, 0x0, sizeof(uint64_t) * OX_STATS_REC_TYPES);
     memset (ox_stats.log, 0x0, sizeof(uint64_t) * OX_STATS_LOG_TYPES);
     memset (ox_stats.cp, 0x0, sizeof(uint64_t) * OX_STATS_CP_TYPES);
-    reset_read = 0;
 
     return 0;
-
-CLEAN_IO:
-    while (type_i) {
-        type_i--;
-        pthread_spin_destroy (&ox_stats.io_spin[type_i]);
-    }
-    return -1;
-}
\ No newline at end of file
+}
@@ -171,6 +171,51 @@ ox_cmd show_cmd[] = {
           "Restart I/O and bytes count of 'show io' command",
           "Usage: show reset"
         },
+        { "latency",
+          NULL,
+          cmdline_show_latency,
+          NULL,
+          "Displays per-stage I/O latency percentiles",
+          "Usage: show latency\n"
+          "    Displays latency percentiles of each I/O stage for reads, writes\n"
+          "    and media commands, in microseconds.\n"
+          "      Stage      Description\n"
+          "      parse:     NVMe command parsing\n"
+          "      ftl-queue: Waiting in the FTL queue (reads: 'map', read queue and\n"
+          "                 mapping lookup)\n"
+          "      ftl:       FTL batching and media writes (reads: 'media')\n"
+          "      commit:    Mapping commit and completion\n"
+          "      total:     Parser to host completion"
+        },
+        { "latency-reset",
+          NULL,
+          cmdline_show_latency_reset,
+          NULL,
+          "Restart the histograms of 'show latency' command",
+          "Usage: show latency-reset"
+        },
+        { "channels",
+          NULL,
+          cmdline_show_channels,
+          NULL,
+          "Displays per-channel and per-LUN utilization",
+          "Usage: show channels\n"
+          "    Displays queue depth, utilization, IOPS and bandwidth of each\n"
+          "    channel and LUN in the last second and the last 60 seconds,\n"
+          "    and the utilization of each channel over the last 30 seconds.\n"
+          "    Depth counts media commands submitted and not completed."
+        },
+        { "waf",
+          NULL,
+          cmdline_show_waf,
+          NULL,
+          "Displays write amplification and GC efficiency",
+          "Usage: show waf\n"
+          "    Displays media sectors written per host sector, split by cause\n"
+          "    (user, GC relocation, map, log, checkpoint, padding) and by\n"
+          "    provisioning line, since the last 'show reset' and over the\n"
+          "    last 60 and 10 seconds."
+        },
         { NULL, NULL, NULL, NULL, NULL, NULL }
 };
 
@@ -182,17 +227,19 @@ ox_cmd output_cmd[] = {
           "Starts logging I/O information in memory",
           "Starts logging I/O information in memory\n"
           "\n"
-          "    I/O information will be appended in memory until 'stop' is called."
+          "    I/O information is buffered in memory and written to a binary\n"
+          "    file in background until 'stop' is called."
         },
         { "stop",
           NULL,
           cmdline_stop_output,
           NULL,
-          "Stops logging I/O information and flushes the log to a CSV file",
-          "Stops logging I/O information and flushes the log to a CSV file\n"
+          "Stops logging I/O information and closes the trace files",
+          "Stops logging I/O information and closes the trace files\n"
           "\n"
-          "    A CSV file per ox-mq instance will be flushed containing I/O"
-                                                                " information."
+          "    A binary file per ox-mq instance (output/<id>_<name>.trc) is\n"
+          "    written containing I/O information. Use 'ox-mq-trace' to\n"
+          "    convert it to CSV."
         },
         { NULL, NULL, NULL, NULL, NULL, NULL }
 };
@@ -225,6 +272,16 @@ ox_cmd main_cmd[] = {
           "Usage: debug [sub-command]\n"
           "    Enables or disables debugging output."
         },
+        { "budget",
+          NULL,
+          cmdline_set_budget,
+          NULL,
+          "Sets the memory budget of a type",
+          "Usage: budget <type> <MB> [block/fail]\n"
+          "    Sets the memory budget of a type listed by 'show memory', 0 MB\n"
+          "    removes it. Allocations over the budget wait for frees of the\n"
+          "    same type (block, default) or fail at once (fail)."
+        },
         { "exit",
           NULL,
           cmdline_exit,
@@ -250,9 +307,9 @@ ox_cmd main_cmd[] = {
           output_cmd,
           NULL,
           NULL,
-          "Logs I/O latency in memory and flushes a CSV file with data",
+          "Logs I/O latency in memory and writes a trace file with data",
           "Usage: output [start/stop]\n"
-          "   Logs I/O latency in memory and flushes a CSV file with data."
+          "   Logs I/O latency in memory and writes a trace file with data."
         },
         { NULL, NULL, NULL, NULL, NULL, NULL }
 };
@@ -291,6 +348,7 @@ int cmdline_show_debug (char *line, ox_cmd *cmd)
 int cmdline_show_memory (char *line, ox_cmd *cmd)
 {
         ox_mem_print_memory ();
+        ox_io_vec_print ();
         return 0;
 }
 
@@ -335,6 +393,31 @@ int cmdline_show_reset (char *line, ox_cmd *cmd)
         return 0;
 }
 
+int cmdline_show_latency (char *line, ox_cmd *cmd)
+{
+        ox_lat_print ();
+        return 0;
+}
+
+int cmdline_show_latency_reset (char *line, ox_cmd *cmd)
+{
+        ox_lat_reset ();
+        printf ("OX: latency histograms cleared\n");
+        return 0;
+}
+
+int cmdline_show_channels (char *line, ox_cmd *cmd)
+{
+        ox_chstat_print ();
+        return 0;
+}
+
+int cmdline_show_waf (char *line, ox_cmd *cmd)
+{
+        ox_stats_print_waf ();
+        return 0;
+}
+
 int cmdline_start_output (char *line, ox_cmd *cmd)
 {
         ox_mq_output_start ();
@@ -353,6 +436,30 @@ int cmdline_show_mq_status (char *line, ox_cmd *cmd)
         return 0;
 }
 
+int cmdline_set_budget (char *line, ox_cmd *cmd)
+{
+        char name[32], policy[8] = "block";
+        uint64_t mb;
+        int type, n;
+
+        n = sscanf(line, "%*s %31s %lu %7s", name, &mb, policy);
+        if (n < 2 || (strcmp(policy, "block") && strcmp(policy, "fail"))) {
+                printf("%s\n", cmd->help);
+                return -1;
+        }
+
+        type = ox_mem_find_type (name);
+        if (type < 0 || ox_mem_set_budget (type, mb * 1024 * 1024,
+                                !strcmp(policy, "block") ? OX_MEM_BUDGET_BLOCK :
+                                                        OX_MEM_BUDGET_FAIL)) {
+                printf("OX: memory type %s not found\n", name);
+                return -1;
+        }
+
+        printf("OX: budget of %s set to %lu MB\n", name, mb);
+        return 0;
+}
+
 int cmdline_admin (char *line, ox_cmd *cmd)
 {
         struct nvm_init_arg args = {
@@ -506,6 +613,9 @@ void find_command (char *line, ox_cmd **p_cmd, ox_cmd *p_cmd_list[])
                                 cmd_list = NULL;
                         }
                 }
+                /* The remaining words are arguments of a leaf command */
+                if (full_match && !comp_cmd->next && comp_cmd->func)
+                        break;
                 word = strtok_r(NULL, seperator, &tok_state);
                 if (word) {
                         cmd = NULL;
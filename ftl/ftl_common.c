@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <libox.h>
 
 void ftl_pg_io_prepare (struct nvm_channel *ch, struct nvm_io_data *data)
@@ -62,49 +63,144 @@ void ftl_pl_pg_io_prepare (struct nvm_channel *ch, struct nvm_io_data *data)
     }
 }
 
-struct nvm_io_data *ftl_alloc_pg_io (struct nvm_channel *ch)
+/*
+ * Page I/O helpers are kept in pools keyed by the channel geometry. Each
+ * helper is a single block holding the nvm_io_data, its vectors, the OOB
+ * buffer and the page buffer. Released helpers go back to their pool, up to
+ * FTL_PG_IO_POOL_MAX idle ones, and are reset when acquired again.
+ */
+#define FTL_PG_IO_POOLS     8
+#define FTL_PG_IO_POOL_MAX  32
+
+struct ftl_pg_io_pool;
+
+struct ftl_pg_io {
+    struct nvm_io_data      data;
+    struct ftl_pg_io_pool  *pool;
+    struct ftl_pg_io       *next;
+};
+
+struct ftl_pg_io_pool {
+    uint8_t             n_pl;
+    uint32_t            pg_sz;
+    uint32_t            meta_sz;
+    uint16_t            sec_per_pg;
+    uint16_t            sec_per_pl_pg;
+    struct ftl_pg_io   *free;
+    uint32_t            nfree;
+};
+
+static struct ftl_pg_io_pool pg_io_pools[FTL_PG_IO_POOLS];
+static uint8_t               pg_io_npools = 0;
+static pthread_spinlock_t    pg_io_spin;
+static pthread_once_t        pg_io_once = PTHREAD_ONCE_INIT;
+
+static void ftl_pg_io_spin_init (void)
+{
+    pthread_spin_init (&pg_io_spin, 0);
+}
+
+/* Called with pg_io_spin held, returns NULL if all pools are taken */
+static struct ftl_pg_io_pool *ftl_pg_io_pool_get (struct nvm_mmgr_geometry *g)
 {
+    struct ftl_pg_io_pool *pool;
+    uint8_t i;
+
+    for (i = 0; i < pg_io_npools; i++) {
+        pool = &pg_io_pools[i];
+        if (pool->n_pl == g->n_of_planes && pool->pg_sz == g->pg_size &&
+                pool->meta_sz == g->sec_oob_sz * g->sec_per_pg &&
+                pool->sec_per_pg == g->sec_per_pg &&
+                pool->sec_per_pl_pg == g->sec_per_pl_pg)
+            return pool;
+    }
+
+    if (pg_io_npools == FTL_PG_IO_POOLS)
+        return NULL;
+
+    pool = &pg_io_pools[pg_io_npools++];
+    pool->n_pl = g->n_of_planes;
+    pool->pg_sz = g->pg_size;
+    pool->meta_sz = g->sec_oob_sz * g->sec_per_pg;
+    pool->sec_per_pg = g->sec_per_pg;
+    pool->sec_per_pl_pg = g->sec_per_pl_pg;
+    pool->free = NULL;
+    pool->nfree = 0;
+
+    return pool;
+}
+
+static struct ftl_pg_io *ftl_pg_io_new (struct nvm_mmgr_geometry *g)
+{
+    struct ftl_pg_io *pio;
     struct nvm_io_data *data;
-    struct nvm_mmgr_geometry *g;
+    size_t vec_sz, sec_sz, oob_sz, buf_off;
+    uint8_t *off;
     uint16_t pl;
 
-    data = ox_malloc (sizeof (struct nvm_io_data), OX_MEM_FTL);
-    if (!data)
+    vec_sz = sizeof (uint8_t *) * (g->n_of_planes * 2 + g->sec_per_pl_pg);
+    sec_sz = sizeof (uint8_t *) * (g->sec_per_pg + 1) * g->n_of_planes;
+    oob_sz = (size_t) g->sec_oob_sz * g->sec_per_pg * g->n_of_planes;
+    buf_off = (sizeof (struct ftl_pg_io) + vec_sz + sec_sz + oob_sz + 63) &
+                                                                ~((size_t) 63);
+
+    pio = ox_malloc (buf_off + (size_t) (g->pg_size + g->sec_oob_sz *
+                            g->sec_per_pg) * g->n_of_planes, OX_MEM_FTL);
+    if (!pio)
         return NULL;
 
-    data->ch = ch;
-    g = data->ch->geometry;
+    data = &pio->data;
     data->n_pl = g->n_of_planes;
     data->pg_sz = g->pg_size;
     data->meta_sz = g->sec_oob_sz * g->sec_per_pg;
     data->buf_sz = (data->pg_sz + data->meta_sz) * data->n_pl;
 
-    data->buf = ox_calloc(data->buf_sz, 1, OX_MEM_FTL);
-    if (!data->buf)
-        goto FREE;
+    off = (uint8_t *) (pio + 1);
+    data->pl_vec = (uint8_t **) off;
+    off += sizeof (uint8_t *) * data->n_pl;
+    data->oob_vec = (uint8_t **) off;
+    off += sizeof (uint8_t *) * g->sec_per_pl_pg;
+    data->sec_vec = (uint8_t ***) off;
+    off += sizeof (uint8_t **) * data->n_pl;
+    for (pl = 0; pl < data->n_pl; pl++) {
+        data->sec_vec[pl] = (uint8_t **) off;
+        off += sizeof (uint8_t *) * (g->sec_per_pg + 1);
+    }
+    data->mod_oob = off;
+    data->buf = (uint8_t *) pio + buf_off;
 
-    data->pl_vec = ox_malloc (sizeof (uint8_t *) * data->n_pl, OX_MEM_FTL);
-    if (!data->pl_vec)
-        goto FREE_BUF;
+    return pio;
+}
 
-    data->oob_vec = ox_malloc (sizeof (uint8_t *) * g->sec_per_pl_pg, OX_MEM_FTL);
-    if (!data->oob_vec)
-        goto FREE_VEC;
+struct nvm_io_data *ftl_alloc_pg_io (struct nvm_channel *ch)
+{
+    struct ftl_pg_io_pool *pool;
+    struct ftl_pg_io *pio = NULL;
+    struct nvm_io_data *data;
 
-    data->sec_vec = ox_malloc (sizeof (void *) * data->n_pl, OX_MEM_FTL);
-    if (!data->sec_vec)
-        goto FREE_OOB;
+    pthread_once (&pg_io_once, ftl_pg_io_spin_init);
 
-    for (pl = 0; pl < data->n_pl; pl++) {
-        data->sec_vec[pl] = ox_malloc (sizeof (uint8_t *) * (g->sec_per_pg + 1),
-                                                                    OX_MEM_FTL);
-        if (!data->sec_vec[pl])
-            goto FREE_SEC;
+    pthread_spin_lock (&pg_io_spin);
+    pool = ftl_pg_io_pool_get (ch->geometry);
+    if (pool && pool->free) {
+        pio = pool->free;
+        pool->free = pio->next;
+        pool->nfree--;
     }
+    pthread_spin_unlock (&pg_io_spin);
 
-    data->mod_oob = ox_malloc (data->meta_sz * data->n_pl, OX_MEM_FTL);
-    if (!data->mod_oob)
-        goto FREE_SEC;
+    if (!pio) {
+        pio = ftl_pg_io_new (ch->geometry);
+        if (!pio)
+            return NULL;
+    }
+
+    pio->pool = pool;
+    pio->next = NULL;
+
+    data = &pio->data;
+    data->ch = ch;
+    memset (data->buf, 0x0, data->buf_sz);
 
     if (ch->mmgr->flags & MMGR_FLAG_PL_CMD)
         ftl_pl_pg_io_prepare (ch, data);
@@ -112,37 +208,53 @@ struct nvm_io_data *ftl_alloc_pg_io (struct nvm_channel *ch)
         ftl_pg_io_prepare (ch, data);
 
     return data;
-
-FREE_SEC:
-    while (pl) {
-        pl--;
-        ox_free (data->sec_vec[pl], OX_MEM_FTL);
-    }
-    ox_free (data->sec_vec, OX_MEM_FTL);
-FREE_OOB:
-    ox_free (data->oob_vec, OX_MEM_FTL);
-FREE_VEC:
-    ox_free (data->pl_vec, OX_MEM_FTL);
-FREE_BUF:
-    ox_free (data->buf, OX_MEM_FTL);
-FREE:
-    ox_free (data, OX_MEM_FTL);
-    return NULL;
 }
 
 void ftl_free_pg_io (struct nvm_io_data *data)
 {
-    uint32_t pl;
+    struct ftl_pg_io *pio = (struct ftl_pg_io *) data;
+    struct ftl_pg_io_pool *pool = pio->pool;
+
+    if (pool) {
+        pthread_spin_lock (&pg_io_spin);
+        if (pool->nfree < FTL_PG_IO_POOL_MAX) {
+            pio->next = pool->free;
+            pool->free = pio;
+            pool->nfree++;
+            pio = NULL;
+        }
+        pthread_spin_unlock (&pg_io_spin);
+    }
 
-    for (pl = 0; pl < data->n_pl; pl++)
-        ox_free (data->sec_vec[pl], OX_MEM_FTL);
+    if (pio)
+        ox_free (pio, OX_MEM_FTL);
+}
 
-    ox_free (data->sec_vec, OX_MEM_FTL);
-    ox_free (data->mod_oob, OX_MEM_FTL);
-    ox_free (data->oob_vec, OX_MEM_FTL);
-    ox_free (data->pl_vec, OX_MEM_FTL);
-    ox_free (data->buf, OX_MEM_FTL);
-    ox_free (data, OX_MEM_FTL);
+/* Free the idle helpers, called when an FTL is unregistered. The lists are
+ * detached under the lock and freed after it */
+void ftl_pg_io_drain (void)
+{
+    struct ftl_pg_io *pio, *list = NULL, *next;
+    uint8_t i;
+
+    pthread_once (&pg_io_once, ftl_pg_io_spin_init);
+
+    pthread_spin_lock (&pg_io_spin);
+    for (i = 0; i < pg_io_npools; i++) {
+        while (pg_io_pools[i].free) {
+            pio = pg_io_pools[i].free;
+            pg_io_pools[i].free = pio->next;
+            pio->next = list;
+            list = pio;
+        }
+        pg_io_pools[i].nfree = 0;
+    }
+    pthread_spin_unlock (&pg_io_spin);
+
+    for (pio = list; pio; pio = next) {
+        next = pio->next;
+        ox_free (pio, OX_MEM_FTL);
+    }
 }
 
 int ftl_blk_current_page (struct nvm_channel *ch, struct nvm_io_data *io,
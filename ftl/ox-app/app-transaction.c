@@ -101,7 +101,9 @@ RETRY:
         tr->entries[lba_i].abort = 0;
     }
 
-    tr->ts = tr->entries[count - 1].ts;
+    /* An empty transaction keeps the timestamp of its creation */
+    if (count)
+        tr->ts = tr->entries[count - 1].ts;
 
     /* Transaction ID is the timestamp of last entry */
     for (lba_i = 0; lba_i < count; lba_i++)
@@ -233,6 +235,46 @@ ERR:
     return NULL;
 }
 
+/* This function logs the deallocation of the LBAs in 'tr', created by 'new'
+ * as APP_TR_LBA_TRIM. The LBAs are unmapped when the transaction commits. */
+int app_transaction_trim (struct app_transaction_t *tr)
+{
+    uint32_t lba_i, log_count = 0, runs = 0;
+
+    for (lba_i = 0; lba_i < tr->count; lba_i++)
+        if (!lba_i || tr->entries[lba_i].lba != tr->entries[lba_i - 1].lba + 1)
+            runs++;
+
+    struct app_log_entry log[runs];
+
+    /* One log per contiguous range of LBAs */
+    for (lba_i = 0; lba_i < tr->count; lba_i++) {
+        if (log_count && tr->entries[lba_i].lba ==
+                        log[log_count - 1].trim.slba +
+                        log[log_count - 1].trim.nlb) {
+            log[log_count - 1].trim.nlb++;
+            continue;
+        }
+
+        memset (&log[log_count], 0x0, sizeof (struct app_log_entry));
+        log[log_count].ts = tr->entries[lba_i].ts;
+        log[log_count].type = APP_LOG_TRIM;
+        log[log_count].trim.tid = tr->entries[lba_i].tid;
+        log[log_count].trim.slba = tr->entries[lba_i].lba;
+        log[log_count].trim.nlb = 1;
+        log_count++;
+    }
+
+    if (oxapp()->log->append_fn (log, log_count))
+        return -1;
+
+    pthread_spin_lock (&tr->spin);
+    tr->allocated = tr->count;
+    pthread_spin_unlock (&tr->spin);
+
+    return 0;
+}
+
 void app_transaction_free_list (struct app_prov_ppas *prov)
 {
     if (!prov->nch) {
@@ -276,6 +318,7 @@ static void app_transaction_ordered_commit (void)
                     break;
 
                 case APP_TR_LBA_NS:
+                case APP_TR_LBA_TRIM:
                 default:
 
                     for (lba_i = 0; lba_i < tr->count; lba_i++)
@@ -319,8 +362,9 @@ static void app_transaction_ordered_commit (void)
                     goto ROLLBACK;
                 }
 
-            /* Invalidate sectors for GC (only user writes) */
-            if (tr->tr_type == APP_TR_LBA_NS)
+            /* Invalidate sectors for GC (only user writes and trims) */
+            if (tr->tr_type == APP_TR_LBA_NS ||
+                                            tr->tr_type == APP_TR_LBA_TRIM)
                 for (lba_i = 0; lba_i < tr->count; lba_i++)
                     if (old_ppas[lba_i].ppa)
                         oxapp()->md->invalidate_fn (ch[old_ppas[lba_i].g.ch],
@@ -335,7 +379,7 @@ static void app_transaction_ordered_commit (void)
     return;
 
 ROLLBACK:
-    if (tr->tr_type != APP_TR_LBA_NS)
+    if (tr->tr_type != APP_TR_LBA_NS && tr->tr_type != APP_TR_LBA_TRIM)
         return;
 
     while (lba_i) {
@@ -629,6 +673,8 @@ int app_transaction_init (void)
         TAILQ_INSERT_TAIL(&free_tr_head, &transactions[tr_i], entry);
     }
 
+    ox_mem_apply_budget (OX_MEM_APP_TRANS, OX_MEM_BUDGET_BLOCK);
+
     log_info ("[ox-app: Transaction Framework started.\n");
 
     return 0;
@@ -857,6 +857,9 @@ static int ch_prov_get_ppas (struct app_channel *lch, struct nvm_ppa_addr *list,
     }
 
     pthread_mutex_unlock(&prov->ch_mutex);
+
+    ox_stats_add_event (OX_PROV_EVENT_LINE + type,
+                                    pgs * g->n_of_planes * g->sec_per_pg);
     return 0;
 
 FULL:
@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <syslog.h>
 #include <stdlib.h>
 #include <string.h>
@@ -154,13 +158,30 @@ RETRY:
 
 static void delta_exit()
 {
-    return;
+    struct delta_cmd *cmd;
+
+    /* The queue threads must stop before the memory type goes away */
+    if (delta_mq) {
+        ox_mq_destroy (delta_mq);
+        delta_mq = NULL;
+    }
+
+    while (!STAILQ_EMPTY (&fdeltahead)) {
+        cmd = STAILQ_FIRST (&fdeltahead);
+        STAILQ_REMOVE_HEAD (&fdeltahead, fentry);
+        pthread_spin_destroy (&cmd->spin);
+        ox_free (cmd, OX_MEM_OXBLK_DELTA);
+    }
+    pthread_spin_destroy (&cmd_spin);
 }
 
 static int delta_init()
 {
     struct delta_cmd *cmd;
     uint8_t cmd_i;
+#if OX_TH_AFFINITY
+    cpu_set_t sq_cpus, cq_cpus;
+#endif
 
     if (!ox_mem_create_type ("OXBLK_DELTA", OX_MEM_OXBLK_DELTA))
         return -1;
@@ -186,14 +207,16 @@ static int delta_init()
     }
 
     /* Set thread affinity, if enabled */
-    delta_mq_config.sq_affinity[0] = 0;
-    delta_mq_config.cq_affinity[0] = 0;
-
 #if OX_TH_AFFINITY
-    delta_mq_config.sq_affinity[0] |= ((uint64_t) 1 << 0);
-	delta_mq_config.sq_affinity[0] |= ((uint64_t) 1 << 6);
+    CPU_ZERO(&sq_cpus);
+    CPU_SET(0, &sq_cpus);
+    CPU_SET(6, &sq_cpus);
+
+    CPU_ZERO(&cq_cpus);
+    CPU_SET(0, &cq_cpus);
 
-    delta_mq_config.cq_affinity[0] |= ((uint64_t) 1 << 0);
+    delta_mq_config.sq_affinity = &sq_cpus;
+    delta_mq_config.cq_affinity = &cq_cpus;
 #endif /* OX_TH_AFFINITY */
 
     delta_mq = ox_mq_init(&delta_mq_config);
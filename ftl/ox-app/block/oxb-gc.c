@@ -721,6 +721,9 @@ static void *block_gc_run_ch (void *arg)
     struct app_channel       *lch = th_arg->lch;
     struct app_blk_md_entry **list;
 
+    /* Moved pages yield to user I/O in the media manager queues */
+    ox_set_io_class (OX_IO_CLASS_GC);
+
     while (!stop) {
 
         pthread_mutex_lock(&gc_cond_mutex[th_arg->tid]);
@@ -741,6 +744,7 @@ static void *block_gc_run_ch (void *arg)
                     usleep (BLOCK_GC_DELAY_US);
                     break;
                 }
+                OX_PROBE2 (gc_victims, lch->app_ch_id, victims);
 
                 recycled = block_gc_recycle_blks (lch, list, victims,
                                                       th_arg->bufid, &blk_sec);
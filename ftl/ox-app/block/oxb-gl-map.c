@@ -51,6 +51,7 @@ struct map_cache_entry {
 
 struct map_cache {
     struct map_cache_entry                 *pg_buf;
+    struct ox_mem_arena                    *arena; /* page buffers */
     LIST_HEAD(mb_free_l, map_cache_entry)   mbf_head;
     TAILQ_HEAD(mb_used_l, map_cache_entry)  mbu_head;
     pthread_spinlock_t                      mb_spin;
@@ -278,6 +279,8 @@ static int map_evict_pg_cache (struct map_cache *cache, uint8_t is_checkpoint)
     cache->nused--;
     pthread_spin_unlock (&cache->mb_spin);
 
+    OX_PROBE2 (map_evict, cache->id, cache_ent->dirty);
+
     if (map_evict_process (cache, cache_ent, is_checkpoint))
         return -1;
 
@@ -380,9 +383,14 @@ static int map_init_ch_cache (struct map_cache *cache)
     if (!cache->pg_buf)
         return -1;
 
-    if (pthread_spin_init(&cache->mb_spin, 0))
+    cache->arena = ox_mem_arena_create ((size_t) MAP_BUF_PG_SZ * MAP_BUF_CH_PGS,
+                                                            OX_MEM_OXBLK_GMAP);
+    if (!cache->arena)
         goto FREE_BUF;
 
+    if (pthread_spin_init(&cache->mb_spin, 0))
+        goto FREE_ARENA;
+
     cache->mbf_head.lh_first = NULL;
     LIST_INIT(&cache->mbf_head);
     TAILQ_INIT(&cache->mbu_head);
@@ -396,7 +404,8 @@ static int map_init_ch_cache (struct map_cache *cache)
         cache->pg_buf[pg_i].md_entry = NULL;
         cache->pg_buf[pg_i].cache = cache;
 
-        cache->pg_buf[pg_i].buf = ox_malloc (MAP_BUF_PG_SZ, OX_MEM_OXBLK_GMAP);
+        cache->pg_buf[pg_i].buf = ox_mem_arena_alloc (cache->arena,
+                                                                MAP_BUF_PG_SZ);
         if (!cache->pg_buf[pg_i].buf)
             goto FREE_PGS;
 
@@ -411,9 +420,10 @@ FREE_PGS:
         pg_i--;
         LIST_REMOVE(&cache->pg_buf[pg_i], f_entry);
         cache->nfree--;
-        ox_free (cache->pg_buf[pg_i].buf, OX_MEM_OXBLK_GMAP);
     }
     pthread_spin_destroy (&cache->mb_spin);
+FREE_ARENA:
+    ox_mem_arena_destroy (cache->arena);
 FREE_BUF:
     ox_free (cache->pg_buf, OX_MEM_OXBLK_GMAP);
     return -1;
@@ -518,11 +528,11 @@ static void map_exit_ch_cache (struct map_cache *cache)
         if (ent != NULL) {
             LIST_REMOVE(ent, f_entry);
             cache->nfree--;
-            ox_free (ent->buf, OX_MEM_OXBLK_GMAP);
         }
     }
 
     pthread_spin_destroy (&cache->mb_spin);
+    ox_mem_arena_destroy (cache->arena);
     ox_free (cache->pg_buf, OX_MEM_OXBLK_GMAP);
 }
 
@@ -630,6 +640,7 @@ static struct map_cache_entry *map_get_cache_entry (uint64_t lba)
     pthread_mutex_lock (&ch[ch_map]->map_md->entry_mutex[pg_off]);
     if (!addr->g.flag) {
 
+        OX_PROBE1 (map_miss, lba);
         first_pg_lba = (lba / map_ent_per_pg) * map_ent_per_pg;
 
         if (map_load_pg_cache (&map_ch_cache[ch_map], md_ent, first_pg_lba,
@@ -641,6 +652,7 @@ static struct map_cache_entry *map_get_cache_entry (uint64_t lba)
 
     } else {
 
+        OX_PROBE1 (map_hit, lba);
         cache_ent = (struct map_cache_entry *) ((uint64_t) addr->g.addr);
 
         /* Keep cache entry as hot, in the tail of the queue */
@@ -19,6 +19,10 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <syslog.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,12 +39,16 @@
 #define LBA_IO_WRITE_Q      0
 #define LBA_IO_READ_Q       1
 #define LBA_IO_QUEUE_TO     4000000
+#define LBA_IO_QUEUE_POLL   20
 #define LBA_IO_RETRY        40000
 #define LBA_IO_RETRY_DELAY  100
 
 #define LBA_IO_RETRY_S         100
 #define LBA_IO_RETRY_DELAY_S   1000
 
+/* Deallocated LBAs per trim transaction */
+#define LBA_IO_TRIM_LBAS       1024
+
 struct lba_io_sec {
     uint32_t                    lba_id;
     uint64_t                    transaction_id;
@@ -102,7 +110,10 @@ extern pthread_mutex_t      user_w_mutex;
 
 static void lba_io_reset_cmd (struct lba_io_cmd *lcmd)
 {
+    struct nvm_io_vec *vec = lcmd->cmd.vec;
+
     memset (&lcmd->cmd, 0x0, sizeof (struct nvm_io_cmd));
+    ox_io_vec_attach (&lcmd->cmd, vec, LBA_IO_PPA_SIZE);
     memset (lcmd->vec, 0x0, sizeof (struct lba_io_sec *) * 64);
     lcmd->prov = NULL;
     memset (lcmd->oob_lba, 0x0, LBA_IO_PPA_SIZE *
@@ -137,8 +148,9 @@ static int lba_io_cmd_amend (struct nvm_io_cmd *cmd)
 
 static void __lba_io_callback (struct nvm_io_cmd *cmd)
 {
-    uint16_t i;
+    uint16_t i, n_ent = 0;
     struct lba_io_cmd *lcmd;
+    struct ox_mq_entry *mentry[LBA_IO_PPA_SIZE];
     struct lba_io_sec **lba;
     struct lba_io_sec *last_lba = NULL;
     struct nvm_io_cmd *nvme_cmd = NULL;
@@ -188,9 +200,13 @@ COMPLETE_LBA:
             }
 
         }
-        ox_mq_complete_req (lba_io_mq, lba[i]->mentry);
+        mentry[n_ent++] = lba[i]->mentry;
     }
 
+    /* Complete the whole line in a single step */
+    if (n_ent)
+        ox_mq_complete_batch (lba_io_mq, mentry, n_ent);
+
 COMPLETE_CMD:
     pthread_spin_lock (&lcmd->spin);
     if (cmd->cmdtype == MMGR_WRITE_PG && !last_lba) {
@@ -219,6 +235,7 @@ static int __lba_io_submit (struct nvm_io_cmd *cmd)
     uint32_t sec_i = 0, qtype, ret = 0;
     struct lba_io_sec *lba[256];
     uint32_t retry = LBA_IO_RETRY;
+    int submitted;
 
     qtype = (cmd->cmdtype == MMGR_WRITE_PG) ? LBA_IO_WRITE_Q : LBA_IO_READ_Q;
 
@@ -272,10 +289,12 @@ RETRY:
         }
     }
 
-    for (sec_i = 0; sec_i < cmd->n_sec; sec_i++) {
-        if (ox_mq_submit_req(lba_io_mq, qtype, lba[sec_i]))
-            /* MQ_TO and callback take care of aborting submitted lbas */
-            goto REQUEUE_UNPROCESSED;
+    submitted = ox_mq_submit_batch (lba_io_mq, qtype, (void **) lba,
+                                                                cmd->n_sec);
+    if (submitted < cmd->n_sec) {
+        /* MQ_TO and callback take care of aborting submitted lbas */
+        sec_i = (submitted > 0) ? submitted : 0;
+        goto REQUEUE_UNPROCESSED;
     }
 
     return 0;
@@ -331,12 +350,140 @@ REQUEUE:
     return -1;
 }
 
+static void lba_io_commit_callback (void *opaque)
+{
+    struct nvm_callback *cb = (struct nvm_callback *) opaque;
+    ox_ftl_callback ((struct nvm_io_cmd *) cb->opaque);
+}
+
+/*
+ * A flush is an empty transaction. Transactions commit in creation order, so
+ * its commit runs after every write submitted before it has been committed,
+ * including sectors still waiting in an open line. Writes complete only after
+ * their commit log is durable, and the log queue skips flushes whose
+ * timestamp is already on media, so concurrent flushes share one log write.
+ */
+static int lba_io_flush (struct nvm_io_cmd *cmd)
+{
+    struct app_transaction_t *tr;
+
+    tr = app_transaction_new (NULL, 0, APP_TR_LBA_NS);
+    if (!tr)
+        goto ERR;
+
+    cmd->opaque = (void *) tr;
+    cmd->status.status = NVM_IO_SUCCESS;
+    cmd->callback.cb_fn = lba_io_commit_callback;
+    cmd->callback.opaque = (void *) cmd;
+    cmd->callback.ts = tr->ts;
+
+    if (app_transaction_commit (tr, &cmd->callback, APP_T_FLUSH_YES)) {
+        app_transaction_abort (tr);
+        goto ERR;
+    }
+
+    return 0;
+
+ERR:
+    cmd->status.status = NVM_IO_FAIL;
+    cmd->status.nvme_status = NVME_INTERNAL_DEV_ERROR;
+    return -1;
+}
+
+static int lba_io_trim_commit (struct nvm_io_cmd *cmd, uint64_t *lbas,
+                                                    uint32_t n, uint8_t last)
+{
+    struct app_transaction_t *tr;
+
+    tr = app_transaction_new (lbas, n, APP_TR_LBA_TRIM);
+    if (!tr)
+        return -1;
+
+    if (app_transaction_trim (tr))
+        goto ABORT;
+
+    if (!last) {
+        if (app_transaction_commit (tr, NULL, APP_T_FLUSH_NO))
+            goto ABORT;
+        return 0;
+    }
+
+    cmd->opaque = (void *) tr;
+    cmd->callback.cb_fn = lba_io_commit_callback;
+    cmd->callback.opaque = (void *) cmd;
+    cmd->callback.ts = tr->ts;
+
+    if (app_transaction_commit (tr, &cmd->callback, APP_T_FLUSH_YES))
+        goto ABORT;
+
+    return 0;
+
+ABORT:
+    app_transaction_abort (tr);
+    return -1;
+}
+
+/*
+ * Ranges are deallocated in transactions of up to LBA_IO_TRIM_LBAS. Commits
+ * are ordered, so only the last transaction flushes the log and completes the
+ * command. LBAs are unmapped and their sectors invalidated at commit.
+ */
+static int lba_io_trim (struct nvm_io_cmd *cmd)
+{
+    uint64_t lbas[LBA_IO_TRIM_LBAS];
+    uint64_t lba, left = 0;
+    uint32_t range_i, n = 0;
+
+    for (range_i = 0; range_i < cmd->n_sec; range_i++)
+        left += cmd->md_prp[range_i];
+
+    cmd->status.status = NVM_IO_SUCCESS;
+
+    if (!left) {
+        ox_ftl_callback (cmd);
+        return 0;
+    }
+
+    for (range_i = 0; range_i < cmd->n_sec; range_i++) {
+        for (lba = cmd->prp[range_i];
+                    lba < cmd->prp[range_i] + cmd->md_prp[range_i]; lba++) {
+            lbas[n++] = lba;
+            left--;
+
+            if (n < LBA_IO_TRIM_LBAS && left)
+                continue;
+
+            if (lba_io_trim_commit (cmd, lbas, n, !left))
+                goto ERR;
+
+            /* The command may be completed, do not touch it anymore */
+            if (!left)
+                return 0;
+
+            n = 0;
+        }
+    }
+
+    return 0;
+
+ERR:
+    cmd->status.status = NVM_IO_FAIL;
+    cmd->status.nvme_status = NVME_INTERNAL_DEV_ERROR;
+    return -1;
+}
+
 static int lba_io_submit (struct nvm_io_cmd *cmd)
 {
     int ret;
     uint32_t lba_i;
     uint64_t lbas[cmd->n_sec];
 
+    if (cmd->cmdtype == MMGR_FLUSH)
+        return lba_io_flush (cmd);
+
+    if (cmd->cmdtype == MMGR_TRIM)
+        return lba_io_trim (cmd);
+
     if (cmd->cmdtype == MMGR_READ_PG)
         goto READ;
 
@@ -391,6 +538,7 @@ static void lba_io_prepare_cmd (struct lba_io_cmd *lcmd, uint8_t type)
     cmd->sec_sz = NVME_KERNEL_PG_SIZE;
     cmd->md_sz = 0;
     cmd->cmdtype = (!type) ? MMGR_WRITE_PG : MMGR_READ_PG;
+    cmd->io_class = (!type) ? OX_IO_CLASS_WRITE : OX_IO_CLASS_USER;
     cmd->req = (void *) lcmd;
 
     cmd->status.pg_errors = 0;
@@ -411,7 +559,7 @@ static void lba_io_prepare_cmd (struct lba_io_cmd *lcmd, uint8_t type)
     for (i = 0; i <= cmd->n_sec; i++) {
 
         /* no write-caching is enabled */
-        cmd->mmgr_io[pg].force_sync_data[i] = 0;
+        cmd->mmgr_io[pg].force_sync_data[nsec] = 0;
 
         if ((i == cmd->n_sec) ||
             (i && (cmd->ppalist[i].ppa == cmd->ppalist[i - 1].ppa)) ||
@@ -654,6 +802,7 @@ static void lba_io_complete_failed_lbas (uint8_t type)
 {
     uint16_t i;
     struct lba_io_sec *lba;
+    struct ox_mq_entry *mentry[LBA_IO_PPA_SIZE];
 
     for (i = 0; i < rw_off[type]; i++) {
         lba = rw_line[type][i];
@@ -661,11 +810,15 @@ static void lba_io_complete_failed_lbas (uint8_t type)
         lba->nvme->status.status = NVM_IO_FAIL;
         lba->nvme->status.nvme_status = NVME_DATA_TRAS_ERROR;
         pthread_mutex_unlock (&lba->nvme->mutex);
-        ox_mq_complete_req (lba_io_mq, lba->mentry);
+        mentry[i] = lba->mentry;
     }
+
+    if (rw_off[type])
+        ox_mq_complete_batch (lba_io_mq, mentry, rw_off[type]);
 }
 
-static void lba_io_sec_sq (struct ox_mq_entry *req)
+/* If 'last' is 0, more entries of the same batch follow this one */
+static void lba_io_sec_line (struct ox_mq_entry *req, uint8_t last)
 {
     int ret, retry = 0;
     struct lba_io_sec *lba = (struct lba_io_sec *) req->opaque;
@@ -675,7 +828,7 @@ static void lba_io_sec_sq (struct ox_mq_entry *req)
     rw_line[lba->type][rw_off[lba->type]] = lba;
     rw_off[lba->type]++;
 
-    ret = ox_mq_used_count (lba_io_mq, lba->type);
+    ret = (last) ? ox_mq_used_count (lba_io_mq, lba->type) : 1;
 
     if (ret < 0) {
 
@@ -693,6 +846,9 @@ static void lba_io_sec_sq (struct ox_mq_entry *req)
 
 RETRY:
     if ((rw_off[lba->type] == LBA_IO_PPA_SIZE) || !ret) {
+        if (!retry)
+            OX_PROBE2 (lba_line_close, lba->type, rw_off[lba->type]);
+
         if (lba_io_rw (lba->type)) {
             usleep (LBA_IO_RETRY_DELAY_S);
 
@@ -717,6 +873,19 @@ RESET_LINE:
                                                             * LBA_IO_PPA_SIZE);
 }
 
+static void lba_io_sec_sq (struct ox_mq_entry *req)
+{
+    lba_io_sec_line (req, 1);
+}
+
+static void lba_io_sec_sq_batch (struct ox_mq_entry **req, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        lba_io_sec_line (req[i], i == n - 1);
+}
+
 static void lba_io_free_ppas (struct nvm_io_cmd *cmd)
 {
     uint32_t sec;
@@ -733,12 +902,6 @@ static void lba_io_free_ppas (struct nvm_io_cmd *cmd)
     }
 }
 
-static void lba_io_commit_callback (void *opaque)
-{
-    struct nvm_callback *cb = (struct nvm_callback *) opaque;
-    ox_ftl_callback ((struct nvm_io_cmd *) cb->opaque);
-}
-
 static void lba_io_sec_callback (void *opaque)
 {
     struct lba_io_sec *lba = (struct lba_io_sec *) opaque;
@@ -761,10 +924,13 @@ static void lba_io_sec_callback (void *opaque)
         pthread_mutex_unlock (&nvme_cmd->mutex);
 
         if (lba->type == LBA_IO_WRITE_Q) {
+            ox_lat_mark (nvme_cmd, OX_LAT_T_MEDIA);
             lba_io_free_ppas (nvme_cmd);
 
             if (nvme_cmd->status.status == NVM_IO_SUCCESS) {
 
+                ox_stats_add_event (OX_HOST_EVENT_WRITE, nvme_cmd->n_sec);
+
                 tr = (struct app_transaction_t *) nvme_cmd->opaque;
                 nvme_cmd->callback.cb_fn = lba_io_commit_callback;
                 nvme_cmd->callback.opaque = (void *) nvme_cmd;
@@ -834,7 +1000,9 @@ struct ox_mq_config lba_io_mq_config = {
     .to_fn      = lba_io_mq_to,
     .output_fn  = lba_io_stats_fill_row,
     .to_usec    = LBA_IO_QUEUE_TO,
-    .flags      = OX_MQ_CPU_AFFINITY
+    .flags      = (OX_MQ_CPU_AFFINITY | OX_MQ_POLL | OX_MQ_SQ_BATCH),
+    .poll_usec  = LBA_IO_QUEUE_POLL,
+    .sq_batch_fn = lba_io_sec_sq_batch
 };
 
 static void lba_io_free_cmd (void)
@@ -846,6 +1014,7 @@ static void lba_io_free_cmd (void)
         cmd = STAILQ_FIRST(&fcmdhead);
         STAILQ_REMOVE_HEAD (&fcmdhead, fentry);
         pthread_spin_destroy (&cmd->spin);
+        ox_io_vec_put (&cmd->cmd);
         ox_free (cmd->oob_lba, OX_MEM_OXBLK_LBA);
         ox_free (cmd, OX_MEM_OXBLK_LBA);
     }
@@ -858,7 +1027,11 @@ static void lba_io_free_cmd (void)
 
 static int lba_io_init (void)
 {
-    uint32_t cmd_i, lba_i, ch_i, ret, qid;
+    uint32_t cmd_i, lba_i, ch_i, ret;
+#if OX_TH_AFFINITY
+    cpu_set_t sq_cpus[2], cq_cpus[2];
+    uint32_t qid;
+#endif
     struct lba_io_cmd *cmd;
     struct lba_io_sec *sec;
 
@@ -909,6 +1082,13 @@ static int lba_io_init (void)
             goto FREE_CMD;
         }
 
+        if (ox_io_vec_get (&cmd->cmd, LBA_IO_PPA_SIZE)) {
+            pthread_spin_destroy (&cmd->spin);
+            ox_free (cmd->oob_lba, OX_MEM_OXBLK_LBA);
+            ox_free (cmd, OX_MEM_OXBLK_LBA);
+            goto FREE_CMD;
+        }
+
         STAILQ_INSERT_TAIL(&fcmdhead, cmd, fentry);
 
         for (lba_i = 0; lba_i < LBA_IO_PPA_SIZE; lba_i++) {
@@ -921,22 +1101,25 @@ static int lba_io_init (void)
     }
 
     /* Set thread affinity, if enabled */
-    for (qid = 0; qid < lba_io_mq_config.n_queues; qid++) {
-        lba_io_mq_config.sq_affinity[qid] = 0;
-        lba_io_mq_config.cq_affinity[qid] = 0;
-
 #if OX_TH_AFFINITY
-        lba_io_mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 0);
-	lba_io_mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 6);
+    for (qid = 0; qid < lba_io_mq_config.n_queues; qid++) {
+        CPU_ZERO(&sq_cpus[qid]);
+        CPU_SET(0, &sq_cpus[qid]);
+        CPU_SET(6, &sq_cpus[qid]);
 
-        lba_io_mq_config.cq_affinity[qid] |= ((uint64_t) 1 << 0);
-#endif /* OX_TH_AFFINITY */
+        CPU_ZERO(&cq_cpus[qid]);
+        CPU_SET(0, &cq_cpus[qid]);
     }
+    lba_io_mq_config.sq_affinity = sq_cpus;
+    lba_io_mq_config.cq_affinity = cq_cpus;
+#endif /* OX_TH_AFFINITY */
 
     lba_io_mq = ox_mq_init(&lba_io_mq_config);
     if (!lba_io_mq)
         goto FREE_CMD;
 
+    ox_mem_apply_budget (OX_MEM_OXBLK_LBA, OX_MEM_BUDGET_BLOCK);
+
     log_info("    [appnvm: LBA I/O started.]\n");
 
     return 0;
@@ -19,6 +19,10 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <pthread.h>
 #include <errno.h>
 #include <stdio.h>
@@ -451,6 +455,8 @@ static int appftl_log_flush_buffer (uint16_t size,
     struct app_log_flushed_pg *flushed_pg;
     struct nvm_mmgr_geometry *g = oxapp()->channels.get_fn (0)->ch->geometry;
 
+    OX_PROBE2 (log_flush, size, synch);
+
     pad = (pad_u) ? pad_u : &pad_f;
     if (!pad_u)
         memset (pad, 0x0, sizeof (struct app_transaction_pad));
@@ -580,11 +586,19 @@ ERR:
 static int appftl_log_flush (uint16_t size, struct app_transaction_pad *pad_u,
                                                         struct nvm_callback *cb)
 {
+    uint8_t io_class;
+    int ret;
+
     /* If callback is not NULL, the call is asynchronous */
     if (cb)
         return ox_mq_submit_req(log_ctrl.log_mq, 0, (void *) cb);
 
-    return appftl_log_flush_buffer (size, pad_u, APP_LOG_SYNCH);
+    io_class = ox_get_io_class ();
+    ox_set_io_class (OX_IO_CLASS_META);
+    ret = appftl_log_flush_buffer (size, pad_u, APP_LOG_SYNCH);
+    ox_set_io_class (io_class);
+
+    return ret;
 }
 
 static void appftl_log_sq (struct ox_mq_entry *req)
@@ -595,6 +609,9 @@ static void appftl_log_sq (struct ox_mq_entry *req)
     if (cb->ts <= lc->cur_ts)
         goto COMPLETE;
 
+    /* Runs in the log queue thread, only used for flushes */
+    ox_set_io_class (OX_IO_CLASS_META);
+
     pthread_mutex_lock (&lc->flush_mutex);
 
     if (cb->ts <= lc->cur_ts) {
@@ -691,9 +708,12 @@ struct ox_mq_config log_mq_config = {
 
 static int appftl_log_init (void)
 {
-    int eid, qid;
+    int eid;
     struct app_log_buf_entry *le;
     struct app_log_ctrl *lc = &log_ctrl;
+#if OX_TH_AFFINITY
+    cpu_set_t log_cpus;
+#endif
 
     if (!ox_mem_create_type ("OXBLK_LOG", OX_MEM_OXBLK_LOG))
         return -1;
@@ -723,21 +743,13 @@ static int appftl_log_init (void)
         goto FLUSH_MUTEX;
 
     /* Set thread affinity, if enabled */
-    for (qid = 0; qid < log_mq_config.n_queues; qid++) {
-        log_mq_config.sq_affinity[qid] = 0;
-	log_mq_config.cq_affinity[qid] = 0;
-
 #if OX_TH_AFFINITY
-        /* Set threads to CPUs 5 */
-        for (qid = 0; qid < log_mq_config.n_queues; qid++) {
-            log_mq_config.sq_affinity[qid] = 0;
-            log_mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 5);
-
-            log_mq_config.cq_affinity[qid] = 0;
-            log_mq_config.cq_affinity[qid] |= ((uint64_t) 1 << 5);
-        }
+    /* Set threads to CPUs 5 */
+    CPU_ZERO(&log_cpus);
+    CPU_SET(5, &log_cpus);
+    log_mq_config.sq_affinity = &log_cpus;
+    log_mq_config.cq_affinity = &log_cpus;
 #endif /* OX_TH_AFFINITY */
-    }
 
     lc->log_mq = ox_mq_init (&log_mq_config);
     if (!lc->log_mq)
@@ -759,6 +771,8 @@ static int appftl_log_init (void)
 
     lc->running = 1;
 
+    ox_mem_apply_budget (OX_MEM_OXBLK_LOG, OX_MEM_BUDGET_BLOCK);
+
     log_info("    [ox-blk: Log Management started.]\n");
 
     return 0;
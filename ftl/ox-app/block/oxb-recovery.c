@@ -228,6 +228,25 @@ static int oxb_recovery_should_drop (struct app_log_entry *log, uint32_t i)
     return drop;
 }
 
+/* Unmaps a deallocated range, invalidating the sectors it pointed to */
+static void oxb_recovery_apply_trim (struct app_channel **lch,
+                                                    struct app_log_entry *log)
+{
+    struct nvm_ppa_addr old;
+    uint64_t lba;
+
+    for (lba = log->trim.slba; lba < log->trim.slba + log->trim.nlb; lba++) {
+        if (oxapp()->gl_map->upsert_fn (lba, 0x0, &old.ppa, 0x0)) {
+            log_err ("[recovery: Upsert LOG_TRIM failed. LBA %lu]", lba);
+            continue;
+        }
+
+        if (old.ppa)
+            oxapp()->md->invalidate_fn (lch[old.g.ch], &old,
+                                                            APP_INVALID_SECTOR);
+    }
+}
+
 static void oxb_recovery_btree_commit (struct app_channel **lch,
                                                     struct app_log_entry *log)
 {
@@ -291,6 +310,10 @@ static void oxb_recovery_btree_commit (struct app_channel **lch,
                                                             APP_INVALID_SECTOR);
             }
 
+        } else if (rec_log->log.type == APP_LOG_TRIM) {
+
+            oxb_recovery_apply_trim (lch, &rec_log->log);
+
         } else if (rec_log->log.type == APP_LOG_GC_MAP) {
 
             /* Do not apply aborted logs caused by race conditions */
@@ -350,6 +373,13 @@ static int oxb_recovery_log_switch (struct app_channel **lch,
                                    "%lu, log %d]", entry->write.tid, index);
             break;
 
+        case APP_LOG_TRIM:
+
+            if (oxb_recovery_btree_add_log (entry))
+                log_err ("[recovery: Log was NOT added to tree. Tr "
+                                   "%lu, log %d]", entry->trim.tid, index);
+            break;
+
         case APP_LOG_MAP:
 
             oxb_recovery_apply_write (lch, entry, APP_INVALID_PAGE, 1);
@@ -547,7 +577,8 @@ static int oxb_recovery_log_replay (void)
     struct nvm_io_data *io[app_nch];
     struct app_channel *lch[app_nch];
     uint32_t ch_i, nch;
-    int ret = -1;
+    uint8_t io_class;
+    int ret = -1, read;
 
     log_head = oxapp()->recovery->get_fn (APP_CP_LOG_HEAD);
     if (!log_head)
@@ -563,8 +594,15 @@ static int oxb_recovery_log_replay (void)
             goto FREE_IO;
     }
 
+    /* The log chain is read in the background I/O class */
+    io_class = ox_get_io_class ();
+    ox_set_io_class (OX_IO_CLASS_GC);
+
     tot_logs = 0;
-    if (oxb_recovery_log_read (log_head, io, lch))
+    read = oxb_recovery_log_read (log_head, io, lch);
+
+    ox_set_io_class (io_class);
+    if (read)
         goto FREE_IO;
 
     /* Destroy RB Tree */
@@ -694,6 +732,8 @@ static int oxb_recovery_recover (void)
     struct nvm_ppa_addr ppa;
     struct nvm_mmgr *mmgr = ox_get_mmgr_instance ();
     uint16_t ent_per_pg, md_pgs, rsvd_blk;
+    uint8_t io_class;
+    int read;
 
     /* TODO: use round-robin in all channels for checkpoint */
     ch = &mmgr->ch_info[0];
@@ -732,8 +772,12 @@ static int oxb_recovery_recover (void)
         ppa.g.pg = pg - md_pgs;
         ppa.g.blk = rsvd_blk;
 
-        if (oxb_recovery_read_cp (io, &ppa, oob.checkpoint_sz,
-                                                           md_pgs, ent_per_pg))
+        io_class = ox_get_io_class ();
+        ox_set_io_class (OX_IO_CLASS_GC);
+        read = oxb_recovery_read_cp (io, &ppa, oob.checkpoint_sz,
+                                                           md_pgs, ent_per_pg);
+        ox_set_io_class (io_class);
+        if (read)
             goto ERR;
 
         if (APP_DEBUG_RECOVERY)
@@ -873,6 +917,7 @@ static int oxb_recovery_checkpoint (void)
     int nch = app_nch;
 
     pthread_mutex_lock (&cp_mutex);
+    OX_PROBE0 (cp_begin);
 
     GET_NANOSECONDS (ns, ts);
     oxapp()->channels.get_list_fn (lch, nch);
@@ -942,6 +987,7 @@ static int oxb_recovery_checkpoint (void)
     /* TODO: use round-robin in all channels for checkpoint */
     if (oxb_recovery_flush_cp (lch[0])) {
         log_err(" [recovery: Checkpoint NOT flushed.]");
+        OX_PROBE1 (cp_end, -1);
         return -1;
     }
 
@@ -952,6 +998,7 @@ static int oxb_recovery_checkpoint (void)
         oxapp()->ch_prov->put_blk_fn (lch[i], 0xffff, 0xffff);
 
     pthread_mutex_unlock (&cp_mutex);
+    OX_PROBE1 (cp_end, 0);
 
     first_cp = 1;
 
@@ -967,6 +1014,9 @@ static void *oxb_recovery_cp_thread (void *arg)
     cp_int = (mmgr->flags & MMGR_FLAG_MIN_CP_TIME) ?
                                         APP_CP_MIN_INTERVAL : APP_CP_INTERVAL;
 
+    /* Checkpoint writes share the metadata class with the log flushes */
+    ox_set_io_class (OX_IO_CLASS_META);
+
     while (oxapp()->recovery->running) {
         usleep (1000);
         if (!oxapp()->recovery->running)
@@ -133,13 +133,15 @@ enum app_log_type {
     APP_LOG_BLK_MD   = 0x8,
     APP_LOG_MAP_MD   = 0x9,
     APP_LOG_ABORT_W  = 0xa,     /* Aborted write, used in log management */
-    APP_LOG_PUT_BLK  = 0xb
+    APP_LOG_PUT_BLK  = 0xb,
+    APP_LOG_TRIM     = 0xc      /* Deallocated LBA range */
 };
 
 enum app_transaction_type {
     APP_TR_LBA_NS   = 0x0,  /* Namespace LBA I/O write */
     APP_TR_GC_NS    = 0x1,  /* Namespace GC write */
-    APP_TR_GC_MAP   = 0x2   /* Mapping GC write */
+    APP_TR_GC_MAP   = 0x2,  /* Mapping GC write */
+    APP_TR_LBA_TRIM = 0x3   /* Namespace LBA deallocation */
 };
 
 enum app_checkpoint_type {
@@ -157,7 +159,9 @@ enum ox_stats_event_code {
     OX_GC_EVENT_RACE_BIG    = 0x3,
     OX_GC_EVENT_RACE_SMALL  = 0x4,
     OX_GC_EVENT_SPACE_REC   = 0x5,
-    OX_CP_EVENT_FLUSH       = 0x6
+    OX_CP_EVENT_FLUSH       = 0x6,
+    OX_HOST_EVENT_WRITE     = 0x7,  /* Host sectors persisted */
+    OX_PROV_EVENT_LINE      = 0x8   /* Sectors provisioned, + APP_LINE_* */
 };
 #define APP_T_FLUSH_NO      0
 #define APP_T_FLUSH_YES     1
@@ -360,6 +364,13 @@ struct app_log_entry {
             uint64_t prev[3];
             uint64_t next[3];
         } __attribute__((packed)) pointer;
+
+        struct {
+            uint64_t tid;       /* Transaction ID, same offset as in 'write' */
+            uint64_t slba;
+            uint64_t nlb;
+            uint8_t  rsv[24];
+        } __attribute__((packed)) trim;
     };
 } __attribute__((packed));
 
@@ -798,6 +809,7 @@ void        app_transaction_abort (struct app_transaction_t *tr);
 void        app_transaction_abort_by_ts (uint64_t tid, uint64_t ts);
 int         app_transaction_close_blk (struct nvm_ppa_addr *ppa, uint8_t type);
 void        app_transaction_free_list (struct app_prov_ppas *prov);
+int         app_transaction_trim (struct app_transaction_t *tr);
 struct app_transaction_t    *app_transaction_new (uint64_t *lbas,uint32_t count,
                             uint8_t tr_type);
 struct app_prov_ppas        *app_transaction_amend (
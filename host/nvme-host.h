@@ -123,5 +123,31 @@ int nvmeh_write_delta (uint8_t *buf, uint64_t size, uint64_t basepage,
                                         nvme_host_callback_fn *cb, void *ctx);
 
 
+/**
+ * Flushes an OX NVMe device. Completes after all writes submitted before the
+ * flush are durable.
+ *
+ * @param cb - user defined callback function for command completion.
+ * @param ctx - user defined context returned by the callback function.
+ * @return returns 0 if the flush has been submitted, or a negative value upon
+ *          failure.
+ */
+int nvmeh_flush (nvme_host_callback_fn *cb, void *ctx);
+
+
+/**
+ * Deallocates logical blocks of an OX NVMe device (Dataset Management).
+ * With the OX-App block FTL, reads of deallocated blocks return zeros.
+ *
+ * @param slba - Starting logical block address.
+ * @param nlb - Number of logical blocks to deallocate.
+ * @param cb - user defined callback function for command completion.
+ * @param ctx - user defined context returned by the callback function.
+ * @return returns 0 if the command has been submitted, or a negative value
+ *          upon failure.
+ */
+int nvmeh_trim (uint64_t slba, uint64_t nlb, nvme_host_callback_fn *cb,
+                                                                    void *ctx);
+
 #endif /* NVME_HOST_H */
 
@@ -435,6 +435,95 @@ FULL:
     return -1;
 }
 
+int nvmeh_flush (oxf_host_callback_fn *cb, void *ctx)
+{
+    struct nvme_cmd cmd;
+    struct nvmeh_ctx *nvmeh_ctx;
+
+    nvmeh_ctx = nvmeh_ctxw_get (&nvmeh);
+    if (!nvmeh_ctx)
+        return -1;
+
+    nvmeh_ctx->user_ctx = ctx;
+    nvmeh_ctx->user_cb = cb;
+    nvmeh_ctx->n_cmd = 1;
+    nvmeh_ctx->cmd_status[0].ctx = nvmeh_ctx;
+    nvmeh_ctx->cmd_status[0].status = 0;
+
+    memset (&cmd, 0x0, sizeof (struct nvme_cmd));
+    cmd.opcode = NVME_CMD_FLUSH;
+
+    if (oxf_host_submit_io (1, &cmd, NULL, 0, nvmeh_callback,
+                                                &nvmeh_ctx->cmd_status[0])) {
+        nvmeh_ctxw_put (&nvmeh, nvmeh_ctx);
+        return -1;
+    }
+
+    return 0;
+}
+
+int nvmeh_trim (uint64_t slba, uint64_t nlb, oxf_host_callback_fn *cb,
+                                                                    void *ctx)
+{
+    NvmeDsmRange range[NVME_DSM_MAX_RANGES];
+    struct nvme_sgl_desc *desc;
+    struct nvme_cmd cmd;
+    struct nvmeh_ctx *nvmeh_ctx;
+    uint8_t *buf_off[1];
+    uint32_t buf_sz[1];
+    uint32_t nr = 0;
+
+    if (!nlb || nlb > (uint64_t) UINT32_MAX * NVME_DSM_MAX_RANGES) {
+        printf ("[nvme: Invalid number of blocks to trim.]\n");
+        return -1;
+    }
+
+    memset (range, 0x0, sizeof (range));
+    while (nlb) {
+        range[nr].slba = slba;
+        range[nr].nlb = (nlb > UINT32_MAX) ? UINT32_MAX : nlb;
+        slba += range[nr].nlb;
+        nlb -= range[nr].nlb;
+        nr++;
+    }
+
+    nvmeh_ctx = nvmeh_ctxw_get (&nvmeh);
+    if (!nvmeh_ctx)
+        return -1;
+
+    nvmeh_ctx->user_ctx = ctx;
+    nvmeh_ctx->user_cb = cb;
+    nvmeh_ctx->n_cmd = 1;
+    nvmeh_ctx->cmd_status[0].ctx = nvmeh_ctx;
+    nvmeh_ctx->cmd_status[0].status = 0;
+
+    buf_off[0] = (uint8_t *) range;
+    buf_sz[0] = nr * sizeof (NvmeDsmRange);
+
+    desc = oxf_host_alloc_sgl (buf_off, buf_sz, 1);
+    if (!desc)
+        goto PUT;
+
+    memset (&cmd, 0x0, sizeof (struct nvme_cmd));
+    cmd.opcode = NVME_CMD_DSM;
+    cmd.cdw10 = nr - 1;
+    cmd.cdw11 = NVME_DSMGMT_AD;
+
+    if (oxf_host_submit_io (1, &cmd, desc, 1, nvmeh_callback,
+                                                &nvmeh_ctx->cmd_status[0])) {
+        oxf_host_free_sgl (desc);
+        goto PUT;
+    }
+
+    oxf_host_free_sgl (desc);
+
+    return 0;
+
+PUT:
+    nvmeh_ctxw_put (&nvmeh, nvmeh_ctx);
+    return -1;
+}
+
 void nvmeh_exit (void)
 {
     oxf_host_exit ();
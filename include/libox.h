@@ -9,6 +9,7 @@
 #include <pthread.h>
 #include <ox-lightnvm.h>
 #include <ox-uatomic.h>
+#include <ox-trace.h>
 
 typedef struct NvmeCtrl      NvmeCtrl;
 typedef struct NvmeCmd       NvmeCmd;
@@ -69,6 +70,10 @@ typedef struct NvmeRequest   NvmeRequest;
 #define MAX_NAME_SIZE           31
 #define NVM_FTL_QUEUE_SIZE      2048
 
+/* Sectors per nvm_io_cmd, larger NVMe I/Os are split into sub-commands */
+#define NVM_IO_MAX_SEC          256
+#define NVM_IO_MAX_PGS          64  /* bits in 'nvm_io_status.pg_map' */
+
 /* Timeout 2 sec */
 #define NVM_QUEUE_RETRY         10000
 #define NVM_QUEUE_RETRY_SLEEP   200
@@ -98,6 +103,13 @@ typedef struct NvmeRequest   NvmeRequest;
 /* Set this macro to enable ox memory management component  */
 #define OX_MEM_MANAGER          1
 
+/* Set this macro to track every ox_malloc block and list leaks at exit */
+#define OX_MEM_LEAK_DEBUG       0
+
+/* What an allocation does when its type is over budget */
+#define OX_MEM_BUDGET_FAIL      0
+#define OX_MEM_BUDGET_BLOCK     1
+
 /* Set this macro to enable thread affinity in OX queues */
 #define OX_TH_AFFINITY		0
 
@@ -118,7 +130,9 @@ enum {
     MMGR_WRITE_SGL = 0x9,
     MMGR_WRITE_PL_PG = 0x10,
     MMGR_READ_PL_PG = 0x11,
-    MMGR_WRITE_DELTA = 0x12
+    MMGR_WRITE_DELTA = 0x12,
+    MMGR_FLUSH = 0x13,
+    MMGR_TRIM = 0x14    /* n_sec ranges: first LBA in prp[], length in md_prp[] */
 };
 
 enum NVM_ERROR {
@@ -145,6 +159,18 @@ enum {
     NVM_IO_TIMEOUT     = 0x5
 };
 
+/* I/O priority classes, mapped to the OX_MQ_QOS classes of the FTL and media
+ * manager queues. Untagged threads submit as OX_IO_CLASS_USER */
+enum {
+    OX_IO_CLASS_USER   = 0x0, /* host reads */
+    OX_IO_CLASS_WRITE  = 0x1, /* host writes */
+    OX_IO_CLASS_META   = 0x2, /* log flushes and checkpoints */
+    OX_IO_CLASS_GC     = 0x3  /* garbage collection and recovery */
+};
+
+/* Weighted-fair shares of the classes above */
+#define OX_IO_CLASS_WEIGHTS     { 8, 4, 4, 2 }
+
 enum RUN_FLAGS {
     RUN_READY      = (1 << 0),
     RUN_NVME_ALLOC = (1 << 1),
@@ -183,6 +209,7 @@ enum OX_MEM_TYPES {
     OX_MEM_FABRICS      = 21,
     OX_MEM_NVMEF        = 22,
     OX_MEM_OXBLK_DELTA  = 23,
+    OX_MEM_NVME_PARSER  = 24,
     OX_MEM_ELEOS_W      = 29,
     OX_MEM_ELEOS_LBA    = 30,
     OX_MEM_APP_HMAP     = 31 /* 31-40 belong to HMAP instances */
@@ -279,6 +306,8 @@ struct nvm_mmgr_io_cmd {
     uint32_t                sec_sz;
     uint32_t                md_sz;
     uint16_t                sec_offset; /* first sector in the ppa vector */
+    uint8_t                 io_class;
+    uint8_t                 sampled;  /* counted by the channel sampler */
     uint8_t                 force_sync_md;
     uint8_t                 force_sync_data[32];
     u_atomic_t              *sync_count;
@@ -291,24 +320,45 @@ struct nvm_mmgr_io_cmd {
     uint8_t                 rsvd[128];       /* Volt + ELEOS */
 };
 
+/* Stage boundaries timestamped in 'nvm_io_cmd' for latency histograms */
+enum ox_lat_marks {
+    OX_LAT_T_PARSE = 0,   /* Command entered the parser */
+    OX_LAT_T_SUBMIT,      /* Handed to the FTL queue or to the read path */
+    OX_LAT_T_FTL,         /* Picked by the FTL (reads: mapping resolved) */
+    OX_LAT_T_MEDIA,       /* All sectors persisted by the FTL */
+    OX_LAT_T_DONE,        /* Completion posted to the host */
+    OX_LAT_MARKS
+};
+
+struct nvm_io_vec;
+
+/* Per-sector and per-page arrays are sized to the request, see ox_io_vec_get */
 struct nvm_io_cmd {
     uint64_t                    cid;
-    struct nvm_channel          *channel[64];
-    struct nvm_ppa_addr         ppalist[256];
+    struct nvm_channel          **channel;
+    struct nvm_ppa_addr         *ppalist;
     struct nvm_io_status        status;
-    struct nvm_mmgr_io_cmd      mmgr_io[64];
+    struct nvm_mmgr_io_cmd      *mmgr_io;
     struct nvm_callback         callback;
     void                        *req;
     void                        *mq_req;
     void                        *opaque;
-    uint64_t                    prp[256]; /* maximum 1 MB for block I/O */
-    uint64_t                    md_prp[256];
+    uint64_t                    *prp;
+    uint64_t                    *md_prp;
+    struct nvm_io_vec           *vec;
     uint32_t                    sec_sz;
     uint32_t                    md_sz;
     uint32_t                    n_sec;
     uint64_t                    slba;
     uint8_t                     cmdtype;
+    uint8_t                     io_class;
+    uint64_t                    lat_ts[OX_LAT_MARKS]; /* ns, monotonic */
     pthread_mutex_t             mutex;
+
+    /* Split I/O: sub-commands point to the host command, which counts the
+     * sub-commands in flight and releases them through 'callback' */
+    struct nvm_io_cmd           *parent;
+    uint32_t                    pending;
 };
 
 #include <nvme.h>
@@ -543,6 +593,7 @@ struct nvm_channel {
     struct nvm_mmgr_geometry    *geometry;
     struct nvm_ppa_addr         *mmgr_rsv_list; /* list of mmgr reserved blks */
     struct nvm_ppa_addr         *ftl_rsv_list;
+    uint8_t                     *rsv_map; /* bit per (lun, blk) if reserved */
     LIST_ENTRY(nvm_channel)     entry;
     union {
         struct {
@@ -662,8 +713,13 @@ int  ox_submit_mmgr     (struct nvm_mmgr_io_cmd *cmd);
 int  ox_submit_ftl      (struct nvm_io_cmd *cmd);
 int  ox_submit_sync_io  (struct nvm_channel *, struct nvm_mmgr_io_cmd *,
                                                             void *, uint8_t);
+void    ox_set_io_class (uint8_t io_class);
+uint8_t ox_get_io_class (void);
 int  ox_contains_ppa    (struct nvm_ppa_addr *list, uint32_t list_sz,
                                                     struct nvm_ppa_addr ppa);
+int  ox_ch_rsv_map_build (struct nvm_channel *ch);
+void ox_ch_rsv_map_free  (struct nvm_channel *ch);
+int  ox_ch_is_rsv        (struct nvm_channel *ch, uint16_t lun, uint16_t blk);
 struct nvm_ftl  *ox_get_ftl_instance (uint16_t ftl_id);
 struct nvm_mmgr *ox_get_mmgr_instance (void);
 int    ox_restart (void);
@@ -678,6 +734,7 @@ struct  nvm_io_data *ftl_alloc_pg_io (struct nvm_channel *ch);
 void    ftl_pg_io_prepare (struct nvm_channel *ch, struct nvm_io_data *data);
 void    ftl_pl_pg_io_prepare (struct nvm_channel *ch,struct nvm_io_data *data);
 void    ftl_free_pg_io (struct nvm_io_data *data);
+void    ftl_pg_io_drain (void);
 int     ftl_io_rsv_blk (struct nvm_channel *ch, uint8_t cmdtype,
                                      void **buf_vec, uint16_t blk, uint16_t pg);
 int     ftl_io_rsv_pl_blk (struct nvm_channel *ch, uint8_t cmdtype,
@@ -723,6 +780,11 @@ int          ox_mem_init (void);
 void         ox_mem_exit (void);
 uint64_t     ox_mem_total (void);
 uint64_t     ox_mem_size (uint16_t type);
+uint64_t     ox_mem_peak (uint16_t type);
+int          ox_mem_set_budget (uint16_t type, uint64_t bytes, uint8_t policy);
+int          ox_mem_conf_budget (const char *name, uint64_t headroom);
+int          ox_mem_apply_budget (uint16_t type, uint8_t policy);
+int          ox_mem_find_type (const char *name);
 
 /* Statistics functions */
 int  ox_stats_init (void);
@@ -739,6 +801,74 @@ void ox_stats_print_io (void);
 void ox_stats_print_gc (void);
 void ox_stats_print_recovery (void);
 void ox_stats_print_checkpoint (void);
+void ox_stats_print_waf (void);
+
+/* Latency histograms */
+enum ox_lat_stages {
+    OX_LAT_PARSE = 0,
+    OX_LAT_FTL_QUEUE,
+    OX_LAT_FTL,
+    OX_LAT_COMMIT,
+    OX_LAT_TOTAL,
+    OX_LAT_STAGES
+};
+
+enum ox_lat_dirs {
+    OX_LAT_READ = 0,
+    OX_LAT_WRITE,
+    OX_LAT_MMGR,    /* Media commands, indexed by OX_LAT_MMGR_* */
+    OX_LAT_DIRS
+};
+
+#define OX_LAT_MMGR_READ    0
+#define OX_LAT_MMGR_WRITE   1
+#define OX_LAT_MMGR_ERASE   2
+
+void     ox_lat_mark (struct nvm_io_cmd *cmd, uint8_t mark);
+void     ox_lat_complete (struct nvm_io_cmd *cmd);
+void     ox_lat_add_mmgr (struct nvm_mmgr_io_cmd *cmd);
+uint64_t ox_lat_count (uint8_t dir, uint8_t stage);
+uint64_t ox_lat_percentile (uint8_t dir, uint8_t stage, double pct);
+void     ox_lat_reset (void);
+void     ox_lat_print (void);
+
+/* Metrics exporter, modules fill snapshots with ox_metrics_add */
+#define OX_METRICS_SOCK     "/tmp/ox-metrics.sock"
+#define OX_METRICS_SOCK_MODE 0660
+#define OX_METRIC_COUNTER   0
+#define OX_METRIC_GAUGE     1
+
+struct ox_metrics;
+int  ox_metrics_init (void);
+void ox_metrics_exit (void);
+struct ox_metrics *ox_metrics_new (void);
+void ox_metrics_free (struct ox_metrics *m);
+char *ox_metrics_format (struct ox_metrics *m, uint8_t json, size_t *len);
+void ox_metrics_add (struct ox_metrics *m, const char *name, uint8_t type,
+                const char *help, double value, const char *labels, ...);
+void ox_stats_sample (void);
+void ox_stats_metrics (struct ox_metrics *m);
+void ox_lat_metrics (struct ox_metrics *m);
+void ox_mem_metrics (struct ox_metrics *m);
+
+/* Pools of nvm_io_cmd arrays */
+int  ox_io_vec_init (void);
+void ox_io_vec_exit (void);
+int  ox_io_vec_get (struct nvm_io_cmd *cmd, uint32_t n_sec);
+void ox_io_vec_put (struct nvm_io_cmd *cmd);
+void ox_io_vec_attach (struct nvm_io_cmd *cmd, struct nvm_io_vec *vec,
+                                                                uint32_t n_sec);
+void ox_io_vec_print (void);
+
+/* Channel and LUN utilization sampler */
+int  ox_chstat_init (void);
+void ox_chstat_exit (void);
+void ox_chstat_submit (struct nvm_mmgr_io_cmd *cmd);
+void ox_chstat_complete (struct nvm_mmgr_io_cmd *cmd);
+void ox_chstat_cancel (struct nvm_mmgr_io_cmd *cmd);
+void ox_chstat_sample (void);
+void ox_chstat_print (void);
+void ox_chstat_metrics (struct ox_metrics *m);
 
 #if OX_MEM_MANAGER
 void        *ox_malloc  (size_t size, uint16_t type);
@@ -764,6 +894,12 @@ static inline void *ox_free (void *ptr, uint16_t type) {
 void         ox_mem_print_memory (void);
 struct ox_mem_type *ox_mem_create_type (const char *name, uint16_t type);
 
+/* Hugepage-backed arenas for large long-lived regions */
+struct ox_mem_arena;
+struct ox_mem_arena *ox_mem_arena_create (size_t size, uint16_t type);
+void        *ox_mem_arena_alloc (struct ox_mem_arena *arena, size_t size);
+void         ox_mem_arena_destroy (struct ox_mem_arena *arena);
+
 /* Module registration */
 int ftl_lnvm_init (void);
 int ftl_oxapp_init (void);
@@ -60,6 +60,10 @@
 
 #define NVME_KERNEL_PG_SIZE 4096
 
+/* 4k * (1 << 11) = 8 MB max transfer per NVMe I/O, split in the parser */
+#define NVME_MDTS           11
+#define NVME_MAX_NLB        (1 << NVME_MDTS)
+
 enum NvmeStatusCodes {
     NVME_SUCCESS                = 0x0000,
     NVME_INVALID_OPCODE         = 0x0001,
@@ -634,6 +638,35 @@ typedef struct NvmeRwCmd {
     uint16_t    appmask;
 } __attribute__((packed)) NvmeRwCmd;
 
+typedef struct NvmeDsmCmd {
+    uint8_t     opcode;
+    uint8_t     fuse : 2;
+    uint8_t     rsvd : 4;
+    uint8_t     psdt : 2;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint64_t    rsvd2[2];
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint32_t    nr;
+    uint32_t    attributes;
+    uint32_t    rsvd12[4];
+} __attribute__((packed)) NvmeDsmCmd;
+
+enum {
+    NVME_DSMGMT_IDR             = 1 << 0,
+    NVME_DSMGMT_IDW             = 1 << 1,
+    NVME_DSMGMT_AD              = 1 << 2,
+};
+
+#define NVME_DSM_MAX_RANGES     256
+
+typedef struct NvmeDsmRange {
+    uint32_t    cattr;
+    uint32_t    nlb;
+    uint64_t    slba;
+} __attribute__((packed)) NvmeDsmRange;
+
 typedef struct vs_reg {
     uint8_t rsvd;
     uint8_t mnr;
@@ -958,7 +991,7 @@ typedef struct NvmeRequest {
     uint16_t                 status;
     uint64_t                 slba;
     uint16_t                 is_write;
-    uint16_t                 nlb;
+    uint32_t                 nlb;
     uint16_t                 ctrl;
     uint64_t                 meta_size;
     uint64_t                 mptr;
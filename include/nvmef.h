@@ -26,6 +26,7 @@
 /* Timeout 10 sec */
 #define NVMEF_RETRY         50000
 #define NVMEF_RETRY_DELAY   200
+#define NVMEF_QUEUE_POLL    20 /* Queue busy-poll window in u-seconds */
 
 #define NVMEF_ICDOFF    16
 #define NVMEF_SGL_SZ    256 /* Space for SGL after command in capsule */
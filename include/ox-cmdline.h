@@ -45,6 +45,11 @@ int cmdline_show_recovery (char *line, ox_cmd *cmd);
 int cmdline_show_checkpoint (char *line, ox_cmd *cmd);
 int cmdline_show_all (char *line, ox_cmd *cmd);
 int cmdline_show_reset (char *line, ox_cmd *cmd);
+int cmdline_show_latency (char *line, ox_cmd *cmd);
+int cmdline_show_latency_reset (char *line, ox_cmd *cmd);
+int cmdline_show_channels (char *line, ox_cmd *cmd);
+int cmdline_show_waf (char *line, ox_cmd *cmd);
+int cmdline_set_budget (char *line, ox_cmd *cmd);
 int cmdline_admin (char *line, ox_cmd *cmd);
 int cmdline_exit (char *line, ox_cmd *cmd);
 
@@ -24,13 +24,32 @@
 
 #include <sys/queue.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <ox-uatomic.h>
 
 #define OX_MQ_MAX_QUEUES    0x4000
 #define OX_MQ_MAX_Q_DEPTH   0x80000
 
+/* Busy-poll window limits for OX_MQ_POLL queues, in microseconds */
+#define OX_MQ_POLL_MIN_USEC 1
+#define OX_MQ_POLL_MAX_USEC 100000
+
+/* Max entries moved by a single batched dequeue or completion step */
+#define OX_MQ_MAX_BATCH     64
+
+/* Timeout checks per 'to_usec' period, timeouts are detected up to
+ * 'to_usec / OX_MQ_TO_TICKS' late */
+#define OX_MQ_TO_TICKS      8
+
+/* Max nested cq_fn calls in the completer's thread for OX_MQ_CQ_INLINE */
+#define OX_MQ_INLINE_DEPTH  4
+
+/* Priority classes of OX_MQ_QOS queues, class 0 is used by ox_mq_submit_req */
+#define OX_MQ_CLASSES       4
+
 enum {
     OX_MQ_FREE = 1,
     OX_MQ_QUEUED,
@@ -51,6 +70,7 @@ struct ox_mq_entry {
     LIST_ENTRY(ox_mq_entry)  ext_entry;
     pthread_mutex_t          entry_mutex;
     struct oxmq_output_row   *out_row;
+    uint64_t                 out_tag; /* owner tag of 'out_row' */
 };
 
 /* Keeps a set of counters related to the multi-queue */
@@ -67,6 +87,9 @@ struct ox_mq_stats {
 
 typedef void (ox_mq_sq_fn)(struct ox_mq_entry *);
 
+/* struct ox_mq_entry ** is an array of ready entries, int is the array size */
+typedef void (ox_mq_sq_batch_fn)(struct ox_mq_entry **, int);
+
 /* void * is the pointer to the opaque user entry */
 typedef void (ox_mq_cq_fn)(void *);
 
@@ -76,6 +99,24 @@ typedef void (ox_mq_to_fn)(void **, int);
 /* Fill the statistics rows for file output */
 typedef void (ox_mq_set_output_fn)(struct oxmq_output_row *row, void *opaque);
 
+/* Bounded lock-free ring of entries, used if OX_MQ_RING flag is set */
+struct ox_mq_ring_slot {
+    volatile uint64_t       seq;
+    struct ox_mq_entry      *entry;
+};
+
+struct ox_mq_ring {
+    struct ox_mq_ring_slot  *slots;
+    uint64_t                mask;
+    uint8_t                 rsvd0[48];
+    volatile uint64_t       head;   /* consumer index, own cache line */
+    uint8_t                 rsvd1[56];
+    volatile uint64_t       tail;   /* producer index, own cache line */
+    uint8_t                 rsvd2[56];
+};
+
+#define ox_mq_ring_empty(r) ((r)->head == (r)->tail)
+
 struct ox_mq_queue {
     pthread_mutex_t                        sq_free_mutex;
     pthread_mutex_t                        cq_free_mutex;
@@ -87,8 +128,25 @@ struct ox_mq_queue {
     TAILQ_HEAD (sq_free_head, ox_mq_entry) sq_free;
     TAILQ_HEAD (sq_used_head, ox_mq_entry) sq_used;
     TAILQ_HEAD (sq_wait_head, ox_mq_entry) sq_wait;
+    TAILQ_HEAD (to_pend_head, ox_mq_entry) to_pending; /* CQ was full */
     TAILQ_HEAD (cq_free_head, ox_mq_entry) cq_free;
     TAILQ_HEAD (cq_used_head, ox_mq_entry) cq_used;
+    struct ox_mq_ring                      sq_free_r;
+    struct ox_mq_ring                      sq_used_r;
+    struct ox_mq_ring                      cq_free_r;
+    struct ox_mq_ring                      cq_used_r;
+    TAILQ_HEAD (sq_class_head, ox_mq_entry) sq_class[OX_MQ_CLASSES];
+    struct ox_mq_ring                      sq_class_r[OX_MQ_CLASSES];
+    u_atomic_t                             class_used[OX_MQ_CLASSES];
+    int32_t                                class_credit[OX_MQ_CLASSES];
+    uint8_t                                class_cur; /* class being served */
+    volatile uint8_t                       sq_sleep; /* consumer is parked */
+    volatile uint8_t                       cq_sleep;
+    uint32_t                               sq_poll_usec; /* current window */
+    uint32_t                               cq_poll_usec;
+    cpu_set_t                              sq_cpus; /* empty, not pinned */
+    cpu_set_t                              cq_cpus;
+    uint8_t                                cpu_auto; /* placed by ox-mq */
     ox_mq_sq_fn                            *sq_fn;
     ox_mq_cq_fn                            *cq_fn;
     pthread_mutex_t                        sq_cond_m;
@@ -105,42 +163,69 @@ struct ox_mq_queue {
 
 #define OX_MQ_TO_COMPLETE   (1 << 0) /* Complete request after timeout */
 #define OX_MQ_CPU_AFFINITY  (1 << 1) /* Forces all threads to run a specific core */
+#define OX_MQ_RING          (1 << 2) /* Lock-free rings instead of mutex lists */
+#define OX_MQ_POLL          (1 << 3) /* Busy-poll up to 'poll_usec' before park */
+#define OX_MQ_SQ_BATCH      (1 << 4) /* Deliver ready entries to 'sq_batch_fn' */
+#define OX_MQ_CPU_AUTO      (1 << 5) /* Place threads from the CPU topology */
+#define OX_MQ_CQ_INLINE     (1 << 6) /* Run cq_fn in the completer's thread */
+#define OX_MQ_QOS           (1 << 7) /* Weighted-fair SQ classes */
+
+/* Output trace files are a 'struct oxmq_output_hdr' followed by rows */
+#define OXMQ_OUTPUT_MAGIC   "OXMQTRC1"
+#define OXMQ_OUTPUT_VERSION 1
+
+struct oxmq_output_hdr {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    row_sz;
+    uint64_t    id;
+    uint32_t    nodes;
+    uint32_t    rsvd;
+    char        name[64];
+};
 
+/* Also the on-disk record, laid out without padding */
 struct oxmq_output_row {
     /* Should be set by user in 'ox_mq_set_output_fn' function */
     uint64_t    lba;
-    uint16_t    ch;
-    uint16_t    lun;
     uint32_t    blk;
     uint32_t    pg;
+    uint32_t    size;
+    uint16_t    ch;
+    uint16_t    lun;
     uint8_t     pl;
     uint8_t     sec;
     uint8_t     type;
     uint8_t     failed;
     uint8_t     datacmp;
-    uint32_t    size;
+    uint8_t     rsvd;
 
     /* Filled automatically by ox-mq */
-    uint64_t    seq;
-    uint64_t    node_seq;
     uint16_t    node_id;
+    uint64_t    node_seq;
     uint64_t    tstart;
     uint64_t    tend;
-    uint64_t    ulat;
-    TAILQ_ENTRY(oxmq_output_row) entry;
 };
 
+/* Single-producer ring per queue, filled by the queue SQ thread and drained
+ * by the output writer thread */
 struct oxmq_output_tq {
-    uint64_t                row_off;
     struct oxmq_output_row *rows;
-    TAILQ_HEAD(out_list,oxmq_output_row) out_head;
+    uint64_t               *tags;  /* Owner of each open row, 0 if closed */
+    uint64_t                head __attribute__((aligned(64)));
+    uint64_t                dropped;
+    uint64_t                tail __attribute__((aligned(64)));
 };
+
 struct oxmq_output {
     uint64_t               id;
     uint32_t               nodes;
     char                   name[64];
     pthread_mutex_t        file_mutex;
-    uint64_t               sequence;
+    FILE                   *fp;
+    pthread_t              writer;
+    volatile uint8_t       stop;
+    uint64_t               written;
     uint64_t              *node_seq;
     struct oxmq_output_tq *queues;
 };
@@ -156,9 +241,23 @@ struct ox_mq_config {
     uint64_t            to_usec;    /* timeout in microseconds */
     uint8_t             flags;
 
-    /* Used if OX_MQ_CPU_AFFINITY flag is set, max of 64 CPUs */
-    uint64_t            sq_affinity[OX_MQ_MAX_QUEUES];
-    uint64_t            cq_affinity[OX_MQ_MAX_QUEUES];
+    /* Used if OX_MQ_POLL flag is set. Larger windows trade idle CPU time for
+     * lower wakeup latency. */
+    uint32_t            poll_usec;
+
+    /* Used if OX_MQ_SQ_BATCH flag is set, receives up to OX_MQ_MAX_BATCH
+     * entries at once instead of 'sq_fn' */
+    ox_mq_sq_batch_fn   *sq_batch_fn;
+
+    /* Used if OX_MQ_CPU_AFFINITY flag is set. Arrays of 'n_queues' CPU sets,
+     * NULL or an empty set leaves the thread unpinned (or placed by
+     * OX_MQ_CPU_AUTO, if also set) */
+    cpu_set_t           *sq_affinity;
+    cpu_set_t           *cq_affinity;
+
+    /* Used if OX_MQ_QOS flag is set. Entries taken from each class per
+     * round-robin pass over the classes with pending entries, at least 1 */
+    uint16_t            class_weight[OX_MQ_CLASSES];
 };
 
 struct ox_mq {
@@ -175,20 +274,39 @@ struct ox_mq {
 struct ox_mq *ox_mq_init (struct ox_mq_config *);
 void          ox_mq_destroy (struct ox_mq *);
 int           ox_mq_submit_req (struct ox_mq *, uint32_t, void *);
+int           ox_mq_submit_class (struct ox_mq *, uint32_t, void *, uint8_t);
 int           ox_mq_complete_req (struct ox_mq *, struct ox_mq_entry *);
+int           ox_mq_submit_batch (struct ox_mq *, uint32_t, void **, int);
+int           ox_mq_complete_batch (struct ox_mq *, struct ox_mq_entry **, int);
 void          ox_mq_show_mq (struct ox_mq *);
 void          ox_mq_show_all (void);
 struct ox_mq *ox_mq_get (const char *);
 int           ox_mq_used_count (struct ox_mq *, uint16_t qid);
 int           ox_mq_get_status (struct ox_mq *, struct ox_mq_stats *,
                                                                   uint16_t qid);
+struct ox_metrics;
+void          ox_mq_metrics (struct ox_metrics *);
 void                    ox_mq_output_start (void);
 void                    ox_mq_output_stop (void);
 struct oxmq_output_row *ox_mq_output_new (struct oxmq_output *output,
                                                                 int node_id);
+void                    ox_mq_output_end (struct oxmq_output *output,
+                                    uint32_t node_id, struct oxmq_output_row *row,
+                                    uint64_t tag, uint64_t tend);
 void                    ox_mq_output_flush (struct oxmq_output *output);
 void                    ox_mq_output_exit (struct oxmq_output *output);
 struct oxmq_output     *ox_mq_output_init (uint64_t id, const char *name,
                                                                 uint32_t nodes);
+int                 ox_mq_cpu_auto (cpu_set_t *sq, cpu_set_t *cq);
+void                ox_mq_cpu_release (cpu_set_t *sq, cpu_set_t *cq);
+int                 ox_mq_ring_init (struct ox_mq_ring *ring, uint32_t size);
+void                ox_mq_ring_free (struct ox_mq_ring *ring);
+int                 ox_mq_ring_push (struct ox_mq_ring *ring,
+                                                    struct ox_mq_entry *entry);
+struct ox_mq_entry *ox_mq_ring_pop (struct ox_mq_ring *ring);
+int                 ox_mq_ring_push_bulk (struct ox_mq_ring *ring,
+                                        struct ox_mq_entry **entry, int count);
+int                 ox_mq_ring_pop_bulk (struct ox_mq_ring *ring,
+                                        struct ox_mq_entry **entry, int max);
 
 #endif /* OX_MQ_H */
\ No newline at end of file
@@ -0,0 +1,84 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Static tracepoints (USDT)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Probes are defined under the 'ox' provider when CMake finds <sys/sdt.h>
+ * (systemtap-sdt-dev) and USDT is not disabled with -DNO_USDT=1. A probe is a
+ * single nop in the code, its arguments are only read by an attached tracer:
+ *
+ *   bpftrace -e 'usdt:./ox-ctrl-nvme-volt:ox:mmgr_complete { @[arg1] = count(); }'
+ *   perf probe -x ./ox-ctrl-nvme-volt sdt_ox:ftl_enqueue
+ *
+ * Without <sys/sdt.h>, probes compile to nothing.
+ *
+ * A file that defines OX_TRACE_SEMAPHORES before including this header must
+ * declare every probe it fires with OX_PROBE_SEMAPHORE. OX_PROBE_ENABLED is
+ * then true only while a tracer is attached, so costly arguments can be
+ * skipped.
+ *
+ *  Probe           Arguments
+ *  nvme_parse      cid, opcode, slba, nlb
+ *  ftl_enqueue     cid, ftl queue, sectors
+ *  ftl_dequeue     cid, opcode
+ *  lba_line_close  type (0: write, 1: read), sectors
+ *  map_hit         lba
+ *  map_miss        lba
+ *  map_evict       cache (channel), dirty
+ *  gc_victims      channel, victim blocks
+ *  log_flush       entries, synchronous
+ *  cp_begin        -
+ *  cp_end          status
+ *  mmgr_submit     cmd pointer, cmdtype, channel, sectors
+ *  mmgr_complete   cmd pointer, cmdtype, status, latency (us)
+ *  fabrics_recv    queue, cid, capsule bytes
+ *  fabrics_send    queue, cid, capsule bytes
+ */
+
+#ifndef OX_TRACE_H
+#define OX_TRACE_H
+
+#ifdef CONFIG_USDT
+
+#ifdef OX_TRACE_SEMAPHORES
+#define _SDT_HAS_SEMAPHORES 1
+#endif
+
+#include <sys/sdt.h>
+
+#define OX_PROBE_SEMAPHORE(name)                                            \
+    __extension__ unsigned short ox_##name##_semaphore                      \
+                __attribute__ ((unused)) __attribute__ ((section (".probes")))
+#define OX_PROBE_ENABLED(name)  __builtin_expect (ox_##name##_semaphore, 0)
+
+#define OX_PROBE0(name)                 DTRACE_PROBE(ox, name)
+#define OX_PROBE1(name,a)               DTRACE_PROBE1(ox, name, a)
+#define OX_PROBE2(name,a,b)             DTRACE_PROBE2(ox, name, a, b)
+#define OX_PROBE3(name,a,b,c)           DTRACE_PROBE3(ox, name, a, b, c)
+#define OX_PROBE4(name,a,b,c,d)         DTRACE_PROBE4(ox, name, a, b, c, d)
+
+#else
+
+#define OX_PROBE_SEMAPHORE(name)        extern int ox_probe_unused
+#define OX_PROBE_ENABLED(name)          0
+
+#define OX_PROBE0(name)                 do { } while (0)
+#define OX_PROBE1(name,a)               do { } while (0)
+#define OX_PROBE2(name,a,b)             do { } while (0)
+#define OX_PROBE3(name,a,b,c)           do { } while (0)
+#define OX_PROBE4(name,a,b,c,d)         do { } while (0)
+
+#endif /* CONFIG_USDT */
+
+#endif /* OX_TRACE_H */
@@ -6,6 +6,10 @@
  * Written by Ivan Luiz Picoli <ivpi@itu.dk>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <liblightnvm.h>
@@ -444,7 +448,10 @@ static void ocssd_stats_fill_row (struct oxmq_output_row *row, void *opaque)
 static int ocssd_start_mq (void)
 {
     struct ox_mq_config mq_config;
+#if OX_TH_AFFINITY
+    cpu_set_t sq_cpus[OCSSD_QUEUE_COUNT], cq_cpus[OCSSD_QUEUE_COUNT];
     uint16_t qid;
+#endif
 
     sprintf(mq_config.name, "%s", "OCSSD_MMGR");
     mq_config.n_queues = OCSSD_QUEUE_COUNT;
@@ -455,20 +462,26 @@ static int ocssd_start_mq (void)
     mq_config.output_fn = ocssd_stats_fill_row;
     mq_config.to_usec = OCSSD_QUEUE_TO;
     mq_config.flags = OX_MQ_CPU_AFFINITY;
+    mq_config.sq_affinity = NULL;
+    mq_config.cq_affinity = NULL;
 
-    /* Set thread affinity, if enabled */
-    for (qid = 0; qid < mq_config.n_queues; qid++) {
-        mq_config.sq_affinity[qid] = 0;
-	mq_config.cq_affinity[qid] = 0;
-
+    /* Set thread affinity, if enabled. Otherwise, spread the channel queues
+     * over the host topology */
 #if OX_TH_AFFINITY
-        mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 4);
-        mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 5);
-	mq_config.sq_affinity[qid] |= ((uint64_t) 1 << 6);
+    for (qid = 0; qid < mq_config.n_queues; qid++) {
+        CPU_ZERO(&sq_cpus[qid]);
+        CPU_SET(4, &sq_cpus[qid]);
+        CPU_SET(5, &sq_cpus[qid]);
+        CPU_SET(6, &sq_cpus[qid]);
 
-        mq_config.cq_affinity[qid] |= ((uint64_t) 1 << 7);
-#endif /* OX_TH_AFFINITY */
+        CPU_ZERO(&cq_cpus[qid]);
+        CPU_SET(7, &cq_cpus[qid]);
     }
+    mq_config.sq_affinity = sq_cpus;
+    mq_config.cq_affinity = cq_cpus;
+#else
+    mq_config.flags |= OX_MQ_CPU_AUTO;
+#endif /* OX_TH_AFFINITY */
 
     ocssd.mq = ox_mq_init(&mq_config);
     if (!ocssd.mq)
@@ -129,10 +129,12 @@ static void volt_free (void *ptr, uint64_t sz)
     volt_sub_mem(sz);
 }
 
+/* Page data lives in the media arena, released in volt_free_blocks */
 static void volt_free_page_data(VoltPage *pg)
 {
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
-    volt_free (pg->data, geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg));
+    volt_sub_mem (geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg));
+    pg->data = NULL;
 }
 
 static void volt_free_block_data (VoltBlock *blk)
@@ -166,6 +168,9 @@ static void volt_free_blocks (int nblk, int npg_lb, int free_pg_lb)
         volt_free (volt->blocks[nblk].pages,sizeof(VoltPage) * geo->pg_per_blk);
 
     volt_free (volt->blocks, sizeof(VoltBlock) * total_blk);
+
+    ox_mem_arena_destroy (volt->media);
+    volt->media = NULL;
 }
 
 static void volt_free_luns (int tot_blk)
@@ -208,11 +213,13 @@ static void volt_clean_mem(void)
 static int volt_init_page(VoltPage *pg)
 {
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
+    uint32_t sz = geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg);
 
     pg->state = 0;
-    pg->data = volt_alloc(geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg));
+    pg->data = ox_mem_arena_alloc (volt->media, sz);
     if (!pg->data)
         return -1;
+    volt_add_mem (sz);
 
     return 0;
 }
@@ -225,10 +232,22 @@ static int volt_init_blocks(void)
     int i_blk, i_pg;
     int total_blk = geo->n_of_planes * geo->blk_per_lun * geo->lun_per_ch *
                                                                    geo->n_of_ch;
+    uint64_t pg_sz = geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg);
+
+    /* One arena for all page data, ox_mem_arena_alloc rounds to 64 bytes */
+    pg_sz = (pg_sz + 63) & ~63UL;
+
+    volt->media = ox_mem_arena_create (pg_sz * geo->pg_per_blk * total_blk,
+                                                            OX_MEM_MMGR_VOLT);
+    if (!volt->media)
+        return VOLT_MEM_ERROR;
 
     volt->blocks = volt_alloc(sizeof(VoltBlock) * total_blk);
-    if (!volt->blocks)
-        return -1;
+    if (!volt->blocks) {
+        ox_mem_arena_destroy (volt->media);
+        volt->media = NULL;
+        return VOLT_MEM_ERROR;
+    }
 
     for (i_blk = 0; i_blk < total_blk; i_blk++) {
         VoltBlock *blk = &volt->blocks[i_blk];
@@ -516,7 +535,7 @@ static int volt_enqueue_io (struct nvm_mmgr_io_cmd *io)
 
     retry = 16;
     do {
-        ret = ox_mq_submit_req(volt->mq, io->ppa.g.ch, io);
+        ret = ox_mq_submit_class(volt->mq, io->ppa.g.ch, io, io->io_class);
     	if (ret < 0)
             retry--;
         else if (core.debug)
@@ -725,7 +744,9 @@ struct ox_mq_config volt_mq = {
     .to_fn      = volt_req_timeout,
     .output_fn  = volt_stats_fill_row,
     .to_usec    = 0,
-    .flags      = 0x0
+    .flags      = (OX_MQ_RING | OX_MQ_POLL | OX_MQ_CPU_AUTO | OX_MQ_QOS),
+    .poll_usec  = VOLT_QUEUE_POLL_US,
+    .class_weight = OX_IO_CLASS_WEIGHTS
 };
 
 /* DEBUG (disabled): Thread to show multi-queue statistics */
@@ -56,6 +56,7 @@
 
 #define VOLT_QUEUE_SIZE     2048
 #define VOLT_QUEUE_TO       48000
+#define VOLT_QUEUE_POLL_US  20
 
 typedef struct VoltStatus {
     uint8_t     ready; /* 0x00-busy, 0x01-ready to use */
@@ -89,6 +90,7 @@ typedef struct VoltCtrl {
     VoltLun         *luns;
     VoltCh          *channels;
     struct ox_mq    *mq;
+    struct ox_mem_arena *media; /* page data, hugepage backed */
     uint8_t         *edma; /* emergency DMA buffer for timeout requests */
 } VoltCtrl;
 
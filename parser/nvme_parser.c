@@ -22,17 +22,47 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/queue.h>
 #include <libox.h>
 #include <nvme.h>
 #include <nvmef.h>
 #include <ox-app.h>
+#include <ox-mq.h>
 
-#define PARSER_NVME_COUNT   5
+#define PARSER_NVME_COUNT   7
+
+/* Reads bypass the FTL queue, mapping lookups run in the read queues */
+#define PARSER_READ_QUEUES  4
+#define PARSER_READ_Q_SIZE  NVM_FTL_QUEUE_SIZE
+
+/* I/Os above NVM_IO_MAX_SEC are split into sub-commands taken from a pool.
+ * The pool starts with PARSER_SPLIT_POOL entries and grows when empty, it is
+ * bounded by the commands the hosts can have outstanding. */
+#define PARSER_SPLIT_POOL   32
+#define PARSER_SPLIT_SUBS   (NVME_MAX_NLB / NVM_IO_MAX_SEC)
 
 extern struct core_struct core;
 
-/* Bypass FTL queue */
 void ox_ftl_process_cq (void *opaque);
+void ox_ftl_process_to (void **opaque, int counter);
+
+struct nvme_parser_split {
+    struct nvm_io_cmd                sub[PARSER_SPLIT_SUBS];
+    TAILQ_ENTRY(nvme_parser_split)   entry;
+    LIST_ENTRY(nvme_parser_split)    aentry;
+};
+
+static struct ox_mq *read_mq;
+static uint32_t      read_next_q;
+
+static const uint8_t parser_zero_sec[NVME_KERNEL_PG_SIZE];
+
+static uint8_t                                  split_started;
+static TAILQ_HEAD(split_free, nvme_parser_split) split_fh;
+static LIST_HEAD(split_all, nvme_parser_split)  split_ah;
+static pthread_spinlock_t                       split_spin;
 
 static void nvme_debug_print_io (NvmeRwCmd *cmd, uint32_t bs, uint64_t dt_sz,
         uint64_t md_sz, uint64_t elba, uint64_t *prp)
@@ -52,7 +82,7 @@ static void nvme_debug_print_io (NvmeRwCmd *cmd, uint32_t bs, uint64_t dt_sz,
     fflush (stdout);
 }
 
-static void nvme_parser_prepare_read (struct nvm_io_cmd *cmd)
+static void nvme_parser_prepare_read (struct nvm_io_cmd *cmd, uint32_t n_sec)
 {
     uint32_t i, pg, nsec;
 
@@ -60,13 +90,13 @@ static void nvme_parser_prepare_read (struct nvm_io_cmd *cmd)
 
     pg = 0;
     nsec = 0;
-    for (i = 0; i <= cmd->n_sec; i++) {
+    for (i = 0; i <= n_sec; i++) {
 
         /* this is an user IO, so data is transferred to host */
-        cmd->mmgr_io[pg].force_sync_data[i] = 0;
+        cmd->mmgr_io[pg].force_sync_data[nsec] = 0;
 
         /* create flash pages */
-        if ((i == cmd->n_sec) ||
+        if ((i == n_sec) ||
             (i && (cmd->ppalist[i].ppa == cmd->ppalist[i - 1].ppa)) ||
             (i && ( cmd->ppalist[i].g.ch != cmd->ppalist[i - 1].g.ch ||
                     cmd->ppalist[i].g.lun != cmd->ppalist[i - 1].g.lun ||
@@ -96,37 +126,264 @@ static void nvme_parser_prepare_read (struct nvm_io_cmd *cmd)
     cmd->status.total_pgs = pg;
 }
 
+/* Not retried: a failure means the read timed out and was completed */
+static void nvme_parser_read_callback (void *opaque)
+{
+    struct nvm_io_cmd *cmd = (struct nvm_io_cmd *) opaque;
+
+    ox_mq_complete_req (read_mq, (struct ox_mq_entry *) cmd->mq_req);
+}
+
 static int nvme_parser_read_submit (struct nvm_io_cmd *cmd)
 {
-    int ret;
-    uint32_t sec_i, pgs;
+    uint32_t sec_i, nsec = 0;
     struct nvm_ppa_addr sec_ppa;
     struct nvm_mmgr *mmgr = ox_get_mmgr_instance ();
     struct app_map_entry *map_entry;
 
-    pgs = cmd->n_sec / mmgr->geometry->sec_per_pl_pg;
-    if (cmd->n_sec % mmgr->geometry->sec_per_pl_pg > 0)
-        pgs++;
-
     for (sec_i = 0; sec_i < cmd->n_sec; sec_i++) {
         map_entry = oxapp()->gl_map->read_fn (cmd->slba + sec_i);
-        sec_ppa.ppa = map_entry->ppa;
-        if (sec_ppa.ppa == AND64)
+        if (!map_entry || map_entry->ppa == AND64)
             return 1;
+        sec_ppa.ppa = map_entry->ppa;
 
-        /* 'cmd->ppalist[sec_i].ppa'is replaced for the PPA */
-        cmd->ppalist[sec_i].ppa = sec_ppa.ppa;
+        /* Unmapped sectors (never written or deallocated) are read as zeros
+         * without touching the media, mapped sectors are moved forward */
+        if (!sec_ppa.ppa) {
+            if (ox_dma ((void *) parser_zero_sec, cmd->prp[sec_i],
+                                    NVME_KERNEL_PG_SIZE, NVM_DMA_TO_HOST))
+                return 1;
+            continue;
+        }
+
+        /* 'cmd->ppalist[nsec].ppa'is replaced for the PPA */
+        cmd->ppalist[nsec].ppa = sec_ppa.ppa;
+        cmd->prp[nsec] = cmd->prp[sec_i];
+        cmd->channel[nsec] = &mmgr->ch_info[sec_ppa.g.ch];
+        nsec++;
+    }
 
-        cmd->channel[sec_i] = &mmgr->ch_info[sec_ppa.g.ch];
+    if (!nsec) {
+        cmd->status.status = NVM_IO_SUCCESS;
+        nvme_parser_read_callback (cmd);
+        return 0;
     }
 
-    nvme_parser_prepare_read (cmd);
+    nvme_parser_prepare_read (cmd, nsec);
+    ox_lat_mark (cmd, OX_LAT_T_FTL);
 
-    cmd->callback.cb_fn = ox_ftl_process_cq;
+    cmd->callback.cb_fn = nvme_parser_read_callback;
     cmd->callback.opaque = (void *) cmd;
-    ret = oxapp()->ppa_io->submit_fn (cmd);
 
-    return ret;
+    return oxapp()->ppa_io->submit_fn (cmd);
+}
+
+/*
+ * Read queue consumer. Lookups that miss the map cache read the mapping page
+ * synchronously, this blocks only the read queue thread, not the transport.
+ */
+static void nvme_parser_read_sq (struct ox_mq_entry *req)
+{
+    struct nvm_io_cmd *cmd = (struct nvm_io_cmd *) req->opaque;
+
+    cmd->mq_req = (void *) req;
+
+    if (nvme_parser_read_submit (cmd)) {
+        cmd->status.status = NVM_IO_FAIL;
+        cmd->status.nvme_status = NVME_CMD_ABORT_REQ;
+        ox_mq_complete_req (read_mq, req);
+    }
+}
+
+static int nvme_parser_read_enqueue (struct nvm_io_cmd *cmd)
+{
+    uint32_t qid, retry = NVM_QUEUE_RETRY;
+
+    ox_lat_mark (cmd, OX_LAT_T_SUBMIT);
+    cmd->status.nvme_status = NVME_SUCCESS;
+    cmd->io_class = OX_IO_CLASS_USER;
+
+    qid = __sync_fetch_and_add (&read_next_q, 1) % PARSER_READ_QUEUES;
+
+    while (ox_mq_submit_req (read_mq, qid, cmd)) {
+        retry--;
+        if (!retry)
+            return NVME_CMD_ABORT_REQ;
+        usleep (NVM_QUEUE_RETRY_SLEEP);
+    }
+
+    return NVME_NO_COMPLETE;
+}
+
+static struct nvme_parser_split *nvme_parser_split_new (void)
+{
+    struct nvme_parser_split *split;
+    uint32_t sub_i;
+
+    split = ox_calloc (1, sizeof (struct nvme_parser_split),
+                                                        OX_MEM_NVME_PARSER);
+    if (!split)
+        return NULL;
+
+    for (sub_i = 0; sub_i < PARSER_SPLIT_SUBS; sub_i++)
+        pthread_mutex_init (&split->sub[sub_i].mutex, NULL);
+
+    pthread_spin_lock (&split_spin);
+    LIST_INSERT_HEAD (&split_ah, split, aentry);
+    pthread_spin_unlock (&split_spin);
+
+    return split;
+}
+
+static void nvme_parser_split_free (struct nvme_parser_split *split)
+{
+    uint32_t sub_i;
+
+    for (sub_i = 0; sub_i < PARSER_SPLIT_SUBS; sub_i++)
+        pthread_mutex_destroy (&split->sub[sub_i].mutex);
+
+    ox_free (split, OX_MEM_NVME_PARSER);
+}
+
+/* Never waits on the transport thread, an empty pool grows instead */
+static struct nvme_parser_split *nvme_parser_split_get (void)
+{
+    struct nvme_parser_split *split;
+
+    pthread_spin_lock (&split_spin);
+    split = TAILQ_FIRST (&split_fh);
+    if (split)
+        TAILQ_REMOVE (&split_fh, split, entry);
+    pthread_spin_unlock (&split_spin);
+
+    return (split) ? split : nvme_parser_split_new ();
+}
+
+/* Called by the core when the last sub-command completes */
+static void nvme_parser_split_put (void *opaque)
+{
+    struct nvme_parser_split *split = (struct nvme_parser_split *) opaque;
+
+    pthread_spin_lock (&split_spin);
+    TAILQ_INSERT_TAIL (&split_fh, split, entry);
+    pthread_spin_unlock (&split_spin);
+}
+
+static int nvme_parser_split_submit (NvmeRequest *req, uint64_t *prp)
+{
+    struct nvm_io_cmd *cmd = &req->nvm_io, *sub;
+    struct nvme_parser_split *split;
+    uint32_t sub_i, n_sub, nsec, off = 0;
+    int ret = NVME_NO_COMPLETE;
+
+    split = nvme_parser_split_get ();
+    if (!split) {
+        log_err ("[nvme-parser: Split not allocated, cid %lu aborted.]",
+                                                                    cmd->cid);
+        return NVME_CMD_ABORT_REQ;
+    }
+
+    n_sub = (cmd->n_sec + NVM_IO_MAX_SEC - 1) / NVM_IO_MAX_SEC;
+
+    cmd->pending = n_sub;
+    cmd->status.status = NVM_IO_SUCCESS;
+    cmd->status.nvme_status = NVME_SUCCESS;
+    cmd->callback.cb_fn = nvme_parser_split_put;
+    cmd->callback.opaque = (void *) split;
+
+    for (sub_i = 0; sub_i < n_sub; sub_i++) {
+        sub = &split->sub[sub_i];
+        nsec = MIN (NVM_IO_MAX_SEC, cmd->n_sec - off);
+
+        sub->cid = cmd->cid;
+        sub->sec_sz = cmd->sec_sz;
+        sub->md_sz = cmd->md_sz;
+        sub->cmdtype = cmd->cmdtype;
+        sub->n_sec = nsec;
+        sub->slba = cmd->slba + off;
+        sub->req = cmd->req;
+        sub->opaque = NULL;
+        sub->parent = cmd;
+        memcpy (sub->lat_ts, cmd->lat_ts, sizeof (cmd->lat_ts));
+        memset (&sub->status, 0x0, sizeof (struct nvm_io_status));
+        sub->status.status = NVM_IO_NEW;
+
+        if (ret == NVME_NO_COMPLETE) {
+            if (ox_io_vec_get (sub, nsec)) {
+                ret = NVME_INTERNAL_DEV_ERROR;
+            } else {
+                memcpy (sub->prp, &prp[off], sizeof (uint64_t) * nsec);
+                ret = (cmd->cmdtype == MMGR_READ_PG) ?
+                        nvme_parser_read_enqueue (sub) : ox_submit_ftl (sub);
+            }
+        }
+        off += nsec;
+
+        /* Sub-commands that were not submitted fail the host command */
+        if (ret != NVME_NO_COMPLETE) {
+            sub->status.status = NVM_IO_FAIL;
+            sub->status.nvme_status = ret;
+            ox_ftl_process_cq (sub);
+        }
+    }
+
+    return NVME_NO_COMPLETE;
+}
+
+/* A PRP list starts anywhere in a page, qword aligned. If the entries left do
+ * not fit in the rest of that page, its last slot points to the next list */
+static int nvme_parser_prp_list (uint64_t *prp, uint64_t list, uint32_t n)
+{
+    uint32_t slots, len;
+
+    while (n) {
+        if (list & (sizeof (uint64_t) - 1))
+            return -1;
+
+        slots = (NVME_KERNEL_PG_SIZE - (list & (NVME_KERNEL_PG_SIZE - 1))) /
+                                                            sizeof (uint64_t);
+        len = (n > slots) ? slots - 1 : n;
+        if (len && ox_dma ((void *) prp, list, len * sizeof (uint64_t),
+                                                        NVM_DMA_FROM_HOST))
+            return -1;
+
+        n -= len;
+        prp += len;
+
+        if (n && ox_dma ((void *) &list, list + len * sizeof (uint64_t),
+                                        sizeof (uint64_t), NVM_DMA_FROM_HOST))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int nvme_parser_map_prp (NvmeCmd *cmd, uint32_t nlb, uint64_t *prp)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint64_t keys[16];
+
+    switch (rw->psdt) {
+        case CMD_PSDT_PRP:
+        case CMD_PSDT_RSV:
+            prp[0] = rw->prp1;
+
+            if (nlb == 2)
+                prp[1] = rw->prp2;
+            else if (nlb > 2 && nvme_parser_prp_list (&prp[1], rw->prp2,
+                                                                    nlb - 1))
+                return NVME_DATA_TRAS_ERROR;
+            break;
+        case CMD_PSDT_SGL:
+        case CMD_PSDT_SGL_MD:
+            if (nvmef_sgl_to_prp (nlb, &cmd->sgl, prp, keys))
+                return NVME_INVALID_FIELD;
+            break;
+        default:
+            return NVME_INVALID_FORMAT;
+    }
+
+    return NVME_SUCCESS;
 }
 
 static int parser_nvme_rw (NvmeRequest *req, NvmeCmd *cmd)
@@ -134,8 +391,9 @@ static int parser_nvme_rw (NvmeRequest *req, NvmeCmd *cmd)
     NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
     NvmeNamespace *ns = req->ns;
     NvmeCtrl *n = core.nvme_ctrl;
-    uint64_t keys[16];
-    int i;
+    uint64_t split_prp[NVME_MAX_NLB];
+    uint64_t *prp;
+    int i, ret;
 
     uint32_t nlb  = rw->nlb + 1;
     uint64_t slba = rw->slba;
@@ -145,6 +403,10 @@ static int parser_nvme_rw (NvmeRequest *req, NvmeCmd *cmd)
     const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
     uint64_t data_size = nlb << data_shift;
 
+    memset (req->nvm_io.lat_ts, 0x0, sizeof (req->nvm_io.lat_ts));
+    ox_lat_mark (&req->nvm_io, OX_LAT_T_PARSE);
+    OX_PROBE4 (nvme_parse, rw->cid, rw->opcode, slba, nlb);
+
     req->nvm_io.status.status = NVM_IO_NEW;
     req->is_write = rw->opcode == NVME_CMD_WRITE || rw->opcode == NVME_CMD_WRITE_DELTA;
 
@@ -154,32 +416,24 @@ static int parser_nvme_rw (NvmeRequest *req, NvmeCmd *cmd)
     if (n->id_ctrl.mdts && data_size > n->page_size * (1 << n->id_ctrl.mdts))
 	return NVME_LBA_RANGE | NVME_DNR;
 
-    if (nlb > 256)
+    if (nlb > NVME_MAX_NLB)
 	return NVME_INVALID_FIELD | NVME_DNR;
 
     /* Metadata and End-to-end Data protection are disabled */
 
     /* Map PRPs and SGL addresses */
-    switch (rw->psdt) {
-        case CMD_PSDT_PRP:
-        case CMD_PSDT_RSV:
-            req->nvm_io.prp[0] = rw->prp1;
-
-            if (nlb == 2)
-                req->nvm_io.prp[1] = rw->prp2;
-            else if (nlb > 2)
-                ox_dma ((void *)(&req->nvm_io.prp[1]), rw->prp2,
-                            (nlb - 1) * sizeof(uint64_t), NVM_DMA_FROM_HOST);
-            break;
-        case CMD_PSDT_SGL:
-        case CMD_PSDT_SGL_MD:
-            if (nvmef_sgl_to_prp (nlb, &cmd->sgl, req->nvm_io.prp, keys))
-                return NVME_INVALID_FIELD;
-            break;
-        default:
-            return NVME_INVALID_FORMAT;
+    if (nlb > NVM_IO_MAX_SEC) {
+        prp = split_prp;
+    } else {
+        if (ox_io_vec_get (&req->nvm_io, nlb))
+            return NVME_INTERNAL_DEV_ERROR;
+        prp = req->nvm_io.prp;
     }
 
+    ret = nvme_parser_map_prp (cmd, nlb, prp);
+    if (ret)
+        return ret;
+
     req->slba = slba;
     req->meta_size = 0;
     req->status = NVME_SUCCESS;
@@ -204,6 +458,7 @@ static int parser_nvme_rw (NvmeRequest *req, NvmeCmd *cmd)
     req->nvm_io.n_sec = nlb;
     req->nvm_io.req = (void *) req;
     req->nvm_io.slba = slba;
+    req->nvm_io.parent = NULL;
 
     req->nvm_io.status.pg_errors = 0;
     req->nvm_io.status.ret_t = 0;
@@ -218,13 +473,15 @@ static int parser_nvme_rw (NvmeRequest *req, NvmeCmd *cmd)
 
     if (core.debug)
         nvme_debug_print_io (rw, req->nvm_io.sec_sz, data_size,
-                                     req->nvm_io.md_sz, elba, req->nvm_io.prp);
+                                     req->nvm_io.md_sz, elba, prp);
+
+    if (nlb > NVM_IO_MAX_SEC)
+        return nvme_parser_split_submit (req, prp);
 
     if (req->is_write)
         return ox_submit_ftl (&req->nvm_io);
     else
-        return (!nvme_parser_read_submit (&req->nvm_io)) ? NVME_NO_COMPLETE :
-                                                            NVME_CMD_ABORT_REQ;
+        return nvme_parser_read_enqueue (&req->nvm_io);
 }
 
 static int parser_nvme_null (NvmeRequest *req, NvmeCmd *cmd)
@@ -232,6 +489,131 @@ static int parser_nvme_null (NvmeRequest *req, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
+/* Completes after all writes submitted before it are durable in OX-App */
+static int parser_nvme_flush (NvmeRequest *req, NvmeCmd *cmd)
+{
+    memset (req->nvm_io.lat_ts, 0x0, sizeof (req->nvm_io.lat_ts));
+    OX_PROBE4 (nvme_parse, cmd->cid, cmd->opcode, 0, 0);
+
+    /* Other FTLs do not acknowledge writes before they reach the media */
+    if (core.std_ftl != FTL_ID_OXAPP || core.std_oxapp != FTL_ID_BLOCK)
+        return NVME_SUCCESS;
+
+    if (ox_io_vec_get (&req->nvm_io, 1))
+        return NVME_INTERNAL_DEV_ERROR;
+
+    req->slba = 0;
+    req->nlb = 0;
+    req->is_write = 0;
+    req->status = NVME_SUCCESS;
+
+    req->nvm_io.cid = cmd->cid;
+    req->nvm_io.cmdtype = MMGR_FLUSH;
+    req->nvm_io.sec_sz = NVME_KERNEL_PG_SIZE;
+    req->nvm_io.md_sz = 0;
+    req->nvm_io.n_sec = 0;
+    req->nvm_io.slba = 0;
+    req->nvm_io.req = (void *) req;
+    req->nvm_io.parent = NULL;
+
+    memset (&req->nvm_io.status, 0x0, sizeof (struct nvm_io_status));
+    req->nvm_io.status.status = NVM_IO_NEW;
+
+    return ox_submit_ftl (&req->nvm_io);
+}
+
+/* Loads the DSM range list, it fits in one host page unless PRP1 has an
+ * offset. SGL data blocks are contiguous. */
+static int nvme_parser_dsm_ranges (NvmeCmd *cmd, NvmeDsmRange *range,
+                                                                uint32_t nr)
+{
+    NvmeDsmCmd *dsm = (NvmeDsmCmd *) cmd;
+    uint32_t len = nr * sizeof (NvmeDsmRange), first = len;
+    uint32_t pg_sz = core.nvme_ctrl->page_size;
+    uint64_t prp[2];
+    int ret;
+
+    if ((dsm->psdt == CMD_PSDT_PRP || dsm->psdt == CMD_PSDT_RSV) &&
+                                        (dsm->prp1 % pg_sz) + len > pg_sz)
+        first = pg_sz - (dsm->prp1 % pg_sz);
+
+    ret = nvme_parser_map_prp (cmd, (first < len) ? 2 : 1, prp);
+    if (ret)
+        return ret;
+
+    if (ox_dma ((void *) range, prp[0], first, NVM_DMA_FROM_HOST))
+        return NVME_DATA_TRAS_ERROR;
+
+    if (first < len && ox_dma ((uint8_t *) range + first, prp[1],
+                                            len - first, NVM_DMA_FROM_HOST))
+        return NVME_DATA_TRAS_ERROR;
+
+    return NVME_SUCCESS;
+}
+
+/* Deallocates LBA ranges, the other DSM attributes are hints and ignored */
+static int parser_nvme_dsm (NvmeRequest *req, NvmeCmd *cmd)
+{
+    NvmeDsmCmd *dsm = (NvmeDsmCmd *) cmd;
+    NvmeNamespace *ns = req->ns;
+    NvmeDsmRange range[NVME_DSM_MAX_RANGES];
+    uint32_t range_i, n = 0, nr = (dsm->nr & 0xff) + 1;
+    int ret;
+
+    memset (req->nvm_io.lat_ts, 0x0, sizeof (req->nvm_io.lat_ts));
+    OX_PROBE4 (nvme_parse, cmd->cid, cmd->opcode, 0, nr);
+
+    if (!(dsm->attributes & NVME_DSMGMT_AD))
+        return NVME_SUCCESS;
+
+    /* Only OX-App block keeps a mapping to release */
+    if (core.std_ftl != FTL_ID_OXAPP || core.std_oxapp != FTL_ID_BLOCK)
+        return NVME_SUCCESS;
+
+    ret = nvme_parser_dsm_ranges (cmd, range, nr);
+    if (ret)
+        return ret;
+
+    for (range_i = 0; range_i < nr; range_i++)
+        if (range[range_i].slba > ns->id_ns.nsze ||
+                range[range_i].nlb > ns->id_ns.nsze - range[range_i].slba)
+            return NVME_LBA_RANGE | NVME_DNR;
+
+    if (ox_io_vec_get (&req->nvm_io, nr))
+        return NVME_INTERNAL_DEV_ERROR;
+
+    /* Ranges are passed to the FTL in the sector arrays */
+    for (range_i = 0; range_i < nr; range_i++) {
+        if (!range[range_i].nlb)
+            continue;
+        req->nvm_io.prp[n] = range[range_i].slba;
+        req->nvm_io.md_prp[n] = range[range_i].nlb;
+        n++;
+    }
+
+    if (!n)
+        return NVME_SUCCESS;
+
+    req->slba = 0;
+    req->nlb = 0;
+    req->is_write = 0;
+    req->status = NVME_SUCCESS;
+
+    req->nvm_io.cid = cmd->cid;
+    req->nvm_io.cmdtype = MMGR_TRIM;
+    req->nvm_io.sec_sz = NVME_KERNEL_PG_SIZE;
+    req->nvm_io.md_sz = 0;
+    req->nvm_io.n_sec = n;
+    req->nvm_io.slba = 0;
+    req->nvm_io.req = (void *) req;
+    req->nvm_io.parent = NULL;
+
+    memset (&req->nvm_io.status, 0x0, sizeof (struct nvm_io_status));
+    req->nvm_io.status.status = NVM_IO_NEW;
+
+    return ox_submit_ftl (&req->nvm_io);
+}
+
 static struct nvm_parser_cmd nvme_cmds[PARSER_NVME_COUNT] = {
     {
         .name       = "NVME_WRITE",
@@ -262,14 +644,86 @@ static struct nvm_parser_cmd nvme_cmds[PARSER_NVME_COUNT] = {
         .opcode     = NVME_CMD_WRITE_DELTA,
         .opcode_fn  = parser_nvme_rw,
         .queue_type = NVM_CMD_IO
+    },
+    {
+        .name       = "NVME_FLUSH",
+        .opcode     = NVME_CMD_FLUSH,
+        .opcode_fn  = parser_nvme_flush,
+        .queue_type = NVM_CMD_IO
+    },
+    {
+        .name       = "NVME_DSM",
+        .opcode     = NVME_CMD_DSM,
+        .opcode_fn  = parser_nvme_dsm,
+        .queue_type = NVM_CMD_IO
     }
 };
 
+static void nvme_parser_split_exit (void)
+{
+    struct nvme_parser_split *split;
+
+    while (!LIST_EMPTY (&split_ah)) {
+        split = LIST_FIRST (&split_ah);
+        LIST_REMOVE (split, aentry);
+        nvme_parser_split_free (split);
+    }
+    TAILQ_INIT (&split_fh);
+
+    pthread_spin_destroy (&split_spin);
+    split_started = 0;
+}
+
+static int nvme_parser_split_init (void)
+{
+    struct nvme_parser_split *split;
+    uint32_t split_i;
+
+    if (!ox_mem_create_type ("NVME_PARSER", OX_MEM_NVME_PARSER))
+        return -1;
+
+    if (pthread_spin_init (&split_spin, 0))
+        return -1;
+
+    TAILQ_INIT (&split_fh);
+    LIST_INIT (&split_ah);
+    split_started = 1;
+
+    for (split_i = 0; split_i < PARSER_SPLIT_POOL; split_i++) {
+        split = nvme_parser_split_new ();
+        if (!split) {
+            nvme_parser_split_exit ();
+            return -1;
+        }
+        TAILQ_INSERT_TAIL (&split_fh, split, entry);
+    }
+
+    return 0;
+}
+
 static void parser_nvme_exit (struct nvm_parser *parser)
 {
+    if (read_mq) {
+        ox_mq_destroy (read_mq);
+        read_mq = NULL;
+    }
 
+    if (split_started)
+        nvme_parser_split_exit ();
 }
 
+static struct ox_mq_config read_mq_config = {
+    .name       = "NVME_READ",
+    .n_queues   = PARSER_READ_QUEUES,
+    .q_size     = PARSER_READ_Q_SIZE,
+    .sq_fn      = nvme_parser_read_sq,
+    .cq_fn      = ox_ftl_process_cq,
+    .to_fn      = ox_ftl_process_to,
+    .to_usec    = NVM_FTL_QUEUE_TO,
+    .flags      = (OX_MQ_TO_COMPLETE | OX_MQ_RING | OX_MQ_CQ_INLINE |
+                                        OX_MQ_CPU_AFFINITY | OX_MQ_CPU_AUTO)
+};
+
 static struct nvm_parser parser_nvme = {
     .name       = "NVME_PARSER",
     .cmd_count  = PARSER_NVME_COUNT,
@@ -280,5 +734,24 @@ int parser_nvme_init (void)
 {
     parser_nvme.cmd = nvme_cmds;
 
-    return ox_register_parser (&parser_nvme);
+    if (nvme_parser_split_init ())
+        return -1;
+
+    read_mq = ox_mq_init (&read_mq_config);
+    if (!read_mq)
+        goto SPLIT;
+
+    read_next_q = 0;
+
+    if (ox_register_parser (&parser_nvme))
+        goto MQ;
+
+    return 0;
+
+MQ:
+    ox_mq_destroy (read_mq);
+    read_mq = NULL;
+SPLIT:
+    nvme_parser_split_exit ();
+    return -1;
 }
\ No newline at end of file
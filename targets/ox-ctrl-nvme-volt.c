@@ -30,6 +30,15 @@ static void ox_ftl_modules (void)
     oxb_delta_register ();
 }
 
+/* Memory allowed over the preallocated pools, changed at run time with the
+ * 'budget' command */
+static void ox_mem_budgets (void)
+{
+    ox_mem_conf_budget ("OXAPP_TRANSACTION", 128 * 1024 * 1024);
+    ox_mem_conf_budget ("OXBLK_LOG", 64 * 1024 * 1024);
+    ox_mem_conf_budget ("OXBLK_LBA", 64 * 1024 * 1024);
+}
+
 int main (int argc, char **argv)
 {
     ox_add_mmgr (mmgr_volt_init_nodisk);
@@ -40,6 +49,7 @@ int main (int argc, char **argv)
     ox_set_std_ftl (FTL_ID_OXAPP);
     ox_set_std_oxapp (FTL_ID_BLOCK);
     ox_ftl_modules ();
+    ox_mem_budgets ();
 
     ox_add_parser (parser_nvme_init);
     ox_add_parser (parser_fabrics_init);
@@ -0,0 +1,119 @@
+/*  OX: Open-Channel NVM Express SSD Controller
+ *
+ *  - Multi-Queue Support for Parallel I/O - Trace to CSV converter
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Converts the binary files written by 'output start/stop' to the CSV format
+ * of earlier OX versions. Usage: ox-mq-trace <file.trc> [file.csv]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <libox.h>
+#include <ox-mq.h>
+
+static int trace_write_row (FILE *fp, struct oxmq_output_row *row)
+{
+    char tstart[21], tend[21];
+    uint64_t ulat;
+
+    ulat = (row->tend > row->tstart) ? (row->tend - row->tstart) / 1000 : 0;
+
+    /* Timestamps are printed without the 4 most significant digits */
+    sprintf (tstart, "%lu", row->tstart);
+    sprintf (tend, "%lu", row->tend);
+    if (strlen (tstart) > 4)
+        memmove (tstart, tstart + 4, strlen (tstart) - 3);
+    if (strlen (tend) > 4)
+        memmove (tend, tend + 4, strlen (tend) - 3);
+
+    return fprintf (fp, "%lu;%d;%lu;%d;%d;%d;%d;%d;%d;%s;%s;%lu;%c;%d;%d;%d\n",
+                row->node_seq, row->node_id, row->lba, row->ch, row->lun,
+                row->blk, row->pg, row->pl, row->sec, tstart, tend, ulat,
+                row->type, row->failed, row->datacmp, row->size);
+}
+
+int main (int argc, char **argv)
+{
+    struct oxmq_output_hdr hdr;
+    struct oxmq_output_row row;
+    char csvname[256];
+    uint64_t rows = 0;
+    FILE *in, *out;
+    size_t len;
+
+    if (argc < 2) {
+        printf ("Usage: %s <file.trc> [file.csv]\n", argv[0]);
+        return -1;
+    }
+
+    in = fopen (argv[1], "r");
+    if (!in) {
+        printf (" Trace file not found: %s\n", argv[1]);
+        return -1;
+    }
+
+    if (fread (&hdr, sizeof (struct oxmq_output_hdr), 1, in) != 1 ||
+                memcmp (hdr.magic, OXMQ_OUTPUT_MAGIC, sizeof (hdr.magic))) {
+        printf (" Not an ox-mq trace file: %s\n", argv[1]);
+        goto CLOSE_IN;
+    }
+
+    if (hdr.version != OXMQ_OUTPUT_VERSION ||
+                            hdr.row_sz != sizeof (struct oxmq_output_row)) {
+        printf (" Unsupported trace version %d (row size %d)\n",
+                                                    hdr.version, hdr.row_sz);
+        goto CLOSE_IN;
+    }
+
+    if (argc > 2) {
+        snprintf (csvname, sizeof (csvname), "%s", argv[2]);
+    } else {
+        len = strlen (argv[1]);
+        if (len > 4 && !strcmp (argv[1] + len - 4, ".trc"))
+            len -= 4;
+        snprintf (csvname, sizeof (csvname), "%.*s.csv", (int) len, argv[1]);
+    }
+
+    out = fopen (csvname, "w");
+    if (!out) {
+        printf (" Not possible to create %s\n", csvname);
+        goto CLOSE_IN;
+    }
+
+    fprintf (out, "node_sequence;node_id;lba;channel;lun;block;page;"
+        "plane;sector;start;end;latency;type;is_failed;read_memcmp;bytes\n");
+
+    while (fread (&row, sizeof (struct oxmq_output_row), 1, in) == 1) {
+        if (trace_write_row (out, &row) < 0) {
+            printf (" Not possible writing to %s\n", csvname);
+            fclose (out);
+            goto CLOSE_IN;
+        }
+        rows++;
+    }
+
+    fclose (out);
+    fclose (in);
+
+    printf (" %s (%s, %d queues): %lu rows -> %s\n", argv[1], hdr.name,
+                                                hdr.nodes, rows, csvname);
+    return 0;
+
+CLOSE_IN:
+    fclose (in);
+    return -1;
+}
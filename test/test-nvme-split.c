@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <libox.h>
+#include <nvme.h>
+#include <ox-app.h>
+
+/*
+ * Checks I/Os above NVM_IO_MAX_SEC, which the fabrics host never sends. The
+ * controller runs in this process on volt with a loopback transport, data is
+ * copied by memcpy and PRPs are local addresses. Each command must be split
+ * into sub-commands and completed once with the merged status:
+ *
+ *  - write and read back SPLIT_NLB blocks, the PRP list starts at an offset
+ *    inside its page and chains at the end of each list page;
+ *  - read unwritten blocks into a buffer with a page that fails the DMA, only
+ *    one sub-command fails and the command fails.
+ *
+ * Run as 'ox-test-nvme-split start'. Returns non-zero if any check fails.
+ */
+
+#define SPLIT_QID       1
+#define SPLIT_NLB       600     /* 3 sub-commands: 256 + 256 + 88 */
+#define SPLIT_SLBA      4096
+#define SPLIT_ZERO_SLBA (SPLIT_SLBA + 16384)
+#define SPLIT_POISON    300     /* Page of the second sub-command */
+#define SPLIT_LIST_OFF  3000    /* Offset of the PRP list in its first page */
+#define SPLIT_LIST_PGS  4
+#define WAIT_SEC        60
+#define READY_SEC       300
+
+#define PG_SZ           NVME_KERNEL_PG_SIZE
+
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            printf ("  FAIL %s:%d: ", __func__, __LINE__);              \
+            printf (__VA_ARGS__);                                       \
+            printf ("\n");                                              \
+            fails++;                                                    \
+        }                                                               \
+} while (0)
+
+struct split_io {
+    uint16_t        status;
+    uint32_t        done;
+};
+
+static pthread_mutex_t   split_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    split_cond = PTHREAD_COND_INITIALIZER;
+static volatile uint64_t poison;
+static uint16_t          next_cid;
+static int               fails;
+
+extern struct core_struct core;
+
+static int split_create (uint16_t qid)
+{
+    return 0;
+}
+
+static void split_destroy (uint16_t qid)
+{
+
+}
+
+static void split_exit (void)
+{
+
+}
+
+static int split_complete (NvmeCqe *cqe, void *ctx)
+{
+    struct split_io *io = (struct split_io *) ctx;
+
+    pthread_mutex_lock (&split_mutex);
+    io->status = cqe->status;
+    io->done++;
+    pthread_cond_broadcast (&split_cond);
+    pthread_mutex_unlock (&split_mutex);
+
+    return 0;
+}
+
+static int split_rdma (void *buf, uint32_t size, uint64_t prp, uint8_t dir)
+{
+    if (poison && prp >= poison && prp < poison + PG_SZ)
+        return -1;
+
+    if (dir == NVM_DMA_TO_HOST)
+        memcpy ((void *) prp, buf, size);
+    else
+        memcpy (buf, (void *) prp, size);
+
+    return 0;
+}
+
+static struct nvm_fabrics_ops split_ops = {
+    .create     = split_create,
+    .destroy    = split_destroy,
+    .complete   = split_complete,
+    .rdma       = split_rdma,
+    .exit       = split_exit
+};
+
+static struct nvm_fabrics split_fabrics = {
+    .name       = "SPLIT_LOOPBACK",
+    .ops        = &split_ops
+};
+
+static int split_transport_init (void)
+{
+    return ox_register_fabrics (&split_fabrics);
+}
+
+/* Fills the PRP list of 'buf' at 'off' in 'list', the last slot of a list
+ * page points to the next page if entries are left. Returns PRP2 */
+static uint64_t split_prp_list (uint8_t *buf, uint32_t nlb, uint8_t *list,
+                                                                uint32_t off)
+{
+    uint64_t *slot = (uint64_t *) (list + off);
+    uint64_t prp2 = (uint64_t) slot;
+    uint32_t i;
+
+    for (i = 1; i < nlb; i++) {
+        if (((uint64_t) slot & (PG_SZ - 1)) == PG_SZ - sizeof (uint64_t) &&
+                                                                i < nlb - 1) {
+            *slot = ((uint64_t) slot & ~((uint64_t) PG_SZ - 1)) + PG_SZ;
+            slot = (uint64_t *) *slot;
+        }
+        *slot = (uint64_t) (buf + (uint64_t) i * PG_SZ);
+        slot++;
+    }
+
+    return prp2;
+}
+
+/* Submits one command and waits for its completion, returns the status */
+static uint16_t split_io (uint8_t opcode, uint64_t slba, uint8_t *buf,
+                                                                uint8_t *list)
+{
+    struct split_io io = { 0, 0 };
+    struct timespec ts;
+    NvmeCmd cmd;
+    NvmeRwCmd *rw = (NvmeRwCmd *) &cmd;
+
+    memset (&cmd, 0x0, sizeof (NvmeCmd));
+    memset (list, 0x0, PG_SZ * SPLIT_LIST_PGS);
+
+    rw->opcode = opcode;
+    rw->psdt = CMD_PSDT_PRP;
+    rw->cid = SPLIT_QID * core.nvme_ctrl->max_q_ents + next_cid++;
+    rw->nsid = 1;
+    rw->slba = slba;
+    rw->nlb = SPLIT_NLB - 1;
+    rw->prp1 = (uint64_t) buf;
+    rw->prp2 = split_prp_list (buf, SPLIT_NLB, list, SPLIT_LIST_OFF);
+
+    if (nvmef_process_capsule (&cmd, &io)) {
+        CHECK (0, "opcode 0x%x not submitted", opcode);
+        return NVME_CMD_ABORT_REQ;
+    }
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += WAIT_SEC;
+
+    pthread_mutex_lock (&split_mutex);
+    while (!io.done) {
+        if (pthread_cond_timedwait (&split_cond, &split_mutex, &ts)
+                                                                == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock (&split_mutex);
+
+    CHECK (io.done == 1, "opcode 0x%x completed %d times", opcode, io.done);
+
+    /* A second completion would show up after the last sub-command */
+    usleep (200000);
+    CHECK (io.done == 1, "opcode 0x%x completed %d times, late", opcode,
+                                                                    io.done);
+
+    return io.status;
+}
+
+static void split_run (void)
+{
+    uint8_t *wbuf, *rbuf, *list;
+    uint16_t status;
+    uint32_t i;
+
+    wbuf = aligned_alloc (PG_SZ, (size_t) PG_SZ * SPLIT_NLB);
+    rbuf = aligned_alloc (PG_SZ, (size_t) PG_SZ * SPLIT_NLB);
+    list = aligned_alloc (PG_SZ, PG_SZ * SPLIT_LIST_PGS);
+    if (!wbuf || !rbuf || !list) {
+        CHECK (0, "buffers not allocated");
+        goto FREE;
+    }
+
+    for (i = 0; i < PG_SZ * SPLIT_NLB; i++)
+        wbuf[i] = (uint8_t) (i / PG_SZ + i % 251);
+    memset (rbuf, 0x0, (size_t) PG_SZ * SPLIT_NLB);
+
+    status = split_io (NVME_CMD_WRITE, SPLIT_SLBA, wbuf, list);
+    CHECK (status == NVME_SUCCESS, "write status 0x%x", status);
+
+    status = split_io (NVME_CMD_READ, SPLIT_SLBA, rbuf, list);
+    CHECK (status == NVME_SUCCESS, "read status 0x%x", status);
+    CHECK (!memcmp (wbuf, rbuf, (size_t) PG_SZ * SPLIT_NLB),
+                                                "data read back differs");
+    printf ("  write/read %d blocks%s\n", SPLIT_NLB, fails ? "" : " ok");
+
+    /* Only the sub-command holding the poisoned page fails */
+    poison = (uint64_t) (rbuf + (uint64_t) SPLIT_POISON * PG_SZ);
+    status = split_io (NVME_CMD_READ, SPLIT_ZERO_SLBA, rbuf, list);
+    poison = 0;
+    CHECK (status == NVME_CMD_ABORT_REQ, "failed read status 0x%x", status);
+    printf ("  failed sub-command%s\n", fails ? "" : " ok");
+
+FREE:
+    free (list);
+    free (rbuf);
+    free (wbuf);
+}
+
+static void *split_test (void *arg)
+{
+    uint32_t wait = READY_SEC * 10;
+
+    while (!(core.run_flag & RUN_READY) && wait--)
+        usleep (100000);
+
+    printf ("\nsplit I/O checks:\n");
+
+    if (!(core.run_flag & RUN_READY)) {
+        CHECK (0, "controller not ready after %d seconds", READY_SEC);
+    } else if (nvmef_create_queue (SPLIT_QID)) {
+        CHECK (0, "queue %d not created", SPLIT_QID);
+    } else {
+        split_run ();
+    }
+
+    printf ("%s: %d failed checks\n", fails ? "FAILED" : "PASSED", fails);
+
+    /* The command line keeps the main thread, leave from here */
+    exit (fails ? EXIT_FAILURE : EXIT_SUCCESS);
+
+    return NULL;
+}
+
+static void ox_ftl_modules (void)
+{
+    oxb_bbt_byte_register ();
+    oxb_blk_md_register ();
+    oxb_ch_prov_register ();
+    oxb_gl_prov_register ();
+    oxb_ch_map_register();
+    oxb_gl_map_register ();
+    oxb_ppa_io_register ();
+    oxb_lba_io_register ();
+    oxb_gc_register ();
+    oxb_log_register ();
+    oxb_recovery_register ();
+    oxb_delta_register ();
+}
+
+int main (int argc, char **argv)
+{
+    pthread_t tid;
+
+    ox_add_mmgr (mmgr_volt_init_nodisk);
+
+    ox_add_ftl (ftl_lnvm_init);
+    ox_add_ftl (ftl_oxapp_init);
+    ox_set_std_ftl (FTL_ID_OXAPP);
+    ox_set_std_oxapp (FTL_ID_BLOCK);
+    ox_ftl_modules ();
+
+    ox_add_parser (parser_nvme_init);
+
+    ox_add_transport (split_transport_init);
+    ox_set_std_transport (NVM_TRANSP_FABRICS);
+
+    if (pthread_create (&tid, NULL, split_test, NULL))
+        return -1;
+
+    return ox_ctrl_start (argc, argv);
+}
@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <libox.h>
+#include <ox-mq.h>
+
+/*
+ * Correctness checks for ox-mq. Each case submits requests from several
+ * producer threads and checks that every request reaches sq_fn and cq_fn
+ * exactly once, in submission order per producer (and class, with QoS), and
+ * that all entries are back in the free lists at the end. Returns non-zero if
+ * any check fails.
+ */
+
+#define N_PRODUCERS     4
+#define N_QUEUES        2
+#define PER_PRODUCER    20000
+#define N_REQ           (N_PRODUCERS * PER_PRODUCER)
+#define SMALL_QUEUE     8       /* Small rings wrap around many times */
+#define WAIT_SEC        30
+
+#define QOS_PER_CLASS   32
+#define QOS_CHECKED     64
+
+#define TO_USEC         20000
+#define TO_HOLD_EVERY   1000    /* Every N-th request is left to time out */
+#define TO_SLOW_EVERY   4000    /* Every N-th is completed near its deadline */
+
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            printf ("  FAIL %s:%d: ", __func__, __LINE__);              \
+            printf (__VA_ARGS__);                                       \
+            printf ("\n");                                              \
+            fails++;                                                    \
+        }                                                               \
+} while (0)
+
+struct test_cmd {
+    uint32_t id;
+    uint32_t producer;
+    uint32_t seq;
+    uint8_t  cls;
+    uint8_t  hold;
+    uint8_t  slow;
+};
+
+static struct ox_mq         *test_mq;
+static struct test_cmd      *cmds;
+static uint32_t             *sq_count;
+static uint32_t             *cq_count;
+static int64_t               last_seq[N_PRODUCERS][OX_MQ_CLASSES];
+static uint32_t              order_err;
+static uint32_t              cq_total;
+static uint32_t              cq_inline;
+static uint32_t              to_total;
+static uint32_t              sq_done;
+static int                   test_batch;
+static int                   fails;
+
+static __thread int          in_sq;
+
+/* QoS: the SQ thread is held on a plug while the classes fill up */
+static volatile int          plug_in, plug_out;
+static const uint16_t        qos_weight[OX_MQ_CLASSES] = {4, 2, 1, 1};
+static uint8_t               qos_order[QOS_PER_CLASS * OX_MQ_CLASSES + 1];
+static uint32_t              qos_n;
+
+/* Timeout: held entries are completed late by the main thread, slow ones are
+ * completed by the SQ thread while the timeout thread may be taking them */
+static struct ox_mq_entry   *held[N_REQ / TO_HOLD_EVERY + 1];
+static uint32_t              held_n;
+
+static void test_sq_one (struct ox_mq_entry *req)
+{
+    struct test_cmd *cmd = (struct test_cmd *) req->opaque;
+
+    __atomic_fetch_add (&sq_count[cmd->id], 1, __ATOMIC_RELAXED);
+
+    /* A producer submits to a single queue, only its SQ thread gets here */
+    if ((int64_t) cmd->seq <= last_seq[cmd->producer][cmd->cls])
+        __atomic_fetch_add (&order_err, 1, __ATOMIC_RELAXED);
+    last_seq[cmd->producer][cmd->cls] = cmd->seq;
+
+    if (cmd->hold) {
+        held[__atomic_fetch_add (&held_n, 1, __ATOMIC_RELAXED)] = req;
+        return;
+    }
+
+    /* Entries behind a slow one may time out too, complete them once */
+    in_sq = 1;
+    if (cmd->slow)
+        usleep (TO_USEC * (6 + cmd->id % 5) / 8);
+    if (cmd->slow || test_mq->config->to_usec)
+        ox_mq_complete_req (test_mq, req);
+    else
+        while (ox_mq_complete_req (test_mq, req))
+            sched_yield ();
+    in_sq = 0;
+
+    __atomic_fetch_add (&sq_done, 1, __ATOMIC_RELEASE);
+}
+
+static void test_sq_batch (struct ox_mq_entry **req, int n)
+{
+    struct ox_mq_entry *run[OX_MQ_MAX_BATCH];
+    int i, done = 0, nrun = 0, slow = -1;
+
+    for (i = 0; i < n; i++) {
+        struct test_cmd *cmd = (struct test_cmd *) req[i]->opaque;
+
+        __atomic_fetch_add (&sq_count[cmd->id], 1, __ATOMIC_RELAXED);
+        if ((int64_t) cmd->seq <= last_seq[cmd->producer][cmd->cls])
+            __atomic_fetch_add (&order_err, 1, __ATOMIC_RELAXED);
+        last_seq[cmd->producer][cmd->cls] = cmd->seq;
+
+        if (cmd->hold) {
+            held[__atomic_fetch_add (&held_n, 1, __ATOMIC_RELAXED)] = req[i];
+            continue;
+        }
+        if (cmd->slow)
+            slow = cmd->id;
+        run[nrun++] = req[i];
+    }
+
+    in_sq = 1;
+    if (slow >= 0)
+        usleep (TO_USEC * (6 + slow % 5) / 8);
+    while (done < nrun) {
+        done += ox_mq_complete_batch (test_mq, &run[done], nrun - done);
+        if (done < nrun)
+            sched_yield ();
+    }
+    in_sq = 0;
+
+    __atomic_fetch_add (&sq_done, nrun, __ATOMIC_RELEASE);
+}
+
+static void test_sq_qos (struct ox_mq_entry *req)
+{
+    struct test_cmd *cmd = (struct test_cmd *) req->opaque;
+
+    __atomic_fetch_add (&sq_count[cmd->id], 1, __ATOMIC_RELAXED);
+
+    if (cmd->id == 0) {
+        plug_in = 1;
+        while (!plug_out)
+            usleep (100);
+    } else {
+        qos_order[qos_n++] = cmd->cls;
+    }
+
+    while (ox_mq_complete_req (test_mq, req))
+        sched_yield ();
+}
+
+static void test_cq (void *opaque)
+{
+    struct test_cmd *cmd = (struct test_cmd *) opaque;
+
+    __atomic_fetch_add (&cq_count[cmd->id], 1, __ATOMIC_RELAXED);
+    if (in_sq)
+        __atomic_fetch_add (&cq_inline, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&cq_total, 1, __ATOMIC_RELEASE);
+}
+
+static void test_to (void **opaque, int counter)
+{
+    __atomic_fetch_add (&to_total, counter, __ATOMIC_RELAXED);
+}
+
+static void test_submit (uint32_t qid, struct test_cmd *cmd)
+{
+    while (ox_mq_submit_class (test_mq, qid, cmd, cmd->cls))
+        sched_yield ();
+}
+
+static void *test_producer (void *arg)
+{
+    uint32_t p = *(uint32_t *) arg;
+    uint32_t qid = p % N_QUEUES, i = 0;
+    struct test_cmd *mine[OX_MQ_MAX_BATCH];
+    int n, ret;
+
+    while (i < PER_PRODUCER) {
+        if (!test_batch) {
+            test_submit (qid, &cmds[p * PER_PRODUCER + i]);
+            i++;
+            continue;
+        }
+
+        n = MIN (OX_MQ_MAX_BATCH, PER_PRODUCER - i);
+        for (ret = 0; ret < n; ret++)
+            mine[ret] = &cmds[p * PER_PRODUCER + i + ret];
+        ret = ox_mq_submit_batch (test_mq, qid, (void **) mine, n);
+        if (ret > 0)
+            i += ret;
+        else
+            sched_yield ();
+    }
+
+    return NULL;
+}
+
+static void test_reset (uint32_t n_req, uint8_t classes, uint32_t hold_every)
+{
+    uint32_t i, c;
+
+    memset (sq_count, 0x0, sizeof (uint32_t) * N_REQ);
+    memset (cq_count, 0x0, sizeof (uint32_t) * N_REQ);
+    for (i = 0; i < N_PRODUCERS; i++)
+        for (c = 0; c < OX_MQ_CLASSES; c++)
+            last_seq[i][c] = -1;
+
+    for (i = 0; i < n_req; i++) {
+        cmds[i].id = i;
+        cmds[i].producer = i / PER_PRODUCER;
+        cmds[i].seq = i % PER_PRODUCER;
+        cmds[i].cls = (classes) ? i % classes : 0;
+        cmds[i].hold = (hold_every && i % hold_every == hold_every - 1);
+        cmds[i].slow = (hold_every && i % TO_SLOW_EVERY == TO_SLOW_EVERY / 2);
+    }
+
+    order_err = cq_total = cq_inline = to_total = sq_done = 0;
+    held_n = qos_n = 0;
+    plug_in = plug_out = 0;
+    test_batch = 0;
+}
+
+static int test_wait_cq (uint32_t n)
+{
+    int ms = WAIT_SEC * 1000;
+
+    while (__atomic_load_n (&cq_total, __ATOMIC_ACQUIRE) < n && ms--)
+        usleep (1000);
+
+    return __atomic_load_n (&cq_total, __ATOMIC_ACQUIRE) == n;
+}
+
+static void test_init_config (struct ox_mq_config *config, const char *name,
+                                            uint32_t q_size, uint16_t flags)
+{
+    memset (config, 0x0, sizeof (struct ox_mq_config));
+    strcpy (config->name, name);
+    config->n_queues = N_QUEUES;
+    config->q_size = q_size;
+    config->sq_fn = test_sq_one;
+    config->cq_fn = test_cq;
+    config->to_fn = test_to;
+    config->flags = flags;
+    if (flags & OX_MQ_POLL)
+        config->poll_usec = 50;
+    if (flags & OX_MQ_SQ_BATCH)
+        config->sq_batch_fn = test_sq_batch;
+}
+
+/* All SQ and CQ entries are free once the queues are drained */
+static void test_check_free (uint32_t q_size)
+{
+    struct ox_mq_stats st;
+    uint32_t qid;
+    int ms = 1000;
+
+    for (qid = 0; qid < N_QUEUES; qid++) {
+        do {
+            ox_mq_get_status (test_mq, &st, qid);
+            if (u_atomic_read (&st.sq_free) == q_size &&
+                                    u_atomic_read (&st.cq_free) == q_size)
+                break;
+            usleep (1000);
+        } while (--ms);
+
+        CHECK (!u_atomic_read (&st.sq_used) && !u_atomic_read (&st.sq_wait) &&
+               !u_atomic_read (&st.cq_used), "queue %d not drained", qid);
+        CHECK (u_atomic_read (&st.sq_free) == q_size, "queue %d: %d of %d SQ "
+                "entries free", qid, (int) u_atomic_read (&st.sq_free), q_size);
+        CHECK (u_atomic_read (&st.cq_free) == q_size, "queue %d: %d of %d CQ "
+                "entries free", qid, (int) u_atomic_read (&st.cq_free), q_size);
+    }
+}
+
+static void test_check_once (uint32_t n_req)
+{
+    uint32_t i, lost = 0, dup = 0;
+
+    for (i = 0; i < n_req; i++) {
+        if (!sq_count[i] || !cq_count[i])
+            lost++;
+        if (sq_count[i] > 1 || cq_count[i] > 1)
+            dup++;
+    }
+
+    CHECK (!lost, "%d requests lost", lost);
+    CHECK (!dup, "%d requests delivered more than once", dup);
+    CHECK (!order_err, "%d requests out of order", order_err);
+}
+
+/* Concurrent producers, per-producer FIFO, exactly once, small rings */
+static void test_mpmc (const char *name, uint32_t q_size, uint16_t flags,
+                                                                    int batch)
+{
+    struct ox_mq_config config;
+    pthread_t th[N_PRODUCERS];
+    uint32_t arg[N_PRODUCERS], p;
+    int prev = fails;
+
+    test_init_config (&config, name, q_size, flags);
+    test_reset (N_REQ, (flags & OX_MQ_QOS) ? OX_MQ_CLASSES : 0, 0);
+    test_batch = batch;
+    for (p = 0; p < OX_MQ_CLASSES && (flags & OX_MQ_QOS); p++)
+        config.class_weight[p] = OX_MQ_CLASSES - p;
+
+    test_mq = ox_mq_init (&config);
+    CHECK (test_mq != NULL, "ox_mq_init failed");
+    if (!test_mq)
+        return;
+
+    for (p = 0; p < N_PRODUCERS; p++) {
+        arg[p] = p;
+        pthread_create (&th[p], NULL, test_producer, &arg[p]);
+    }
+    for (p = 0; p < N_PRODUCERS; p++)
+        pthread_join (th[p], NULL);
+
+    CHECK (test_wait_cq (N_REQ), "%d of %d completed", cq_total, N_REQ);
+
+    test_check_once (N_REQ);
+
+    if (flags & OX_MQ_CQ_INLINE)
+        CHECK (cq_inline == N_REQ, "%d of %d completions inline",
+                                                            cq_inline, N_REQ);
+    else
+        CHECK (!cq_inline, "%d completions ran in the SQ thread", cq_inline);
+
+    test_check_free (q_size);
+    ox_mq_destroy (test_mq);
+
+    printf ("  %-24s %s\n", name, (fails == prev) ? "ok" : "FAILED");
+}
+
+/* Backlogged classes are served in proportion to their weights */
+static void test_qos_weights (const char *name, uint16_t flags)
+{
+    struct ox_mq_config config;
+    const uint32_t n_req = 1 + QOS_PER_CLASS * OX_MQ_CLASSES;
+    uint32_t seen[OX_MQ_CLASSES] = {0}, i, c, weights = 0, expect;
+    int prev = fails;
+
+    test_init_config (&config, name, n_req, flags | OX_MQ_QOS);
+    config.n_queues = 1;
+    config.sq_fn = test_sq_qos;
+    for (c = 0; c < OX_MQ_CLASSES; c++) {
+        config.class_weight[c] = qos_weight[c];
+        weights += config.class_weight[c];
+    }
+
+    test_reset (n_req, 0, 0);
+    for (i = 1; i < n_req; i++) {
+        cmds[i].producer = 0;
+        cmds[i].cls = (i - 1) % OX_MQ_CLASSES;
+    }
+
+    test_mq = ox_mq_init (&config);
+    CHECK (test_mq != NULL, "ox_mq_init failed");
+    if (!test_mq)
+        return;
+
+    test_submit (0, &cmds[0]);
+    while (!plug_in)
+        usleep (100);
+    for (i = 1; i < n_req; i++)
+        test_submit (0, &cmds[i]);
+    plug_out = 1;
+
+    CHECK (test_wait_cq (n_req), "%d of %d completed", cq_total, n_req);
+    test_check_once (n_req);
+
+    for (i = 0; i < QOS_CHECKED && i < qos_n; i++)
+        seen[qos_order[i]]++;
+
+    for (c = 0; c < OX_MQ_CLASSES; c++) {
+        expect = QOS_CHECKED * config.class_weight[c] / weights;
+        CHECK (seen[c] + config.class_weight[c] >= expect &&
+               seen[c] <= expect + config.class_weight[c],
+               "class %d: %d of the first %d, expected %d", c, seen[c],
+               QOS_CHECKED, expect);
+    }
+
+    ox_mq_destroy (test_mq);
+
+    printf ("  %-24s %s\n", name, (fails == prev) ? "ok" : "FAILED");
+}
+
+/*
+ * Held requests time out, complete once through the timeout path, and their
+ * late completion is refused. Slow requests are completed by the SQ thread
+ * around their deadline, racing with the timeout thread: each request still
+ * reaches cq_fn exactly once, and every timed out request is counted once as
+ * a late completion.
+ */
+static void test_timeout (const char *name, uint16_t flags, int batch)
+{
+    struct ox_mq_config config;
+    pthread_t th[N_PRODUCERS];
+    uint32_t arg[N_PRODUCERS], p, late = 0, n_held, to, back;
+    int prev = fails, ms = WAIT_SEC * 1000;
+
+    test_init_config (&config, name, 64, flags | OX_MQ_TO_COMPLETE);
+    config.to_usec = TO_USEC;
+    test_reset (N_REQ, 0, TO_HOLD_EVERY);
+    test_batch = batch;
+    n_held = N_REQ / TO_HOLD_EVERY;
+
+    test_mq = ox_mq_init (&config);
+    CHECK (test_mq != NULL, "ox_mq_init failed");
+    if (!test_mq)
+        return;
+
+    for (p = 0; p < N_PRODUCERS; p++) {
+        arg[p] = p;
+        pthread_create (&th[p], NULL, test_producer, &arg[p]);
+    }
+    for (p = 0; p < N_PRODUCERS; p++)
+        pthread_join (th[p], NULL);
+
+    CHECK (test_wait_cq (N_REQ), "%d of %d completed", cq_total, N_REQ);
+    while (__atomic_load_n (&sq_done, __ATOMIC_ACQUIRE) < N_REQ - n_held &&
+                                                                        ms--)
+        usleep (1000);
+    test_check_once (N_REQ);
+
+    to = u_atomic_read (&test_mq->stats.timeout);
+    CHECK (held_n == n_held, "%d of %d requests held", held_n, n_held);
+    CHECK (to >= n_held, "%d timeouts counted, at least %d expected",
+                                                                to, n_held);
+    CHECK (to_total == to, "to_fn got %d of %d", to_total, to);
+
+    /* Let the timeout thread mark the entries as completed */
+    usleep (TO_USEC);
+    for (p = 0; p < held_n; p++)
+        late += (ox_mq_complete_req (test_mq, held[p]) != 0);
+
+    CHECK (late == held_n, "%d of %d late completions refused", late, held_n);
+    /* Without inline completion a full CQ also refuses the SQ thread's only
+     * try, that request is then completed by the timeout path but not late */
+    back = u_atomic_read (&test_mq->stats.to_back);
+    if (flags & OX_MQ_CQ_INLINE)
+        CHECK (back == to, "%d late completions counted, expected %d",
+                                                                    back, to);
+    else
+        CHECK (back >= n_held && back <= to, "%d late completions counted, "
+                                "expected %d to %d", back, n_held, to);
+    CHECK (cq_total == N_REQ, "cq_fn called %d times after late completions",
+                                                                    cq_total);
+    test_check_once (N_REQ);
+
+    ox_mq_destroy (test_mq);
+
+    printf ("  %-24s %s\n", name, (fails == prev) ? "ok" : "FAILED");
+}
+
+int main (int argc, char **argv)
+{
+    if (ox_mem_init ())
+        return -1;
+
+    if (!ox_mem_create_type ("OX_MQ", OX_MEM_OX_MQ))
+        return -1;
+
+    cmds = calloc (N_REQ, sizeof (struct test_cmd));
+    sq_count = calloc (N_REQ, sizeof (uint32_t));
+    cq_count = calloc (N_REQ, sizeof (uint32_t));
+    if (!cmds || !sq_count || !cq_count)
+        return -1;
+
+    printf ("ox-mq checks:\n");
+
+    test_mpmc ("list", SMALL_QUEUE, 0, 0);
+    test_mpmc ("ring", SMALL_QUEUE, OX_MQ_RING, 0);
+    test_mpmc ("ring+poll", SMALL_QUEUE, OX_MQ_RING | OX_MQ_POLL, 0);
+    test_mpmc ("ring+batch", SMALL_QUEUE * 8, OX_MQ_RING | OX_MQ_SQ_BATCH, 1);
+    test_mpmc ("list+batch", SMALL_QUEUE * 8, OX_MQ_SQ_BATCH, 1);
+    test_mpmc ("ring+inline", SMALL_QUEUE, OX_MQ_RING | OX_MQ_CQ_INLINE, 0);
+    test_mpmc ("ring+batch+inline", SMALL_QUEUE * 8,
+                        OX_MQ_RING | OX_MQ_SQ_BATCH | OX_MQ_CQ_INLINE, 1);
+    test_mpmc ("ring+qos", SMALL_QUEUE, OX_MQ_RING | OX_MQ_QOS, 0);
+    test_mpmc ("list+qos", SMALL_QUEUE, OX_MQ_QOS, 0);
+    test_qos_weights ("qos weights (ring)", OX_MQ_RING);
+    test_qos_weights ("qos weights (list)", 0);
+    test_timeout ("timeout (list)", 0, 0);
+    test_timeout ("timeout (ring)", OX_MQ_RING, 0);
+    test_timeout ("timeout (ring+inline)", OX_MQ_RING | OX_MQ_CQ_INLINE, 0);
+    test_timeout ("timeout (ring+batch+inline)",
+                        OX_MQ_RING | OX_MQ_SQ_BATCH | OX_MQ_CQ_INLINE, 1);
+
+    printf ("%s: %d failed checks\n", (fails) ? "FAILED" : "PASSED", fails);
+
+    free (cq_count);
+    free (sq_count);
+    free (cmds);
+    ox_mem_exit ();
+
+    return (fails) ? 1 : 0;
+}
@@ -11,6 +11,7 @@
 #define N_QUEUES    4
 #define N_CMD       (1024 * 1024 * N_QUEUES)
 #define N_CORES     8
+#define SUBMIT_BATCH 32
 
 struct test_struct {
     uint64_t id;
@@ -18,6 +19,8 @@ struct test_struct {
 };
 
 static struct ox_mq *test_mq;
+static int test_batch;
+static int test_qos;
 volatile static uint64_t completed [N_QUEUES];
 
 static struct timespec ts, te;
@@ -32,6 +35,14 @@ RETRY:
         goto RETRY;
 }
 
+static void test_process_sq_batch (struct ox_mq_entry **req, int n)
+{
+    int done = 0;
+
+    while (done < n)
+        done += ox_mq_complete_batch (test_mq, &req[done], n - done);
+}
+
 static void test_process_cq (void *opaque)
 {
     struct test_struct *cmd = (struct test_struct *) opaque;
@@ -48,7 +59,8 @@ static void test_process_to (void **opaque, int counter)
 
 static void *test_submit_th (void *arg)
 {
-    uint64_t ent_i;
+    uint64_t ent_i, n;
+    int ret;
     uint64_t count = N_CMD / N_QUEUES;
     uint64_t qid = *(int *) arg;
     cpu_set_t cpuset;
@@ -63,22 +75,36 @@ static void *test_submit_th (void *arg)
     printf ("Thread %lu set to core %lu\n", qid,
                                         ((qid % N_CORES) + N_QUEUES) % N_CORES);
 
-    for (ent_i = 0; ent_i < count; ent_i++) {
+    for (ent_i = 0; ent_i < count; ent_i++)
+        cmd[(count * qid) + ent_i]->queue = qid;
+
+    ent_i = 0;
+    while (test_batch && ent_i < count) {
+        n = MIN (SUBMIT_BATCH, count - ent_i);
+        ret = ox_mq_submit_batch (test_mq, qid,
+                                (void **) &cmd[(count * qid) + ent_i], n);
+        if (ret > 0)
+            ent_i += ret;
+    }
+
+    for (; ent_i < count; ent_i++) {
         cmd[(count * qid) + ent_i]->queue = qid;
 RETRY:
-        if (ox_mq_submit_req (test_mq, qid, cmd[(count * qid) + ent_i]))
+        if (ox_mq_submit_class (test_mq, qid, cmd[(count * qid) + ent_i],
+                                        (test_qos) ? ent_i % OX_MQ_CLASSES : 0))
             goto RETRY;
     }
 
     return NULL;
 }
 
-int main (void)
+int main (int argc, char **argv)
 {
     int ent_i, i;
     uint64_t total, qid;
     struct ox_mq_config config;
     pthread_t th[N_QUEUES];
+    cpu_set_t sq_cpus[N_QUEUES], cq_cpus[N_QUEUES];
     int th_qid[N_QUEUES];
 
     if (ox_mem_init ())
@@ -95,15 +121,47 @@ int main (void)
     config.to_usec = 0;
     config.flags = OX_MQ_CPU_AFFINITY;
 
+    /* Arguments: 'ring' for the lock-free ring backend, 'poll' for
+     * spin-then-park consumer threads, 'batch' for batched submission and
+     * completion, 'auto' for topology based thread placement, 'inline' for
+     * run-to-completion callbacks, 'qos' for weighted classes */
+    for (i = 1; i < argc; i++) {
+        if (!strcmp (argv[i], "ring"))
+            config.flags |= OX_MQ_RING;
+        if (!strcmp (argv[i], "poll")) {
+            config.flags |= OX_MQ_POLL;
+            config.poll_usec = 50;
+        }
+        if (!strcmp (argv[i], "batch")) {
+            config.flags |= OX_MQ_SQ_BATCH;
+            config.sq_batch_fn = test_process_sq_batch;
+            test_batch = 1;
+        }
+        if (!strcmp (argv[i], "inline"))
+            config.flags |= OX_MQ_CQ_INLINE;
+        if (!strcmp (argv[i], "qos")) {
+            config.flags |= OX_MQ_QOS;
+            for (qid = 0; qid < OX_MQ_CLASSES; qid++)
+                config.class_weight[qid] = OX_MQ_CLASSES - qid;
+            test_qos = 1;
+        }
+        if (!strcmp (argv[i], "auto"))
+            config.flags = (config.flags & ~OX_MQ_CPU_AFFINITY) |
+                                                                OX_MQ_CPU_AUTO;
+    }
+
     /* Set thread affinity*/
-    for (qid = 0; qid < N_QUEUES; qid++) {
+    config.sq_affinity = sq_cpus;
+    config.cq_affinity = cq_cpus;
+    for (qid = 0; qid < N_QUEUES && (config.flags & OX_MQ_CPU_AFFINITY); qid++) {
         printf ("Queue %lu - SQ set to core %lu, CQ set to core %lu\n", qid,
                 (qid % N_CORES),
                 ((qid % N_CORES) + N_QUEUES) % N_CORES);
 
-        config.sq_affinity[qid] |= ((uint64_t) 1 << (qid % N_CORES));
-        config.cq_affinity[qid] |=
-                    ((uint64_t) 1 << (((qid % N_CORES) + N_QUEUES) % N_CORES));
+        CPU_ZERO(&sq_cpus[qid]);
+        CPU_SET(qid % N_CORES, &sq_cpus[qid]);
+        CPU_ZERO(&cq_cpus[qid]);
+        CPU_SET(((qid % N_CORES) + N_QUEUES) % N_CORES, &cq_cpus[qid]);
     }
 
     test_mq = ox_mq_init(&config);
@@ -65,8 +65,10 @@ int oxf_rdma (void *buf, uint32_t size, uint64_t prp, uint8_t dir)
     switch (dir) {
         case NVM_DMA_TO_HOST:
             memcpy ((void *) prp, buf, size);
+            break;
         case NVM_DMA_FROM_HOST:
             memcpy (buf, (void *) prp, size);
+            break;
     }
 
     return 0;
@@ -85,6 +87,8 @@ int oxf_complete (NvmeCqe *cqe, void *ctx)
 
     /* Read: data has been copied to cq_capsule via "DMA" by bottom layers */
 
+    OX_PROBE3 (fabrics_send, cqe->sq_id, cqe->cid, capsule->size);
+
     if (fabrics.server->ops->reply (reply->con, capsule,
                                 capsule->size, (void *) reply->cli))
         return -1;
@@ -195,6 +199,7 @@ static void oxf_fabrics_set_direction (struct nvme_cmd *cmd,
         case NVME_CMD_WRITE:
         case NVME_CMD_WRITE_NULL:
         case NVME_CMD_ELEOS_FLUSH:
+        case NVME_CMD_DSM:
             rep->is_write = 1;
             break;
         case NVME_CMD_READ:
@@ -225,6 +230,9 @@ static void oxf_fabrics_rcv_fn (uint32_t size, void *arg, void *recv_cli)
                 return;
             }
 
+            OX_PROBE3 (fabrics_recv, capsule->sqc.cmd.cid / OXF_QUEUE_SIZE,
+                                                capsule->sqc.cmd.cid, size);
+
             while (retry) {
 
                 sq_id = capsule->sqc.cmd.cid / OXF_QUEUE_SIZE;
@@ -20,6 +20,10 @@
  * 
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <sys/queue.h>
 #include <string.h>
@@ -195,6 +199,7 @@ static void oxf_fabrics_set_direction (struct nvme_cmd *cmd,
         case NVME_CMD_WRITE:
         case NVME_CMD_WRITE_NULL:
         case NVME_CMD_ELEOS_FLUSH:
+        case NVME_CMD_DSM:
             qcmd->is_write = 1;
             break;
         case NVME_CMD_READ:
@@ -472,6 +477,9 @@ int oxf_host_create_queue (uint16_t qid)
 {
     uint32_t ent_i, iface_id;
     struct ox_mq_config mq_config;
+#if ELEOS_HOST_CQ_CORE0
+    cpu_set_t cq_cpus;
+#endif
 
     if (qid >= OXF_MAX_QUEUES) {
         printf ("[ox-fabrics (create): Invalid QID (%d), maximum of %d\n]",
@@ -497,11 +505,13 @@ int oxf_host_create_queue (uint16_t qid)
     mq_config.flags = (OX_MQ_TO_COMPLETE | OX_MQ_CPU_AFFINITY);
 
     /* Set completion thread affinity to a single core, if enabled */
-    mq_config.sq_affinity[0] = 0;
-    mq_config.cq_affinity[0] = 0;
+    mq_config.sq_affinity = NULL;
+    mq_config.cq_affinity = NULL;
 
 #if ELEOS_HOST_CQ_CORE0
-    mq_config.cq_affinity[0] |= ((uint64_t) 1 << 0);
+    CPU_ZERO(&cq_cpus);
+    CPU_SET(0, &cq_cpus);
+    mq_config.cq_affinity = &cq_cpus;
 #endif /* ELEOS_HOST_CQ_CORE0 */
 
     fabrics.queues[qid].mq = ox_mq_init(&mq_config);